@@ -0,0 +1,228 @@
+/*
+ * bench.c
+ * Times irecovery_send_buffer() on the calculator against a real phone and writes the results to an AppVar.
+ *
+ * Build it as a CE toolchain program with irecovery.c and irecovery.h copied into its src folder next to this file.
+ * Plug the phone in, in DFU or recovery mode, and start the program; [clear] stops it between two runs.
+ * The image is junk and never gets booted, so DFU runs end with an ABORT instead of IRECOVERY_SEND_OPT_DFU_NOTIFY_FINISH.
+ *
+ * Every run is one line of the IRBENCH AppVar:
+ *     mode,options,length,packet_size,run,result,ticks,first_packet_ticks,bytes_per_second,packets,status_polls,status_retries,retries,crc_ticks
+ * ticks and first_packet_ticks are 32768 Hz hardware timer ticks, crc_ticks are clock() ticks like the rest of irecovery_stats.
+ * The first BENCH_RUNS lines time irecovery_crc32_update() over the whole image, with the kernel as the mode (crc32,
+ * crc32_nibble or crc32_ez80) and only length, run, ticks and bytes_per_second filled in. With crc32_ez80, run 0 also
+ * builds the table.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timers.h>
+#include <ti/getcsc.h>
+#include <ti/screen.h>
+#include <fileioc.h>
+#include "irecovery.h"
+
+#define BENCH_APPVAR "IRBENCH"
+#define BENCH_RUNS 3
+
+// Largest image tried, a packet and a half in recovery mode. Halved until it fits in the heap.
+#define BENCH_MAX_LENGTH 0xC200
+
+// Timer 1 is left to clock(), which the library uses
+#define BENCH_TIMER 2
+#define BENCH_TIMER_HZ 32768
+
+static const unsigned int bench_dfu_options[] = {
+    IRECOVERY_SEND_OPT_NONE,
+    IRECOVERY_SEND_OPT_RETRY
+};
+
+static const unsigned int bench_recovery_options[] = {
+    IRECOVERY_SEND_OPT_NONE,
+    IRECOVERY_SEND_OPT_RECOVERY_PIPELINE,
+    IRECOVERY_SEND_OPT_RETRY,
+    IRECOVERY_SEND_OPT_RECOVERY_PIPELINE | IRECOVERY_SEND_OPT_RETRY
+};
+
+static uint8_t bench_appvar;
+static uint32_t bench_started;
+static uint32_t bench_first_packet;
+
+static uint32_t bench_ticks(void) {
+    return timer_Get(BENCH_TIMER);
+}
+
+static bool bench_mode_is_dfu(int mode) {
+    return mode == IRECOVERY_K_DFU_MODE || mode == IRECOVERY_K_WTF_MODE;
+}
+
+// Same block size the upload uses: 0x8000 in recovery mode, wTransferSize (0x800 without a descriptor) in DFU mode.
+static size_t bench_packet_size(irecovery_client_t client, int mode) {
+    if (!bench_mode_is_dfu(mode)) return 0x8000;
+
+    struct irecovery_dfu_functional_descriptor descriptor;
+    if (irecovery_get_dfu_functional_descriptor(client, &descriptor) != IRECOVERY_E_SUCCESS || descriptor.w_transfer_size < 16) return 0x800;
+    return (descriptor.w_transfer_size > 0x8000) ? 0x8000 : descriptor.w_transfer_size;
+}
+
+static void bench_print(const char* line) {
+    os_PutStrFull(line);
+    os_NewLine();
+}
+
+static void bench_write(const char* line) {
+    if (bench_appvar) ti_Write(line, strlen(line), 1, bench_appvar);
+}
+
+// Only the first packet of an upload and the last get here, see irecovery_event_subscribe_progress()
+static int bench_progress(irecovery_client_t client, const irecovery_event_t* event) {
+    (void)client;
+    (void)event;
+    if (!bench_first_packet) bench_first_packet = bench_ticks() - bench_started;
+    return 0;
+}
+
+static bool bench_run(irecovery_client_t client, int mode, unsigned char* image, size_t length, size_t packet_size, unsigned int options, int run) {
+    irecovery_reset_stats(client);
+    bench_first_packet = 0;
+    bench_started = bench_ticks();
+    irecovery_error_t error = irecovery_send_buffer(client, image, length, options);
+    uint32_t ticks = bench_ticks() - bench_started;
+
+    // Without NOTIFY_FINISH the phone is left in dfuDNLOAD-IDLE, and the next upload wants dfuIDLE
+    if (bench_mode_is_dfu(mode)) irecovery_usb_control_transfer(client, 0x21, 6, 0, 0, NULL, 0);
+
+    struct irecovery_stats stats;
+    irecovery_get_stats(client, &stats);
+    // length is at most BENCH_MAX_LENGTH, so this fits in 32 bits
+    uint32_t rate = ticks ? (uint32_t)length * BENCH_TIMER_HZ / ticks : 0;
+
+    char line[160];
+    sprintf(line, "%s,%u,%u,%u,%d,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", irecovery_mode_to_str(mode), options, (unsigned int)length,
+            (unsigned int)packet_size, run, error, (unsigned long)ticks, (unsigned long)bench_first_packet, (unsigned long)rate,
+            (unsigned long)stats.packets_sent, (unsigned long)stats.status_polls, (unsigned long)stats.status_retries,
+            (unsigned long)stats.upload_retries, (unsigned long)stats.crc_ticks);
+    bench_write(line);
+
+    sprintf(line, "%05X o%u: %lu B/s", (unsigned int)length, options, (unsigned long)rate);
+    bench_print(error == IRECOVERY_E_SUCCESS ? line : irecovery_strerror(error));
+
+    return error != IRECOVERY_E_NO_DEVICE;
+}
+
+#ifndef IRECOVERY_NO_CRC32
+#if defined(IRECOVERY_CRC32_EZ80)
+#define BENCH_CRC32_KERNEL "crc32_ez80"
+#elif defined(IRECOVERY_CRC32_NIBBLE_TABLE)
+#define BENCH_CRC32_KERNEL "crc32_nibble"
+#else
+#define BENCH_CRC32_KERNEL "crc32"
+#endif
+
+static void bench_crc32(const unsigned char* image, size_t length, int run) {
+    uint32_t started = bench_ticks();
+    uint32_t crc = irecovery_crc32_update(irecovery_crc32_init(), image, length);
+    uint32_t ticks = bench_ticks() - started;
+    uint32_t rate = ticks ? (uint32_t)length * BENCH_TIMER_HZ / ticks : 0;
+
+    char line[160];
+    sprintf(line, "%s,0,%u,0,%d,0,%lu,0,%lu,0,0,0,0,0\n", BENCH_CRC32_KERNEL, (unsigned int)length, run, (unsigned long)ticks,
+            (unsigned long)rate);
+    bench_write(line);
+
+    sprintf(line, "CRC %08lX: %lu B/s", (unsigned long)irecovery_crc32_final(crc), (unsigned long)rate);
+    bench_print(line);
+}
+#endif
+
+// Lengths around the packet size and the 512 byte bulk packet boundary: a recovery mode upload that ends on one sends a ZLP.
+static size_t bench_lengths(size_t packet_size, size_t max_length, size_t* lengths) {
+    const size_t candidates[] = { 0x1FF, 0x200, packet_size - 1, packet_size, packet_size + packet_size / 2, packet_size + packet_size / 2 + 1 };
+    size_t count = 0;
+
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        if (candidates[i] > max_length || (count > 0 && candidates[i] <= lengths[count - 1])) continue;
+        lengths[count++] = candidates[i];
+    }
+
+    return count;
+}
+
+static irecovery_client_t bench_connect(void) {
+    irecovery_client_t client = NULL;
+    if (irecovery_client_new(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL, 0, NULL, &client) != IRECOVERY_E_SUCCESS) return NULL;
+
+    bench_print("Plug in a phone...");
+    while (irecovery_poll_for_device(client) != IRECOVERY_E_SUCCESS) {
+        if (os_GetCSC() == sk_Clear) {
+            irecovery_client_free(&client);
+            return NULL;
+        }
+    }
+
+    return client;
+}
+
+int main(void) {
+    os_ClrHome();
+
+    size_t max_length = BENCH_MAX_LENGTH;
+    unsigned char* image = NULL;
+    while (max_length >= 0x200 && !(image = (unsigned char*)malloc(max_length))) max_length /= 2;
+    if (!image) {
+        bench_print("Out of memory.");
+        while (!os_GetCSC());
+        return 1;
+    }
+    for (size_t i = 0; i < max_length; i++) image[i] = (unsigned char)(i * 7 + (i >> 8));
+
+    irecovery_client_t client = bench_connect();
+    if (!client) {
+        free(image);
+        return 1;
+    }
+    irecovery_event_subscribe_progress(client, bench_progress, 1000, 0);
+
+    int mode = 0;
+    irecovery_get_mode(client, &mode);
+    size_t packet_size = bench_packet_size(client, mode);
+    bool dfu = bench_mode_is_dfu(mode);
+    const unsigned int* options = dfu ? bench_dfu_options : bench_recovery_options;
+    size_t option_count = dfu ? sizeof(bench_dfu_options) / sizeof(bench_dfu_options[0]) : sizeof(bench_recovery_options) / sizeof(bench_recovery_options[0]);
+
+    size_t lengths[6];
+    size_t length_count = bench_lengths(packet_size, max_length, lengths);
+
+    bench_appvar = ti_Open(BENCH_APPVAR, "w");
+    if (!bench_appvar) bench_print("Can't write " BENCH_APPVAR ".");
+    bench_write("mode,options,length,packet_size,run,result,ticks,first_packet_ticks,bytes_per_second,packets,status_polls,status_retries,retries,crc_ticks\n");
+
+    timer_Disable(BENCH_TIMER);
+    timer_Set(BENCH_TIMER, 0);
+    timer_Enable(BENCH_TIMER, TIMER_32K, TIMER_NOINT, TIMER_UP);
+
+    os_ClrHome();
+#ifndef IRECOVERY_NO_CRC32
+    for (int run = 0; run < BENCH_RUNS; run++) bench_crc32(image, max_length, run);
+#endif
+    bench_print(irecovery_mode_to_str(mode));
+    bool running = true;
+    for (size_t o = 0; o < option_count && running; o++) {
+        for (size_t l = 0; l < length_count && running; l++) {
+            for (int run = 0; run < BENCH_RUNS && running; run++) {
+                running = bench_run(client, mode, image, lengths[l], packet_size, options[o], run) && os_GetCSC() != sk_Clear;
+            }
+        }
+    }
+
+    timer_Disable(BENCH_TIMER);
+    if (bench_appvar) ti_Close(bench_appvar);
+    bench_print(running ? "Done, see " BENCH_APPVAR "." : "Stopped, see " BENCH_APPVAR ".");
+
+    irecovery_client_free(&client);
+    free(image);
+    while (!os_GetCSC());
+    return 0;
+}
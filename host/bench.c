@@ -0,0 +1,1518 @@
+/*
+ * bench.c
+ * Runs irecovery.c against the mock device on a PC and times its hot paths.
+ *
+ * Build from the repository root:
+ *     cc -O2 -Ihost/include -I. host/bench.c host/mock_usb.c -o irecovery-bench
+ * With -DIRECOVERY_DEVICE_DB it reads the database from IRECDEV.bin, or -DBENCH_DEVICE_DB=\"path\":
+ *     tools/mkdevicedb.py irecovery.c --raw IRECDEV.bin
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mock_usb.h"
+
+// Short enough that freeing a client stuck mid-upload doesn't hold the bench up
+#define IRECOVERY_FREE_DRAIN_TIMEOUT 100
+
+// Pulled in whole so the benchmarks can reach its static functions
+#include "../irecovery.c"
+
+#if defined(IRECOVERY_DEVICE_DB) && !defined(BENCH_DEVICE_DB)
+#define BENCH_DEVICE_DB "IRECDEV.bin"
+#endif
+
+// Without the CRC, DFU uploads need a manifest, so the DFU upload benchmarks only run with both built in. See bench_manifest().
+#if !defined(IRECOVERY_NO_DFU) && !defined(IRECOVERY_NO_CRC32)
+#define BENCH_DFU_UPLOADS
+#endif
+
+static const char bench_serial[] = "CPID:8010 CPRV:11 CPFM:03 SCEP:01 BDID:0C ECID:001A2B3C4D5E6F70 IBFL:3C SRNM:[F17XXXXXXXXX] SRTG:[iBoot-2696.0.0.1.33]";
+static const char bench_nonces[] = "NONC:0123456789abcdef0123456789abcdef01234567 SNON:fedcba9876543210fedcba9876543210fedcba98";
+
+static const struct mock_device bench_dfu_device       = { 0x1227, bench_serial, bench_nonces, NULL, 0, 0, 0 };
+#ifdef BENCH_DFU_UPLOADS
+static const uint8_t bench_busy_states[] = { 4, 4, 5 };
+static const struct mock_device bench_busy_dfu_device  = { 0x1227, bench_serial, bench_nonces, bench_busy_states, 3, 0, 0 };
+static const struct mock_device bench_large_dfu_device = { 0x1227, bench_serial, bench_nonces, NULL, 0, 0, 0x4000 };
+#endif
+static const struct mock_device bench_recovery_device  = { 0x1281, bench_serial, bench_nonces, NULL, 0, 0, 0 };
+#ifndef IRECOVERY_NO_RECOVERY
+static const struct mock_device bench_recovery3_device = { 0x1282, bench_serial, bench_nonces, NULL, 0, 0, 0 };
+#endif
+
+// Same model and mode as bench_dfu_device, another phone
+static const char bench_other_serial[] = "CPID:8010 CPRV:11 CPFM:03 SCEP:01 BDID:0C ECID:00000000000000AA IBFL:3C SRNM:[F17YYYYYYYYY] SRTG:[iBoot-2696.0.0.1.33]";
+static const struct mock_device bench_other_dfu_device = { 0x1227, bench_other_serial, bench_nonces, NULL, 0, 0, 0 };
+
+// Phones on a hub, each busy for 1 ms after every DFU packet
+static const uint8_t bench_hub_states[] = { 4, 5 };
+static const struct mock_device bench_hub_devices[] = {
+    { 0x1227, "CPID:8010 BDID:0C ECID:0000000000000001 SRTG:[iBoot-2696.0.0.1.33]", bench_nonces, bench_hub_states, 2, 1, 0 },
+    { 0x1227, "CPID:8015 BDID:0E ECID:0000000000000002 SRTG:[iBoot-3401.0.0.1.16]", bench_nonces, bench_hub_states, 2, 1, 0 },
+    { 0x1227, "CPID:8020 BDID:0C ECID:0000000000000003 SRTG:[iBoot-4479.0.0.100.4]", bench_nonces, bench_hub_states, 2, 1, 0 }
+};
+#define BENCH_HUB_DEVICES (sizeof(bench_hub_devices) / sizeof(bench_hub_devices[0]))
+
+static int bench_failures;
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char* name, unsigned iterations, double seconds) {
+    printf("%-32s %8u  %10.3f ms  %10.3f us/op\n", name, iterations, seconds * 1e3, seconds * 1e6 / iterations);
+}
+
+static void bench_check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        bench_failures++;
+    }
+}
+
+static irecovery_client_t bench_connect(const struct mock_device* device) {
+    irecovery_client_t client = NULL;
+    if (irecovery_client_new(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL, 0, NULL, &client) != IRECOVERY_E_SUCCESS) return NULL;
+
+    mock_attach(device);
+    if (irecovery_poll_for_device(client) != IRECOVERY_E_SUCCESS) {
+        irecovery_client_free(&client);
+        return NULL;
+    }
+
+    return client;
+}
+
+static void bench_disconnect(irecovery_client_t* client) {
+    mock_detach();
+    irecovery_client_free(client);
+}
+
+// Bit at a time reference, to make sure the table driven kernel is right. Also builds manifests for bench_manifest().
+static uint32_t bench_crc32_reference(uint32_t crc, const unsigned char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+#ifndef IRECOVERY_NO_CRC32
+static void bench_crc32(const unsigned char* image, size_t length) {
+    const unsigned iterations = 64;
+    uint32_t crc = 0;
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        crc = irecovery_crc32_update(irecovery_crc32_init(), image, length);
+    }
+    bench_report("crc32 (per image)", iterations, bench_now() - started);
+
+    bench_check(crc == bench_crc32_reference(0xFFFFFFFF, image, length), "crc32 matches the reference");
+}
+#endif
+
+static void bench_send_buffer(const char* name, const struct mock_device* device, unsigned char* image, size_t length, unsigned int options) {
+    const unsigned iterations = 16;
+    irecovery_client_t client = bench_connect(device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    if (device->product_id == 0x1227) {
+        struct irecovery_dfu_functional_descriptor functional;
+        bench_check(irecovery_get_dfu_functional_descriptor(client, &functional) == IRECOVERY_E_SUCCESS &&
+                    functional.w_transfer_size == (device->transfer_size ? device->transfer_size : 0x800), "the DFU transfer size is read");
+    }
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        memset(&mock_counters, 0, sizeof(mock_counters));
+        irecovery_error_t error = irecovery_send_buffer(client, image, length, options);
+        if (error != IRECOVERY_E_SUCCESS) {
+            printf("FAILED: %s returned %s\n", name, irecovery_strerror(error));
+            bench_failures++;
+            break;
+        }
+    }
+    bench_report(name, iterations, bench_now() - started);
+
+    // Image plus the 16 byte DFU suffix, or just the image in recovery mode
+    size_t expected = length + (device->product_id == 0x1227 ? 16 : 0);
+    bench_check(mock_counters.bytes_out == expected, "every image byte reaches the device");
+
+    bench_disconnect(&client);
+}
+
+// An empty image is initiated and closed like any other, without a packet to move it along.
+// Stepped by hand, so a hang shows up as a failure.
+static void bench_empty_upload_case(const char* what, const struct mock_device* device, unsigned char* image, unsigned int options,
+                                    uint32_t expected_bulk, uint32_t expected_resets) {
+    irecovery_client_t client = bench_connect(device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    irecovery_error_t error = irecovery_send_buffer_begin(client, image, 0, options);
+    for (unsigned steps = 0; error == IRECOVERY_E_SUCCESS || error == IRECOVERY_E_UPLOAD_IN_PROGRESS; steps++) {
+        if (steps == 1000) break;
+        if ((error = irecovery_send_step(client)) == IRECOVERY_E_SUCCESS) break;
+    }
+    if (error != IRECOVERY_E_SUCCESS || mock_counters.bytes_out != 0 || mock_counters.bulk_transfers != expected_bulk || mock_counters.resets != expected_resets) {
+        printf("FAILED: %s (%s)\n", what, irecovery_strerror(error));
+        bench_failures++;
+    }
+
+    bench_disconnect(&client);
+}
+
+static void bench_empty_upload(unsigned char* image) {
+    (void)image;
+#ifdef BENCH_DFU_UPLOADS
+    bench_empty_upload_case("an empty DFU upload ends", &bench_dfu_device, image, IRECOVERY_SEND_OPT_NONE, 0, 0);
+    bench_empty_upload_case("an empty DFU upload notifies the finish", &bench_dfu_device, image, IRECOVERY_SEND_OPT_DFU_NOTIFY_FINISH, 0, 1);
+#endif
+#ifndef IRECOVERY_NO_RECOVERY
+    // 0 is a multiple of 512, so the ZLP goes out
+    bench_empty_upload_case("an empty recovery mode upload sends the ZLP", &bench_recovery_device, image, IRECOVERY_SEND_OPT_NONE, 1, 0);
+#endif
+}
+
+#ifndef IRECOVERY_NO_DFU
+// A DFU upload that trusts a manifest sends the same bytes as one that hashes the image, and is the only kind without the CRC
+static void bench_manifest(unsigned char* image, size_t length) {
+    static const unsigned char xbuf[12] = { 0xff, 0xff, 0xff, 0xff, 0xac, 0x05, 0x00, 0x01, 0x55, 0x46, 0x44, 0x10 };
+    uint32_t running = bench_crc32_reference(bench_crc32_reference(0xFFFFFFFF, image, length), xbuf, sizeof(xbuf));
+    uint32_t fields[] = { (uint32_t)length, ~running };
+    uint16_t packets = (uint16_t)((length + 0x7FF) / 0x800);
+
+    // Laid out like tools/mkmanifest.py writes it
+    unsigned char raw[IRECOVERY_MANIFEST_SIZE] = { 'I', 'R', 'M', 'F', IRECOVERY_MANIFEST_VERSION };
+    for (int byte = 0; byte < 4; byte++) {
+        raw[5 + byte]  = (unsigned char)(fields[0] >> (byte * 8));
+        raw[11 + byte] = (unsigned char)(fields[1] >> (byte * 8));
+        raw[27 + byte] = (unsigned char)(running >> (byte * 8));
+    }
+    raw[9]  = packets & 0xFF;
+    raw[10] = packets >> 8;
+    memcpy(raw + 15, xbuf, sizeof(xbuf));
+
+    struct irecovery_manifest manifest;
+    bench_check(irecovery_manifest_parse(raw, sizeof(raw), &manifest) == IRECOVERY_E_SUCCESS, "the manifest parses");
+
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+#ifdef IRECOVERY_NO_CRC32
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_BAD_MANIFEST, "DFU uploads need a manifest without the CRC");
+    uint32_t expected = 0;
+#else
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_SUCCESS, "the hashed upload works");
+    uint32_t expected = mock_counters.checksum_out;
+#endif
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    irecovery_set_manifest(client, &manifest);
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_DFU_MANIFEST) == IRECOVERY_E_SUCCESS &&
+                mock_counters.bytes_out == length + 16 && (expected == 0 || mock_counters.checksum_out == expected), "the manifest upload sends the same bytes");
+
+    bench_disconnect(&client);
+}
+#endif
+
+static void bench_finalize(const char* name, unsigned int options, uint32_t expected_reads) {
+    const unsigned iterations = 1000;
+    uint32_t reads = 0;
+    bool nonces = false;
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        irecovery_client_t client = NULL;
+        if (irecovery_client_new(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL, 0, NULL, &client) != IRECOVERY_E_SUCCESS) break;
+        irecovery_set_finalize_options(client, options);
+
+        memset(&mock_counters, 0, sizeof(mock_counters));
+        mock_attach(&bench_dfu_device);
+        irecovery_poll_for_device(client);
+        reads = mock_counters.string_descriptor_reads;
+        nonces = client->device_info.ap_nonce && client->device_info.sep_nonce;
+
+        bench_disconnect(&client);
+    }
+    bench_report(name, iterations, bench_now() - started);
+
+    bench_check(reads == expected_reads, "string descriptor reads while finalizing");
+    bench_check(nonces == !(options & IRECOVERY_FINALIZE_OPT_SKIP_NONCES), "nonces are read unless skipped");
+}
+
+static void bench_reconnect(void) {
+    const unsigned iterations = 1000;
+    struct irecovery_device_cache_entry cache[2];
+    memset(cache, 0, sizeof(cache));
+
+    irecovery_client_t client = NULL;
+    if (irecovery_client_new(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL, 0x001A2B3C4D5E6F70ULL, NULL, &client) != IRECOVERY_E_SUCCESS) return;
+    irecovery_set_device_cache(client, cache, 2);
+
+    uint32_t reads = 0, configuration_reads = 0;
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        memset(&mock_counters, 0, sizeof(mock_counters));
+        mock_attach(&bench_dfu_device);
+        irecovery_poll_for_device(client);
+        reads = mock_counters.string_descriptor_reads;
+        configuration_reads = mock_counters.configuration_reads;
+        if (i + 1 < iterations) mock_detach();
+    }
+    bench_report("reconnect (cached)", iterations, bench_now() - started);
+
+    struct irecovery_stats stats = { 0 };
+    irecovery_get_stats(client, &stats);
+    bench_check(stats.cache_hits == iterations - 1, "reconnects are served from the device cache");
+    bench_check(reads == 2 && configuration_reads == 0, "cached reconnects read the serial string and the nonces, not the configuration");
+    bench_check(client->device_info.cpid == 0x8010 && client->device_info.ap_nonce && client->finalized == 1, "cached device info");
+
+    // Another phone of the same model is still told apart by its serial string
+    mock_detach();
+    mock_attach(&bench_other_dfu_device);
+    bench_check(irecovery_poll_for_device(client) == IRECOVERY_E_ECID_MISMATCH && client->finalized == -1, "a cached client rejects another phone with the same PID");
+
+    // The AppVar layout, written by hand since the mock drops writes: a cache loaded from it skips the configuration too
+    static unsigned char saved[6 + 11 + IRECOVERY_DEVICE_CACHE_CONFIG_SIZE] = { 'I', 'R', 'D', 'C', 2, 1 };
+    for (int byte = 0; byte < 8; byte++) {
+        saved[6 + byte] = (unsigned char)(cache[0].ecid >> (byte * 8));
+    }
+    saved[14] = cache[0].pid & 0xFF;
+    saved[15] = cache[0].pid >> 8;
+    saved[16] = cache[0].configuration_length;
+    memcpy(saved + 17, cache[0].configuration, cache[0].configuration_length);
+    mock_add_appvar("BENCHDC", saved, (uint16_t)(17 + cache[0].configuration_length));
+    mock_detach();
+    irecovery_client_free(&client);
+
+    memset(cache, 0, sizeof(cache));
+    if (irecovery_client_new(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL, 0, NULL, &client) != IRECOVERY_E_SUCCESS) return;
+    irecovery_set_device_cache(client, cache, 2);
+    bench_check(irecovery_device_cache_load(client, "BENCHDC") == IRECOVERY_E_SUCCESS && cache[0].ecid == 0x001A2B3C4D5E6F70ULL, "the device cache loads");
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    mock_attach(&bench_dfu_device);
+    bench_check(irecovery_poll_for_device(client) == IRECOVERY_E_SUCCESS && mock_counters.configuration_reads == 0, "a loaded cache skips the configuration");
+
+    saved[4] = 1;
+    bench_check(irecovery_device_cache_load(client, "BENCHDC") == IRECOVERY_E_BAD_DEVICE_CACHE && cache[0].ecid == 0, "an older cache layout is refused");
+
+    bench_disconnect(&client);
+}
+
+static void bench_await_reconnect(void) {
+    const unsigned iterations = 1000;
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    irecovery_error_t error = IRECOVERY_E_SUCCESS;
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations && error == IRECOVERY_E_SUCCESS; i++) {
+        // DFU to recovery and back, like an iBSS/iBEC hop
+        irecovery_finish_transfer(client);
+        mock_detach();
+        mock_attach((i & 1) ? &bench_dfu_device : &bench_recovery_device);
+        error = irecovery_await_reconnect(client, 1000, NULL);
+    }
+    bench_report("await reconnect", iterations, bench_now() - started);
+
+    bench_check(error == IRECOVERY_E_SUCCESS && client->finalized == 1, "the device is finalized after a reset");
+
+    mock_detach();
+    uint32_t ready_ms = 0;
+    bench_check(irecovery_await_reconnect(client, 20, &ready_ms) == IRECOVERY_E_TIMEOUT && ready_ms >= 20, "waiting for a device that doesn't come back times out");
+
+    mock_attach(&bench_dfu_device);
+    bench_check(irecovery_await_reconnect(client, IRECOVERY_WAIT_FOREVER, NULL) == IRECOVERY_E_SUCCESS, "waiting forever for a phone that comes back");
+    bench_check(irecovery_ms_to_clock(IRECOVERY_WAIT_FOREVER) == IRECOVERY_CLOCK_MAX, "IRECOVERY_WAIT_FOREVER never runs out");
+    bench_check(irecovery_ms_to_clock(UINT32_MAX - 1) >= irecovery_ms_to_clock(131072000) && irecovery_ms_to_clock(131072000) > 0,
+                "long timeouts don't wrap around");
+
+    bench_disconnect(&client);
+}
+
+// A phone of the same model that re-enumerates in its place isn't taken for it, even when the cache knows the product ID
+static void bench_await_reconnect_cached(void) {
+    struct irecovery_device_cache_entry cache[2];
+    memset(cache, 0, sizeof(cache));
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+    irecovery_set_device_cache(client, cache, 2);
+
+    // Once more so the cache has the phone
+    mock_detach();
+    mock_attach(&bench_dfu_device);
+    bench_check(irecovery_await_reconnect(client, 1000, NULL) == IRECOVERY_E_SUCCESS, "the phone comes back");
+
+    mock_detach();
+    mock_attach(&bench_other_dfu_device);
+    irecovery_error_t error = irecovery_await_reconnect(client, 20, NULL);
+    bench_check(error == IRECOVERY_E_TIMEOUT && client->finalized != 1, "another ECID coming back isn't the same phone");
+    bench_check(client->ecid_restriction == 0, "the restriction is put back after waiting");
+
+    mock_detach();
+    mock_attach(&bench_dfu_device);
+    error = irecovery_await_reconnect(client, 1000, NULL);
+    bench_check(error == IRECOVERY_E_SUCCESS && client->device_info.ecid == 0x001A2B3C4D5E6F70ULL, "the right phone is still taken after that");
+
+    struct irecovery_stats stats = { 0 };
+    irecovery_get_stats(client, &stats);
+    bench_check(stats.cache_hits == 1, "the right phone coming back hits the cache");
+
+    bench_disconnect(&client);
+}
+
+// Under the one connection limit, the phone coming back after a reset doesn't open the client up to other phones
+static void bench_await_reconnect_limited(void) {
+    irecovery_client_t client = NULL;
+    bench_check(irecovery_client_new(IRECOVERY_CLIENT_DEVICE_POLICY_ONE_CONNECTION_LIMIT, 0, NULL, &client) == IRECOVERY_E_SUCCESS, "client is created");
+    if (!client) return;
+    mock_attach(&bench_dfu_device);
+    bench_check(irecovery_poll_for_device(client) == IRECOVERY_E_SUCCESS, "device connects");
+
+    // Rejected for its ECID, so it's not counted
+    mock_detach();
+    mock_attach(&bench_other_dfu_device);
+    bench_check(irecovery_await_reconnect(client, 20, NULL) == IRECOVERY_E_TIMEOUT, "another ECID coming back isn't the same phone");
+    struct irecovery_stats stats = { 0 };
+    irecovery_get_stats(client, &stats);
+    bench_check(stats.reconnects == 0, "a rejected phone isn't a reconnect");
+
+    mock_detach();
+    mock_attach(&bench_dfu_device);
+    bench_check(irecovery_await_reconnect(client, 1000, NULL) == IRECOVERY_E_SUCCESS, "the phone comes back");
+    irecovery_get_stats(client, &stats);
+    bench_check(stats.reconnects == 1, "the phone coming back is a reconnect");
+
+    mock_detach();
+    mock_attach(&bench_other_dfu_device);
+    bench_check(irecovery_poll_for_device(client) != IRECOVERY_E_SUCCESS && client->finalized != 1, "a second phone is still refused");
+
+    bench_disconnect(&client);
+}
+
+static unsigned bench_rejections;
+
+static int bench_count_rejection(irecovery_client_t client, const irecovery_event_t* event) {
+    (void)client;
+    (void)event;
+    bench_rejections++;
+    return 0;
+}
+
+static void bench_context(unsigned char* image, size_t length) {
+    irecovery_context_t context = NULL;
+    irecovery_client_t clients[BENCH_HUB_DEVICES] = { NULL };
+    bench_check(irecovery_context_new(&context) == IRECOVERY_E_SUCCESS, "context is created");
+    if (!context) return;
+
+    // The last phone is plugged in first, but its ECID still picks its client
+    irecovery_context_client_new(context, 0, NULL, NULL, 0, &clients[0]);
+    irecovery_context_client_new(context, 0, NULL, NULL, 0, &clients[1]);
+    irecovery_context_client_new(context, 3, NULL, NULL, 0, &clients[2]);
+    bench_rejections = 0;
+    if (clients[2]) irecovery_event_subscribe(clients[2], IRECOVERY_ECID_REJECTED, bench_count_rejection);
+    for (unsigned i = BENCH_HUB_DEVICES; i-- > 0;) {
+        mock_attach_port(i, &bench_hub_devices[i]);
+    }
+    irecovery_context_poll(context);
+
+    bool bound = true;
+    for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+        bound = bound && clients[i] && clients[i]->finalized == 1;
+    }
+    bench_check(bound, "every phone on the hub gets a client");
+    bench_check(bound && clients[2]->device_info.ecid == 3, "a phone goes to the client restricted to its ECID");
+    bench_check(bench_rejections == 0, "phones tried on the restricted client and taken by another aren't rejected");
+    if (!bound) {
+        irecovery_context_free(&context);
+        return;
+    }
+
+#ifdef BENCH_DFU_UPLOADS
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    double started = bench_now();
+    for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+        irecovery_send_buffer(clients[i], image, length, IRECOVERY_SEND_OPT_NONE);
+    }
+    bench_report("hub upload, one after another", BENCH_HUB_DEVICES, bench_now() - started);
+    bench_check(mock_counters.bytes_out == BENCH_HUB_DEVICES * (length + 16), "every phone gets the image");
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    started = bench_now();
+    for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+        irecovery_send_buffer_begin(clients[i], image, length, IRECOVERY_SEND_OPT_NONE);
+    }
+    while (irecovery_context_send_step(context) == IRECOVERY_E_UPLOAD_IN_PROGRESS);
+    bench_report("hub upload, interleaved", BENCH_HUB_DEVICES, bench_now() - started);
+    bench_check(mock_counters.bytes_out == BENCH_HUB_DEVICES * (length + 16), "every phone gets the image");
+#else
+    (void)image;
+    (void)length;
+#endif
+
+    // With only the restricted client free, a phone with another ECID has nowhere to go
+    mock_detach_port(2);
+    irecovery_context_poll(context);
+    mock_attach_port(2, &bench_other_dfu_device);
+    irecovery_context_poll(context);
+    irecovery_context_poll(context);
+    bench_check(bench_rejections == 1 && !irecovery_client_is_usable(clients[2], false), "a phone no client takes is rejected once");
+
+    for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+        mock_detach_port(i);
+    }
+    bench_check(!irecovery_client_is_usable(clients[0], false), "unplugging reaches the client");
+
+    irecovery_context_free(&context);
+}
+
+// Restricted clients with device caches, the phones plugged in the other way around the second time
+static void bench_context_cache(void) {
+    irecovery_context_t context = NULL;
+    irecovery_client_t clients[BENCH_HUB_DEVICES] = { NULL };
+    struct irecovery_device_cache_entry cache[BENCH_HUB_DEVICES][1];
+    memset(cache, 0, sizeof(cache));
+    bench_check(irecovery_context_new(&context) == IRECOVERY_E_SUCCESS, "context is created");
+    if (!context) return;
+
+    for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+        irecovery_context_client_new(context, i + 1, NULL, NULL, 0, &clients[i]);
+        if (clients[i]) irecovery_set_device_cache(clients[i], cache[i], 1);
+    }
+
+    bool bound = true;
+    for (unsigned pass = 0; pass < 2; pass++) {
+        for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+            mock_attach_port(i, &bench_hub_devices[pass ? BENCH_HUB_DEVICES - 1 - i : i]);
+        }
+        irecovery_context_poll(context);
+
+        for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+            bound = bound && clients[i] && clients[i]->finalized == 1 && clients[i]->device_info.ecid == i + 1 &&
+                    mock_device_spec(clients[i]->handle) == &bench_hub_devices[i];
+        }
+        for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+            mock_detach_port(i);
+        }
+        irecovery_context_poll(context);
+    }
+    bench_check(bound, "cached clients get the phone with their ECID");
+
+    uint32_t hits = 0;
+    for (unsigned i = 0; i < BENCH_HUB_DEVICES; i++) {
+        struct irecovery_stats stats = { 0 };
+        irecovery_get_stats(clients[i], &stats);
+        hits += stats.cache_hits;
+    }
+    bench_check(hits == BENCH_HUB_DEVICES, "the second time round is served from the caches");
+
+    irecovery_context_free(&context);
+}
+
+#ifdef BENCH_DFU_UPLOADS
+// A context client whose phone stopped answering mid-upload resets the phone when it's freed, instead of waiting on it forever
+static void bench_context_free_stuck(unsigned char* image, size_t length) {
+    irecovery_context_t context = NULL;
+    irecovery_client_t client = NULL;
+    bench_check(irecovery_context_new(&context) == IRECOVERY_E_SUCCESS, "context is created");
+    if (!context) return;
+
+    irecovery_context_client_new(context, 0, NULL, NULL, 0, &client);
+    mock_attach(&bench_dfu_device);
+    irecovery_context_poll(context);
+    bool connected = client && client->finalized == 1;
+    bench_check(connected, "device connects");
+    if (connected) {
+        memset(&mock_counters, 0, sizeof(mock_counters));
+        mock_hold_transfers(true);
+        irecovery_send_buffer_begin(client, image, length, IRECOVERY_SEND_OPT_NONE);
+        irecovery_send_step(client);
+        bool queued = !irecovery_upload_idle(&client->upload);
+        irecovery_client_free(&client);
+        mock_hold_transfers(false);
+        bench_check(queued && !client && mock_counters.resets == 1, "freeing a client stuck mid-upload resets its phone");
+    }
+
+    mock_detach();
+    irecovery_context_free(&context);
+}
+#endif
+
+#ifndef IRECOVERY_NO_RECOVERY
+// Lines the console handed out, joined with '|'
+static char bench_console_lines[256];
+static unsigned bench_console_line_count;
+
+static int bench_console_line(irecovery_client_t client, const irecovery_event_t* event) {
+    (void)client;
+    size_t used = strlen(bench_console_lines);
+    snprintf(bench_console_lines + used, sizeof(bench_console_lines) - used, "%s%s", bench_console_line_count ? "|" : "", event->data);
+    bench_console_line_count++;
+    return 0;
+}
+
+static void bench_console(unsigned char* image, size_t length) {
+    static const char output[] = "hello\r\n\0world\npartial";
+    char ring[64], data[64];
+    size_t read = 0;
+    irecovery_client_t client = bench_connect(&bench_recovery_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    bench_console_lines[0] = '\0';
+    bench_console_line_count = 0;
+    bench_check(irecovery_event_subscribe(client, IRECOVERY_CONSOLE_LINE, bench_console_line) == IRECOVERY_E_SUCCESS, "console lines can be subscribed to");
+    bench_check(irecovery_console_start(client, ring, sizeof(ring)) == IRECOVERY_E_SUCCESS &&
+                irecovery_console_start(client, ring, sizeof(ring)) == IRECOVERY_E_CLIENT_ALREADY_ACTIVE, "the console starts once");
+
+    bench_check(irecovery_console_read(client, data, sizeof(data), &read) == IRECOVERY_E_SUCCESS && read == 0, "nothing is read before there's output");
+    mock_console_output(output, sizeof(output) - 1);
+    for (int i = 0; i < 4; i++) usb_HandleEvents();
+    bench_check(irecovery_console_read(client, data, sizeof(data), &read) == IRECOVERY_E_SUCCESS &&
+                read == sizeof(output) - 2 && memcmp(data, "hello\r\nworld\npartial", read) == 0, "console output is read without its NULs");
+    bench_check(bench_console_line_count == 2 && strcmp(bench_console_lines, "hello|world") == 0, "complete lines are published");
+
+    // Output keeps streaming in while an upload runs
+    mock_console_output("line\n", 5);
+    irecovery_error_t error = irecovery_send_buffer_begin(client, image, length, IRECOVERY_SEND_OPT_NONE);
+    while (error == IRECOVERY_E_UPLOAD_IN_PROGRESS || error == IRECOVERY_E_SUCCESS) {
+        error = irecovery_send_step(client);
+        if (error == IRECOVERY_E_SUCCESS) break;
+    }
+    bench_check(error == IRECOVERY_E_SUCCESS, "an upload runs next to the console");
+    bench_check(bench_console_line_count == 3 && strcmp(bench_console_lines, "hello|world|partialline") == 0, "lines span reads");
+    bench_check(irecovery_console_read(client, data, sizeof(data), &read) == IRECOVERY_E_SUCCESS && read == 5 &&
+                memcmp(data, "line\n", 5) == 0, "output that came in during the upload is buffered");
+
+    // A full ring drops what doesn't fit
+    memset(&client->stats, 0, sizeof(client->stats));
+    memset(data, 'x', sizeof(data));
+    mock_console_output(data, sizeof(data));
+    mock_console_output(data, 16);
+    for (int i = 0; i < 4; i++) usb_HandleEvents();
+    bench_check(irecovery_console_read(client, data, sizeof(data), &read) == IRECOVERY_E_SUCCESS && read == sizeof(ring) &&
+                client->stats.console_dropped == 16, "a full ring counts what it drops");
+
+    // Stopped, the read in flight takes the output and drops it
+    bench_check(irecovery_console_stop(client) == IRECOVERY_E_SUCCESS && irecovery_console_stop(client) == IRECOVERY_E_SUCCESS, "the console stops");
+    mock_console_output("late\n", 5);
+    for (int i = 0; i < 4; i++) usb_HandleEvents();
+    bench_check(irecovery_console_read(client, data, sizeof(data), &read) == IRECOVERY_E_SUCCESS && read == 0 &&
+                bench_console_line_count == 3, "a stopped console doesn't read");
+
+    // Stopped and started again before the read in flight lands, the read is taken back and its output kept
+    bench_check(irecovery_console_start(client, ring, sizeof(ring)) == IRECOVERY_E_SUCCESS &&
+                irecovery_console_stop(client) == IRECOVERY_E_SUCCESS &&
+                irecovery_console_start(client, ring, sizeof(ring)) == IRECOVERY_E_SUCCESS, "the console restarts with a read in flight");
+    mock_console_output("back\n", 5);
+    for (int i = 0; i < 4; i++) usb_HandleEvents();
+    bench_check(irecovery_console_read(client, data, sizeof(data), &read) == IRECOVERY_E_SUCCESS && read == 5 && memcmp(data, "back\n", 5) == 0 &&
+                bench_console_line_count == 4, "output after a restart is read");
+    bench_check(irecovery_console_stop(client) == IRECOVERY_E_SUCCESS, "the console stops");
+
+    // Started again, it goes away with the phone
+    bench_check(irecovery_console_start(client, NULL, 0) == IRECOVERY_E_SUCCESS, "the console starts again without a ring");
+    mock_console_output("again\n", 6);
+    for (int i = 0; i < 4; i++) usb_HandleEvents();
+    bench_check(bench_console_line_count == 5, "lines still come without a ring");
+    bench_disconnect(&client);
+
+    // Past recovery mode 2 the console is on another alternate setting, which usbdrvce has to set up
+    client = bench_connect(&bench_recovery3_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_console_start(client, ring, sizeof(ring)) == IRECOVERY_E_SUCCESS && mock_counters.interface_sets == 1 &&
+                mock_counters.blocking_transfers == 0, "the console's alternate setting goes through usb_SetInterface()");
+    bench_disconnect(&client);
+
+    client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+    bench_check(irecovery_console_start(client, ring, sizeof(ring)) == IRECOVERY_E_SERVICE_NOT_AVAILABLE, "DFU mode has no console");
+    bench_disconnect(&client);
+}
+#endif
+
+static void bench_commands(void) {
+    const unsigned iterations = 1000;
+    static const char* const commands[] = {
+        "setenv auto-boot false", "setenv boot-args -v", "setenv debug-uarts 3", "setenv display-rotation 0",
+        "setenv pwr-path 1", "setenv idle-off false", "setenv wdt-enable 0", "saveenv"
+    };
+    const unsigned count = sizeof(commands) / sizeof(commands[0]);
+    irecovery_client_t client = bench_connect(&bench_recovery_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        for (unsigned j = 0; j < count; j++) {
+            irecovery_send_command(client, commands[j]);
+        }
+    }
+    bench_report("commands, one at a time", iterations * count, bench_now() - started);
+
+    irecovery_error_t results[sizeof(commands) / sizeof(commands[0])];
+    irecovery_error_t error = IRECOVERY_E_SUCCESS;
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    started = bench_now();
+    for (unsigned i = 0; i < iterations && error == IRECOVERY_E_SUCCESS; i++) {
+        error = irecovery_send_commands(client, commands, count, results);
+    }
+    bench_report("commands, batched", iterations * count, bench_now() - started);
+    bench_check(error == IRECOVERY_E_SUCCESS && results[count - 1] == IRECOVERY_E_SUCCESS && mock_counters.console_commands == iterations * count, "every batched command is sent");
+    bench_check(mock_counters.event_polls == iterations, "a batch checks the client once");
+
+    static const char* const with_empty[] = { "setenv auto-boot false", "", "saveenv" };
+    bench_check(irecovery_send_commands(client, with_empty, 3, results) == IRECOVERY_E_SUCCESS && results[1] == IRECOVERY_E_SUCCESS, "empty commands count as sent");
+    bench_check(irecovery_send_commands(NULL, commands, 0, NULL) == IRECOVERY_E_NO_DEVICE, "an empty batch still checks the client");
+
+    // setenv, setenv, then saveenv ahead of go
+    static const char script[] = "setenv auto-boot true\r\n# a comment\n\nsetenv boot-args -v\ngo\n";
+    mock_add_appvar("BENCHSCR", script, sizeof(script) - 1);
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    size_t line = 0;
+    bench_check(irecovery_run_script(client, "BENCHSCR", &line) == IRECOVERY_E_SUCCESS && line == 0 && mock_counters.console_commands == 4, "script runs with saveenv folded in");
+
+    bench_disconnect(&client);
+}
+
+// Uploads with the mock failing `count` image transfers after `skip` good ones, and checks the outcome.
+static void bench_retry_case(const char* what, const struct mock_device* device, unsigned char* image, size_t length, unsigned int options,
+                             uint32_t skip, uint32_t count, irecovery_error_t expected, uint64_t expected_bytes) {
+    irecovery_client_t client = bench_connect(device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    mock_fail_transfers(skip, count);
+    irecovery_error_t error = irecovery_send_buffer(client, image, length, options);
+    mock_fail_transfers(0, 0);
+    if (error != expected || mock_counters.bytes_out != expected_bytes) {
+        printf("FAILED: %s (%s, %llu bytes)\n", what, irecovery_strerror(error), (unsigned long long)mock_counters.bytes_out);
+        bench_failures++;
+    }
+    // Retries and restarts are scheduled like every other transfer, so a context's other uploads keep going meanwhile
+    bench_check(mock_counters.blocking_transfers == 0, "retries don't block on the bus");
+
+    bench_disconnect(&client);
+}
+
+static void bench_retry(unsigned char* image, size_t length) {
+#ifdef BENCH_DFU_UPLOADS
+    const size_t dfu_packet = 0x800;
+    bench_retry_case("a DFU upload starts over from block 0", &bench_dfu_device, image, length,
+                     IRECOVERY_SEND_OPT_RETRY, 5, 1, IRECOVERY_E_SUCCESS, 5 * dfu_packet + length + 16);
+#endif
+
+#ifndef IRECOVERY_NO_RECOVERY
+    const size_t recovery_packet = 0x8000;
+    bench_retry_case("a failed recovery mode packet is sent again", &bench_recovery_device, image, length,
+                     IRECOVERY_SEND_OPT_RETRY, 3, 1, IRECOVERY_E_SUCCESS, length);
+    // The packet queued behind the failed one lands, so the image goes again from the start
+    bench_retry_case("a pipelined upload starts over", &bench_recovery_device, image, length,
+                     IRECOVERY_SEND_OPT_RETRY | IRECOVERY_SEND_OPT_RECOVERY_PIPELINE, 3, 1, IRECOVERY_E_SUCCESS, length + 4 * recovery_packet);
+    bench_retry_case("retries are bounded", &bench_recovery_device, image, length,
+                     IRECOVERY_SEND_OPT_RETRY, 3, 100, IRECOVERY_E_USB_UPLOAD_FAILED, 3 * recovery_packet);
+
+    // Fails without retries, then picks up where it stopped
+    irecovery_client_t client = bench_connect(&bench_recovery_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    size_t offset = 0, checkpoint_length = 0;
+    mock_fail_transfers(3, 1);
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_USB_UPLOAD_FAILED, "uploads fail without IRECOVERY_SEND_OPT_RETRY");
+    mock_fail_transfers(0, 0);
+    bench_check(irecovery_get_upload_checkpoint(client, &offset, &checkpoint_length) == IRECOVERY_E_SUCCESS &&
+                offset == 3 * recovery_packet && checkpoint_length == length, "the failed upload leaves a checkpoint");
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_RESUME) == IRECOVERY_E_SUCCESS &&
+                mock_counters.bytes_out == length - offset, "the upload resumes at the checkpoint");
+    bench_check(irecovery_get_upload_checkpoint(client, &offset, &checkpoint_length) == IRECOVERY_E_NO_UPLOAD, "a finished upload clears the checkpoint");
+
+    bench_disconnect(&client);
+#endif
+}
+
+// Greedy LZ4 block compression like tools/mkcompressed.py, returns the compressed size.
+static size_t bench_lz4_compress(const unsigned char* src, size_t length, unsigned char* dst) {
+    static uint32_t table[4096];
+    unsigned char* op = dst;
+    size_t anchor = 0, i = 0;
+    memset(table, 0xFF, sizeof(table));
+
+    while (i + 12 < length) {
+        uint32_t key;
+        memcpy(&key, src + i, 4);
+        uint32_t hash = (key * 2654435761u) >> 20;
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)i;
+        if (candidate == 0xFFFFFFFF || memcmp(src + candidate, src + i, 4) != 0) {
+            i++;
+            continue;
+        }
+
+        size_t match = 4;
+        while (i + match < length - 5 && src[candidate + match] == src[i + match]) match++;
+
+        size_t literals = i - anchor;
+        unsigned char* token = op++;
+        *token = (unsigned char)((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15) {
+            size_t rest = literals - 15;
+            for (; rest >= 255; rest -= 255) *op++ = 255;
+            *op++ = (unsigned char)rest;
+        }
+        memcpy(op, src + anchor, literals);
+        op += literals;
+        *op++ = (unsigned char)(i - candidate);
+        *op++ = (unsigned char)((i - candidate) >> 8);
+        *token |= (unsigned char)(match - 4 < 15 ? match - 4 : 15);
+        if (match - 4 >= 15) {
+            size_t rest = match - 4 - 15;
+            for (; rest >= 255; rest -= 255) *op++ = 255;
+            *op++ = (unsigned char)rest;
+        }
+        i += match;
+        anchor = i;
+    }
+
+    size_t literals = length - anchor;
+    *op++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        size_t rest = literals - 15;
+        for (; rest >= 255; rest -= 255) *op++ = 255;
+        *op++ = (unsigned char)rest;
+    }
+    memcpy(op, src + anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+// Builds what tools/mkcompressed.py would, split into two AppVars at the block nearest the middle. Returns the total size.
+static size_t bench_compress_image(const unsigned char* image, size_t length, size_t block_size, unsigned char* out, size_t* split) {
+    unsigned char* op = out;
+    memcpy(op, "IRLZ", 4);
+    op[4] = IRECOVERY_COMPRESSED_VERSION;
+    op[5] = 0;
+    op[6] = (unsigned char)block_size;
+    op[7] = (unsigned char)(block_size >> 8);
+    for (int i = 0; i < 4; i++) op[8 + i] = (unsigned char)(length >> (8 * i));
+    op += IRECOVERY_COMPRESSED_HEADER_SIZE;
+
+    *split = 0;
+    for (size_t offset = 0; offset < length; offset += block_size) {
+        size_t size = length - offset < block_size ? length - offset : block_size;
+        if (!*split && offset >= length / 2) *split = op - out;
+
+        size_t compressed = bench_lz4_compress(image + offset, size, op + 2);
+        if (compressed >= size) {
+            compressed = 0;
+            memcpy(op + 2, image + offset, size);
+        }
+        op[0] = (unsigned char)compressed;
+        op[1] = (unsigned char)(compressed >> 8);
+        op += 2 + (compressed ? compressed : size);
+    }
+    return op - out;
+}
+
+// Uploads the image from compressed AppVars, and checks the device gets exactly what irecovery_send_buffer() sends.
+static void bench_compressed_case(const char* name, const struct mock_device* device, unsigned char* image, size_t length,
+                                  size_t block_size, unsigned int options) {
+    const unsigned iterations = 16;
+    static unsigned char compressed[160 * 1024];
+    static unsigned appvars;
+    char first[9], second[9];
+    snprintf(first, sizeof(first), "BLZ%uA", appvars);
+    snprintf(second, sizeof(second), "BLZ%uB", appvars);
+    appvars++;
+
+    size_t split;
+    size_t size = bench_compress_image(image, length, block_size, compressed, &split);
+    // The mock keeps pointers, so every case gets its own copy
+    unsigned char* data = malloc(size);
+    if (!data) return;
+    memcpy(data, compressed, size);
+    mock_add_appvar(first, data, (uint16_t)split);
+    mock_add_appvar(second, data + split, (uint16_t)(size - split));
+    const char* names[] = { first, second };
+
+    irecovery_client_t client = bench_connect(device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_send_buffer(client, image, length, options) == IRECOVERY_E_SUCCESS, "the uncompressed image uploads");
+    uint32_t expected = mock_counters.checksum_out;
+    uint64_t expected_bytes = mock_counters.bytes_out;
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        memset(&mock_counters, 0, sizeof(mock_counters));
+        irecovery_error_t error = irecovery_send_compressed_appvars(client, names, 2, options);
+        if (error != IRECOVERY_E_SUCCESS) {
+            printf("FAILED: %s returned %s\n", name, irecovery_strerror(error));
+            bench_failures++;
+            break;
+        }
+    }
+    bench_report(name, iterations, bench_now() - started);
+    bench_check(mock_counters.checksum_out == expected && mock_counters.bytes_out == expected_bytes, "the decompressed image reaches the device");
+
+    bench_disconnect(&client);
+}
+
+static int bench_stream_read(void* user_data, size_t offset, unsigned char* dst, size_t length) {
+    memcpy(dst, (const unsigned char*)user_data + offset, length);
+    return length;
+}
+
+// Uploads the image through a read callback and from three AppVars, and checks the device gets exactly what
+// irecovery_send_buffer() sends. Packets straddle the AppVars, so the DFU block numbers and CRC have to carry across them.
+static void bench_stream_case(const char* name, const struct mock_device* device, unsigned char* image, unsigned int options) {
+    static const uint16_t sizes[] = { 0x3000, 0x5123, 0x100 };
+    static unsigned appvars;
+    char names[3][9];
+    const char* list[3];
+    size_t length = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        length += sizes[i];
+    }
+
+    // The mock keeps pointers, so every case gets its own copy
+    unsigned char* data = malloc(length);
+    if (!data) return;
+    memcpy(data, image, length);
+    for (unsigned i = 0, offset = 0; i < 3; offset += sizes[i], i++) {
+        snprintf(names[i], sizeof(names[i]), "BAV%u%c", appvars, 'A' + i);
+        mock_add_appvar(names[i], data + offset, sizes[i]);
+        list[i] = names[i];
+    }
+    appvars++;
+
+    irecovery_client_t client = bench_connect(device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_send_buffer(client, data, length, options) == IRECOVERY_E_SUCCESS, "the image uploads from a buffer");
+    uint32_t expected = mock_counters.checksum_out;
+    uint64_t expected_bytes = mock_counters.bytes_out;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    irecovery_error_t error = irecovery_send_stream(client, bench_stream_read, data, length, options);
+    if (error != IRECOVERY_E_SUCCESS || mock_counters.checksum_out != expected || mock_counters.bytes_out != expected_bytes) {
+        printf("FAILED: %s streamed (%s)\n", name, irecovery_strerror(error));
+        bench_failures++;
+    }
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    error = irecovery_send_appvars(client, list, 3, options);
+    if (error != IRECOVERY_E_SUCCESS || mock_counters.checksum_out != expected || mock_counters.bytes_out != expected_bytes) {
+        printf("FAILED: %s from AppVars (%s)\n", name, irecovery_strerror(error));
+        bench_failures++;
+    }
+
+    bench_disconnect(&client);
+}
+
+#ifdef BENCH_DFU_UPLOADS
+// Cancels a DFU upload a few packets in, then checks the next one goes through whole.
+static void bench_cancel(unsigned char* image, size_t length) {
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_SUCCESS, "the image uploads from a buffer");
+    uint32_t expected = mock_counters.checksum_out;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    irecovery_error_t error = irecovery_send_buffer_begin(client, image, length, IRECOVERY_SEND_OPT_NONE);
+    if (error == IRECOVERY_E_SUCCESS) {
+        do {
+            error = irecovery_send_step(client);
+        } while (error == IRECOVERY_E_UPLOAD_IN_PROGRESS && mock_counters.bytes_out < 4 * 0x800);
+    }
+    bench_check(error == IRECOVERY_E_UPLOAD_IN_PROGRESS && irecovery_send_cancel(client) == IRECOVERY_E_SUCCESS, "a DFU upload can be cancelled");
+    for (unsigned steps = 0; steps < 1000; steps++) {
+        if ((error = irecovery_send_step(client)) != IRECOVERY_E_UPLOAD_IN_PROGRESS) break;
+    }
+    bench_check(error == IRECOVERY_E_UPLOAD_CANCELLED && mock_counters.bytes_out < length, "a cancelled DFU upload stops early");
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_SUCCESS &&
+                mock_counters.checksum_out == expected && mock_counters.bytes_out == length + 16, "the next DFU upload after a cancel goes through");
+
+    bench_disconnect(&client);
+}
+#endif
+
+static void bench_compressed(void) {
+    // Repetitive code-like data around a stretch that doesn't compress, so both kinds of blocks show up
+    size_t length = 96 * 1024 + 45;
+    unsigned char* image = malloc(length);
+    if (!image) return;
+    uint32_t seed = 1;
+    for (size_t i = 0; i < length; i++) {
+        if (i >= 40 * 1024 && i < 56 * 1024) {
+            seed = seed * 1103515245u + 12345u;
+            image[i] = (unsigned char)(seed >> 16);
+        } else {
+            image[i] = (unsigned char)((i % 48) < 32 ? (i / 48) & 0x1F : i);
+        }
+    }
+
+#ifdef BENCH_DFU_UPLOADS
+    bench_compressed_case("compressed dfu", &bench_dfu_device, image, length, 0x800, IRECOVERY_SEND_OPT_NONE);
+    bench_compressed_case("compressed dfu (0x600)", &bench_dfu_device, image, length, 0x600, IRECOVERY_SEND_OPT_NONE);
+    bench_compressed_case("compressed dfu (0x4000 packets)", &bench_large_dfu_device, image, length, 0x800, IRECOVERY_SEND_OPT_NONE);
+
+    // An IRECOVERY_SCRATCH_SIZE arena has no room to decompress ahead, so the upload goes without instead of using the heap
+    static unsigned char scratch[IRECOVERY_SCRATCH_SIZE];
+    irecovery_client_t arena_client = NULL;
+    if (irecovery_client_new_with_scratch(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL, 0, NULL, scratch, sizeof(scratch), &arena_client) == IRECOVERY_E_SUCCESS) {
+        mock_attach(&bench_dfu_device);
+        bool connected = irecovery_poll_for_device(arena_client) == IRECOVERY_E_SUCCESS;
+        bench_check(connected, "device connects");
+        if (connected) {
+            // The first compressed dfu case's AppVars
+            const char* names[] = { "BLZ0A", "BLZ0B" };
+            bool heap = false;
+            irecovery_error_t error = irecovery_send_compressed_appvars_begin(arena_client, names, 2, IRECOVERY_SEND_OPT_NONE);
+            if (error == IRECOVERY_E_SUCCESS) {
+                do {
+                    unsigned char* prefetch = arena_client->upload.prefetch;
+                    heap |= prefetch && (prefetch < scratch || prefetch >= scratch + sizeof(scratch));
+                } while ((error = irecovery_send_step(arena_client)) == IRECOVERY_E_UPLOAD_IN_PROGRESS);
+            }
+            bench_check(error == IRECOVERY_E_SUCCESS && !heap, "a compressed upload stays in the default arena");
+        }
+        bench_disconnect(&arena_client);
+    }
+#endif
+#ifndef IRECOVERY_NO_RECOVERY
+    bench_compressed_case("compressed recovery", &bench_recovery_device, image, length, 0x800, IRECOVERY_SEND_OPT_NONE);
+    bench_compressed_case("compressed recovery (0x600)", &bench_recovery_device, image, length, 0x600, IRECOVERY_SEND_OPT_NONE);
+    bench_compressed_case("compressed recovery pipelined", &bench_recovery_device, image, length, 0x800, IRECOVERY_SEND_OPT_RECOVERY_PIPELINE);
+#endif
+
+#ifdef BENCH_DFU_UPLOADS
+    bench_stream_case("dfu upload", &bench_dfu_device, image, IRECOVERY_SEND_OPT_NONE);
+    bench_cancel(image, length);
+#endif
+#ifndef IRECOVERY_NO_RECOVERY
+    bench_stream_case("recovery upload", &bench_recovery_device, image, IRECOVERY_SEND_OPT_NONE);
+#endif
+
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (client) {
+        static const unsigned char bad_header[IRECOVERY_COMPRESSED_HEADER_SIZE] = { 'I', 'R', 'L', 'Z', 2 };
+        mock_add_appvar("BLZBAD", bad_header, sizeof(bad_header));
+        const char* names[] = { "BLZBAD" };
+        bench_check(irecovery_send_compressed_appvars(client, names, 1, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_BAD_IMAGE, "an unknown version is rejected");
+
+        // Cut off in the middle of the first block
+        static unsigned char truncated[IRECOVERY_COMPRESSED_HEADER_SIZE + 64];
+        size_t split;
+        unsigned char* full = malloc(length + length / 8 + 1024);
+        if (full) {
+            bench_compress_image(image, length, 0x800, full, &split);
+            memcpy(truncated, full, sizeof(truncated));
+            free(full);
+            mock_add_appvar("BLZCUT", truncated, sizeof(truncated));
+            names[0] = "BLZCUT";
+            bench_check(irecovery_send_compressed_appvars(client, names, 1, IRECOVERY_SEND_OPT_NONE) != IRECOVERY_E_SUCCESS, "a truncated image fails");
+        }
+        bench_disconnect(&client);
+    }
+
+    free(image);
+}
+
+static unsigned bench_event_counts[IRECOVERY_MODE_CHANGED + 1];
+
+static int bench_count_event(irecovery_client_t client, const irecovery_event_t* event) {
+    (void)client;
+    bench_event_counts[event->type]++;
+    return 0;
+}
+
+static int bench_count_event_again(irecovery_client_t client, const irecovery_event_t* event) {
+    return bench_count_event(client, event);
+}
+
+static void bench_events(void) {
+    const uint32_t idle_ms = 30;
+    irecovery_client_t client = NULL;
+    bench_check(irecovery_client_new(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL, 0, NULL, &client) == IRECOVERY_E_SUCCESS, "client is created");
+    if (!client) return;
+
+    memset(bench_event_counts, 0, sizeof(bench_event_counts));
+    for (int type = IRECOVERY_DEVICE_ATTACHED; type <= IRECOVERY_MODE_CHANGED; type++) {
+        bench_check(irecovery_event_subscribe(client, type, bench_count_event) == IRECOVERY_E_SUCCESS, "subscribing without a phone works");
+    }
+    bench_check(irecovery_event_subscribe(client, IRECOVERY_DEVICE_ATTACHED, bench_count_event_again) == IRECOVERY_E_SUCCESS &&
+                irecovery_event_subscribe(client, IRECOVERY_DEVICE_ATTACHED, bench_count_event_again) == IRECOVERY_E_SUCCESS, "a type takes several subscribers");
+
+    // Nothing plugged in: it should sleep through the timeout rather than spin
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    double started = bench_now();
+    bench_check(irecovery_wait_for_event(client, IRECOVERY_EVENT_ANY, idle_ms, NULL) == IRECOVERY_E_TIMEOUT, "waiting without a phone times out");
+    double waited = bench_now() - started;
+    uint32_t sleeping_polls = mock_counters.event_polls;
+    bench_check(waited * 1e3 >= idle_ms && mock_counters.timer_wakeups > 0, "the wait sleeps until its timer fires");
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    started = bench_now();
+    while (bench_now() - started < idle_ms / 1e3) irecovery_poll_for_device(client);
+    printf("%-32s %8" PRIu32 " polls while sleeping, %" PRIu32 " while spinning\n", "idle wait for a phone", sleeping_polls, mock_counters.event_polls);
+    bench_check(sleeping_polls * 10 < mock_counters.event_polls, "sleeping polls far less than spinning");
+
+    irecovery_event_t event;
+    mock_attach(&bench_dfu_device);
+    bench_check(irecovery_wait_for_event(client, IRECOVERY_DEVICE_FINALIZED, 1000, &event) == IRECOVERY_E_SUCCESS &&
+                event.error == IRECOVERY_E_SUCCESS && event.mode == IRECOVERY_K_DFU_MODE && event.ecid == 0x001A2B3C4D5E6F70, "a new phone is finalized while waiting");
+    bench_check(bench_event_counts[IRECOVERY_DEVICE_ATTACHED] == 2 && bench_event_counts[IRECOVERY_DEVICE_FINALIZED] == 1, "every subscriber hears about it once");
+
+    // The same phone coming back in recovery mode
+    mock_detach();
+    bench_check(bench_event_counts[IRECOVERY_DEVICE_DISCONNECTED] == 1, "disconnects are published");
+    mock_attach(&bench_recovery_device);
+    bench_check(irecovery_wait_for_event(client, IRECOVERY_MODE_CHANGED, 1000, &event) == IRECOVERY_E_SUCCESS &&
+                event.mode == IRECOVERY_K_RECOVERY_MODE_2, "a mode change is published");
+
+    bench_check(irecovery_event_unsubscribe_callback(client, IRECOVERY_DEVICE_ATTACHED, bench_count_event_again) == IRECOVERY_E_SUCCESS &&
+                irecovery_event_unsubscribe_callback(client, IRECOVERY_DEVICE_ATTACHED, bench_count_event_again) == IRECOVERY_E_BAD_PTR, "one subscriber can leave");
+    bench_check(irecovery_wait_for_event(client, 42, 0, NULL) == IRECOVERY_E_UNKNOWN_EVENT_TYPE, "unknown event types are rejected");
+
+    bench_disconnect(&client);
+}
+
+#ifdef BENCH_DFU_UPLOADS
+static struct {
+    unsigned calls;
+    uint16_t last_permille;
+    double last_progress;
+    bool ordered;
+} bench_progress_plain, bench_progress_stepped, bench_progress_timed;
+
+#define BENCH_PROGRESS_CALLBACK(name, record)                                                \
+    static int name(irecovery_client_t client, const irecovery_event_t* event) {           \
+        (void)client;                                                                       \
+        if (record.calls > 0 && event->permille < record.last_permille) record.ordered = false; \
+        record.calls++;                                                                     \
+        record.last_permille = event->permille;                                             \
+        record.last_progress = event->progress;                                             \
+        return 0;                                                                           \
+    }
+BENCH_PROGRESS_CALLBACK(bench_progress_plain_cb, bench_progress_plain)
+BENCH_PROGRESS_CALLBACK(bench_progress_stepped_cb, bench_progress_stepped)
+BENCH_PROGRESS_CALLBACK(bench_progress_timed_cb, bench_progress_timed)
+
+static void bench_progress(unsigned char* image, size_t length) {
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    const unsigned packets = (unsigned)((length + 0x7FF) / 0x800);
+    memset(&bench_progress_plain, 0, sizeof(bench_progress_plain));
+    memset(&bench_progress_stepped, 0, sizeof(bench_progress_stepped));
+    memset(&bench_progress_timed, 0, sizeof(bench_progress_timed));
+    bench_progress_plain.ordered = bench_progress_stepped.ordered = bench_progress_timed.ordered = true;
+
+    bench_check(irecovery_event_subscribe(client, IRECOVERY_PROGRESS, bench_progress_plain_cb) == IRECOVERY_E_SUCCESS &&
+                irecovery_event_subscribe_progress(client, bench_progress_stepped_cb, 100, 0) == IRECOVERY_E_SUCCESS &&
+                irecovery_event_subscribe_progress(client, bench_progress_timed_cb, 0, 60000) == IRECOVERY_E_SUCCESS, "progress subscriptions work");
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_SUCCESS, "the image uploads");
+
+    // The last DFU packet carries the trailer, so the percentage goes a hair past 100
+    bench_check(bench_progress_plain.calls == packets && bench_progress_plain.last_permille == 1000 &&
+                bench_progress_plain.last_progress >= 100.0 && bench_progress_plain.ordered, "every packet is reported");
+    // The first packet, every 10%, and the last
+    bench_check(bench_progress_stepped.calls >= 10 && bench_progress_stepped.calls <= 12 && bench_progress_stepped.last_permille == 1000 &&
+                bench_progress_stepped.ordered, "a step throttles progress");
+    bench_check(bench_progress_timed.calls == 2 && bench_progress_timed.last_permille == 1000, "an interval throttles progress");
+    printf("%-32s %8u  calls, %u with a 10%% step, %u with a 60 s interval\n", "progress callbacks", bench_progress_plain.calls,
+           bench_progress_stepped.calls, bench_progress_timed.calls);
+
+    // Only the throttled subscriber left: no floating point
+    bench_check(irecovery_event_unsubscribe_callback(client, IRECOVERY_PROGRESS, bench_progress_plain_cb) == IRECOVERY_E_SUCCESS &&
+                irecovery_event_unsubscribe_callback(client, IRECOVERY_PROGRESS, bench_progress_timed_cb) == IRECOVERY_E_SUCCESS, "progress subscribers leave");
+    bench_progress_stepped.calls = 0;
+    bench_check(irecovery_send_buffer(client, image, length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_SUCCESS &&
+                bench_progress_stepped.calls >= 10 && bench_progress_stepped.last_progress == 0.0, "throttled subscribers skip the percentage");
+
+    bench_disconnect(&client);
+}
+#endif
+
+#if defined(BENCH_DFU_UPLOADS) && !defined(IRECOVERY_NO_RECOVERY)
+// Whether or not the compressed stage's first packet was decompressed while the phone was away
+static bool bench_boot_primed;
+
+// Runs the boot chain, unplugging the phone whenever it's waited for and plugging next[stage] in, if there's one.
+static irecovery_error_t bench_boot_run(irecovery_client_t client, const struct irecovery_boot_stage* stages, size_t count,
+                                        const struct mock_device* const* next, uint32_t timeout_ms, size_t* stage) {
+    size_t replugged = count;
+    irecovery_error_t error = irecovery_boot_begin(client, stages, count, timeout_ms);
+    while (error == IRECOVERY_E_BOOT_IN_PROGRESS) {
+        if (client->boot.state == IRECOVERY_BOOT_STATE_RECONNECT && client->boot.index != replugged) {
+            replugged = client->boot.index;
+            if (client->boot.prepared && client->boot.next.primed) bench_boot_primed = true;
+            mock_detach();
+            if (next[replugged]) mock_attach(next[replugged]);
+        }
+        error = irecovery_boot_step(client);
+    }
+
+    irecovery_get_boot_stage(client, stage);
+    return error;
+}
+
+static void bench_boot(unsigned char* image) {
+    const unsigned iterations = 8;
+    const size_t ibss_length = 64 * 1024, ibec_length = 96 * 1024;
+    unsigned char* ibss = image;
+    unsigned char* ibec = image + ibss_length;
+    static unsigned char compressed[64 * 1024];
+    static const char* const ibec_names[] = { "BIBEC" };
+    static const char* const missing_names[] = { "BMISSING" };
+    static const char* const go[] = { "go" };
+    static const char* const setup[] = { "setenv auto-boot false", "saveenv" };
+
+    size_t split;
+    size_t size = bench_compress_image(ibec, ibec_length, 0x800, compressed, &split);
+    bench_check(size <= 0xFFE0, "iBEC fits in one AppVar");
+    mock_add_appvar(ibec_names[0], compressed, (uint16_t)size);
+
+    struct irecovery_boot_stage stages[3];
+    memset(stages, 0, sizeof(stages));
+    stages[0].image         = IRECOVERY_BOOT_IMAGE_BUFFER;
+    stages[0].buffer        = ibss;
+    stages[0].length        = ibss_length;
+    stages[0].next_mode     = IRECOVERY_K_RECOVERY_MODE_2;
+    stages[1].image         = IRECOVERY_BOOT_IMAGE_COMPRESSED_APPVARS;
+    stages[1].names         = ibec_names;
+    stages[1].count         = 1;
+    stages[1].commands      = go;
+    stages[1].command_count = 1;
+    stages[1].next_mode     = IRECOVERY_K_RECOVERY_MODE_2;
+    stages[2].commands      = setup;
+    stages[2].command_count = 2;
+    const struct mock_device* const next[] = { &bench_recovery_device, &bench_recovery_device, NULL };
+    const struct mock_device* const back_in_dfu[] = { &bench_dfu_device, NULL, NULL };
+    const struct mock_device* const gone[] = { NULL, NULL, NULL };
+
+    // What the two images look like on the wire when they're sent by hand
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_send_buffer(client, ibss, ibss_length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_SUCCESS, "iBSS uploads");
+    mock_detach();
+    mock_attach(&bench_recovery_device);
+    bench_check(irecovery_poll_for_device(client) == IRECOVERY_E_SUCCESS &&
+                irecovery_send_buffer(client, ibec, ibec_length, IRECOVERY_SEND_OPT_NONE) == IRECOVERY_E_SUCCESS, "iBEC uploads");
+    uint32_t expected = mock_counters.checksum_out;
+
+    size_t stage = 0;
+    irecovery_error_t error = IRECOVERY_E_SUCCESS;
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations && error == IRECOVERY_E_SUCCESS; i++) {
+        mock_detach();
+        mock_attach(&bench_dfu_device);
+        irecovery_poll_for_device(client);
+        memset(&mock_counters, 0, sizeof(mock_counters));
+        bench_boot_primed = false;
+        error = bench_boot_run(client, stages, 3, next, 1000, &stage);
+    }
+    bench_report("boot chain (3 stages)", iterations, bench_now() - started);
+    bench_check(error == IRECOVERY_E_SUCCESS && stage == 3, "the boot chain runs every stage");
+    bench_check(mock_counters.checksum_out == expected && mock_counters.console_commands == 3, "every image and command reaches the device");
+    bench_check(bench_boot_primed, "the next stage is decompressed while the phone re-enumerates");
+    bench_check(irecovery_boot_step(client) == IRECOVERY_E_NO_BOOT, "nothing runs after the boot");
+
+    // The phone comes back in the wrong mode, or doesn't at all
+    mock_detach();
+    mock_attach(&bench_dfu_device);
+    irecovery_poll_for_device(client);
+    bench_check(bench_boot_run(client, stages, 3, back_in_dfu, 1000, &stage) == IRECOVERY_E_UNEXPECTED_MODE && stage == 0, "the wrong mode stops the boot");
+    mock_detach();
+    mock_attach(&bench_dfu_device);
+    irecovery_poll_for_device(client);
+    bench_check(bench_boot_run(client, stages, 3, gone, 20, &stage) == IRECOVERY_E_TIMEOUT && stage == 0, "a phone that doesn't come back times out");
+
+    // irecovery_boot() sleeps on the timer while it waits for the phone, instead of spinning on usb_HandleEvents()
+    mock_attach(&bench_dfu_device);
+    irecovery_poll_for_device(client);
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    error = irecovery_boot(client, stages, 1, 20, &stage);
+    bench_check(error == IRECOVERY_E_TIMEOUT && mock_counters.timer_wakeups > 0 && mock_counters.event_polls < 1000, "the blocking boot sleeps while the phone is away");
+
+    // A missing AppVar is found while the phone re-enumerates, a bad stage before anything is sent
+    mock_attach(&bench_dfu_device);
+    irecovery_poll_for_device(client);
+    stages[1].names = missing_names;
+    bench_check(bench_boot_run(client, stages, 3, next, 1000, &stage) == IRECOVERY_E_APPVAR_NOT_FOUND && stage == 0, "a missing AppVar stops the boot");
+    mock_attach(&bench_dfu_device);
+    irecovery_poll_for_device(client);
+    stages[1].names = NULL;
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    bench_check(irecovery_boot_begin(client, stages, 3, 1000) == IRECOVERY_E_BAD_PTR && mock_counters.bytes_out == 0, "bad stages are rejected up front");
+
+    // Commands for a stage that runs in DFU mode, first stage or after one that stays in DFU mode
+    stages[1].names         = ibec_names;
+    stages[0].commands      = go;
+    stages[0].command_count = 1;
+    bench_check(irecovery_boot_begin(client, stages, 3, 1000) == IRECOVERY_E_SERVICE_NOT_AVAILABLE && mock_counters.bytes_out == 0, "commands without a console are rejected up front");
+    stages[0].command_count = 0;
+    stages[0].next_mode     = IRECOVERY_K_DFU_MODE;
+    bench_check(irecovery_boot_begin(client, stages, 3, 1000) == IRECOVERY_E_SERVICE_NOT_AVAILABLE && mock_counters.bytes_out == 0, "commands after a stage that stays in DFU mode are rejected up front");
+
+    bench_disconnect(&client);
+}
+#endif
+
+static void bench_session(void) {
+    const unsigned iterations = 10000;
+    struct irecovery_dfu_status status;
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        irecovery_get_status(client, &status);
+    }
+    bench_report("get_status, no session", iterations, bench_now() - started);
+    bench_check(mock_counters.event_polls == iterations, "every call handles events without a session");
+
+    memset(&mock_counters, 0, sizeof(mock_counters));
+    irecovery_error_t error = irecovery_session_begin(client);
+    started = bench_now();
+    for (unsigned i = 0; i < iterations && error == IRECOVERY_E_SUCCESS; i++) {
+        error = irecovery_get_status(client, &status);
+    }
+    bench_report("get_status, in a session", iterations, bench_now() - started);
+    bench_check(error == IRECOVERY_E_SUCCESS && mock_counters.event_polls == 1, "a session checks the client once");
+
+    // Unplugged and plugged back in, the session is still over
+    mock_detach();
+    mock_attach(&bench_dfu_device);
+    irecovery_poll_for_device(client);
+    bench_check(irecovery_get_status(client, &status) == IRECOVERY_E_NO_DEVICE, "a session doesn't outlive its connection");
+    bench_check(irecovery_session_end(client) == IRECOVERY_E_NO_DEVICE && irecovery_session_end(client) == IRECOVERY_E_NO_SESSION, "ending the session reports the lost connection");
+    bench_check(irecovery_get_status(client, &status) == IRECOVERY_E_SUCCESS, "the new connection works outside the session");
+
+    bench_disconnect(&client);
+}
+
+static void bench_getenv(void) {
+    const unsigned iterations = 10000;
+    irecovery_client_t client = bench_connect(&bench_recovery_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        char* value = NULL;
+        if (irecovery_getenv(client, "build-version", &value) == IRECOVERY_E_SUCCESS) free(value);
+    }
+    bench_report("getenv", iterations, bench_now() - started);
+
+    char value[64];
+    size_t length = 1;
+    irecovery_error_t error = IRECOVERY_E_SUCCESS;
+    started = bench_now();
+    for (unsigned i = 0; i < iterations && error == IRECOVERY_E_SUCCESS; i++) {
+        error = irecovery_getenv_into(client, "build-version", value, sizeof(value), &length);
+    }
+    bench_report("getenv, into a buffer", iterations, bench_now() - started);
+    bench_check(error == IRECOVERY_E_SUCCESS && length == 0 && value[0] == '\0', "getenv_into reads the reply");
+
+    unsigned char serial[2 + 2 * sizeof(bench_serial)];
+    bench_check(irecovery_get_string_descriptor_ascii_into(client, 3, serial, sizeof(serial), &length) == IRECOVERY_E_SUCCESS &&
+                length == sizeof(bench_serial) - 1 && strcmp((const char*)serial, bench_serial) == 0, "serial string reads in place");
+    bench_check(irecovery_get_string_descriptor_ascii_into(client, 3, serial, 12, &length) == IRECOVERY_E_SUCCESS &&
+                length == 5 && strcmp((const char*)serial, "CPID:") == 0, "short buffers truncate the serial string");
+    bench_check(irecovery_get_string_descriptor_ascii_into(client, 3, serial, 3, &length) == IRECOVERY_E_SUCCESS &&
+                length == 2 && strcmp((const char*)serial, "CP") == 0, "buffers under 4 bytes still get the start of the string");
+    bench_check(irecovery_get_string_descriptor_ascii_into(client, 3, serial, 1, &length) == IRECOVERY_E_SUCCESS &&
+                length == 0 && serial[0] == '\0', "a 1 byte buffer gets an empty string");
+
+    bench_disconnect(&client);
+}
+
+static void bench_iboot_string(void) {
+    const unsigned iterations = 10000;
+    irecovery_client_t client = bench_connect(&bench_dfu_device);
+    bench_check(client != NULL, "device connects");
+    if (!client) return;
+
+    // The parse clears device_info, and only serial_string is freed in the loop
+    free(client->device_info.ap_nonce);
+    free(client->device_info.sep_nonce);
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        free(client->device_info.serial_string);
+        irecovery_load_device_info_from_iboot_string(client, bench_serial);
+    }
+    bench_report("iboot string parse", iterations, bench_now() - started);
+
+    bench_check(client->device_info.cpid == 0x8010 && client->device_info.ecid == 0x001A2B3C4D5E6F70ULL, "iboot string fields");
+
+    // Bracketed values run to their closing bracket, spaces included
+    free(client->device_info.serial_string);
+    irecovery_load_device_info_from_iboot_string(client, "CPID:8020 SRTG:[iBoot-7429.0.0.1 ECID:FF] SRNM:[F17XXXXXXXXX] ECID:00AB");
+    bench_check(client->device_info.srtg && strcmp(client->device_info.srtg, "iBoot-7429.0.0.1 ECID:FF") == 0 &&
+                client->device_info.srnm && strcmp(client->device_info.srnm, "F17XXXXXXXXX") == 0 &&
+                client->device_info.cpid == 0x8020 && client->device_info.ecid == 0xAB, "iboot string bracketed spaces");
+
+    bench_disconnect(&client);
+}
+
+#ifndef IRECOVERY_NO_DEVICE_TABLE
+// Entries of the built-in table, which the database build has to give back the same
+static const struct irecovery_device bench_known_devices[] = {
+    { "iPhone1,1",  "m68ap", 0x00, 0x8900, "iPhone 2G" },
+    { "iPhone10,3", "d22ap", 0x06, 0x8015, "iPhone X (Global)" }
+};
+
+static bool bench_device_equal(irecovery_device_t device, const struct irecovery_device* expected) {
+    return device && strcmp(device->product_type, expected->product_type) == 0 && strcmp(device->hardware_model, expected->hardware_model) == 0 &&
+           device->board_id == expected->board_id && device->chip_id == expected->chip_id && strcmp(device->display_name, expected->display_name) == 0;
+}
+
+static void bench_device_lookups(void) {
+    const unsigned iterations = 100;
+    unsigned lookups = 0;
+
+#ifdef IRECOVERY_DEVICE_DB
+    // tools/mkdevicedb.py irecovery.c --raw BENCH_DEVICE_DB, see the build line at the top
+    static unsigned char db[0x10000];
+    FILE* file = fopen(BENCH_DEVICE_DB, "rb");
+    size_t size = file ? fread(db, 1, sizeof(db) - 1, file) : 0;
+    if (file) fclose(file);
+    bench_check(size > 0, "the device database is read from " BENCH_DEVICE_DB);
+    if (size == 0) return;
+
+    bench_check(irecovery_devices_get_all() == NULL, "no database AppVar, no table");
+    mock_add_appvar(IRECOVERY_DEVICE_DB_NAME, db, (uint16_t)size);
+#endif
+
+    irecovery_device_t all = irecovery_devices_get_all();
+    bench_check(all != NULL, "the device table loads");
+    if (!all) return;
+
+    double started = bench_now();
+    for (unsigned i = 0; i < iterations; i++) {
+        for (irecovery_device_t entry = irecovery_devices_get_all(); entry->product_type; entry++) {
+            irecovery_device_t device = NULL;
+            bench_check(irecovery_devices_get_device_by_product_type(entry->product_type, &device) == IRECOVERY_E_SUCCESS, "lookup by product type");
+            device = NULL;
+            bench_check(irecovery_devices_get_device_by_hardware_model(entry->hardware_model, &device) == IRECOVERY_E_SUCCESS, "lookup by hardware model");
+            lookups += 2;
+        }
+    }
+    bench_report("device table lookup", lookups, bench_now() - started);
+
+    for (size_t i = 0; i < sizeof(bench_known_devices) / sizeof(bench_known_devices[0]); i++) {
+        irecovery_device_t device = NULL;
+        irecovery_devices_get_device_by_product_type(bench_known_devices[i].product_type, &device);
+        bench_check(bench_device_equal(device, &bench_known_devices[i]), "a lookup gives back the built-in entry");
+    }
+
+    // Freed and built again on the next lookup
+    irecovery_devices_free();
+    irecovery_device_t device = NULL;
+    bench_check(irecovery_devices_get_device_by_hardware_model("d22ap", &device) == IRECOVERY_E_SUCCESS &&
+                bench_device_equal(device, &bench_known_devices[1]), "the device table comes back after it's freed");
+}
+#endif
+
+int main(void) {
+    size_t length = 256 * 1024 + 123;
+    unsigned char* image = malloc(length);
+    if (!image) return 1;
+    for (size_t i = 0; i < length; i++) {
+        image[i] = (unsigned char)(i * 131 + 7);
+    }
+
+#ifndef IRECOVERY_NO_CRC32
+    bench_crc32(image, length);
+#endif
+#ifdef BENCH_DFU_UPLOADS
+    bench_send_buffer("send_buffer dfu", &bench_dfu_device, image, length, IRECOVERY_SEND_OPT_NONE);
+    bench_send_buffer("send_buffer dfu (busy status)", &bench_busy_dfu_device, image, length, IRECOVERY_SEND_OPT_NONE);
+    bench_send_buffer("send_buffer dfu (0x4000 blocks)", &bench_large_dfu_device, image, length, IRECOVERY_SEND_OPT_NONE);
+#endif
+#ifndef IRECOVERY_NO_RECOVERY
+    bench_send_buffer("send_buffer recovery", &bench_recovery_device, image, length, IRECOVERY_SEND_OPT_NONE);
+    bench_send_buffer("send_buffer recovery pipelined", &bench_recovery_device, image, length, IRECOVERY_SEND_OPT_RECOVERY_PIPELINE);
+#endif
+    bench_empty_upload(image);
+#ifndef IRECOVERY_NO_DFU
+    bench_manifest(image, 64 * 1024 + 5);
+#endif
+    bench_retry(image, length);
+    bench_compressed();
+#ifdef BENCH_DFU_UPLOADS
+    bench_progress(image, length);
+#endif
+    bench_finalize("finalize", IRECOVERY_FINALIZE_OPT_NONE, 2);
+    bench_finalize("finalize (skip nonces)", IRECOVERY_FINALIZE_OPT_SKIP_NONCES, 1);
+    bench_reconnect();
+    bench_await_reconnect();
+    bench_await_reconnect_cached();
+    bench_await_reconnect_limited();
+    bench_events();
+    bench_context(image, 64 * 1024);
+    bench_context_cache();
+#ifdef BENCH_DFU_UPLOADS
+    bench_context_free_stuck(image, 64 * 1024);
+#endif
+    bench_commands();
+#ifndef IRECOVERY_NO_RECOVERY
+    bench_console(image, 64 * 1024);
+#endif
+#if defined(BENCH_DFU_UPLOADS) && !defined(IRECOVERY_NO_RECOVERY)
+    bench_boot(image);
+#endif
+    bench_session();
+    bench_getenv();
+    bench_iboot_string();
+#ifndef IRECOVERY_NO_DEVICE_TABLE
+    bench_device_lookups();
+#endif
+
+    free(image);
+
+    if (bench_failures) {
+        printf("%d check(s) failed\n", bench_failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+/* Host stand-in for the CE toolchain's fileioc.h, backed by the in-memory AppVars in mock_usb.c */
+#ifndef HOST_FILEIOC_H
+#define HOST_FILEIOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+uint8_t ti_Open(const char* name, const char* mode);
+int ti_Close(uint8_t handle);
+void* ti_GetDataPtr(uint8_t handle);
+uint16_t ti_GetSize(uint8_t handle);
+size_t ti_Write(const void* data, size_t size, size_t count, uint8_t handle);
+
+#endif
@@ -0,0 +1,4 @@
+/* Host stand-in for the CE toolchain's sys/rtc.h, nothing in the library uses it yet */
+#ifndef HOST_SYS_RTC_H
+#define HOST_SYS_RTC_H
+#endif
@@ -0,0 +1,11 @@
+/* Host stand-in for the CE toolchain's sys/timers.h */
+#ifndef HOST_SYS_TIMERS_H
+#define HOST_SYS_TIMERS_H
+
+#include <stdint.h>
+#include <time.h>
+
+unsigned int sleep(unsigned int seconds);
+void delay(uint16_t msec);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Host stand-in for the CE toolchain's usbdrvce.h.
+ * Only covers what irecovery.c uses, see mock_usb.c for the implementation.
+ */
+#ifndef HOST_USBDRVCE_H
+#define HOST_USBDRVCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#ifndef usb_callback_data_t
+#define usb_callback_data_t void
+#endif
+#ifndef usb_transfer_data_t
+#define usb_transfer_data_t void
+#endif
+
+#define USB_DEFAULT_INIT_FLAGS 0
+
+typedef enum usb_error {
+    USB_SUCCESS,
+    USB_IGNORE,
+    USB_ERROR_SYSTEM,
+    USB_ERROR_INVALID_PARAM,
+    USB_ERROR_SCHEDULE_FULL,
+    USB_ERROR_NO_DEVICE,
+    USB_ERROR_NO_MEMORY,
+    USB_ERROR_NOT_SUPPORTED,
+    USB_ERROR_OVERFLOW,
+    USB_ERROR_TIMEOUT,
+    USB_ERROR_FAILED,
+    USB_USER_ERROR = 100
+} usb_error_t;
+
+typedef enum usb_role {
+    USB_ROLE_HOST   = 0,
+    USB_ROLE_DEVICE = 1 << 4
+} usb_role_t;
+
+typedef enum usb_event {
+    USB_ROLE_CHANGED_EVENT,
+    USB_DEVICE_DISCONNECTED_EVENT,
+    USB_DEVICE_CONNECTED_EVENT,
+    USB_DEVICE_DISABLED_EVENT,
+    USB_DEVICE_ENABLED_EVENT
+} usb_event_t;
+
+typedef enum usb_transfer_status {
+    USB_TRANSFER_COMPLETED  = 0,
+    USB_TRANSFER_STALLED    = 1 << 0,
+    USB_TRANSFER_NO_DEVICE  = 1 << 1,
+    USB_TRANSFER_HOST_ERROR = 1 << 2,
+    USB_TRANSFER_ERROR      = 1 << 3,
+    USB_TRANSFER_OVERFLOW   = 1 << 4,
+    USB_TRANSFER_BUS_ERROR  = 1 << 5,
+    USB_TRANSFER_FAILED     = 1 << 6,
+    USB_TRANSFER_CANCELLED  = 1 << 7
+} usb_transfer_status_t;
+
+enum {
+    USB_DEVICE_DESCRIPTOR        = 1,
+    USB_CONFIGURATION_DESCRIPTOR = 2,
+    USB_STRING_DESCRIPTOR        = 3,
+    USB_INTERFACE_DESCRIPTOR     = 4,
+    USB_ENDPOINT_DESCRIPTOR      = 5
+};
+
+typedef struct usb_device* usb_device_t;
+typedef struct usb_endpoint* usb_endpoint_t;
+
+typedef struct usb_control_setup {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+} usb_control_setup_t;
+
+typedef struct usb_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+} usb_descriptor_t;
+
+typedef struct usb_device_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+    uint8_t bNumConfigurations;
+} usb_device_descriptor_t;
+
+typedef struct usb_configuration_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t wTotalLength;
+    uint8_t bNumInterfaces;
+    uint8_t bConfigurationValue;
+    uint8_t iConfiguration;
+    uint8_t bmAttributes;
+    uint8_t bMaxPower;
+} usb_configuration_descriptor_t;
+
+typedef struct usb_interface_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} usb_interface_descriptor_t;
+
+typedef struct usb_string_descriptor {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint16_t bString[]; // wchar_t in usbdrvce, which is two bytes on the calculator
+} usb_string_descriptor_t;
+
+typedef struct usb_timer usb_timer_t;
+typedef usb_error_t (*usb_timer_callback_t)(usb_timer_t* timer);
+struct usb_timer {
+    uint32_t tick;
+    usb_timer_callback_t handler;
+};
+typedef usb_error_t (*usb_event_callback_t)(usb_event_t event, void* event_data, usb_callback_data_t* callback_data);
+typedef usb_error_t (*usb_transfer_callback_t)(usb_endpoint_t endpoint, usb_transfer_status_t status, size_t transferred, usb_transfer_data_t* data);
+
+usb_error_t usb_Init(usb_event_callback_t handler, usb_callback_data_t* data, const void* device_descriptors, unsigned flags);
+void usb_Cleanup(void);
+usb_error_t usb_HandleEvents(void);
+usb_error_t usb_WaitForEvents(void);
+usb_error_t usb_StartTimerCycles(usb_timer_t* timer, uint32_t timeout_cycles);
+usb_error_t usb_StopTimer(usb_timer_t* timer);
+usb_role_t usb_GetRole(void);
+usb_error_t usb_ResetDevice(usb_device_t device);
+usb_endpoint_t usb_GetDeviceEndpoint(usb_device_t device, uint8_t address);
+
+usb_error_t usb_GetDescriptor(usb_device_t device, uint8_t type, uint8_t index, void* descriptor, size_t length, size_t* transferred);
+usb_error_t usb_GetStringDescriptor(usb_device_t device, uint8_t index, uint16_t language_id, usb_string_descriptor_t* descriptor, size_t length, size_t* transferred);
+size_t usb_GetConfigurationDescriptorTotalLength(usb_device_t device, uint8_t index);
+usb_error_t usb_GetConfigurationDescriptor(usb_device_t device, uint8_t index, usb_configuration_descriptor_t* descriptor, size_t length, size_t* transferred);
+usb_error_t usb_SetConfiguration(usb_device_t device, const usb_configuration_descriptor_t* descriptor, size_t length);
+usb_error_t usb_SetInterface(usb_device_t device, const usb_interface_descriptor_t* descriptor, size_t length);
+
+usb_error_t usb_ControlTransfer(usb_endpoint_t endpoint, const usb_control_setup_t* setup, void* buffer, unsigned retries, size_t* transferred);
+usb_error_t usb_Transfer(usb_endpoint_t endpoint, void* buffer, size_t length, unsigned retries, size_t* transferred);
+usb_error_t usb_ScheduleControlTransfer(usb_endpoint_t endpoint, const usb_control_setup_t* setup, void* buffer, usb_transfer_callback_t handler, usb_transfer_data_t* data);
+usb_error_t usb_ScheduleTransfer(usb_endpoint_t endpoint, void* buffer, size_t length, usb_transfer_callback_t handler, usb_transfer_data_t* data);
+
+#endif
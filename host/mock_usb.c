@@ -0,0 +1,557 @@
+/*
+ * mock_usb.c
+ * Scripted stand-in for usbdrvce and fileioc, so irecovery.c can run on a PC.
+ *
+ * Scheduled transfers complete one per usb_HandleEvents() call, in order, like a
+ * device that answers as fast as it's asked. Console reads on endpoint 0x81 wait
+ * for mock_console_output().
+ */
+#include <usbdrvce.h>
+#include <fileioc.h>
+#include <sys/timers.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mock_usb.h"
+
+struct usb_device { uint8_t port; };
+struct usb_endpoint { struct usb_device* device; uint8_t address; };
+
+struct mock_transfer {
+    usb_endpoint_t endpoint;
+    usb_transfer_callback_t handler;
+    usb_transfer_data_t* data;
+    size_t transferred;
+    usb_transfer_status_t status;
+    const uint8_t* out;         // Image data to add to checksum_out when the transfer completes, NULL for other transfers
+    int32_t block;              // DNLOAD block number added ahead of the data, -1 for bulk OUT
+};
+
+#define MOCK_QUEUE_SIZE 32
+#define MOCK_APPVARS    32
+
+struct mock_counters mock_counters;
+
+// One hub port each, port 0 is the one mock_attach() uses
+static struct mock_port {
+    struct usb_device device;
+    struct usb_endpoint endpoints[16];
+    const struct mock_device* spec;
+    bool pending_attach;
+    uint8_t status_index;
+} mock_ports[MOCK_PORTS];
+
+static usb_event_callback_t mock_event_handler;
+static usb_callback_data_t* mock_event_data;
+
+static struct mock_transfer mock_queue[MOCK_QUEUE_SIZE];
+static unsigned mock_queued;
+
+// The one usbdrvce timer the library uses, NULL when it isn't running
+static usb_timer_t* mock_timer;
+static uint32_t mock_timer_cycles;
+
+// The console read in flight on endpoint 0x81, parked until there's output for it. NULL handler when there isn't one.
+static struct {
+    usb_endpoint_t endpoint;
+    usb_transfer_callback_t handler;
+    usb_transfer_data_t* data;
+    uint8_t* buffer;
+    size_t length;
+} mock_console_read;
+
+#define MOCK_CONSOLE_SIZE 1024
+
+// Console output the device hasn't handed over yet
+static uint8_t mock_console[MOCK_CONSOLE_SIZE];
+static size_t mock_console_length;
+
+// Whether or not scheduled transfers are held back, like a device that stopped answering
+static bool mock_held;
+
+// Scheduled image transfers to let through before failing, and how many to fail after that
+static uint32_t mock_fail_skip;
+static uint32_t mock_fail_count;
+
+static struct {
+    char name[9];
+    const void* data;
+    uint16_t size;
+} mock_appvars[MOCK_APPVARS];
+static unsigned mock_appvar_count;
+
+// FNV-1a, so benchmarks can compare what two uploads put on the wire
+static void mock_checksum(const uint8_t* data, size_t length) {
+    uint32_t hash = mock_counters.checksum_out ? mock_counters.checksum_out : 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    mock_counters.checksum_out = hash;
+}
+
+static const struct mock_device* mock_spec(usb_device_t device) {
+    return device ? mock_ports[device->port].spec : NULL;
+}
+
+const struct mock_device* mock_device_spec(struct usb_device* device) {
+    return mock_spec(device);
+}
+
+void mock_attach_port(unsigned port, const struct mock_device* device) {
+    mock_ports[port].device.port     = (uint8_t)port;
+    mock_ports[port].spec            = device;
+    mock_ports[port].pending_attach  = true;
+    mock_ports[port].status_index    = 0;
+}
+
+static usb_error_t mock_enqueue(usb_endpoint_t endpoint, usb_transfer_callback_t handler, usb_transfer_data_t* data, size_t transferred, usb_transfer_status_t status, const void* out);
+
+// Ends the console reads on the device (any device if NULL) with status, like usbdrvce does when it drops them.
+static void mock_cancel_console(const struct usb_device* device, usb_transfer_status_t status) {
+    struct mock_transfer cancelled[MOCK_QUEUE_SIZE + 1];
+    unsigned count = 0, kept = 0;
+    for (unsigned i = 0; i < mock_queued; i++) {
+        bool console = mock_queue[i].endpoint->address == 0x81 && (!device || mock_queue[i].endpoint->device == device);
+        if (console) {
+            cancelled[count++] = mock_queue[i];
+        } else {
+            mock_queue[kept++] = mock_queue[i];
+        }
+    }
+    mock_queued = kept;
+
+    if (mock_console_read.handler && (!device || mock_console_read.endpoint->device == device)) {
+        cancelled[count].endpoint = mock_console_read.endpoint;
+        cancelled[count].handler  = mock_console_read.handler;
+        cancelled[count].data     = mock_console_read.data;
+        count++;
+        mock_console_read.handler = NULL;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        cancelled[i].handler(cancelled[i].endpoint, status, 0, cancelled[i].data);
+    }
+}
+
+void mock_detach_port(unsigned port) {
+    mock_cancel_console(&mock_ports[port].device, USB_TRANSFER_NO_DEVICE);
+
+    // Transfers to the device are never coming back
+    unsigned kept = 0;
+    for (unsigned i = 0; i < mock_queued; i++) {
+        if (mock_queue[i].endpoint->device != &mock_ports[port].device) mock_queue[kept++] = mock_queue[i];
+    }
+    mock_queued = kept;
+
+    if (mock_ports[port].spec && mock_event_handler) mock_event_handler(USB_DEVICE_DISCONNECTED_EVENT, &mock_ports[port].device, mock_event_data);
+    mock_ports[port].spec = NULL;
+    mock_ports[port].pending_attach = false;
+}
+
+void mock_hold_transfers(bool hold) {
+    mock_held = hold;
+}
+
+void mock_attach(const struct mock_device* device) {
+    mock_attach_port(0, device);
+}
+
+void mock_detach(void) {
+    mock_detach_port(0);
+}
+
+void mock_console_output(const void* data, size_t size) {
+    if (size > MOCK_CONSOLE_SIZE - mock_console_length) size = MOCK_CONSOLE_SIZE - mock_console_length;
+    memcpy(mock_console + mock_console_length, data, size);
+    mock_console_length += size;
+}
+
+void mock_add_appvar(const char* name, const void* data, uint16_t size) {
+    if (mock_appvar_count == MOCK_APPVARS) return;
+    strncpy(mock_appvars[mock_appvar_count].name, name, 8);
+    mock_appvars[mock_appvar_count].data = data;
+    mock_appvars[mock_appvar_count].size = size;
+    mock_appvar_count++;
+}
+
+/* usbdrvce */
+
+usb_error_t usb_Init(usb_event_callback_t handler, usb_callback_data_t* data, const void* device_descriptors, unsigned flags) {
+    (void)device_descriptors;
+    (void)flags;
+    mock_event_handler = handler;
+    mock_event_data    = data;
+    return USB_SUCCESS;
+}
+
+void usb_Cleanup(void) {
+    mock_cancel_console(NULL, USB_TRANSFER_CANCELLED);
+    mock_queued = 0;
+    mock_timer  = NULL;
+    mock_event_handler = NULL;
+}
+
+usb_error_t usb_HandleEvents(void) {
+    mock_counters.event_polls++;
+    for (unsigned port = 0; port < MOCK_PORTS && mock_event_handler; port++) {
+        if (mock_ports[port].pending_attach) {
+            mock_ports[port].pending_attach = false;
+            mock_event_handler(USB_DEVICE_CONNECTED_EVENT, &mock_ports[port].device, mock_event_data);
+            mock_event_handler(USB_DEVICE_ENABLED_EVENT, &mock_ports[port].device, mock_event_data);
+        }
+    }
+
+    // The parked console read gets whatever output there is, up to its length
+    if (mock_console_read.handler && mock_console_length > 0) {
+        size_t length = mock_console_length < mock_console_read.length ? mock_console_length : mock_console_read.length;
+        memcpy(mock_console_read.buffer, mock_console, length);
+        if (mock_enqueue(mock_console_read.endpoint, mock_console_read.handler, mock_console_read.data, length, USB_TRANSFER_COMPLETED, NULL) == USB_SUCCESS) {
+            mock_console_length -= length;
+            memmove(mock_console, mock_console + length, mock_console_length);
+            mock_console_read.handler = NULL;
+        }
+    }
+
+    if (mock_queued > 0 && !mock_held) {
+        struct mock_transfer transfer = mock_queue[0];
+        memmove(mock_queue, mock_queue + 1, --mock_queued * sizeof(struct mock_transfer));
+        // Read now rather than when it was scheduled, like the controller would
+        if (transfer.out && transfer.status == USB_TRANSFER_COMPLETED) {
+            if (transfer.block >= 0) {
+                const uint8_t block[2] = { transfer.block & 0xFF, transfer.block >> 8 };
+                mock_checksum(block, sizeof(block));
+            }
+            mock_checksum(transfer.out, transfer.transferred);
+        }
+        transfer.handler(transfer.endpoint, transfer.status, transfer.transferred, transfer.data);
+    }
+
+    return USB_SUCCESS;
+}
+
+usb_error_t usb_WaitForEvents(void) {
+    bool pending = (mock_queued > 0 && !mock_held) || (mock_console_read.handler && mock_console_length > 0);
+    for (unsigned port = 0; port < MOCK_PORTS; port++) {
+        pending |= mock_ports[port].pending_attach;
+    }
+
+    // Nothing else is going to happen, so wait for the timer to fire. Like delay(), this spins on clock() to line up with the library.
+    if (!pending && mock_timer) {
+        usb_timer_t* timer = mock_timer;
+        clock_t until = clock() + (clock_t)((uint64_t)mock_timer_cycles * CLOCKS_PER_SEC / 48000000);
+        while (clock() < until);
+        mock_timer = NULL;
+        mock_counters.timer_wakeups++;
+        return timer->handler(timer);
+    }
+    return usb_HandleEvents();
+}
+
+usb_error_t usb_StartTimerCycles(usb_timer_t* timer, uint32_t timeout_cycles) {
+    mock_timer        = timer;
+    mock_timer_cycles = timeout_cycles;
+    return USB_SUCCESS;
+}
+
+usb_error_t usb_StopTimer(usb_timer_t* timer) {
+    if (mock_timer == timer) mock_timer = NULL;
+    return USB_SUCCESS;
+}
+
+usb_role_t usb_GetRole(void) {
+    return USB_ROLE_HOST;
+}
+
+usb_error_t usb_ResetDevice(usb_device_t device) {
+    mock_counters.resets++;
+
+    // The transfers in flight are cancelled, held back or not
+    mock_cancel_console(device, USB_TRANSFER_CANCELLED);
+    struct mock_transfer cancelled[MOCK_QUEUE_SIZE];
+    unsigned count = 0, kept = 0;
+    for (unsigned i = 0; i < mock_queued; i++) {
+        if (mock_queue[i].endpoint->device == device) {
+            cancelled[count++] = mock_queue[i];
+        } else {
+            mock_queue[kept++] = mock_queue[i];
+        }
+    }
+    mock_queued = kept;
+    for (unsigned i = 0; i < count; i++) {
+        cancelled[i].handler(cancelled[i].endpoint, USB_TRANSFER_CANCELLED, 0, cancelled[i].data);
+    }
+    return USB_SUCCESS;
+}
+
+usb_endpoint_t usb_GetDeviceEndpoint(usb_device_t device, uint8_t address) {
+    usb_endpoint_t endpoint = &mock_ports[device->port].endpoints[address & 0x0F];
+    endpoint->device  = device;
+    endpoint->address = address;
+    return endpoint;
+}
+
+usb_error_t usb_GetDescriptor(usb_device_t device, uint8_t type, uint8_t index, void* descriptor, size_t length, size_t* transferred) {
+    (void)index;
+    const struct mock_device* mock_device = mock_spec(device);
+    if (!mock_device || type != USB_DEVICE_DESCRIPTOR) return USB_ERROR_FAILED;
+
+    usb_device_descriptor_t device_descriptor = {
+        .bLength            = sizeof(usb_device_descriptor_t),
+        .bDescriptorType    = USB_DEVICE_DESCRIPTOR,
+        .bcdUSB             = 0x0200,
+        .bMaxPacketSize0    = 64,
+        .idVendor           = 0x05AC,
+        .idProduct          = mock_device->product_id,
+        .iManufacturer      = 1,
+        .iProduct           = 2,
+        .iSerialNumber      = 3,
+        .bNumConfigurations = 1
+    };
+
+    if (length > sizeof(device_descriptor)) length = sizeof(device_descriptor);
+    memcpy(descriptor, &device_descriptor, length);
+    *transferred = length;
+    return USB_SUCCESS;
+}
+
+usb_error_t usb_GetStringDescriptor(usb_device_t device, uint8_t index, uint16_t language_id, usb_string_descriptor_t* descriptor, size_t length, size_t* transferred) {
+    (void)language_id;
+    const struct mock_device* mock_device = mock_spec(device);
+    if (!mock_device) return USB_ERROR_NO_DEVICE;
+    mock_counters.string_descriptor_reads++;
+
+    const char* string = (index == 3) ? mock_device->serial : mock_device->nonces;
+    if (!string) string = "";
+
+    size_t characters = strlen(string);
+    if (2 + characters * sizeof(descriptor->bString[0]) > length) characters = (length - 2) / sizeof(descriptor->bString[0]);
+
+    descriptor->bLength         = (uint8_t)(2 + characters * sizeof(descriptor->bString[0]));
+    descriptor->bDescriptorType = USB_STRING_DESCRIPTOR;
+    for (size_t i = 0; i < characters; i++) {
+        descriptor->bString[i] = (uint16_t)string[i];
+    }
+
+    *transferred = descriptor->bLength;
+    return USB_SUCCESS;
+}
+
+// One configuration with the DFU interface and its functional descriptor, then the console interface, whose alternate
+// setting 1 has the bulk IN endpoint.
+static const uint8_t mock_configuration[] = {
+    9, USB_CONFIGURATION_DESCRIPTOR, 52, 0, 2, 1, 0, 0x80, 250,
+    9, USB_INTERFACE_DESCRIPTOR, 0, 0, 0, 0xFE, 0x01, 0x00, 0,
+    9, 0x21, 0x0B, 0xFF, 0x00, 0x00, 0x08, 0x10, 0x01,
+    9, USB_INTERFACE_DESCRIPTOR, 1, 0, 0, 0xFF, 0xFF, 0x51, 0,
+    9, USB_INTERFACE_DESCRIPTOR, 1, 1, 1, 0xFF, 0xFF, 0x51, 0,
+    7, USB_ENDPOINT_DESCRIPTOR, 0x81, 0x02, 0x00, 0x02, 0
+};
+
+size_t usb_GetConfigurationDescriptorTotalLength(usb_device_t device, uint8_t index) {
+    (void)index;
+    return mock_spec(device) ? sizeof(mock_configuration) : 0;
+}
+
+usb_error_t usb_GetConfigurationDescriptor(usb_device_t device, uint8_t index, usb_configuration_descriptor_t* descriptor, size_t length, size_t* transferred) {
+    (void)index;
+    if (!mock_spec(device)) return USB_ERROR_NO_DEVICE;
+    mock_counters.configuration_reads++;
+
+    uint8_t configuration[sizeof(mock_configuration)];
+    memcpy(configuration, mock_configuration, sizeof(configuration));
+    uint16_t transfer_size = mock_spec(device)->transfer_size;
+    if (transfer_size) {
+        configuration[23] = transfer_size & 0xFF;
+        configuration[24] = transfer_size >> 8;
+    }
+
+    if (length > sizeof(configuration)) length = sizeof(configuration);
+    memcpy(descriptor, configuration, length);
+    *transferred = length;
+    return USB_SUCCESS;
+}
+
+usb_error_t usb_SetConfiguration(usb_device_t device, const usb_configuration_descriptor_t* descriptor, size_t length) {
+    (void)descriptor;
+    (void)length;
+    return mock_spec(device) ? USB_SUCCESS : USB_ERROR_NO_DEVICE;
+}
+
+usb_error_t usb_SetInterface(usb_device_t device, const usb_interface_descriptor_t* descriptor, size_t length) {
+    if (!mock_spec(device)) return USB_ERROR_NO_DEVICE;
+    // usbdrvce reads the endpoint descriptors behind it, so it has to point into a configuration
+    if (length < sizeof(*descriptor) || descriptor->bDescriptorType != USB_INTERFACE_DESCRIPTOR) return USB_ERROR_INVALID_PARAM;
+
+    mock_counters.interface_sets++;
+    return USB_SUCCESS;
+}
+
+// Answers a control request the way the recorded device would, returns the number of bytes moved.
+static size_t mock_control(usb_endpoint_t endpoint, const usb_control_setup_t* setup, void* buffer) {
+    struct mock_port* port = &mock_ports[endpoint->device->port];
+    const struct mock_device* mock_device = port->spec;
+    uint8_t* bytes = (uint8_t*)buffer;
+    mock_counters.control_transfers++;
+
+    if (setup->bmRequestType == 0x21 && setup->bRequest == 1) {
+        // DNLOAD, the status sequence starts over
+        port->status_index = 0;
+        mock_counters.bytes_out += setup->wLength;
+        return setup->wLength;
+    } else if (setup->bmRequestType == 0xA1 && setup->bRequest == 3) {
+        // GETSTATUS
+        uint8_t state = 5;
+        if (mock_device->dfu_states && mock_device->dfu_state_count > 0) {
+            state = mock_device->dfu_states[port->status_index];
+            if (port->status_index + 1 < mock_device->dfu_state_count) port->status_index++;
+        }
+        bytes[0] = 0;
+        bytes[1] = mock_device->poll_timeout & 0xFF;
+        bytes[2] = (mock_device->poll_timeout >> 8) & 0xFF;
+        bytes[3] = (mock_device->poll_timeout >> 16) & 0xFF;
+        bytes[4] = state;
+        bytes[5] = 0;
+        return 6;
+    } else if (setup->bmRequestType == 0xA1 && setup->bRequest == 5) {
+        // GETSTATE, dfuIDLE
+        bytes[0] = 2;
+        return 1;
+    } else if (setup->bmRequestType & 0x80) {
+        memset(buffer, 0, setup->wLength);
+        return setup->wLength;
+    }
+
+    if (setup->bmRequestType == 0x40) mock_counters.console_commands++;
+    mock_counters.bytes_out += setup->wLength;
+    return setup->wLength;
+}
+
+static usb_error_t mock_enqueue(usb_endpoint_t endpoint, usb_transfer_callback_t handler, usb_transfer_data_t* data, size_t transferred, usb_transfer_status_t status, const void* out) {
+    if (mock_queued == MOCK_QUEUE_SIZE) return USB_ERROR_SCHEDULE_FULL;
+
+    mock_queue[mock_queued].endpoint    = endpoint;
+    mock_queue[mock_queued].handler     = handler;
+    mock_queue[mock_queued].data        = data;
+    mock_queue[mock_queued].transferred = transferred;
+    mock_queue[mock_queued].status      = status;
+    mock_queue[mock_queued].out         = (const uint8_t*)out;
+    mock_queue[mock_queued].block       = -1;
+    mock_queued++;
+    return USB_SUCCESS;
+}
+
+void mock_fail_transfers(uint32_t skip, uint32_t count) {
+    mock_fail_skip  = skip;
+    mock_fail_count = count;
+}
+
+// Whether or not the image transfer being scheduled should fail, without reaching the device.
+static bool mock_take_failure(void) {
+    if (mock_fail_skip > 0) {
+        mock_fail_skip--;
+        return false;
+    }
+    if (mock_fail_count == 0) return false;
+
+    mock_fail_count--;
+    return true;
+}
+
+usb_error_t usb_ControlTransfer(usb_endpoint_t endpoint, const usb_control_setup_t* setup, void* buffer, unsigned retries, size_t* transferred) {
+    (void)retries;
+    if (!mock_spec(endpoint->device)) return USB_ERROR_NO_DEVICE;
+
+    mock_counters.blocking_transfers++;
+    *transferred = mock_control(endpoint, setup, buffer);
+    return USB_SUCCESS;
+}
+
+usb_error_t usb_Transfer(usb_endpoint_t endpoint, void* buffer, size_t length, unsigned retries, size_t* transferred) {
+    (void)buffer;
+    (void)retries;
+    if (!mock_spec(endpoint->device)) return USB_ERROR_NO_DEVICE;
+
+    mock_counters.blocking_transfers++;
+    mock_counters.bulk_transfers++;
+    mock_counters.bytes_out += length;
+    *transferred = length;
+    return USB_SUCCESS;
+}
+
+usb_error_t usb_ScheduleControlTransfer(usb_endpoint_t endpoint, const usb_control_setup_t* setup, void* buffer, usb_transfer_callback_t handler, usb_transfer_data_t* data) {
+    if (!mock_spec(endpoint->device)) return USB_ERROR_NO_DEVICE;
+
+    bool image = setup->bmRequestType == 0x21 && setup->bRequest == 1 && setup->wLength > 0;
+    if (image && mock_take_failure()) {
+        return mock_enqueue(endpoint, handler, data, 0, USB_TRANSFER_FAILED, NULL);
+    }
+    usb_error_t error = mock_enqueue(endpoint, handler, data, mock_control(endpoint, setup, buffer), USB_TRANSFER_COMPLETED, image ? buffer : NULL);
+    if (error == USB_SUCCESS && image) mock_queue[mock_queued - 1].block = setup->wValue;
+    return error;
+}
+
+usb_error_t usb_ScheduleTransfer(usb_endpoint_t endpoint, void* buffer, size_t length, usb_transfer_callback_t handler, usb_transfer_data_t* data) {
+    if (!mock_spec(endpoint->device)) return USB_ERROR_NO_DEVICE;
+
+    if (!(endpoint->address & 0x80)) {
+        if (length > 0 && mock_take_failure()) return mock_enqueue(endpoint, handler, data, 0, USB_TRANSFER_FAILED, NULL);
+        mock_counters.bulk_transfers++;
+        mock_counters.bytes_out += length;
+        return mock_enqueue(endpoint, handler, data, length, USB_TRANSFER_COMPLETED, buffer);
+    } else if (endpoint->address == 0x81) {
+        if (mock_console_read.handler) return USB_ERROR_SCHEDULE_FULL;
+        mock_console_read.endpoint = endpoint;
+        mock_console_read.handler  = handler;
+        mock_console_read.data     = data;
+        mock_console_read.buffer   = (uint8_t*)buffer;
+        mock_console_read.length   = length;
+        return USB_SUCCESS;
+    }
+    return mock_enqueue(endpoint, handler, data, length, USB_TRANSFER_COMPLETED, NULL);
+}
+
+/* sys/timers */
+
+unsigned int sleep(unsigned int seconds) {
+    (void)seconds;
+    return 0;
+}
+
+void delay(uint16_t msec) {
+    // Spin on clock() so the library's timeouts still line up
+    clock_t until = clock() + (clock_t)msec * CLOCKS_PER_SEC / 1000;
+    while (clock() < until);
+}
+
+/* fileioc */
+
+uint8_t ti_Open(const char* name, const char* mode) {
+    (void)mode;
+    for (unsigned i = 0; i < mock_appvar_count; i++) {
+        if (strncmp(mock_appvars[i].name, name, 8) == 0) return (uint8_t)(i + 1);
+    }
+    return 0;
+}
+
+int ti_Close(uint8_t handle) {
+    (void)handle;
+    return 1;
+}
+
+void* ti_GetDataPtr(uint8_t handle) {
+    return (void*)mock_appvars[handle - 1].data;
+}
+
+uint16_t ti_GetSize(uint8_t handle) {
+    return mock_appvars[handle - 1].size;
+}
+
+size_t ti_Write(const void* data, size_t size, size_t count, uint8_t handle) {
+    // Read-only AppVars, writes are accepted and dropped
+    (void)data;
+    (void)size;
+    (void)handle;
+    return count;
+}
@@ -0,0 +1,65 @@
+/*
+ * mock_usb.h
+ * Scripted stand-in for usbdrvce and fileioc, so irecovery.c can run on a PC.
+ */
+#ifndef MOCK_USB_H
+#define MOCK_USB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Recorded behavior of one device, played back by the mock.
+struct mock_device {
+    uint16_t product_id;        // 0x1227 for DFU, 0x1281 for recovery, etc.
+    const char* serial;         // String descriptor 3, the iBoot string.
+    const char* nonces;         // String descriptor 1, NONC and SNON.
+    const uint8_t* dfu_states;  // bState of each GETSTATUS reply after a DNLOAD, the last one repeats. NULL for always dfuDNLOAD-IDLE.
+    uint8_t dfu_state_count;    // Number of entries in dfu_states.
+    uint32_t poll_timeout;      // bwPollTimeout of every GETSTATUS reply, in milliseconds.
+    uint16_t transfer_size;     // wTransferSize of the DFU functional descriptor, 0 for 0x800.
+};
+
+struct mock_counters {
+    uint32_t control_transfers;
+    uint32_t bulk_transfers;
+    uint32_t string_descriptor_reads;
+    uint32_t configuration_reads;      // Configuration descriptor downloads.
+    uint32_t interface_sets;           // usb_SetInterface() calls.
+    uint32_t resets;
+    uint32_t console_commands;
+    uint32_t event_polls;
+    uint32_t timer_wakeups;     // Times usb_WaitForEvents() slept until a timer fired.
+    uint32_t blocking_transfers; // usb_ControlTransfer() and usb_Transfer() calls, which the step functions never make.
+    uint64_t bytes_out;
+    uint32_t checksum_out;      // FNV-1a of the scheduled image transfers' data (bulk OUT, DNLOAD after its block number) as they complete,
+                                // 0 before the first.
+};
+
+extern struct mock_counters mock_counters;
+
+// Ports on the mock's hub.
+#define MOCK_PORTS 4
+
+// Plugs the device into a hub port. The next usb_HandleEvents() reports it.
+void mock_attach_port(unsigned port, const struct mock_device* device);
+// Unplugs the device in a hub port.
+void mock_detach_port(unsigned port);
+// Plugs the device into port 0.
+void mock_attach(const struct mock_device* device);
+// The recorded device behind a usbdrvce handle, NULL if it was unplugged.
+struct usb_device;
+const struct mock_device* mock_device_spec(struct usb_device* device);
+// Unplugs the device in port 0.
+void mock_detach(void);
+// Lets `skip` scheduled image transfers (bulk OUT or DNLOAD with data) through, then fails the next `count` without them
+// reaching the device.
+void mock_fail_transfers(uint32_t skip, uint32_t count);
+// Holds scheduled transfers back until called with false or usb_ResetDevice() cancels them, like a device that stopped answering.
+void mock_hold_transfers(bool hold);
+// Queues console output for the read scheduled on endpoint 0x81, which gets it on a later usb_HandleEvents().
+void mock_console_output(const void* data, size_t size);
+// Adds an AppVar that ti_Open() can find. The data isn't copied.
+void mock_add_appvar(const char* name, const void* data, uint16_t size);
+
+#endif
@@ -31,28 +31,275 @@
 #include <sys/rtc.h>
 #include <inttypes.h>
 #include <sys/timers.h>
+#include <time.h>
+#include <fileioc.h>
 #include "irecovery.h"
-#include "nsscanf.h"
+
+#if defined(IRECOVERY_NO_DFU) && defined(IRECOVERY_NO_RECOVERY)
+#error "IRECOVERY_NO_DFU and IRECOVERY_NO_RECOVERY together leave nothing to upload with"
+#endif
+#if defined(IRECOVERY_CRC32_EZ80) && defined(IRECOVERY_CRC32_NIBBLE_TABLE)
+#error "IRECOVERY_CRC32_EZ80 and IRECOVERY_CRC32_NIBBLE_TABLE are two different CRC32 kernels, pick one"
+#endif
 
 #define APPLE_VENDOR_ID 0x05AC
 
+// Image source feeding an upload one packet at a time.
+// map() is optional and hands out bytes in place so they don't have to be copied into the packet buffer.
+// release() is optional and is called once the upload is done with the source.
+// prefetch asks for the next packet to be read while the current one is sent, for sources where reading costs real time.
+// primed is the first packet, read ahead of time into scratch memory by the boot chain. The upload takes it over if it's the right size.
+struct irecovery_source {
+	irecovery_stream_read_cb_t read;
+	const unsigned char* (*map)(void* user_data, size_t offset, size_t length);
+	void (*release)(irecovery_client_t client, void* user_data);
+	void* user_data;
+	bool prefetch;
+	unsigned char* primed;
+	size_t primed_size;
+};
+
+typedef enum {
+	IRECOVERY_UPLOAD_STATE_IDLE = 0,
+	IRECOVERY_UPLOAD_STATE_INITIATE,      // Waiting for the recovery mode initiate request or the DFU GETSTATE reply
+	IRECOVERY_UPLOAD_STATE_PACKET,        // Waiting for a packet to be sent
+	IRECOVERY_UPLOAD_STATE_PIPELINE,      // Waiting for the oldest of several queued recovery mode packets to be sent
+	IRECOVERY_UPLOAD_STATE_TRAILER,       // Waiting for the last DFU packet to be sent, the trailer didn't fit behind it
+	IRECOVERY_UPLOAD_STATE_STATUS,        // Waiting for the GETSTATUS reply after a DFU packet
+	IRECOVERY_UPLOAD_STATE_STATUS_DELAY,  // Waiting out bwPollTimeout before asking for the DFU status again
+	IRECOVERY_UPLOAD_STATE_RETRY,         // Waiting out the backoff after a failed packet, see IRECOVERY_SEND_OPT_RETRY
+	IRECOVERY_UPLOAD_STATE_RESTART,       // Waiting for the GETSTATUS reply before a DFU upload starts over
+	IRECOVERY_UPLOAD_STATE_RESTART_CLEAR, // Waiting for the CLRSTATUS or ABORT that takes the device back to dfuIDLE to start over
+	IRECOVERY_UPLOAD_STATE_ZLP,           // Waiting for the recovery mode ZLP to be sent
+	IRECOVERY_UPLOAD_STATE_FINISH,        // Waiting for the zero-length DFU DNLOAD to be sent
+	IRECOVERY_UPLOAD_STATE_FINISH_STATUS, // Waiting for a GETSTATUS reply after the zero-length DFU DNLOAD
+	IRECOVERY_UPLOAD_STATE_FINISH_ZLP,    // Waiting for the DFU pseudo ZLP to be sent
+	IRECOVERY_UPLOAD_STATE_CLOSE,         // Waiting for the CLRSTATUS or ABORT that puts the device back in dfuIDLE before failing
+	IRECOVERY_UPLOAD_STATE_DONE,          // Nothing left to send
+	IRECOVERY_UPLOAD_STATE_DRAIN          // Ended, waiting for transfers that are still queued to land
+} irecovery_upload_state_t;
+
+// How long a DFU block may keep the device busy before the upload fails, in milliseconds.
+#ifndef IRECOVERY_DFU_STATUS_TIMEOUT
+#define IRECOVERY_DFU_STATUS_TIMEOUT 20000
+#endif
+
+// How long irecovery_client_free() waits for a context client's queued transfers to land before resetting the device to drop
+// them, in milliseconds.
+#ifndef IRECOVERY_FREE_DRAIN_TIMEOUT
+#define IRECOVERY_FREE_DRAIN_TIMEOUT 2000
+#endif
+
+// Number of failed packets IRECOVERY_SEND_OPT_RETRY retries per upload.
+#ifndef IRECOVERY_UPLOAD_RETRIES
+#define IRECOVERY_UPLOAD_RETRIES 4
+#endif
+
+// Backoff before the first retry, in milliseconds. It doubles with every retry.
+#ifndef IRECOVERY_UPLOAD_RETRY_DELAY
+#define IRECOVERY_UPLOAD_RETRY_DELAY 25
+#endif
+
+// Number of bulk transfers IRECOVERY_SEND_OPT_RECOVERY_PIPELINE keeps queued.
+#ifndef IRECOVERY_PIPELINE_DEPTH
+#define IRECOVERY_PIPELINE_DEPTH 2
+#endif
+
+// One transfer's worth of upload state. Pipelined recovery mode uploads keep several of these in flight.
+struct irecovery_upload_slot {
+	unsigned char* packet;                 // One packet worth of RAM, only allocated when a source can't be mapped
+	unsigned char* data;                   // Bytes of the transfer in flight
+	size_t size;                           // Size of the transfer in flight
+	volatile bool pending;                 // Whether or not a transfer is in flight
+	usb_transfer_status_t transfer_status; // Status of the last completed transfer
+	size_t transferred;                    // Bytes moved by the last completed transfer
+	struct irecovery_stats* stats;         // Where the transfer's time goes once it completes
+	clock_t started;                       // When the transfer in flight was scheduled
+	bool bulk;                             // Whether or not the transfer in flight is a bulk transfer
+};
+
+// State of the upload in progress, advanced by irecovery_send_step().
+struct irecovery_upload {
+	struct irecovery_source source;
+	size_t length;
+	unsigned int options;
+	bool recovery_mode;
+	size_t packet_size;
+	int packets;
+	size_t last;
+	uint32_t h1;                           // Running DFU CRC
+	bool trusted;                          // Whether or not the trailer comes from the client's manifest
+
+	irecovery_upload_state_t state;
+	bool cancelled;
+	int index;                             // Oldest packet in flight
+	int queued;                            // Packets handed to usbdrvce so far
+	size_t count;                          // Bytes the device has accepted
+	unsigned char* prefetch;               // Packet buffer the next packet is read into while the current one is sent
+	bool prefetched;                       // Whether or not packet `queued` is already in prefetch
+	int retry;                             // GETSTATUS polls for the current packet
+	uint8_t attempts;                      // Retries used by IRECOVERY_SEND_OPT_RETRY
+	clock_t wait_started;                  // When the wait for the next DFU status poll or retry started
+	clock_t wait;                          // How long that wait is
+	clock_t busy_started;                  // When the device first said it was busy with the current packet
+	irecovery_upload_state_t after;        // State to poll the DFU status in once woken up
+	usb_control_setup_t setup;             // Setup packet of the control transfer in flight
+	unsigned char reply[6];                // GETSTATE/GETSTATUS reply
+
+	irecovery_error_t result;              // Result to report once drained
+	uint8_t depth;                         // Number of slots in use
+	struct irecovery_upload_slot slots[IRECOVERY_PIPELINE_DEPTH];
+};
+
+typedef enum {
+	IRECOVERY_BOOT_STATE_IDLE = 0,
+	IRECOVERY_BOOT_STATE_UPLOAD,          // Uploading the stage's image
+	IRECOVERY_BOOT_STATE_RECONNECT        // Waiting for the phone to come back in the stage's next_mode
+} irecovery_boot_state_t;
+
+// State of the boot chain in progress, advanced by irecovery_boot_step().
+struct irecovery_boot {
+	const struct irecovery_boot_stage* stages;
+	size_t count;
+	size_t index;                          // Stage in progress
+	irecovery_boot_state_t state;
+	clock_t timeout;                       // How long the phone gets to come back after a stage
+	clock_t started;                       // When it went away
+	struct irecovery_source next;          // Source of the next stage, opened while the phone re-enumerates
+	size_t next_length;
+	bool prepared;                         // Whether or not next is open
+};
+
+// Slot of packet `index`. Control transfers always go through the slot of the oldest packet in flight.
+#define IRECOVERY_UPLOAD_SLOT(upload, index) (&(upload)->slots[(index) % (upload)->depth])
+
+// Whether or not an upload goes over the recovery mode bulk endpoint. It's a constant when one of the two paths is compiled out,
+// so the compiler drops the other path's branches and the helpers only they call.
+#if defined(IRECOVERY_NO_DFU)
+#define IRECOVERY_UPLOAD_IS_RECOVERY(upload) true
+#elif defined(IRECOVERY_NO_RECOVERY)
+#define IRECOVERY_UPLOAD_IS_RECOVERY(upload) false
+#else
+#define IRECOVERY_UPLOAD_IS_RECOVERY(upload) ((upload)->recovery_mode)
+#endif
+
+// A console read queued on the bulk IN endpoint. It's allocated on its own so it can land after the console was stopped, or the
+// client was freed, and free itself.
+struct irecovery_console_read {
+	irecovery_client_t client;             // Client the output goes to, NULL once detached
+	irecovery_client_t parked_by;          // Client that stopped the console and can take the read back, NULL otherwise
+	size_t line_length;                    // Characters of the unfinished line in line
+	char line[IRECOVERY_CONSOLE_LINE_SIZE];
+	unsigned char data[IRECOVERY_CONSOLE_READ_SIZE];
+};
+
+// A callback irecovery_event_subscribe() or irecovery_event_subscribe_progress() was given.
+struct irecovery_event_subscriber {
+	irecovery_event_type type;
+	irecovery_event_cb_t callback;
+	bool throttled;                        // Whether or not it only gets some IRECOVERY_PROGRESS events
+	uint16_t step;                         // Progress it waits for between events, in permille. 0 if it doesn't.
+	clock_t interval;                      // Time it waits for between events. 0 if it doesn't.
+	bool delivered;                        // Whether or not it got an event in this upload yet
+	uint16_t last_permille;                // Progress and time of the last one
+	clock_t last_time;
+};
+
 struct irecovery_client {
     /* Static Zone - No dynamic pointers allowed */
+    irecovery_context_t context;                     // Context that owns USB for this client, NULL if the client initialized it.
     irecovery_connection_policy_t connection_policy; // Connection policy to use.
     irecovery_log_cb_t log_fp;                       // Log function pointer.
+    irecovery_log_sink_cb_t log_sink;                // Bulk log function pointer, preferred over log_fp.
     uint64_t ecid_restriction;                       // Optional ECID restriction.
+    bool routing;                                    // Set while irecovery_context_bind() tries the client, which reports mismatches itself.
     int num_connections;                             // Number of connections this client has had.
+    struct irecovery_manifest manifest;              // Manifest trusted by IRECOVERY_SEND_OPT_DFU_MANIFEST.
+    bool has_manifest;                               // Whether or not manifest is set.
+    unsigned int finalize_options;                   // IRECOVERY_FINALIZE_OPT_* flags.
+    uint64_t last_ecid;                              // ECID of the last finalized device, what irecovery_await_reconnect() waits for.
+    bool awaiting_reconnect;                         // Whether or not a reconnect is being waited for, see irecovery_reconnect_begin().
+    uint64_t reconnect_restriction;                  // ECID restriction to put back once it's over.
+    unsigned int generation;                         // Bumped whenever a connection is dropped, see irecovery_client_check().
+    unsigned int session_depth;                      // Number of irecovery_session_begin() calls not yet ended.
+    unsigned int session_generation;                 // Generation the outermost session began with.
+    unsigned int last_mode;                          // Mode of the last finalized device, to tell when it comes back in another.
+    struct irecovery_event_subscriber subscribers[IRECOVERY_EVENT_SUBSCRIBERS]; // Event subscriptions, NULL callbacks are free.
+    irecovery_event_t* waited_event;                 // Where irecovery_wait_for_event() wants its event, NULL when it isn't waiting.
+    irecovery_event_type waited_type;                // Type it's waiting for.
+    bool waited;                                     // Whether or not that event came.
+    usb_timer_t wait_timer;                          // Wakes irecovery_wait_for_event() up for its timeout.
+    bool wait_timer_armed;                           // Whether or not wait_timer is running.
+
+    /* Stats Zone - Only cleared by irecovery_reset_stats() */
+    struct irecovery_stats stats;                    // Transfer statistics, see irecovery_get_stats().
+
+    /* Log Zone - Caller-supplied ring buffer for deferred log output */
+    char* log_ring;                                  // Ring buffer, NULL if logs aren't buffered.
+    size_t log_ring_size;                            // Size of the ring buffer.
+    size_t log_ring_head;                            // Index of the oldest buffered character.
+    size_t log_ring_used;                            // Number of buffered characters.
+    bool log_deferred;                               // Whether or not output is held in the ring until flushed.
+
+    /* Scratch Zone - Fixed arena reused by hot paths instead of the heap, set up once */
+    unsigned char* scratch;                          // Arena, NULL if the client doesn't have one.
+    size_t scratch_size;                             // Size of the arena.
+    size_t scratch_used;                             // Bytes in use. Allocations are released in LIFO order.
+    bool owns_scratch;                               // Whether or not the client allocated the arena itself.
+
+    /* Cache Zone - Caller-supplied device cache, survives disconnects */
+    struct irecovery_device_cache_entry* device_cache; // Cache entries, NULL if connections aren't cached.
+    size_t device_cache_count;                       // Number of entries.
+    size_t device_cache_next;                        // Entry to replace once they're all used.
+
+    /* Upload Zone - Owned by the upload engine, survives disconnects so in-flight transfers can land */
+    struct irecovery_upload upload;                  // Upload in progress.
+    uint64_t checkpoint_ecid;                        // Device the last recovery mode upload failed on, 0 without a checkpoint.
+    size_t checkpoint_length;                        // Length of that image.
+    size_t checkpoint_offset;                        // Bytes of it the device accepted, a whole number of packets.
+
+    /* Console Zone - Caller-supplied ring buffer for console output, survives disconnects so it can still be read out */
+    char* console_ring;                              // Ring buffer, NULL if the console only goes to IRECOVERY_CONSOLE_LINE.
+    size_t console_ring_size;                        // Size of the ring buffer.
+    size_t console_ring_head;                        // Index of the oldest unread character.
+    size_t console_ring_used;                        // Number of unread characters.
+    struct irecovery_console_read* console_read;     // Read in flight, NULL when the console isn't running.
+    struct irecovery_console_read* console_parked;   // Read still in flight after irecovery_console_stop(), for the next start.
       
+    /* Boot Zone - Owned by the boot chain, survives the disconnects between its stages */
+    struct irecovery_boot boot;                      // Boot chain in progress.
+
     /* Device Zone - Anything relating to devices, anything is allowed */      
     usb_device_t handle;                             // usbdrvce handle.
     usb_device_descriptor_t device_descriptor;       // Device descriptor.
     struct irecovery_device_info device_info;        // Device info.
     unsigned int mode;                               // Device mode.
     int finalized;                                   // Whether or not this client is finalized.
-	irecovery_event_cb_t progress_callback;          // Progress callback
+    struct irecovery_dfu_functional_descriptor dfu_functional; // DFU functional descriptor of configuration 1, zeroed if it has none.
 };
 #define DEVICE_ZONE_OFFSET offsetof(struct irecovery_client, handle)
 
+// Enabled devices a context can hold on to until one of its clients is free.
+#define IRECOVERY_CONTEXT_PENDING_DEVICES 8
+
+struct irecovery_context {
+    irecovery_client_t clients[IRECOVERY_CONTEXT_MAX_CLIENTS]; // Clients in the context, NULL slots are free.
+    struct {
+        usb_device_t device;                         // Enabled device no client has yet, NULL if the slot is free.
+        uint64_t ecid;                               // Its ECID once a finalization read it, 0 before that.
+    } pending[IRECOVERY_CONTEXT_PENDING_DEVICES];
+};
+
+static void irecovery_upload_end(irecovery_client_t client, irecovery_error_t error);
+static void irecovery_boot_end(irecovery_client_t client);
+static bool irecovery_upload_idle(const struct irecovery_upload* upload);
+static clock_t irecovery_ms_to_clock(uint32_t ms);
+static bool irecovery_wait_timer_arm(irecovery_client_t client, uint32_t remaining_ms);
+static void irecovery_wait_timer_stop(irecovery_client_t client);
+
+#if defined(IRECOVERY_NO_DEVICE_TABLE)
+// No device table and no irecovery_devices_*() lookups
+#elif !defined(IRECOVERY_DEVICE_DB)
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L159 */
 static struct irecovery_device irecovery_devices[] = {
 	/* iPhone */
@@ -362,8 +609,192 @@ static struct irecovery_device irecovery_devices[] = {
 	{ NULL,          NULL,         -1,     -1, NULL }
 };
 
+/* BEGIN GENERATED DEVICE INDEX - tools/gen_device_index.py */
+#define IRECOVERY_DEVICE_COUNT 293
+
+static const uint16_t irecovery_devices_by_product_type[] = {
+	226, 291, 172, 173, 167, 168, 169, 170, 171, 174, 175, 176,
+	177, 236, 237, 245, 246, 247, 248, 249, 238, 240, 241, 242,
+	239, 243, 244, 257, 258, 259, 260, 261, 250, 251, 252, 253,
+	254, 255, 256, 262, 270, 271, 272, 273, 263, 264, 265, 266,
+	267, 268, 269, 233, 228, 229, 230, 231, 232, 227, 292, 274,
+	178, 179, 182, 183, 180, 181, 184, 185, 186, 187, 188, 189,
+	190, 191, 192, 197, 198, 199, 193, 194, 195, 196, 200, 208,
+	209, 210, 211, 212, 213, 214, 215, 216, 201, 202, 203, 204,
+	205, 206, 207, 217, 224, 225, 218, 219, 220, 221, 222, 223,
+	275, 282, 283, 284, 285, 286, 287, 288, 289, 290, 276, 277,
+	278, 279, 280, 281, 234, 235,  68, 123, 124, 125, 126, 127,
+	128, 129, 130, 131, 139, 140, 141, 142, 143, 144, 132, 133,
+	134, 135, 136, 137, 138, 145, 153, 154, 146, 147, 148, 149,
+	150, 151, 152, 155, 156, 157, 158, 159, 160, 161, 162, 163,
+	164, 165, 166,  69,  70,  71,  72,  73,  74,  75,  76,  77,
+	 78,  79,  80,  81,  82,  83,  84,  85,  86,  87,  88,  89,
+	 90,  91,  92,  93,  94,  99, 100, 101, 102,  95,  96,  97,
+	 98, 103, 109, 110, 104, 105, 106, 107, 108, 111, 120, 121,
+	122, 112, 113, 114, 115, 116, 117, 118, 119,   0,   1,  25,
+	 26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,
+	 38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  49,
+	 50,  51,  52,  53,  54,  55,  56,  57,  58,  59,  60,   2,
+	  3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+	 15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  61,  62,
+	 63,  64,  65,  66,  67
+};
+
+static const uint16_t irecovery_devices_by_hardware_model[] = {
+	174, 175, 176, 177,  23,  21,  24,  22,  45,  46,  28,  25,
+	 29,  26,  30,  27,  48,  49,  31,  32,  33,  52,  53,  36,
+	 37,  58,  59,  47,  39,  40,  41,  42,  43,  44,  50,  51,
+	 38,  54,  55,  56,  57, 171, 103, 104,  95,  96, 277, 275,
+	283, 281, 284, 279, 127, 109, 128, 110, 278, 243, 129, 130,
+	287, 288,  76, 105, 106, 123, 124, 282, 286, 290, 125, 126,
+	289, 285, 173, 143, 144, 226, 227, 228,  78,  77, 172, 131,
+	132, 145, 146, 233, 232, 231, 230, 229, 111, 112, 113, 114,
+	115, 116, 117, 118, 291, 168, 169, 236, 237, 141, 142, 161,
+	162, 238, 241, 244, 249, 242, 245, 119, 120, 121, 122, 170,
+	251, 252, 234, 235, 240, 246, 247, 248, 159, 160, 239, 250,
+	151, 152, 255, 257, 253, 256, 258, 254, 133, 134, 135, 136,
+	137, 138, 139, 140, 153, 154, 269, 261, 262, 155, 156, 259,
+	266, 268, 260, 265, 267, 147, 148, 149, 150, 263, 264, 157,
+	158, 276, 272, 273, 163, 164,  82, 107,  99, 100, 165, 166,
+	 83, 108, 101, 102,  84, 270, 271, 280,  93,  94,  85,  88,
+	 86,  89,  87,  90,  91,  92,  97,  98,  68, 167,  72,  69,
+	 70,  71,   0,  66,  35, 185, 184,  67, 187, 186, 189, 188,
+	197, 196, 191, 190, 199, 198, 209, 208, 193, 192, 195, 194,
+	211, 210, 201, 200, 203, 202, 205, 204, 207, 206,  63, 213,
+	212, 215, 214, 216, 218, 217, 220, 219, 221, 223, 222, 225,
+	224, 178, 180, 179, 181, 292,   7,   8,  61,   9,  10,  11,
+	 12,  13,  14,  17,  18,  19,  20,  15,  16,  62, 182, 183,
+	 65,  64,   1,  34,   2,   3,   4,   5,   6,  79,  80,  81,
+	 73,  74,  75,  60, 274
+};
+
+static const uint16_t irecovery_devices_by_chip_board[] = {
+	231, 229, 236, 232, 230, 237, 246, 244, 245, 241, 242, 247,
+	243, 248, 253, 254, 255, 256, 261, 257, 258, 271, 268, 267,
+	269, 266, 265,  13,  14,  91,  92,  66, 175, 170, 174,  94,
+	 93, 178, 179,  20,  15,  17,  99, 101,  95,  96,  97,  98,
+	180, 181, 182, 183,  19,  16,  18, 100, 102, 186, 187, 184,
+	185, 188, 189, 190, 191, 192, 193, 194, 195, 176, 196, 197,
+	198, 199,  21,  22,  23,  24,  67, 107, 108, 109, 110, 171,
+	105, 106, 103, 104, 280, 275, 276, 277, 278, 279, 281, 282,
+	287, 288, 283, 290, 284, 289, 286, 285,  25,  26,  27,  28,
+	 29,  30, 172,  32,  34,  31, 123, 124,  33, 125, 126, 127,
+	128, 115, 117, 111, 113, 116, 118, 112, 114, 121, 122, 119,
+	120, 226,  37,  35,  36,  38, 129, 130, 291, 131, 132,  42,
+	 39,  40,  41, 143, 144, 133, 134, 135, 136, 141, 142, 137,
+	138, 139, 140, 227, 228, 233, 234, 235, 173, 145, 146,  45,
+	 46,  43,  44,  47,  48,  49, 147, 148, 149, 150, 151, 152,
+	153, 154, 240, 238, 239, 249, 292,  52,  53,  50,  51, 159,
+	160, 155, 156, 157, 158, 250, 251, 252, 259, 260,  54,  55,
+	161, 162, 163, 164, 165, 166, 262, 263, 264, 270, 272, 273,
+	 60,  58,  59,  56,  57, 200, 201, 202, 203, 204, 205, 206,
+	207, 177, 216, 208, 209, 210, 211, 212, 213, 214, 215, 221,
+	217, 218, 219, 220, 222, 223, 224, 225,  62,   0,  61,   1,
+	  2,  63,   3,  68,   4,   5,  64, 167,  71,  69,  70,   6,
+	 65,  72, 168,  73,  74,  75,  76,  77,  78, 169,   7,   8,
+	  9,  10,  79,  80,  81,  11,  12,  85,  86,  87,  82,  83,
+	 84,  88,  89,  90, 274
+};
+
+/* END GENERATED DEVICE INDEX */
+
+_Static_assert(sizeof(irecovery_devices) / sizeof(irecovery_devices[0]) == IRECOVERY_DEVICE_COUNT + 1, "irecovery_devices[] changed, run tools/gen_device_index.py");
+
+#define irecovery_device_count IRECOVERY_DEVICE_COUNT
+
+static bool irecovery_devices_load(void) {
+	return true;
+}
+#else
+#ifndef IRECOVERY_DEVICE_DB_NAME
+#define IRECOVERY_DEVICE_DB_NAME "IRECDEV"
+#endif
+
+// The device table, pointing into the AppVar written by tools/mkdevicedb.py. NULL until something needs it.
+static struct irecovery_device* irecovery_devices;
+static const uint16_t* irecovery_devices_by_product_type;
+static const uint16_t* irecovery_devices_by_hardware_model;
+static const uint16_t* irecovery_devices_by_chip_board;
+static size_t irecovery_device_count;
+
+static uint16_t irecovery_read_le16(const unsigned char* p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+// Builds the device table from the database AppVar the first time it's needed, on the heap until irecovery_devices_free().
+// The strings and indexes are used in place, so the AppVar has to stay archived while the table is loaded.
+static bool irecovery_devices_load(void) {
+	if (irecovery_devices) return true;
+
+	uint8_t handle = ti_Open(IRECOVERY_DEVICE_DB_NAME, "r");
+	if (!handle) return false;
+	const unsigned char* db = (const unsigned char*)ti_GetDataPtr(handle);
+	size_t size = ti_GetSize(handle);
+	ti_Close(handle);
+
+	if (size < 8 || memcmp(db, "IRDB", 4) != 0 || db[4] != 1) return false;
+	size_t count = irecovery_read_le16(db + 6);
+	if (8 + 16 * count >= size) return false;
+	const unsigned char* records = db + 8 + 6 * count;
+	const char* pool = (const char*)records + 10 * count;
+	size_t pool_size = size - (8 + 16 * count);
+	if (pool[pool_size - 1] != '\0') return false;
+
+	// The lookups index irecovery_devices[] with these without checking, so a bad entry fails the load
+	for (size_t i = 0; i < 3 * count; i++) {
+		if (irecovery_read_le16(db + 8 + 2 * i) >= count) return false;
+	}
+
+	struct irecovery_device* devices = (struct irecovery_device*)malloc((count + 1) * sizeof(struct irecovery_device));
+	if (!devices) return false;
+
+	for (size_t i = 0; i < count; i++) {
+		const unsigned char* record = records + 10 * i;
+		uint16_t product_type   = irecovery_read_le16(record + 4);
+		uint16_t hardware_model = irecovery_read_le16(record + 6);
+		uint16_t display_name   = irecovery_read_le16(record + 8);
+		if (product_type >= pool_size || hardware_model >= pool_size || display_name >= pool_size) {
+			free(devices);
+			return false;
+		}
+
+		devices[i].board_id       = irecovery_read_le16(record);
+		devices[i].chip_id        = irecovery_read_le16(record + 2);
+		devices[i].product_type   = pool + product_type;
+		devices[i].hardware_model = pool + hardware_model;
+		devices[i].display_name   = pool + display_name;
+	}
+	devices[count] = (struct irecovery_device){ NULL, NULL, -1, -1, NULL };
+
+	// The indexes are little endian like the eZ80, so they're used as is
+	irecovery_devices_by_product_type   = (const uint16_t*)(db + 8);
+	irecovery_devices_by_hardware_model = (const uint16_t*)(db + 8 + 2 * count);
+	irecovery_devices_by_chip_board     = (const uint16_t*)(db + 8 + 4 * count);
+	irecovery_device_count = count;
+	irecovery_devices      = devices;
+	return true;
+}
+#endif
+
+#ifndef IRECOVERY_NO_CRC32
+#ifdef IRECOVERY_CRC32_EZ80
+// crc32_lookup_t1 split into its four byte planes for irecovery_crc32.asm, built on first use so no table is in the program.
+// The kernel steps from one plane to the next with inc h, so they start on a 1 KB boundary inside the storage.
+static unsigned char crc32_plane_storage[4 * 256 + 1023];
+static unsigned char* crc32_planes;
+
+uint32_t irecovery_crc32_update_ez80(uint32_t crc, const void* data, size_t length, const unsigned char* planes);
+#elif defined(IRECOVERY_CRC32_NIBBLE_TABLE)
+// Same polynomial as crc32_lookup_t1, 4 bits at a time. Saves 960 bytes at the cost of speed.
+static const uint32_t crc32_lookup_t4[16] = {
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+	0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+	0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+#else
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L468 */
-static uint32_t crc32_lookup_t1[256] = {
+static const uint32_t crc32_lookup_t1[256] = {
 	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
 	0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
 	0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
@@ -429,16 +860,143 @@ static uint32_t crc32_lookup_t1[256] = {
 	0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
 	0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D,
 };
+#endif
+#endif
+
+uint32_t irecovery_crc32_init(void) {
+	return 0xFFFFFFFF;
+}
+
+#ifndef IRECOVERY_NO_CRC32
+#ifdef IRECOVERY_CRC32_EZ80
+static void irecovery_crc32_planes_init(void) {
+	unsigned char* planes = (unsigned char*)(((uintptr_t)crc32_plane_storage + 1023) & ~(uintptr_t)1023);
 
+	for (unsigned int i = 0; i < 256; i++) {
+		uint32_t entry = i;
+		for (int bit = 0; bit < 8; bit++) entry = (entry >> 1) ^ (0xEDB88320 & -(entry & 1));
+
+		planes[i]       = (unsigned char)entry;
+		planes[256 + i] = (unsigned char)(entry >> 8);
+		planes[512 + i] = (unsigned char)(entry >> 16);
+		planes[768 + i] = (unsigned char)(entry >> 24);
+	}
+
+	crc32_planes = planes;
+}
+
+uint32_t irecovery_crc32_update(uint32_t crc, const void* data, size_t length) {
+	if (!crc32_planes) irecovery_crc32_planes_init();
+	return irecovery_crc32_update_ez80(crc, data, length, crc32_planes);
+}
+#else
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L535 */
-#define crc32_step(a,b) \
-	a = (crc32_lookup_t1[(a & 0xFF) ^ ((unsigned char)b)] ^ (a >> 8))
+uint32_t irecovery_crc32_update(uint32_t crc, const void* data, size_t length) {
+	const unsigned char* p = (const unsigned char*)data;
+	const unsigned char* end = p + length;
+
+	// Pointer compare instead of a down-counter and an 8-bit table index keep the loop in 24-bit registers on the eZ80
+	while (p != end) {
+#ifdef IRECOVERY_CRC32_NIBBLE_TABLE
+		crc ^= *p++;
+		crc = crc32_lookup_t4[(uint8_t)crc & 0x0F] ^ (crc >> 4);
+		crc = crc32_lookup_t4[(uint8_t)crc & 0x0F] ^ (crc >> 4);
+#else
+		crc = crc32_lookup_t1[(uint8_t)crc ^ *p++] ^ (crc >> 8);
+#endif
+	}
+
+	return crc;
+}
+#endif
+#endif
+
+uint32_t irecovery_crc32_final(uint32_t crc) {
+	return ~crc;
+}
+
+// Hands out `size` bytes from the client's scratch arena, or from the heap if there's no arena or no room left in it.
+// Scratch memory is released with irecovery_scratch_free(), in the reverse order it was allocated.
+static void* irecovery_scratch_alloc(irecovery_client_t client, size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    if (client->scratch && client->scratch_size - client->scratch_used >= size) {
+        void* ptr = client->scratch + client->scratch_used;
+        client->scratch_used += size;
+        return ptr;
+    }
+
+    return malloc(size);
+}
+
+// Like irecovery_scratch_alloc(), but returns NULL instead of going to the heap once the client's arena is full.
+// For buffers that only make things faster, so a client with an arena stays off the heap.
+static void* irecovery_scratch_alloc_spare(irecovery_client_t client, size_t size) {
+    size_t rounded = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (client->scratch && client->scratch_size - client->scratch_used < rounded) return NULL;
+
+    return irecovery_scratch_alloc(client, size);
+}
+
+static void irecovery_scratch_free(irecovery_client_t client, void* ptr) {
+    if (!ptr) return;
+
+    unsigned char* p = (unsigned char*)ptr;
+    if (client->scratch && p >= client->scratch && p < client->scratch + client->scratch_size) {
+        // Everything allocated after ptr goes with it
+        size_t used = p - client->scratch;
+        if (used < client->scratch_used) client->scratch_used = used;
+    } else {
+        free(ptr);
+    }
+}
+
+// Sends log output straight to whichever logger is set.
+static void irecovery_log_write(irecovery_client_t client, const char* data, size_t length) {
+    if (client->log_sink) {
+        client->log_sink(data, length);
+    } else if (client->log_fp) {
+        for (size_t i = 0; i < length; i++) {
+            client->log_fp(data[i]);
+        }
+    }
+}
+
+#if IRECOVERY_LOG_LEVEL > IRECOVERY_LOG_LEVEL_NONE
+// Appends log output to the ring buffer, dropping the oldest characters once it's full.
+static void irecovery_log_buffer(irecovery_client_t client, const char* data, size_t length) {
+    size_t size = client->log_ring_size;
+    if (length > size) {
+        data += length - size;
+        length = size;
+    }
+
+    size_t tail = (client->log_ring_head + client->log_ring_used) % size;
+    size_t first = size - tail;
+    if (first > length) first = length;
+    memcpy(client->log_ring + tail, data, first);
+    memcpy(client->log_ring, data + first, length - first);
+
+    client->log_ring_used += length;
+    if (client->log_ring_used > size) {
+        client->log_ring_head = (client->log_ring_head + client->log_ring_used - size) % size;
+        client->log_ring_used = size;
+    }
+}
+
+static void irecovery_log_output(irecovery_client_t client, const char* data, size_t length) {
+    if (client->log_ring && (client->log_deferred || (!client->log_sink && !client->log_fp))) {
+        irecovery_log_buffer(client, data, length);
+    } else {
+        irecovery_log_write(client, data, length);
+    }
+}
 
 void irecovery_log(irecovery_client_t client, const char* fmt, ...) {
-    if (!client || !client->log_fp) return;
+    if (!client || (!client->log_fp && !client->log_sink && !client->log_ring)) return;
 
     size_t buffer_len = 256; // Reasonable default size for most messages
-    char* buffer = (char*)malloc(buffer_len);
+    char* buffer = (char*)irecovery_scratch_alloc(client, buffer_len);
     if (!buffer) return;
 
     va_list args;
@@ -446,25 +1004,89 @@ void irecovery_log(irecovery_client_t client, const char* fmt, ...) {
     int needed = vsnprintf(buffer, buffer_len, fmt, args);
     va_end(args);
 
-    // If the buffer wasn't large enough, reallocate
-    if (needed < 0 || (size_t)needed >= buffer_len) {
-        char* bigger = (char*)realloc(buffer, needed + 1);
+    // If the buffer wasn't large enough, get a bigger one
+    char* bigger = NULL;
+    if (needed < 0) {
+        irecovery_scratch_free(client, buffer);
+        return;
+    } else if ((size_t)needed >= buffer_len) {
+        bigger = (char*)irecovery_scratch_alloc(client, needed + 1);
         if (!bigger) {
-            free(buffer);
+            irecovery_scratch_free(client, buffer);
             return;
         }
-        buffer = bigger;
 
         va_start(args, fmt);
-        vsnprintf(buffer, needed + 1, fmt, args);
+        vsnprintf(bigger, needed + 1, fmt, args);
         va_end(args);
     }
 
-    for (size_t i = 0; buffer[i] != '\0'; i++) {
-        client->log_fp(buffer[i]);
-    }
+    irecovery_log_output(client, bigger ? bigger : buffer, (size_t)needed);
+
+    irecovery_scratch_free(client, bigger);
+    irecovery_scratch_free(client, buffer);
+}
+#else
+// Nothing in the library logs at this level, and leaving vsnprintf() out keeps printf out of the program
+void irecovery_log(irecovery_client_t client, const char* fmt, ...) {
+    (void)client;
+    (void)fmt;
+}
+#endif
+
+irecovery_error_t irecovery_set_log_sink(irecovery_client_t client, irecovery_log_sink_cb_t sink) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+
+    client->log_sink = sink;
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_set_log_buffer(irecovery_client_t client, char* buffer, size_t size) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+    if (buffer && size == 0) return IRECOVERY_E_DST_BUF_SIZE_ZERO;
+
+    irecovery_log_flush(client);
+    client->log_ring      = buffer;
+    client->log_ring_size = buffer ? size : 0;
+    client->log_ring_head = 0;
+    client->log_ring_used = 0;
+    client->log_deferred  = buffer && client->upload.state != IRECOVERY_UPLOAD_STATE_IDLE;
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_log_flush(irecovery_client_t client) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+    if (!client->log_ring_used || (!client->log_sink && !client->log_fp)) return IRECOVERY_E_SUCCESS;
+
+    // At most two pieces, the ring may wrap around
+    size_t first = client->log_ring_size - client->log_ring_head;
+    if (first > client->log_ring_used) first = client->log_ring_used;
+    irecovery_log_write(client, client->log_ring + client->log_ring_head, first);
+    if (client->log_ring_used > first) irecovery_log_write(client, client->log_ring, client->log_ring_used - first);
 
-    free(buffer);
+    client->log_ring_head = 0;
+    client->log_ring_used = 0;
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_log_flush_to_appvar(irecovery_client_t client, const char* name) {
+    if (!client || !name) return IRECOVERY_E_BAD_PTR;
+    if (!client->log_ring_used) return IRECOVERY_E_SUCCESS;
+
+    uint8_t handle = ti_Open(name, "a");
+    if (!handle) return IRECOVERY_E_APPVAR_NOT_FOUND;
+
+    size_t first = client->log_ring_size - client->log_ring_head;
+    if (first > client->log_ring_used) first = client->log_ring_used;
+    size_t second = client->log_ring_used - first;
+    bool written = ti_Write(client->log_ring + client->log_ring_head, first, 1, handle) == 1 &&
+                   (second == 0 || ti_Write(client->log_ring, second, 1, handle) == 1);
+    ti_Close(handle);
+    if (!written) return IRECOVERY_E_NO_MEMORY;
+
+    client->log_ring_head = 0;
+    client->log_ring_used = 0;
+    return IRECOVERY_E_SUCCESS;
 }
 
 static bool device_zone_nonzero(irecovery_client_t client) {
@@ -480,22 +1102,37 @@ static bool device_zone_nonzero(irecovery_client_t client) {
     return false;
 }
 
+// Leaves the console read in flight to free itself once it lands.
+static void irecovery_console_detach(irecovery_client_t client) {
+    if (client->console_parked) {
+        client->console_parked->parked_by = NULL;
+        client->console_parked = NULL;
+    }
+    if (!client->console_read) return;
+
+    client->console_read->client = NULL;
+    client->console_read = NULL;
+}
+
 void irecovery_client_clear_device_zone(irecovery_client_t client) {
-    if (!client || !device_zone_nonzero(client)) return;
+    if (!client) return;
+
+    // The console goes away with the phone
+    irecovery_console_detach(client);
+    if (!device_zone_nonzero(client)) return;
 
     // Free dynamically allocated fields if needed
-    free(client->device_info.srnm);
-    free(client->device_info.imei);
-    free(client->device_info.srtg);
-    free(client->device_info.serial_string);
-	free(client->device_info.pwnd);
+    free(client->device_info.serial_string); // srnm, imei, srtg and pwnd live in the same block
     free(client->device_info.ap_nonce);
     free(client->device_info.sep_nonce);
 
+    // Sessions started on the old connection can tell it's gone
+    client->generation++;
+
     // Zero out the Device Zone
     memset((uint8_t*)client + DEVICE_ZONE_OFFSET, 0, sizeof(struct irecovery_client) - DEVICE_ZONE_OFFSET);
 
-    irecovery_log(client, "Device Zone @ %p was cleared.\n", (void*)client);
+    IRECOVERY_LOG_TRACE(client, "Device Zone @ %p was cleared.\n", (void*)client);
 }
 
 // Note: ret_device_descriptor can be NULL.
@@ -526,7 +1163,120 @@ static bool irecovery_device_is_supported(usb_device_t device, usb_device_descri
 
 bool irecovery_client_is_usable(irecovery_client_t client, bool run_event_handler) {
     if (run_event_handler) usb_HandleEvents();
-    return client && client->handle && ((usb_GetRole() & USB_ROLE_DEVICE) != USB_ROLE_DEVICE) && device_zone_nonzero(client);
+    // The handle is the first thing in the Device Zone, so there's no need to scan the rest of it
+    return client && client->handle && ((usb_GetRole() & USB_ROLE_DEVICE) != USB_ROLE_DEVICE);
+}
+
+// irecovery_client_is_usable() for calls that can run inside a session. Disconnects and role changes clear the Device Zone, which
+// bumps the generation, so inside a session comparing it is enough. Transfers keep handling events while they wait.
+static bool irecovery_client_check(irecovery_client_t client, bool run_event_handler) {
+    if (client && client->session_depth) return client->generation == client->session_generation;
+    return irecovery_client_is_usable(client, run_event_handler);
+}
+
+// Progress in tenths of a percent, without the soft-float division.
+static uint16_t irecovery_permille(size_t count, size_t length) {
+    if (length == 0 || count >= length) return 1000;
+
+    // Kept in 32 bits, images past 4 MB lose a little precision
+    uint32_t scaled_count = count, scaled_length = length;
+    while (scaled_length > UINT32_MAX / 1000) {
+        scaled_count  >>= 1;
+        scaled_length >>= 1;
+    }
+    return (uint16_t)(scaled_count * 1000 / scaled_length);
+}
+
+// Whether or not a throttled subscriber gets this progress event: its first one and the last one always go through,
+// the rest once progress moved by its step or its interval went by.
+static bool irecovery_event_throttle_passes(struct irecovery_event_subscriber* subscriber, const irecovery_event_t* event) {
+    clock_t now = subscriber->interval ? clock() : 0;
+    bool passes = !subscriber->delivered || event->permille == 1000 || (subscriber->step == 0 && subscriber->interval == 0);
+
+    if (!passes && subscriber->step != 0) passes = event->permille - subscriber->last_permille >= subscriber->step;
+    if (!passes && subscriber->interval != 0) passes = event->permille != subscriber->last_permille && now - subscriber->last_time >= subscriber->interval;
+    if (!passes) return false;
+
+    subscriber->delivered     = true;
+    subscriber->last_permille = event->permille;
+    subscriber->last_time     = now;
+    return true;
+}
+
+// Runs every subscriber to the event's type, and hands it to irecovery_wait_for_event() if it's waiting for it.
+// Returns the first non-zero value a subscriber returned.
+static int irecovery_event_publish(irecovery_client_t client, const irecovery_event_t* event) {
+    int ret = 0;
+    for (size_t i = 0; i < IRECOVERY_EVENT_SUBSCRIBERS; i++) {
+        // Callbacks can unsubscribe, themselves included
+        irecovery_event_cb_t callback = client->subscribers[i].callback;
+        if (callback && client->subscribers[i].type == event->type) {
+            if (client->subscribers[i].throttled && !irecovery_event_throttle_passes(&client->subscribers[i], event)) continue;
+            int result = callback(client, event);
+            if (ret == 0) ret = result;
+        }
+    }
+
+    if (client->waited_event && !client->waited && (client->waited_type == IRECOVERY_EVENT_ANY || client->waited_type == event->type)) {
+        *client->waited_event = *event;
+        client->waited = true;
+    }
+
+    return ret;
+}
+
+static bool irecovery_event_type_is_valid(irecovery_event_type type) {
+    return type >= IRECOVERY_PROGRESS && type <= IRECOVERY_CONSOLE_LINE;
+}
+
+// Whether or not anyone would hear about an event of that type, so hot paths can skip building it. With throttled set,
+// subscribers from irecovery_event_subscribe_progress() don't count, they don't need irecovery_event_t.progress.
+static bool irecovery_event_is_wanted(irecovery_client_t client, irecovery_event_type type, bool throttled) {
+    if (client->waited_event && !client->waited && (client->waited_type == IRECOVERY_EVENT_ANY || client->waited_type == type)) return true;
+
+    for (size_t i = 0; i < IRECOVERY_EVENT_SUBSCRIBERS; i++) {
+        const struct irecovery_event_subscriber* subscriber = &client->subscribers[i];
+        if (subscriber->callback && subscriber->type == type && (throttled || !subscriber->throttled)) return true;
+    }
+
+    return false;
+}
+
+// Publishes an event about the client's phone, or the one it just lost.
+static void irecovery_event_publish_device(irecovery_client_t client, irecovery_event_type type, irecovery_error_t error, unsigned int mode, uint64_t ecid) {
+    irecovery_event_t event = {
+        .size     = 0,
+        .data     = irecovery_mode_to_str(mode),
+        .progress = 0.0,
+        .type     = type,
+        .error    = error,
+        .mode     = mode,
+        .ecid     = ecid
+    };
+    irecovery_event_publish(client, &event);
+}
+
+irecovery_error_t irecovery_session_begin(irecovery_client_t client) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+
+    if (client->session_depth) {
+        if (client->generation != client->session_generation) return IRECOVERY_E_NO_DEVICE;
+    } else {
+        if (!irecovery_client_is_usable(client, true)) return IRECOVERY_E_NO_DEVICE;
+        client->session_generation = client->generation;
+    }
+    client->session_depth++;
+
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_session_end(irecovery_client_t client) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+    if (!client->session_depth) return IRECOVERY_E_NO_SESSION;
+
+    client->session_depth--;
+
+    return (client->generation == client->session_generation) ? IRECOVERY_E_SUCCESS : IRECOVERY_E_NO_DEVICE;
 }
 
 static int irecovery_get_string_descriptor_ascii(irecovery_client_t client, uint8_t desc_index, unsigned char* buffer, size_t size) {
@@ -538,14 +1288,14 @@ static int irecovery_get_string_descriptor_ascii(irecovery_client_t client, uint
         return IRECOVERY_E_DST_BUF_SIZE_ZERO;
     }
 
-    irecovery_log(client, "Getting string descriptor (ascii) at index %" PRIu8 "...\n", desc_index);
+    IRECOVERY_LOG_TRACE(client, "Getting string descriptor (ascii) at index %" PRIu8 "...\n", desc_index);
     size_t string_descriptor_len = 2 + (size * 2);
-    usb_string_descriptor_t* string_descriptor = (usb_string_descriptor_t*)malloc(string_descriptor_len);
+    usb_string_descriptor_t* string_descriptor = (usb_string_descriptor_t*)irecovery_scratch_alloc(client, string_descriptor_len);
     if (!string_descriptor) return IRECOVERY_E_NO_MEMORY;
 
     size_t transferred = 0;
     if (usb_GetStringDescriptor(client->handle, desc_index, 0, string_descriptor, string_descriptor_len, &transferred) != USB_SUCCESS || transferred == 0) {
-        free(string_descriptor);
+        irecovery_scratch_free(client, string_descriptor);
         return IRECOVERY_E_DESCRIPTOR_FETCH_FAILED;
     }
 
@@ -558,112 +1308,178 @@ static int irecovery_get_string_descriptor_ascii(irecovery_client_t client, uint
     }
     buffer[i] = '\0';
 
-    free(string_descriptor);
+    irecovery_scratch_free(client, string_descriptor);
 
     return i;
 }
 
-/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L765 */
-static void irecovery_load_device_info_from_iboot_string(irecovery_client_t client, const char* iboot_string) {
-    if (!client || !iboot_string) return;
-
-    memset(&client->device_info, 0, sizeof(struct irecovery_device_info));
-
-    client->device_info.serial_string = strdup(iboot_string);
-
-    char* ptr;
-
-    ptr = strstr(iboot_string, "CPID:");
-    if (ptr != NULL) {
-        nsscanf(ptr, "CPID:%x", &client->device_info.cpid);
+irecovery_error_t irecovery_get_string_descriptor_ascii_into(irecovery_client_t client, uint8_t desc_index, unsigned char* buffer, size_t size, size_t* length) {
+    if (length) *length = 0;
+    if (!irecovery_client_check(client, true)) {
+        return IRECOVERY_E_NO_DEVICE;
+    } else if (!buffer) {
+        return IRECOVERY_E_BAD_PTR;
+    } else if (size == 0) {
+        return IRECOVERY_E_DST_BUF_SIZE_ZERO;
     }
 
-    ptr = strstr(iboot_string, "CPRV:");
-    if (ptr != NULL) {
-        nsscanf(ptr, "CPRV:%x", &client->device_info.cprv);
+    // Under 4 bytes the buffer can't hold the descriptor of even one character, so it's read on the stack instead
+    unsigned char small[6];
+    unsigned char* descriptor = buffer;
+    size_t descriptor_size = size;
+    if (size < 4) {
+        descriptor = small;
+        descriptor_size = 2 + 2 * (size - 1);
     }
 
-    ptr = strstr(iboot_string, "CPFM:");
-    if (ptr != NULL) {
-        nsscanf(ptr, "CPFM:%x", &client->device_info.cpfm);
+    size_t transferred = 0;
+    if (usb_GetStringDescriptor(client->handle, desc_index, 0, (usb_string_descriptor_t*)descriptor, descriptor_size, &transferred) != USB_SUCCESS || transferred < 2) {
+        buffer[0] = '\0';
+        return IRECOVERY_E_DESCRIPTOR_FETCH_FAILED;
     }
 
-    ptr = strstr(iboot_string, "SCEP:");
-    if (ptr != NULL) {
-        nsscanf(ptr, "SCEP:%x", &client->device_info.scep);
+    // Character i is read from bytes 2 + 2i and 3 + 2i before byte i is written, so the conversion can run in place
+    const usb_string_descriptor_t* string_descriptor = (const usb_string_descriptor_t*)descriptor;
+    size_t string_desc_str_len = (string_descriptor->bLength - 2) / 2;
+    if (string_desc_str_len > (transferred - 2) / 2) string_desc_str_len = (transferred - 2) / 2;
+    size_t i;
+    for (i = 0; i < string_desc_str_len && i < size - 1; i++) {
+        wchar_t wc = string_descriptor->bString[i];
+        buffer[i] = (wc <= 0x7F) ? (unsigned char)wc : '?';
     }
+    buffer[i] = '\0';
 
-    ptr = strstr(iboot_string, "BDID:");
-    if (ptr != NULL) {
-        uint64_t bdid = 0;
-        nsscanf(ptr, "BDID:%" SCNx64, &bdid);
-        client->device_info.bdid = (unsigned int)bdid;
-    }
+    if (length) *length = i;
+    return IRECOVERY_E_SUCCESS;
+}
 
-    ptr = strstr(iboot_string, "ECID:");
-    if (ptr != NULL) {
-        nsscanf(ptr, "ECID:%" SCNx64, &client->device_info.ecid);
-    }
+// Tags of the iBoot string, in the order irecovery_load_device_info_from_iboot_string() handles them
+enum {
+    IRECOVERY_IBOOT_CPID,
+    IRECOVERY_IBOOT_CPRV,
+    IRECOVERY_IBOOT_CPFM,
+    IRECOVERY_IBOOT_SCEP,
+    IRECOVERY_IBOOT_BDID,
+    IRECOVERY_IBOOT_ECID,
+    IRECOVERY_IBOOT_IBFL,
+    IRECOVERY_IBOOT_SRNM, // Bracketed strings from here on
+    IRECOVERY_IBOOT_IMEI,
+    IRECOVERY_IBOOT_SRTG,
+    IRECOVERY_IBOOT_PWND,
+    IRECOVERY_IBOOT_TAG_COUNT
+};
 
-    ptr = strstr(iboot_string, "IBFL:");
-    if (ptr != NULL) {
-        nsscanf(ptr, "IBFL:%x", &client->device_info.ibfl);
-    }
+static const char irecovery_iboot_tags[IRECOVERY_IBOOT_TAG_COUNT][4] = {
+    {'C','P','I','D'}, {'C','P','R','V'}, {'C','P','F','M'}, {'S','C','E','P'}, {'B','D','I','D'}, {'E','C','I','D'},
+    {'I','B','F','L'}, {'S','R','N','M'}, {'I','M','E','I'}, {'S','R','T','G'}, {'P','W','N','D'}
+};
 
-    char tmp[256];
-    tmp[0] = '\0';
-    ptr = strstr(iboot_string, "SRNM:[");
-    if (ptr != NULL) {
-        nsscanf(ptr, "SRNM:[%s]", tmp);
-        ptr = strrchr(tmp, ']');
-        if (ptr != NULL) {
-            *ptr = '\0';
-        }
-        client->device_info.srnm = strdup(tmp);
+// Value of a hex digit, -1 if c isn't one.
+static int irecovery_hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') return (c | 0x20) - 'a' + 10;
+    return -1;
+}
+
+// Reads hex digits until the first character that isn't one, like %x. A missing value reads as 0.
+static uint64_t irecovery_parse_hex(const char* p, size_t length) {
+    uint64_t value = 0;
+    if (!p) return 0;
+
+    const char* end = p + length;
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) p += 2;
+
+    for (; p < end; p++) {
+        int digit = irecovery_hex_digit(*p);
+        if (digit < 0) break;
+        value = (value << 4) | (uint64_t)digit;
     }
 
-    tmp[0] = '\0';
-	ptr = strstr(iboot_string, "IMEI:[");
-	if (ptr != NULL) {
-		nsscanf(ptr, "IMEI:[%s]", tmp);
-		ptr = strrchr(tmp, ']');
-		if (ptr != NULL) {
-			*ptr = '\0';
-		}
-		client->device_info.imei = strdup(tmp);
-	}
+    return value;
+}
 
-    tmp[0] = '\0';
-	ptr = strstr(iboot_string, "SRTG:[");
-	if (ptr != NULL) {
-		nsscanf(ptr, "SRTG:[%s]", tmp);
-		ptr = strrchr(tmp, ']');
-		if (ptr != NULL) {
-			*ptr = '\0';
-		}
-		client->device_info.srtg = strdup(tmp);
-	}
+/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L765 */
+// Walks the KEY:value / KEY:[value] tokens once. serial_string and the bracketed values share one allocation,
+// owned by serial_string.
+static void irecovery_load_device_info_from_iboot_string(irecovery_client_t client, const char* iboot_string) {
+    if (!client || !iboot_string) return;
 
-	tmp[0] = '\0';
-	ptr = strstr(iboot_string, "PWND:[");
-	if (ptr != NULL) {
-		nsscanf(ptr, "PWND:[%s]", tmp);
-		ptr = strrchr(tmp, ']');
-		if (ptr != NULL) {
-			*ptr = '\0';
-		}
-		client->device_info.pwnd = strdup(tmp);
-	}
+    struct irecovery_device_info* info = &client->device_info;
+    memset(info, 0, sizeof(struct irecovery_device_info));
 
-    client->device_info.pid = client->device_descriptor.idProduct;
-    client->mode            = client->device_descriptor.idProduct;
+    const char* values[IRECOVERY_IBOOT_TAG_COUNT] = { NULL };
+    size_t value_lengths[IRECOVERY_IBOOT_TAG_COUNT] = { 0 };
+    size_t serial_length = 0;
+    size_t block_size = 1;
+
+    const char* p = iboot_string;
+    while (*p) {
+        if (*p == ' ') {
+            p++;
+            continue;
+        }
+
+        const char* token = p;
+        while (*p && *p != ' ') p++;
+        if (p - token < 5 || token[4] != ':') continue;
+
+        for (int tag = 0; tag < IRECOVERY_IBOOT_TAG_COUNT; tag++) {
+            if (memcmp(token, irecovery_iboot_tags[tag], 4) != 0) continue;
+
+            const char* value = token + 5;
+            const char* end = p;
+            if (tag >= IRECOVERY_IBOOT_SRNM) {
+                if (*value != '[') break;
+                value++;
+                // Up to the first closing bracket, spaces included, like %[^]] read it. The token ends at the next space after it.
+                for (end = value; *end && *end != ']'; end++);
+                for (p = end; *p && *p != ' '; p++);
+            }
+
+            if (!values[tag]) {
+                values[tag] = value;
+                value_lengths[tag] = end - value;
+                if (tag >= IRECOVERY_IBOOT_SRNM) block_size += (end - value) + 1;
+            }
+            break;
+        }
+    }
+    serial_length = p - iboot_string;
+    block_size += serial_length;
+
+    info->cpid = (unsigned int)irecovery_parse_hex(values[IRECOVERY_IBOOT_CPID], value_lengths[IRECOVERY_IBOOT_CPID]);
+    info->cprv = (unsigned int)irecovery_parse_hex(values[IRECOVERY_IBOOT_CPRV], value_lengths[IRECOVERY_IBOOT_CPRV]);
+    info->cpfm = (unsigned int)irecovery_parse_hex(values[IRECOVERY_IBOOT_CPFM], value_lengths[IRECOVERY_IBOOT_CPFM]);
+    info->scep = (unsigned int)irecovery_parse_hex(values[IRECOVERY_IBOOT_SCEP], value_lengths[IRECOVERY_IBOOT_SCEP]);
+    info->bdid = (unsigned int)irecovery_parse_hex(values[IRECOVERY_IBOOT_BDID], value_lengths[IRECOVERY_IBOOT_BDID]);
+    info->ecid = irecovery_parse_hex(values[IRECOVERY_IBOOT_ECID], value_lengths[IRECOVERY_IBOOT_ECID]);
+    info->ibfl = (unsigned int)irecovery_parse_hex(values[IRECOVERY_IBOOT_IBFL], value_lengths[IRECOVERY_IBOOT_IBFL]);
+
+    char* block = (char*)malloc(block_size);
+    if (block) {
+        memcpy(block, iboot_string, serial_length);
+        block[serial_length] = '\0';
+        info->serial_string = block;
+        block += serial_length + 1;
+
+        char** strings[] = { &info->srnm, &info->imei, &info->srtg, &info->pwnd };
+        for (int tag = IRECOVERY_IBOOT_SRNM; tag < IRECOVERY_IBOOT_TAG_COUNT; tag++) {
+            if (!values[tag]) continue;
+            memcpy(block, values[tag], value_lengths[tag]);
+            block[value_lengths[tag]] = '\0';
+            *strings[tag - IRECOVERY_IBOOT_SRNM] = block;
+            block += value_lengths[tag] + 1;
+        }
+    }
+
+    info->pid    = client->device_descriptor.idProduct;
+    client->mode = client->device_descriptor.idProduct;
 }
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L1373 */
 // Returns transferred bytes on success, negative values are irecovery_error_t error codes
-int irecovery_usb_control_transfer(irecovery_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char* data, uint16_t w_length) {
-    if (!irecovery_client_is_usable(client, true)) return IRECOVERY_E_NO_DEVICE;
-
+// irecovery_usb_control_transfer() for callers that already checked the client.
+static int irecovery_usb_control_transfer_unchecked(irecovery_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char* data, uint16_t w_length) {
     usb_control_setup_t setup = {
         .bmRequestType = bm_request_type,
         .bRequest      = b_request,
@@ -673,24 +1489,36 @@ int irecovery_usb_control_transfer(irecovery_client_t client, uint8_t bm_request
     };
 
     size_t transferred = 0;
-    if (usb_ControlTransfer(usb_GetDeviceEndpoint(client->handle, 0), &setup, data, 0, &transferred) != USB_SUCCESS) return IRECOVERY_E_USB_UPLOAD_FAILED;
+    clock_t started = clock();
+    usb_error_t error = usb_ControlTransfer(usb_GetDeviceEndpoint(client->handle, 0), &setup, data, 0, &transferred);
+    client->stats.control_ticks += clock() - started;
+    if (error != USB_SUCCESS) {
+        client->stats.failed_transfers++;
+        return IRECOVERY_E_USB_UPLOAD_FAILED;
+    }
 
     return transferred;
 }
 
+int irecovery_usb_control_transfer(irecovery_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char* data, uint16_t w_length) {
+    if (!irecovery_client_check(client, true)) return IRECOVERY_E_NO_DEVICE;
+
+    return irecovery_usb_control_transfer_unchecked(client, bm_request_type, b_request, w_value, w_index, data, w_length);
+}
+
 static irecovery_error_t irecovery_get_total_configuration_descriptor(irecovery_client_t client, uint8_t index, usb_configuration_descriptor_t** configuration_descriptor, size_t* length) {
 	if (!configuration_descriptor || *configuration_descriptor || !length) return IRECOVERY_E_BAD_PTR;
 
 	*length = usb_GetConfigurationDescriptorTotalLength(client->handle, index);
 	if (*length == 0) return IRECOVERY_E_DESCRIPTOR_FETCH_FAILED;
-	*configuration_descriptor = (usb_configuration_descriptor_t*)malloc(*length);
+	*configuration_descriptor = (usb_configuration_descriptor_t*)irecovery_scratch_alloc(client, *length);
 	if (!(*configuration_descriptor)) {
 		return IRECOVERY_E_NO_MEMORY;
 	}
 
 	size_t transferred = 0;
 	if (usb_GetConfigurationDescriptor(client->handle, index, *configuration_descriptor, *length, &transferred) != USB_SUCCESS || transferred == 0) {
-		free(*configuration_descriptor);
+		irecovery_scratch_free(client, *configuration_descriptor);
 		*length = 0;
 		return IRECOVERY_E_DESCRIPTOR_FETCH_FAILED;
 	}
@@ -698,18 +1526,57 @@ static irecovery_error_t irecovery_get_total_configuration_descriptor(irecovery_
 	return IRECOVERY_E_SUCCESS;
 }
 
-static irecovery_error_t irecovery_usb_set_configuration(irecovery_client_t client, uint8_t configuration) {
+// Keeps the functional descriptor of the DFU interface (class 0xFE, subclass 0x01) in the configuration, if there's one.
+static void irecovery_parse_dfu_functional_descriptor(irecovery_client_t client, const unsigned char* configuration, size_t length) {
+    memset(&client->dfu_functional, 0, sizeof(client->dfu_functional));
+
+    bool dfu_interface = false;
+    for (size_t offset = 0; offset + 2 <= length; offset += configuration[offset]) {
+        const unsigned char* descriptor = configuration + offset;
+        if (descriptor[0] < 2 || offset + descriptor[0] > length) break;
+
+        if (descriptor[1] == USB_INTERFACE_DESCRIPTOR && descriptor[0] >= 9) {
+            dfu_interface = (descriptor[5] == 0xFE && descriptor[6] == 0x01);
+        } else if (descriptor[1] == 0x21 && dfu_interface && descriptor[0] >= 7) {
+            client->dfu_functional.bm_attributes    = descriptor[2];
+            client->dfu_functional.w_detach_timeout = (uint16_t)(descriptor[3] | (descriptor[4] << 8));
+            client->dfu_functional.w_transfer_size  = (uint16_t)(descriptor[5] | (descriptor[6] << 8));
+            if (descriptor[0] >= 9) client->dfu_functional.bcd_dfu_version = (uint16_t)(descriptor[7] | (descriptor[8] << 8));
+            IRECOVERY_LOG_TRACE(client, "DFU transfer size is %" PRIu16 " bytes, attributes are 0x%02" PRIX8 ".\n", client->dfu_functional.w_transfer_size, client->dfu_functional.bm_attributes);
+            return;
+        }
+    }
+}
+
+// Uses the descriptor kept in entry if it has one, otherwise fetches it and keeps a copy there if it fits. entry can be NULL.
+static irecovery_error_t irecovery_usb_set_configuration(irecovery_client_t client, uint8_t configuration, struct irecovery_device_cache_entry* entry) {
     if (!irecovery_client_is_usable(client, true)) return IRECOVERY_E_NO_DEVICE;
 
-    irecovery_log(client, "Setting configuration to %" PRIu8 "...\n", configuration);
+    IRECOVERY_LOG_TRACE(client, "Setting configuration to %" PRIu8 "...\n", configuration);
+    if (entry && entry->configuration_length) {
+        IRECOVERY_LOG_TRACE(client, "Configuration %" PRIu8 " is cached.\n", configuration);
+        irecovery_parse_dfu_functional_descriptor(client, entry->configuration, entry->configuration_length);
+        if (usb_SetConfiguration(client->handle, (const usb_configuration_descriptor_t*)entry->configuration, entry->configuration_length) == USB_SUCCESS) {
+            return IRECOVERY_E_SUCCESS;
+        } else {
+            return IRECOVERY_E_DESCRIPTOR_SET_FAILED;
+        }
+    }
+
 	usb_configuration_descriptor_t* configuration_descriptor = NULL;
 	size_t length = 0;
     irecovery_error_t irecovery_error = irecovery_get_total_configuration_descriptor(client, configuration, &configuration_descriptor, &length);
 	if (irecovery_error != IRECOVERY_E_SUCCESS) return irecovery_error;
-	irecovery_log(client, "Configuration %" PRIu8 " is %zu bytes.\n", configuration, length);
+	IRECOVERY_LOG_TRACE(client, "Configuration %" PRIu8 " is %zu bytes.\n", configuration, length);
+    irecovery_parse_dfu_functional_descriptor(client, (const unsigned char*)configuration_descriptor, length);
+
+    if (entry && length <= IRECOVERY_DEVICE_CACHE_CONFIG_SIZE) {
+        memcpy(entry->configuration, configuration_descriptor, length);
+        entry->configuration_length = (uint8_t)length;
+    }
 
     usb_error_t error = usb_SetConfiguration(client->handle, configuration_descriptor, length);
-    free(configuration_descriptor);
+    irecovery_scratch_free(client, configuration_descriptor);
     if (error == USB_SUCCESS) {
         return IRECOVERY_E_SUCCESS;
     } else {
@@ -753,7 +1620,7 @@ static void irecovery_copy_nonce_with_tag_from_buffer(irecovery_client_t client,
 	} while (colon);
 
 	if (nlen == 0) {
-		irecovery_log(client, "%s: WARNING: couldn't find tag %s in string %s\n", __func__, tag, buf);
+		IRECOVERY_LOG_WARN(client, "%s: WARNING: couldn't find tag %s in string %s\n", __func__, tag, buf);
 		return;
 	}
 
@@ -764,17 +1631,19 @@ static void irecovery_copy_nonce_with_tag_from_buffer(irecovery_client_t client,
 
 	int i = 0;
 	for (i = 0; i < nlen; i++) {
-		int val = 0;
-		if (nsscanf(nonce_string+(i*2), "%2x", &val) == 1) {
-			nn[i] = (unsigned char)val;
+		// Two hex digits per byte, like the "%2x" libirecovery scans for
+		int high = irecovery_hex_digit(nonce_string[i*2]);
+		int low = irecovery_hex_digit(nonce_string[i*2+1]);
+		if (high >= 0 && low >= 0) {
+			nn[i] = (unsigned char)((high << 4) | low);
 		} else {
-			irecovery_log(client, "%s: ERROR: unexpected data in nonce result (%2s)\n", __func__, nonce_string+(i*2));
+			IRECOVERY_LOG_ERROR(client, "%s: ERROR: unexpected data in nonce result (%2s)\n", __func__, nonce_string+(i*2));
 			break;
 		}
 	}
 
 	if (i != nlen) {
-		irecovery_log(client, "%s: ERROR: unable to parse nonce\n", __func__);
+		IRECOVERY_LOG_ERROR(client, "%s: ERROR: unable to parse nonce\n", __func__);
 		free(nn);
 		return;
 	}
@@ -784,8 +1653,10 @@ static void irecovery_copy_nonce_with_tag_from_buffer(irecovery_client_t client,
 }
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L919 */
-static void irecovery_copy_nonce_with_tag(irecovery_client_t client, const char* tag, unsigned char** nonce, unsigned int* nonce_size) {
-    if (!irecovery_client_is_usable(client, false) || !tag || !nonce || *nonce || !nonce_size) return;
+// Both nonces live in string descriptor 1, so it's read once and parsed for each tag.
+static void irecovery_copy_nonces(irecovery_client_t client) {
+    if (!irecovery_client_is_usable(client, false)) return;
+    if (client->device_info.ap_nonce && client->device_info.sep_nonce) return;
 
     char buf[256];
     int len = 0;
@@ -793,14 +1664,90 @@ static void irecovery_copy_nonce_with_tag(irecovery_client_t client, const char*
     memset(buf, 0, sizeof(buf));
     len = irecovery_get_string_descriptor_ascii(client, 1, (unsigned char*)buf, sizeof(buf) - 1);
     if (len < 0) {
-        irecovery_log(client, "%s: got length: %d\n", __func__, len);
+        IRECOVERY_LOG_TRACE(client, "%s: got length: %d\n", __func__, len);
         return;
     }
 
     buf[len] = '\0';
 
-    irecovery_copy_nonce_with_tag_from_buffer(client, tag, nonce, nonce_size, buf);
+    if (!client->device_info.ap_nonce) {
+        irecovery_copy_nonce_with_tag_from_buffer(client, "NONC", &client->device_info.ap_nonce, &client->device_info.ap_nonce_size, buf);
+    }
+    if (!client->device_info.sep_nonce) {
+        irecovery_copy_nonce_with_tag_from_buffer(client, "SNON", &client->device_info.sep_nonce, &client->device_info.sep_nonce_size, buf);
+    }
+}
+
+// Returns the entry kept for the phone in that mode, or NULL. ECID 0 never matches.
+static struct irecovery_device_cache_entry* irecovery_device_cache_find(irecovery_client_t client, uint64_t ecid, uint16_t pid) {
+    if (!client->device_cache || ecid == 0) return NULL;
+
+    for (size_t i = 0; i < client->device_cache_count; i++) {
+        struct irecovery_device_cache_entry* entry = &client->device_cache[i];
+        if (entry->ecid == ecid && entry->pid == pid) return entry;
+    }
+
+    return NULL;
+}
+
+// Returns the entry to record the phone in: its old entry, an unused one, or the oldest. NULL if it can't be cached.
+static struct irecovery_device_cache_entry* irecovery_device_cache_slot(irecovery_client_t client, uint64_t ecid, uint16_t pid) {
+    if (!client->device_cache || client->device_cache_count == 0 || ecid == 0) return NULL;
+
+    struct irecovery_device_cache_entry* entry = irecovery_device_cache_find(client, ecid, pid);
+    if (entry) return entry;
+
+    for (size_t i = 0; i < client->device_cache_count; i++) {
+        if (client->device_cache[i].ecid == 0) return &client->device_cache[i];
+    }
+
+    entry = &client->device_cache[client->device_cache_next];
+    client->device_cache_next = (client->device_cache_next + 1) % client->device_cache_count;
+    return entry;
+}
+
+#ifndef IRECOVERY_NO_RECOVERY
+// Returns the offset of alternate setting `alternate` of interface `number` in the configuration, or length if it has none.
+static size_t irecovery_find_interface_descriptor(const unsigned char* configuration, size_t length, uint8_t number, uint8_t alternate) {
+    for (size_t offset = 0; offset + 2 <= length; offset += configuration[offset]) {
+        const unsigned char* descriptor = configuration + offset;
+        if (descriptor[0] < 2 || offset + descriptor[0] > length) break;
+
+        if (descriptor[1] == USB_INTERFACE_DESCRIPTOR && descriptor[0] >= 9 && descriptor[2] == number && descriptor[3] == alternate) return offset;
+    }
+
+    return length;
+}
+
+// Selects alternate setting `alternate` of interface `number` through usbdrvce, so the endpoints it gets are that setting's.
+// Uses the configuration kept in the device cache if there's one, otherwise fetches it.
+static irecovery_error_t irecovery_usb_set_interface(irecovery_client_t client, uint8_t number, uint8_t alternate) {
+    const struct irecovery_device_cache_entry* entry = irecovery_device_cache_find(client, client->device_info.ecid, client->device_descriptor.idProduct);
+    usb_configuration_descriptor_t* fetched = NULL;
+    const unsigned char* configuration = NULL;
+    size_t length = 0;
+    if (entry && entry->configuration_length) {
+        configuration = entry->configuration;
+        length        = entry->configuration_length;
+    } else {
+        irecovery_error_t error = irecovery_get_total_configuration_descriptor(client, 1, &fetched, &length);
+        if (error != IRECOVERY_E_SUCCESS) return error;
+        configuration = (const unsigned char*)fetched;
+    }
+
+    IRECOVERY_LOG_TRACE(client, "Setting interface %" PRIu8 " to alternate setting %" PRIu8 "...\n", number, alternate);
+    usb_error_t error = USB_ERROR_NOT_SUPPORTED;
+    size_t offset = irecovery_find_interface_descriptor(configuration, length, number, alternate);
+    if (offset < length) error = usb_SetInterface(client->handle, (const usb_interface_descriptor_t*)(configuration + offset), length - offset);
+    irecovery_scratch_free(client, fetched);
+
+    if (error == USB_SUCCESS) {
+        return IRECOVERY_E_SUCCESS;
+    } else {
+        return IRECOVERY_E_INTERFACE_SET_FAILED;
+    }
 }
+#endif
 
 // Client must be released manually if this function fails.
 static irecovery_error_t irecovery_finalize_client(irecovery_client_t client) {
@@ -811,7 +1758,7 @@ static irecovery_error_t irecovery_finalize_client(irecovery_client_t client) {
 		return IRECOVERY_E_FINALIZATION_BLOCKED;
 	}
 
-    // Get the serial string via iSerialNumber
+    // Get the serial string via iSerialNumber. It's the only way to know which phone this is, so it's read even on a cache hit
     char serial_str[256];
     memset(serial_str, 0, sizeof(serial_str));
     int ret = irecovery_get_string_descriptor_ascii(client, client->device_descriptor.iSerialNumber, (unsigned char*)serial_str, sizeof(serial_str)-1);
@@ -826,25 +1773,56 @@ static irecovery_error_t irecovery_finalize_client(irecovery_client_t client) {
     if (client->ecid_restriction != 0) {
         if (client->ecid_restriction != client->device_info.ecid) {
 			// Do not allow finalization again
-			irecovery_log(client, "ECID mismatch, finalization will no longer be available.\n");
+			IRECOVERY_LOG_WARN(client, "ECID mismatch, finalization will no longer be available.\n");
 			client->finalized = -1;
+            if (!client->routing) irecovery_event_publish_device(client, IRECOVERY_ECID_REJECTED, IRECOVERY_E_ECID_MISMATCH, client->device_descriptor.idProduct, client->device_info.ecid);
             return IRECOVERY_E_ECID_MISMATCH;
         }
     }
 
+    // A phone that was seen before in this mode doesn't need its configuration read again
+    struct irecovery_device_cache_entry* cached = irecovery_device_cache_find(client, client->device_info.ecid, client->device_descriptor.idProduct);
+    struct irecovery_device_cache_entry* entry = cached;
+    if (cached && cached->configuration_length) {
+        IRECOVERY_LOG_TRACE(client, "Configuration is cached.\n");
+        client->stats.cache_hits++;
+    } else if (!cached) {
+        // Only kept once the configuration is set, until then the entry is marked unused
+        entry = irecovery_device_cache_slot(client, client->device_info.ecid, client->device_descriptor.idProduct);
+        if (entry) {
+            entry->ecid = 0;
+            entry->configuration_length = 0;
+        }
+    }
+
     // Continue configuring this device
-    irecovery_error_t error = irecovery_usb_set_configuration(client, 1);
+    irecovery_error_t error = irecovery_usb_set_configuration(client, 1, entry);
     if (error != IRECOVERY_E_SUCCESS) {
 		client->finalized = -1;
+		irecovery_event_publish_device(client, IRECOVERY_DEVICE_FINALIZED, error, client->device_descriptor.idProduct, client->device_info.ecid);
 		return error;
 	}
 
-    irecovery_copy_nonce_with_tag(client, "NONC", &client->device_info.ap_nonce, &client->device_info.ap_nonce_size);
-    irecovery_copy_nonce_with_tag(client, "SNON", &client->device_info.sep_nonce, &client->device_info.sep_nonce_size);
+    if (entry && !cached) {
+        entry->ecid = client->device_info.ecid;
+        entry->pid  = client->device_descriptor.idProduct;
+    }
 
-    client->finalized = 1;
+    if (!(client->finalize_options & IRECOVERY_FINALIZE_OPT_SKIP_NONCES)) {
+        irecovery_copy_nonces(client);
+    }
 
-    irecovery_log(client, "Client @ %p was finalized.\n", (void*)client);
+    client->finalized = 1;
+    // Only phones that make it this far count, so one rejected during irecovery_await_reconnect() doesn't use up the one connection
+    if (client->num_connections++ > 0) client->stats.reconnects++;
+    bool mode_changed = client->last_ecid == client->device_info.ecid && client->last_mode != client->mode;
+    client->last_ecid = client->device_info.ecid;
+    client->last_mode = client->mode;
+
+    IRECOVERY_LOG_INFO(client, "Client @ %p was finalized.\n", (void*)client);
+    irecovery_event_publish_device(client, IRECOVERY_DEVICE_FINALIZED, error, client->mode, client->device_info.ecid);
+    // Callbacks can drop the connection
+    if (mode_changed && client->finalized > 0) irecovery_event_publish_device(client, IRECOVERY_MODE_CHANGED, error, client->mode, client->device_info.ecid);
     return error;
 }
 
@@ -857,32 +1835,38 @@ static usb_error_t usb_event_handler(usb_event_t event, void* event_data, void*
         case USB_ROLE_CHANGED_EVENT: {
             usb_role_t* new_role = event_data;
             if ((*new_role & USB_ROLE_DEVICE) == USB_ROLE_DEVICE) {
-                irecovery_log(client, "Calculator is no longer the host.\n");
+                IRECOVERY_LOG_INFO(client, "Calculator is no longer the host.\n");
+                unsigned int mode = client->device_descriptor.idProduct;
+                uint64_t ecid = client->device_info.ecid;
                 irecovery_client_clear_device_zone(client);
+                irecovery_event_publish_device(client, IRECOVERY_ROLE_LOST, IRECOVERY_E_NO_DEVICE, mode, ecid);
             }
             break;
         }
 
         case USB_DEVICE_DISCONNECTED_EVENT: {
             usb_device_t disconnected_device = event_data;
-            irecovery_log(client, "Device @ %p was disconnected.\n", (void*)disconnected_device);
+            IRECOVERY_LOG_INFO(client, "Device @ %p was disconnected.\n", (void*)disconnected_device);
             if (disconnected_device == client->handle) {
+                unsigned int mode = client->device_descriptor.idProduct;
+                uint64_t ecid = client->device_info.ecid;
                 irecovery_client_clear_device_zone(client);
+                irecovery_event_publish_device(client, IRECOVERY_DEVICE_DISCONNECTED, IRECOVERY_E_NO_DEVICE, mode, ecid);
             }
             break;
         }
 
         case USB_DEVICE_CONNECTED_EVENT: {
             usb_device_t connected_device = event_data;
-            irecovery_log(client, "New device @ %p connected.\n", (void*)connected_device);
-            irecovery_log(client, "Calculator is ");
+            IRECOVERY_LOG_INFO(client, "New device @ %p connected.\n", (void*)connected_device);
+            IRECOVERY_LOG_INFO(client, "Calculator is ");
             if ((usb_GetRole() & USB_ROLE_DEVICE) == USB_ROLE_DEVICE) {
-                irecovery_log(client, "not the host. Ignoring...\n");
+                IRECOVERY_LOG_INFO(client, "not the host. Ignoring...\n");
                 break;
             } else {
-                irecovery_log(client, "the host. Resetting...");
+                IRECOVERY_LOG_INFO(client, "the host. Resetting...");
                 error = usb_ResetDevice(connected_device);
-                irecovery_log(client, "%s.\n", (error == USB_SUCCESS) ? "Success" : "Failed");
+                IRECOVERY_LOG_INFO(client, "%s.\n", (error == USB_SUCCESS) ? "Success" : "Failed");
             }
             break;
         }
@@ -890,52 +1874,58 @@ static usb_error_t usb_event_handler(usb_event_t event, void* event_data, void*
         case USB_DEVICE_DISABLED_EVENT: {
             usb_device_t disabled_device = event_data;
             if (disabled_device == client->handle) {
-                irecovery_log(client, "Existing ");
+                IRECOVERY_LOG_INFO(client, "Existing ");
             } else {
-				irecovery_log(client, "Unrelated ");
+				IRECOVERY_LOG_INFO(client, "Unrelated ");
 			}
-			irecovery_log(client, "device @ %p was disabled.\n", (void*)disabled_device);
+			IRECOVERY_LOG_INFO(client, "device @ %p was disabled.\n", (void*)disabled_device);
             break;
         }
 
         case USB_DEVICE_ENABLED_EVENT: {
             usb_device_t enabled_device = event_data;
             if ((usb_GetRole() & USB_ROLE_DEVICE) == USB_ROLE_DEVICE) {
-                irecovery_log(client, "Device @ %p was enabled, but the calculator is not the host. Ignoring...\n", (void*)enabled_device);
+                IRECOVERY_LOG_INFO(client, "Device @ %p was enabled, but the calculator is not the host. Ignoring...\n", (void*)enabled_device);
                 break;
             }
             if (enabled_device == client->handle) {
-                irecovery_log(client, "Device @ %p was re-enabled.\n", (void*)enabled_device);
+                IRECOVERY_LOG_INFO(client, "Device @ %p was re-enabled.\n", (void*)enabled_device);
             } else {
-                irecovery_log(client, "Determining availability for new connections...\n");
-                // Decide whether or not to accept this connection
-                irecovery_log(client, "Policy: ");
-                if (client->connection_policy == IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL) {
-                    irecovery_log(client, "accept all.\n");
+                if (client->awaiting_reconnect) {
+                    // irecovery_await_reconnect() matches the ECID itself, the policy doesn't apply
                     irecovery_client_clear_device_zone(client);
-                } else if (client->connection_policy == IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ONLY_WHEN_NO_CURRENT_CONNECTION) {
-                    irecovery_log(client, "accept when not connected (currently ");
-                    if (irecovery_client_is_usable(client, false)) {
-                        irecovery_log(client, "connected).\n");
-                        break;
-                    } else {
-                        irecovery_log(client, "not connected).\n");
-                    }
-                } else if (client->connection_policy == IRECOVERY_CLIENT_DEVICE_POLICY_ONE_CONNECTION_LIMIT) {
-                    irecovery_log(client, "one connection limit (new connection allowed: ");
-                    if (client->num_connections == 1) {
-                        irecovery_log(client, "no.)\n");
-                        break;
-                    } else {
-                        irecovery_log(client, "yes.)\n");
+                } else {
+                    IRECOVERY_LOG_TRACE(client, "Determining availability for new connections...\n");
+                    // Decide whether or not to accept this connection
+                    IRECOVERY_LOG_TRACE(client, "Policy: ");
+                    if (client->connection_policy == IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL) {
+                        IRECOVERY_LOG_TRACE(client, "accept all.\n");
+                        irecovery_client_clear_device_zone(client);
+                    } else if (client->connection_policy == IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ONLY_WHEN_NO_CURRENT_CONNECTION) {
+                        IRECOVERY_LOG_TRACE(client, "accept when not connected (currently ");
+                        if (irecovery_client_is_usable(client, false)) {
+                            IRECOVERY_LOG_TRACE(client, "connected).\n");
+                            break;
+                        } else {
+                            IRECOVERY_LOG_TRACE(client, "not connected).\n");
+                        }
+                    } else if (client->connection_policy == IRECOVERY_CLIENT_DEVICE_POLICY_ONE_CONNECTION_LIMIT) {
+                        IRECOVERY_LOG_TRACE(client, "one connection limit (new connection allowed: ");
+                        if (client->num_connections >= 1) {
+                            IRECOVERY_LOG_TRACE(client, "no.)\n");
+                            break;
+                        } else {
+                            IRECOVERY_LOG_TRACE(client, "yes.)\n");
+                        }
                     }
                 }
 
                 if (irecovery_device_is_supported(enabled_device, &client->device_descriptor)) {
-                    irecovery_log(client, "Device @ %p is ready to be handled.\n", (void*)enabled_device);
+                    IRECOVERY_LOG_INFO(client, "Device @ %p is ready to be handled.\n", (void*)enabled_device);
                     client->handle = enabled_device;
+                    irecovery_event_publish_device(client, IRECOVERY_DEVICE_ATTACHED, IRECOVERY_E_SUCCESS, client->device_descriptor.idProduct, 0);
                 } else {
-                    irecovery_log(client, "Device @ %p is not handleable. Ignoring...\n", (void*)enabled_device);
+                    IRECOVERY_LOG_INFO(client, "Device @ %p is not handleable. Ignoring...\n", (void*)enabled_device);
                     irecovery_client_clear_device_zone(client);
                 }
             }
@@ -949,6 +1939,79 @@ static usb_error_t usb_event_handler(usb_event_t event, void* event_data, void*
     return error;
 }
 
+static irecovery_client_t irecovery_context_owner(irecovery_context_t context, usb_device_t device) {
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+        if (context->clients[i] && context->clients[i]->handle == device) return context->clients[i];
+    }
+
+    return NULL;
+}
+
+static void irecovery_context_add_pending(irecovery_context_t context, usb_device_t device) {
+    size_t free_slot = IRECOVERY_CONTEXT_PENDING_DEVICES;
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_PENDING_DEVICES; i++) {
+        if (context->pending[i].device == device) return;
+        if (!context->pending[i].device && free_slot == IRECOVERY_CONTEXT_PENDING_DEVICES) free_slot = i;
+    }
+
+    // Past that, the device is dropped until it's enabled again
+    if (free_slot == IRECOVERY_CONTEXT_PENDING_DEVICES) return;
+    context->pending[free_slot].device = device;
+    context->pending[free_slot].ecid   = 0;
+}
+
+static void irecovery_context_remove_pending(irecovery_context_t context, usb_device_t device) {
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_PENDING_DEVICES; i++) {
+        if (context->pending[i].device == device) {
+            context->pending[i].device = NULL;
+            context->pending[i].ecid   = 0;
+        }
+    }
+}
+
+// Routes events to the client that has the device. New devices wait in pending until irecovery_context_poll() hands them out.
+static usb_error_t irecovery_context_event_handler(usb_event_t event, void* event_data, void* callback_data) {
+    irecovery_context_t context = (irecovery_context_t)callback_data;
+    if (!context) return USB_SUCCESS; // Just in case
+
+    switch (event) {
+        case USB_ROLE_CHANGED_EVENT: {
+            memset(context->pending, 0, sizeof(context->pending));
+            for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+                if (context->clients[i]) usb_event_handler(event, event_data, context->clients[i]);
+            }
+            return USB_SUCCESS;
+        }
+
+        case USB_DEVICE_CONNECTED_EVENT: {
+            // Reset once, through any client so it shows up in a log
+            for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+                if (context->clients[i]) return usb_event_handler(event, event_data, context->clients[i]);
+            }
+            if ((usb_GetRole() & USB_ROLE_DEVICE) == USB_ROLE_DEVICE) return USB_SUCCESS;
+            return usb_ResetDevice((usb_device_t)event_data);
+        }
+
+        case USB_DEVICE_ENABLED_EVENT: {
+            irecovery_client_t owner = irecovery_context_owner(context, (usb_device_t)event_data);
+            if (owner) return usb_event_handler(event, event_data, owner);
+            if ((usb_GetRole() & USB_ROLE_DEVICE) != USB_ROLE_DEVICE) irecovery_context_add_pending(context, (usb_device_t)event_data);
+            return USB_SUCCESS;
+        }
+
+        case USB_DEVICE_DISCONNECTED_EVENT:
+        case USB_DEVICE_DISABLED_EVENT: {
+            if (event == USB_DEVICE_DISCONNECTED_EVENT) irecovery_context_remove_pending(context, (usb_device_t)event_data);
+            irecovery_client_t owner = irecovery_context_owner(context, (usb_device_t)event_data);
+            if (owner) return usb_event_handler(event, event_data, owner);
+            return USB_SUCCESS;
+        }
+
+        default:
+            return USB_SUCCESS;
+    }
+}
+
 const char* irecovery_strerror(irecovery_error_t error) {
     switch (error) {
         case IRECOVERY_E_SUCCESS:
@@ -989,18 +2052,41 @@ const char* irecovery_strerror(irecovery_error_t error) {
 			return "Failed to reset the USB device.";
 		case IRECOVERY_E_UNKNOWN_EVENT_TYPE:
 			return "The provided event type is unknown.";
+		case IRECOVERY_E_APPVAR_NOT_FOUND:
+			return "An AppVar could not be opened.";
+		case IRECOVERY_E_UPLOAD_IN_PROGRESS:
+			return "An upload is in progress.";
+		case IRECOVERY_E_UPLOAD_CANCELLED:
+			return "The upload was cancelled.";
+		case IRECOVERY_E_BAD_MANIFEST:
+			return "Manifest is malformed or doesn't match the image.";
+		case IRECOVERY_E_NO_UPLOAD:
+			return "No upload is in progress.";
+		case IRECOVERY_E_BAD_DEVICE_CACHE:
+			return "Device cache is malformed.";
+		case IRECOVERY_E_TIMEOUT:
+			return "Timed out waiting for the device.";
+		case IRECOVERY_E_NO_SESSION:
+			return "No session is in progress.";
+		case IRECOVERY_E_BAD_IMAGE:
+			return "Compressed image is malformed.";
+		case IRECOVERY_E_BOOT_IN_PROGRESS:
+			return "A boot chain is in progress.";
+		case IRECOVERY_E_NO_BOOT:
+			return "No boot chain is in progress.";
+		case IRECOVERY_E_UNEXPECTED_MODE:
+			return "The device came back in an unexpected mode.";
         default:
             return "Foreign error.";
     }
 }
 
 irecovery_error_t irecovery_client_new(irecovery_connection_policy_t connection_policy, uint64_t ecid, irecovery_log_cb_t logger, irecovery_client_t* client) {
-    if (!client) {
-        return IRECOVERY_E_BAD_PTR;
-    } else if (*client) {
-        return IRECOVERY_E_CLIENT_ALREADY_ACTIVE;
-    }
+    return irecovery_client_new_with_scratch(connection_policy, ecid, logger, NULL, 0, client);
+}
 
+// Allocates a client and sets its user members, without touching USB.
+static irecovery_error_t irecovery_client_alloc(irecovery_connection_policy_t connection_policy, uint64_t ecid, irecovery_log_cb_t logger, void* scratch, size_t scratch_size, irecovery_client_t* client) {
     // Allocate and set user members
     *client = (irecovery_client_t)calloc(1, sizeof(struct irecovery_client));
     if (!(*client)) {
@@ -1010,29 +2096,329 @@ irecovery_error_t irecovery_client_new(irecovery_connection_policy_t connection_
         (*client)->connection_policy = connection_policy;
         (*client)->log_fp            = logger;
         (*client)->ecid_restriction  = ecid;
-        irecovery_log(*client, "Logs are enabled.\n");
+
+        // Set Scratch Zone
+        if (scratch_size > 0) {
+            (*client)->owns_scratch = (scratch == NULL);
+            (*client)->scratch      = scratch ? (unsigned char*)scratch : (unsigned char*)malloc(scratch_size);
+            if (!(*client)->scratch) {
+                free(*client);
+                *client = NULL;
+                return IRECOVERY_E_NO_MEMORY;
+            }
+            (*client)->scratch_size = scratch_size;
+        }
+        IRECOVERY_LOG_INFO(*client, "Logs are enabled.\n");
+    }
+
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_client_new_with_scratch(irecovery_connection_policy_t connection_policy, uint64_t ecid, irecovery_log_cb_t logger, void* scratch, size_t scratch_size, irecovery_client_t* client) {
+    if (!client) {
+        return IRECOVERY_E_BAD_PTR;
+    } else if (*client) {
+        return IRECOVERY_E_CLIENT_ALREADY_ACTIVE;
     }
 
-    irecovery_log(*client, "Initializing USB...\n");
+    irecovery_error_t error = irecovery_client_alloc(connection_policy, ecid, logger, scratch, scratch_size, client);
+    if (error != IRECOVERY_E_SUCCESS) return error;
+
+    IRECOVERY_LOG_INFO(*client, "Initializing USB...\n");
     if (usb_Init(usb_event_handler, *client, NULL, USB_DEFAULT_INIT_FLAGS) != USB_SUCCESS) {
-        irecovery_log(*client, "Failed.\n");
+        IRECOVERY_LOG_INFO(*client, "Failed.\n");
         usb_Cleanup();
         irecovery_client_free(client);
         return IRECOVERY_E_USB_INIT_FAILED;
-    } else { irecovery_log(*client, "Success.\n"); }
+    } else { IRECOVERY_LOG_INFO(*client, "Success.\n"); }
+
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_context_new(irecovery_context_t* context) {
+    if (!context) {
+        return IRECOVERY_E_BAD_PTR;
+    } else if (*context) {
+        return IRECOVERY_E_CLIENT_ALREADY_ACTIVE;
+    }
+
+    *context = (irecovery_context_t)calloc(1, sizeof(struct irecovery_context));
+    if (!(*context)) return IRECOVERY_E_NO_MEMORY;
+
+    if (usb_Init(irecovery_context_event_handler, *context, NULL, USB_DEFAULT_INIT_FLAGS) != USB_SUCCESS) {
+        usb_Cleanup();
+        free(*context);
+        *context = NULL;
+        return IRECOVERY_E_USB_INIT_FAILED;
+    }
+
+    return IRECOVERY_E_SUCCESS;
+}
+
+void irecovery_context_free(irecovery_context_t* context) {
+    if (!context || !(*context)) return;
+
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+        irecovery_client_t client = (*context)->clients[i];
+        irecovery_client_free(&client);
+    }
+
+    usb_Cleanup();
+    free(*context);
+    *context = NULL;
+}
+
+irecovery_error_t irecovery_context_client_new(irecovery_context_t context, uint64_t ecid, irecovery_log_cb_t logger, void* scratch, size_t scratch_size, irecovery_client_t* client) {
+    if (!context || !client) {
+        return IRECOVERY_E_BAD_PTR;
+    } else if (*client) {
+        return IRECOVERY_E_CLIENT_ALREADY_ACTIVE;
+    }
+
+    size_t slot = 0;
+    while (slot < IRECOVERY_CONTEXT_MAX_CLIENTS && context->clients[slot]) slot++;
+    if (slot == IRECOVERY_CONTEXT_MAX_CLIENTS) return IRECOVERY_E_NO_MEMORY;
+
+    irecovery_error_t error = irecovery_client_alloc(IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ONLY_WHEN_NO_CURRENT_CONNECTION, ecid, logger, scratch, scratch_size, client);
+    if (error != IRECOVERY_E_SUCCESS) return error;
+
+    (*client)->context = context;
+    context->clients[slot] = *client;
+    return IRECOVERY_E_SUCCESS;
+}
+
+// Returns the free client a device with that ECID goes to. While the ECID is unknown, restricted clients are tried first.
+static irecovery_client_t irecovery_context_find_client(irecovery_context_t context, uint64_t ecid) {
+    irecovery_client_t unrestricted = NULL;
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+        irecovery_client_t client = context->clients[i];
+        if (!client || client->handle) continue;
+
+        if (client->ecid_restriction == 0) {
+            if (!unrestricted) unrestricted = client;
+        } else if (ecid == 0 || client->ecid_restriction == ecid) {
+            return client;
+        }
+    }
+
+    return unrestricted;
+}
+
+// Hands a pending device to a client and finalizes it. Returns false if it has to keep waiting for a free client.
+static bool irecovery_context_bind(irecovery_context_t context, size_t index) {
+    usb_device_t device = context->pending[index].device;
+    irecovery_client_t rejected = NULL;
+    unsigned int rejected_mode = 0;
+    bool done = false;
+
+    // A restricted client that turns out to be the wrong one reads the ECID for the second try. Finalization reads it from the
+    // serial string even when the client's device cache knows the phone, so a cache can't bind a phone to the wrong client.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        irecovery_client_t client = irecovery_context_find_client(context, context->pending[index].ecid);
+        if (!client) break;
+
+        irecovery_client_clear_device_zone(client);
+        if (!irecovery_device_is_supported(device, &client->device_descriptor)) {
+            IRECOVERY_LOG_INFO(client, "Device @ %p is not handleable. Ignoring...\n", (void*)device);
+            irecovery_client_clear_device_zone(client);
+            return true;
+        }
+        client->handle = device;
+        irecovery_event_publish_device(client, IRECOVERY_DEVICE_ATTACHED, IRECOVERY_E_SUCCESS, client->device_descriptor.idProduct, 0);
+
+        clock_t started = clock();
+        client->routing = true;
+        irecovery_error_t error = irecovery_finalize_client(client);
+        client->routing = false;
+        client->stats.finalize_ticks += clock() - started;
+        if (error != IRECOVERY_E_ECID_MISMATCH) {
+            IRECOVERY_LOG_INFO(client, "Device @ %p is ready to be handled.\n", (void*)device);
+            return true;
+        }
+
+        rejected      = client;
+        rejected_mode = client->device_descriptor.idProduct;
+        context->pending[index].ecid = client->device_info.ecid;
+        irecovery_client_clear_device_zone(client);
+        if (context->pending[index].ecid == 0) {
+            done = true;
+            break;
+        }
+    }
+
+    // Only reported once no other client took the phone, a restricted client guessed for it isn't told on every try
+    if (rejected) irecovery_event_publish_device(rejected, IRECOVERY_ECID_REJECTED, IRECOVERY_E_ECID_MISMATCH, rejected_mode, context->pending[index].ecid);
+    return done;
+}
+
+irecovery_error_t irecovery_context_poll(irecovery_context_t context) {
+    if (!context) return IRECOVERY_E_BAD_PTR;
+
+    usb_HandleEvents();
+
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_PENDING_DEVICES; i++) {
+        if (context->pending[i].device && irecovery_context_bind(context, i)) {
+            context->pending[i].device = NULL;
+            context->pending[i].ecid   = 0;
+        }
+    }
+
+    // Clients whose first finalization didn't go through
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+        irecovery_client_t client = context->clients[i];
+        if (client && client->finalized == 0 && irecovery_client_is_usable(client, false)) {
+            clock_t started = clock();
+            irecovery_finalize_client(client);
+            client->stats.finalize_ticks += clock() - started;
+        }
+    }
 
     return IRECOVERY_E_SUCCESS;
 }
 
+irecovery_error_t irecovery_context_send_step(irecovery_context_t context) {
+    if (!context) return IRECOVERY_E_BAD_PTR;
+
+    irecovery_error_t error = IRECOVERY_E_SUCCESS;
+    for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+        irecovery_client_t client = context->clients[i];
+        if (client && client->upload.state != IRECOVERY_UPLOAD_STATE_IDLE && irecovery_send_step(client) == IRECOVERY_E_UPLOAD_IN_PROGRESS) {
+            error = IRECOVERY_E_UPLOAD_IN_PROGRESS;
+        }
+    }
+
+    return error;
+}
+
 irecovery_error_t irecovery_poll_for_device(irecovery_client_t client) {
     if (!client) return IRECOVERY_E_BAD_PTR;
 
-    usb_HandleEvents();
-    return irecovery_finalize_client(client);
+    if (client->context) {
+        irecovery_context_poll(client->context);
+    } else {
+        usb_HandleEvents();
+    }
+
+    clock_t started = clock();
+    irecovery_error_t error = irecovery_finalize_client(client);
+    client->stats.finalize_ticks += clock() - started;
+    return error;
+}
+
+irecovery_error_t irecovery_set_finalize_options(irecovery_client_t client, unsigned int options) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+
+    client->finalize_options = options;
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_set_device_cache(irecovery_client_t client, struct irecovery_device_cache_entry* entries, size_t count) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+
+    client->device_cache       = entries;
+    client->device_cache_count = entries ? count : 0;
+    client->device_cache_next  = 0;
+    return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_device_cache_clear(irecovery_client_t client) {
+    if (!client) return IRECOVERY_E_BAD_PTR;
+
+    if (client->device_cache) {
+        memset(client->device_cache, 0, client->device_cache_count * sizeof(struct irecovery_device_cache_entry));
+    }
+    client->device_cache_next = 0;
+    return IRECOVERY_E_SUCCESS;
+}
+
+/*
+ * Device cache AppVar layout: "IRDC", version (1 byte), count (1), then for each entry
+ * ECID (8, little endian), product ID (2, little endian), configuration length (1), configuration.
+ */
+#define IRECOVERY_DEVICE_CACHE_VERSION 2
+
+irecovery_error_t irecovery_device_cache_save(irecovery_client_t client, const char* name) {
+    if (!client || !name) return IRECOVERY_E_BAD_PTR;
+
+    uint8_t count = 0;
+    for (size_t i = 0; i < client->device_cache_count && count < 0xFF; i++) {
+        if (client->device_cache[i].ecid != 0) count++;
+    }
+
+    uint8_t handle = ti_Open(name, "w");
+    if (!handle) return IRECOVERY_E_APPVAR_NOT_FOUND;
+
+    unsigned char header[6] = { 'I', 'R', 'D', 'C', IRECOVERY_DEVICE_CACHE_VERSION, count };
+    bool written = ti_Write(header, sizeof(header), 1, handle) == 1;
+    for (size_t i = 0; written && count > 0 && i < client->device_cache_count; i++) {
+        const struct irecovery_device_cache_entry* entry = &client->device_cache[i];
+        if (entry->ecid == 0) continue;
+
+        unsigned char key[11];
+        for (int byte = 0; byte < 8; byte++) {
+            key[byte] = (unsigned char)(entry->ecid >> (byte * 8));
+        }
+        key[8]  = entry->pid & 0xFF;
+        key[9]  = entry->pid >> 8;
+        key[10] = entry->configuration_length;
+
+        written = ti_Write(key, sizeof(key), 1, handle) == 1 &&
+                  (entry->configuration_length == 0 || ti_Write(entry->configuration, entry->configuration_length, 1, handle) == 1);
+        count--;
+    }
+    ti_Close(handle);
+
+    return written ? IRECOVERY_E_SUCCESS : IRECOVERY_E_NO_MEMORY;
+}
+
+irecovery_error_t irecovery_device_cache_load(irecovery_client_t client, const char* name) {
+    if (!client || !name) return IRECOVERY_E_BAD_PTR;
+    if (!client->device_cache) return IRECOVERY_E_DST_BUF_SIZE_ZERO;
+
+    uint8_t handle = ti_Open(name, "r");
+    if (!handle) return IRECOVERY_E_APPVAR_NOT_FOUND;
+
+    const unsigned char* data = (const unsigned char*)ti_GetDataPtr(handle);
+    size_t size = ti_GetSize(handle);
+    irecovery_error_t error = IRECOVERY_E_SUCCESS;
+
+    irecovery_device_cache_clear(client);
+    if (size < 6 || memcmp(data, "IRDC", 4) != 0 || data[4] != IRECOVERY_DEVICE_CACHE_VERSION) {
+        error = IRECOVERY_E_BAD_DEVICE_CACHE;
+    } else {
+        size_t offset = 6;
+        for (uint8_t i = 0; i < data[5]; i++) {
+            if (size - offset < 11 || data[offset + 10] > IRECOVERY_DEVICE_CACHE_CONFIG_SIZE || size - offset - 11 < data[offset + 10]) {
+                error = IRECOVERY_E_BAD_DEVICE_CACHE;
+                break;
+            }
+
+            uint64_t ecid = 0;
+            for (int byte = 7; byte >= 0; byte--) {
+                ecid = (ecid << 8) | data[offset + byte];
+            }
+            uint16_t pid = (uint16_t)(data[offset + 8] | (data[offset + 9] << 8));
+            uint8_t configuration_length = data[offset + 10];
+            const unsigned char* configuration = data + offset + 11;
+            offset += 11 + configuration_length;
+
+            if (i >= client->device_cache_count || ecid == 0) continue;
+            struct irecovery_device_cache_entry* entry = &client->device_cache[i];
+            entry->ecid = ecid;
+            entry->pid  = pid;
+            entry->configuration_length = configuration_length;
+            memcpy(entry->configuration, configuration, configuration_length);
+        }
+    }
+    ti_Close(handle);
+
+    // Don't leave half a cache behind
+    if (error != IRECOVERY_E_SUCCESS) irecovery_device_cache_clear(client);
+    return error;
 }
 
 irecovery_error_t irecovery_reset(irecovery_client_t client) {
-	if (!irecovery_client_is_usable(client, true)) return IRECOVERY_E_NO_DEVICE;
+	if (!irecovery_client_check(client, true)) return IRECOVERY_E_NO_DEVICE;
 
 	if (usb_ResetDevice(client->handle) == USB_SUCCESS) {
 		return IRECOVERY_E_SUCCESS;
@@ -1044,21 +2430,62 @@ irecovery_error_t irecovery_reset(irecovery_client_t client) {
 void irecovery_client_free(irecovery_client_t* client) {
     if (!client || !(*client)) return;
 
-    irecovery_log(*client, "Freeing client @ %p...\n", (void*)*client);
+    IRECOVERY_LOG_INFO(*client, "Freeing client @ %p...\n", (void*)*client);
+
+    irecovery_console_detach(*client);
+
+    irecovery_context_t context = (*client)->context;
+    if (context) {
+        // USB stays up for the rest of the context, so queued transfers have to land before the client goes away. A device that
+        // stops answering is reset, which ends them, and one that still doesn't let go is given up on after another timeout.
+        clock_t timeout = irecovery_ms_to_clock(IRECOVERY_FREE_DRAIN_TIMEOUT);
+        clock_t started = clock();
+        bool reset = false;
+        while (!irecovery_upload_idle(&(*client)->upload) && irecovery_client_is_usable(*client, true)) {
+            clock_t elapsed = clock() - started;
+            if (elapsed >= timeout) {
+                if (reset) break;
+
+                IRECOVERY_LOG_ERROR(*client, "%s: ERROR: transfers didn't land, resetting the device\n", __func__);
+                irecovery_wait_timer_stop(*client);
+                usb_ResetDevice((*client)->handle);
+                reset   = true;
+                started = clock();
+                continue;
+            }
+
+            uint32_t remaining = IRECOVERY_FREE_DRAIN_TIMEOUT - (uint32_t)((uint64_t)elapsed * 1000 / CLOCKS_PER_SEC);
+            if (irecovery_wait_timer_arm(*client, remaining)) usb_WaitForEvents();
+        }
+        irecovery_wait_timer_stop(*client);
 
-    usb_Cleanup();
+        for (size_t i = 0; i < IRECOVERY_CONTEXT_MAX_CLIENTS; i++) {
+            if (context->clients[i] == *client) context->clients[i] = NULL;
+        }
+        // Another client can take the device
+        if (irecovery_client_is_usable(*client, false)) irecovery_context_add_pending(context, (*client)->handle);
+    } else {
+        usb_Cleanup();
+    }
+    if ((*client)->boot.state != IRECOVERY_BOOT_STATE_IDLE) irecovery_boot_end(*client);
+    if ((*client)->upload.state != IRECOVERY_UPLOAD_STATE_IDLE) irecovery_upload_end(*client, IRECOVERY_E_NO_DEVICE);
+    irecovery_log_flush(*client);
     irecovery_client_clear_device_zone(*client);
+    if ((*client)->owns_scratch) free((*client)->scratch);
     free(*client);
     *client = NULL;
 }
 
 /* https://github.com/libimobiledevice/libirecovery/blob/638056a593b3254d05f2960fab836bace10ff105/src/libirecovery.c#L1501 */
 int irecovery_usb_bulk_transfer(irecovery_client_t client, unsigned char endpoint, unsigned char* data, size_t length, size_t* transferred) {	
-	if (!irecovery_client_is_usable(client, true)) return IRECOVERY_E_NO_DEVICE;
+	if (!irecovery_client_check(client, true)) return IRECOVERY_E_NO_DEVICE;
     
     size_t _transferred = 0;
+    clock_t started = clock();
     usb_error_t error = usb_Transfer(usb_GetDeviceEndpoint(client->handle, endpoint), data, length, 0, &_transferred);
+    client->stats.bulk_ticks += clock() - started;
     if (error != USB_SUCCESS) {
+        client->stats.failed_transfers++;
         return IRECOVERY_E_USB_UPLOAD_FAILED;
     } else {
         *transferred = _transferred;
@@ -1068,43 +2495,84 @@ int irecovery_usb_bulk_transfer(irecovery_client_t client, unsigned char endpoin
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3857 */
 irecovery_error_t irecovery_reset_counters(irecovery_client_t client) {
-	if (!irecovery_client_is_usable(client, true)) return IRECOVERY_E_NO_DEVICE;
+	if (!irecovery_client_check(client, true)) return IRECOVERY_E_NO_DEVICE;
 
 	if (client->mode == IRECOVERY_K_DFU_MODE || client->mode == IRECOVERY_K_WTF_MODE) {
 		int ret;
-		if ((ret = irecovery_usb_control_transfer(client, 0x21, 4, 0, 0, NULL, 0)) < 0) return ret;
+		if ((ret = irecovery_usb_control_transfer_unchecked(client, 0x21, 4, 0, 0, NULL, 0)) < 0) return ret;
 	}
 
 	return IRECOVERY_E_SUCCESS;
 }
 
+static void irecovery_parse_dfu_status(const unsigned char* buffer, struct irecovery_dfu_status* status) {
+	status->b_status        = buffer[0];
+	status->bw_poll_timeout = (uint32_t)buffer[1] | ((uint32_t)buffer[2] << 8) | ((uint32_t)buffer[3] << 16);
+	status->b_state         = buffer[4];
+	status->i_string        = buffer[5];
+}
+
 /* https://github.com/libimobiledevice/libirecovery/blob/638056a593b3254d05f2960fab836bace10ff105/src/libirecovery.c#L3214 */
-static irecovery_error_t irecovery_get_status(irecovery_client_t client, unsigned int* status) {
-	if (!irecovery_client_is_usable(client, true)) {
-		*status = 0;
-		return IRECOVERY_E_NO_DEVICE;
-	}
+irecovery_error_t irecovery_get_status(irecovery_client_t client, struct irecovery_dfu_status* status) {
+	if (!status) return IRECOVERY_E_BAD_PTR;
+
+	memset(status, 0, sizeof(struct irecovery_dfu_status));
+	if (!irecovery_client_check(client, true)) return IRECOVERY_E_NO_DEVICE;
 
 	unsigned char buffer[6];
 	memset(buffer, 0, 6);
-	if (irecovery_usb_control_transfer(client, 0xA1, 3, 0, 0, buffer, 6) != 6) {
-		*status = 0;
-		return IRECOVERY_E_INVALID_USB_STATUS;
+	client->stats.status_polls++;
+	if (irecovery_usb_control_transfer_unchecked(client, 0xA1, 3, 0, 0, buffer, 6) != 6) return IRECOVERY_E_INVALID_USB_STATUS;
+
+	irecovery_parse_dfu_status(buffer, status);
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Largest clock_t, which is unsigned on the calculator but may be signed elsewhere
+#define IRECOVERY_CLOCK_MAX ((clock_t)-1 > 0 ? (clock_t)-1 : (clock_t)(((uintmax_t)1 << (sizeof(clock_t) * 8 - 1)) - 1))
+
+// Whole seconds below which a conversion fits in clock_t: (seconds + 1) * CLOCKS_PER_SEC still does
+static const uintmax_t irecovery_clock_max_seconds = IRECOVERY_CLOCK_MAX / CLOCKS_PER_SEC;
+
+// Converts milliseconds to clock() ticks. Anything past the largest clock_t, and IRECOVERY_WAIT_FOREVER, becomes
+// IRECOVERY_CLOCK_MAX, which an elapsed time never exceeds: 32768 Hz ticks in 32 bits run out after about 36 hours.
+static clock_t irecovery_ms_to_clock(uint32_t ms) {
+	if (ms == IRECOVERY_WAIT_FOREVER || ms / 1000 >= irecovery_clock_max_seconds) return IRECOVERY_CLOCK_MAX;
+	return (clock_t)(ms / 1000) * CLOCKS_PER_SEC + (clock_t)(ms % 1000) * CLOCKS_PER_SEC / 1000;
+}
+
+static void irecovery_sleep_ms(uint32_t ms) {
+	while (ms > 0) {
+		uint16_t chunk = (ms > 0xFFFF) ? 0xFFFF : (uint16_t)ms;
+		delay(chunk);
+		ms -= chunk;
 	}
+}
 
-	*status = (unsigned int)buffer[4];
+irecovery_error_t irecovery_get_dfu_functional_descriptor(irecovery_client_t client, struct irecovery_dfu_functional_descriptor* descriptor) {
+	if (!descriptor) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (client->dfu_functional.w_transfer_size == 0) {
+		return IRECOVERY_E_DESCRIPTOR_FETCH_FAILED;
+	}
 
+	*descriptor = client->dfu_functional;
 	return IRECOVERY_E_SUCCESS;
 }
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3920 */
 irecovery_error_t irecovery_finish_transfer(irecovery_client_t client) {
-	if (!irecovery_client_is_usable(client, true)) return IRECOVERY_E_NO_DEVICE;
+	if (!irecovery_client_check(client, true)) return IRECOVERY_E_NO_DEVICE;
 
-	irecovery_usb_control_transfer(client, 0x21, 1, 0, 0, NULL, 0);
+	irecovery_usb_control_transfer_unchecked(client, 0x21, 1, 0, 0, NULL, 0);
 
-	unsigned int status = 0;
+	struct irecovery_dfu_status status;
 	for (int i = 0; i < 3; i++) {
+		// Give the device the time it asks for between polls
+		if (i > 0) irecovery_sleep_ms(status.bw_poll_timeout);
 		irecovery_get_status(client, &status);
 	}
 
@@ -1113,11 +2581,164 @@ irecovery_error_t irecovery_finish_transfer(irecovery_client_t client) {
 	return IRECOVERY_E_SUCCESS;
 }
 
+// Drops the old connection and lets the next phone with the last finalized ECID (or the restricted one) in, whatever the
+// connection policy. End with irecovery_reconnect_end().
+static irecovery_error_t irecovery_reconnect_begin(irecovery_client_t client) {
+	uint64_t ecid = client->ecid_restriction ? client->ecid_restriction : client->last_ecid;
+	if (ecid == 0) return IRECOVERY_E_NO_DEVICE;
+
+	// The phone may not have reported going away yet, so the old connection is dropped up front
+	irecovery_client_clear_device_zone(client);
+	client->reconnect_restriction = client->ecid_restriction;
+	client->ecid_restriction      = ecid;
+	client->awaiting_reconnect    = true;
+	return IRECOVERY_E_SUCCESS;
+}
+
+// One round of waiting for the phone. IRECOVERY_E_SUCCESS once it's finalized, IRECOVERY_E_TIMEOUT while it isn't yet.
+static irecovery_error_t irecovery_reconnect_poll(irecovery_client_t client) {
+	if (client->context) {
+		irecovery_context_poll(client->context);
+	} else {
+		usb_HandleEvents();
+	}
+	if (!irecovery_client_is_usable(client, false) || client->finalized < 0) return IRECOVERY_E_TIMEOUT;
+
+	clock_t finalize_started = clock();
+	irecovery_error_t error = irecovery_finalize_client(client);
+	client->stats.finalize_ticks += clock() - finalize_started;
+	if (error == IRECOVERY_E_SUCCESS) return error;
+
+	// Another phone, or one that couldn't be set up yet
+	IRECOVERY_LOG_TRACE(client, "Still waiting (%s)\n", irecovery_strerror(error));
+	return IRECOVERY_E_TIMEOUT;
+}
+
+static void irecovery_reconnect_end(irecovery_client_t client) {
+	client->ecid_restriction   = client->reconnect_restriction;
+	client->awaiting_reconnect = false;
+}
+
+irecovery_error_t irecovery_await_reconnect(irecovery_client_t client, uint32_t timeout_ms, uint32_t* ready_ms) {
+	if (!client) return IRECOVERY_E_BAD_PTR;
+
+	irecovery_error_t error = irecovery_reconnect_begin(client);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	clock_t timeout = irecovery_ms_to_clock(timeout_ms);
+	clock_t started = clock();
+	do {
+		error = irecovery_reconnect_poll(client);
+	} while (error != IRECOVERY_E_SUCCESS && clock() - started < timeout);
+	clock_t elapsed = clock() - started;
+
+	irecovery_reconnect_end(client);
+
+	uint32_t ms = (uint32_t)((uint64_t)elapsed * 1000 / CLOCKS_PER_SEC);
+	if (ready_ms) *ready_ms = ms;
+	if (error == IRECOVERY_E_SUCCESS) {
+		IRECOVERY_LOG_INFO(client, "Device was ready after %" PRIu32 " ms.\n", ms);
+	}
+	return error;
+}
+
+// usbdrvce timers count CPU cycles at 48 MHz. Longer timeouts are waited out a stretch at a time, so a stretch fits in 32 bits.
+#define IRECOVERY_TIMER_CYCLES_PER_MS 48000
+#define IRECOVERY_WAIT_STRETCH_MS     60000
+
+static usb_error_t irecovery_wait_timer_handler(usb_timer_t* timer) {
+	irecovery_client_t client = (irecovery_client_t)((unsigned char*)timer - offsetof(struct irecovery_client, wait_timer));
+	// Firing is enough to wake usb_WaitForEvents() up
+	client->wait_timer_armed = false;
+	return USB_SUCCESS;
+}
+
+// Starts wait_timer so usb_WaitForEvents() wakes up in remaining_ms at the latest, unless it's running already.
+// Returns whether or not it's running.
+static bool irecovery_wait_timer_arm(irecovery_client_t client, uint32_t remaining_ms) {
+	if (!client->wait_timer_armed) {
+		if (remaining_ms == 0) remaining_ms = 1;
+		if (remaining_ms > IRECOVERY_WAIT_STRETCH_MS) remaining_ms = IRECOVERY_WAIT_STRETCH_MS;
+		client->wait_timer.handler = irecovery_wait_timer_handler;
+		client->wait_timer_armed = usb_StartTimerCycles(&client->wait_timer, remaining_ms * IRECOVERY_TIMER_CYCLES_PER_MS) == USB_SUCCESS;
+	}
+
+	return client->wait_timer_armed;
+}
+
+static void irecovery_wait_timer_stop(irecovery_client_t client) {
+	if (client->wait_timer_armed) {
+		usb_StopTimer(&client->wait_timer);
+		client->wait_timer_armed = false;
+	}
+}
+
+// What irecovery_poll_for_device() does, plus a round of the upload in progress.
+static void irecovery_wait_step(irecovery_client_t client) {
+	if (client->context) {
+		irecovery_context_poll(client->context);
+	} else {
+		usb_HandleEvents();
+	}
+
+	if (client->finalized == 0 && irecovery_client_is_usable(client, false)) {
+		clock_t started = clock();
+		irecovery_finalize_client(client);
+		client->stats.finalize_ticks += clock() - started;
+	}
+
+	if (client->upload.state != IRECOVERY_UPLOAD_STATE_IDLE) irecovery_send_step(client);
+}
+
+irecovery_error_t irecovery_wait_for_event(irecovery_client_t client, irecovery_event_type type, uint32_t timeout_ms, irecovery_event_t* event) {
+	if (!client) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (type != IRECOVERY_EVENT_ANY && !irecovery_event_type_is_valid(type)) {
+		return IRECOVERY_E_UNKNOWN_EVENT_TYPE;
+	} else if (client->waited_event) {
+		// Called from a callback while already waiting
+		return IRECOVERY_E_CLIENT_ALREADY_ACTIVE;
+	}
+
+	irecovery_event_t received;
+	memset(&received, 0, sizeof(received));
+	client->waited_event = &received;
+	client->waited_type  = type;
+	client->waited       = false;
+
+	clock_t timeout = irecovery_ms_to_clock(timeout_ms);
+	clock_t started = clock();
+	for (;;) {
+		irecovery_wait_step(client);
+		if (client->waited) break;
+
+		bool timer_needed = false;
+		if (timeout_ms != IRECOVERY_WAIT_FOREVER) {
+			clock_t elapsed = clock() - started;
+			if (elapsed >= timeout) break;
+
+			uint32_t remaining = timeout_ms - (uint32_t)((uint64_t)elapsed * 1000 / CLOCKS_PER_SEC);
+			timer_needed = !irecovery_wait_timer_arm(client, remaining);
+		}
+
+		// Without a timer nothing might wake it up in time, and an upload waiting out a DFU status delay has nothing in flight
+		if (timer_needed || (client->upload.state != IRECOVERY_UPLOAD_STATE_IDLE && irecovery_upload_idle(&client->upload))) continue;
+		usb_WaitForEvents();
+	}
+
+	irecovery_wait_timer_stop(client);
+	client->waited_event = NULL;
+
+	if (!client->waited) return IRECOVERY_E_TIMEOUT;
+	if (event) *event = received;
+	return IRECOVERY_E_SUCCESS;
+}
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3602 */
 irecovery_error_t irecovery_get_mode(irecovery_client_t client, int* mode) {
     if (!mode) {
         return IRECOVERY_E_BAD_PTR;
-    } else if (!irecovery_client_is_usable(client, true)) {
+    } else if (!irecovery_client_check(client, true)) {
         return IRECOVERY_E_NO_DEVICE;
     }
 
@@ -1126,7 +2747,7 @@ irecovery_error_t irecovery_get_mode(irecovery_client_t client, int* mode) {
 	} else {
 		*mode = client->mode;
 	}
-	
+
     return IRECOVERY_E_SUCCESS;
 }
 
@@ -1148,262 +2769,1869 @@ const char* irecovery_mode_to_str(int mode) {
     }
 }
 
+// The callback's existing subscription to the type, or else a free one set up for it. NULL if they're all taken.
+static struct irecovery_event_subscriber* irecovery_event_subscriber_slot(irecovery_client_t client, irecovery_event_type type, irecovery_event_cb_t callback) {
+	struct irecovery_event_subscriber* free_slot = NULL;
+	for (size_t i = 0; i < IRECOVERY_EVENT_SUBSCRIBERS; i++) {
+		struct irecovery_event_subscriber* subscriber = &client->subscribers[i];
+		if (subscriber->callback == callback && subscriber->type == type) return subscriber;
+		if (!subscriber->callback && !free_slot) free_slot = subscriber;
+	}
+	if (!free_slot) return NULL;
+
+	memset(free_slot, 0, sizeof(struct irecovery_event_subscriber));
+	free_slot->type     = type;
+	free_slot->callback = callback;
+	return free_slot;
+}
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L2104 */
 irecovery_error_t irecovery_event_subscribe(irecovery_client_t client, irecovery_event_type type, irecovery_event_cb_t callback) {
-	if (!irecovery_client_is_usable(client, false)) {
-		return IRECOVERY_E_NO_DEVICE;
-	} else if (!callback) {
+	if (!client || !callback) {
 		return IRECOVERY_E_BAD_PTR;
+	} else if (!irecovery_event_type_is_valid(type)) {
+		return IRECOVERY_E_UNKNOWN_EVENT_TYPE;
 	}
-	
-	switch (type) {
-		case IRECOVERY_PROGRESS:
-			client->progress_callback = callback;
-			break;
 
-		default:
-			return IRECOVERY_E_UNKNOWN_EVENT_TYPE;
-	}
+	struct irecovery_event_subscriber* subscriber = irecovery_event_subscriber_slot(client, type, callback);
+	if (!subscriber) return IRECOVERY_E_NO_MEMORY;
 
+	subscriber->throttled = false;
 	return IRECOVERY_E_SUCCESS;
 }
 
-/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L2142 */
-irecovery_error_t irecovery_event_unsubscribe(irecovery_client_t client, irecovery_event_type type) {
-	if (!irecovery_client_is_usable(client, false)) {
-		return IRECOVERY_E_NO_DEVICE;
-	}
+irecovery_error_t irecovery_event_subscribe_progress(irecovery_client_t client, irecovery_event_cb_t callback, uint16_t step_permille, uint32_t interval_ms) {
+	if (!client || !callback) return IRECOVERY_E_BAD_PTR;
 
-	switch (type) {
-		case IRECOVERY_PROGRESS:
-			client->progress_callback = NULL;
+	struct irecovery_event_subscriber* subscriber = irecovery_event_subscriber_slot(client, IRECOVERY_PROGRESS, callback);
+	if (!subscriber) return IRECOVERY_E_NO_MEMORY;
+
+	subscriber->throttled = true;
+	subscriber->step      = step_permille;
+	subscriber->interval  = irecovery_ms_to_clock(interval_ms);
+	subscriber->delivered = false;
+	return IRECOVERY_E_SUCCESS;
+}
+
+/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L2142 */
+irecovery_error_t irecovery_event_unsubscribe(irecovery_client_t client, irecovery_event_type type) {
+	if (!client) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (!irecovery_event_type_is_valid(type)) {
+		return IRECOVERY_E_UNKNOWN_EVENT_TYPE;
+	}
+
+	for (size_t i = 0; i < IRECOVERY_EVENT_SUBSCRIBERS; i++) {
+		if (client->subscribers[i].type == type) client->subscribers[i].callback = NULL;
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_event_unsubscribe_callback(irecovery_client_t client, irecovery_event_type type, irecovery_event_cb_t callback) {
+	if (!client || !callback) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (!irecovery_event_type_is_valid(type)) {
+		return IRECOVERY_E_UNKNOWN_EVENT_TYPE;
+	}
+
+	for (size_t i = 0; i < IRECOVERY_EVENT_SUBSCRIBERS; i++) {
+		if (client->subscribers[i].callback == callback && client->subscribers[i].type == type) {
+			client->subscribers[i].callback = NULL;
+			return IRECOVERY_E_SUCCESS;
+		}
+	}
+
+	return IRECOVERY_E_BAD_PTR;
+}
+
+// Whether or not a phone in that mode has a console that takes commands.
+static bool irecovery_mode_has_console(unsigned int mode) {
+	return mode == IRECOVERY_K_RECOVERY_MODE_1 || mode == IRECOVERY_K_RECOVERY_MODE_2 || mode == IRECOVERY_K_RECOVERY_MODE_3 || mode == IRECOVERY_K_RECOVERY_MODE_4;
+}
+
+// Whether or not the device is in a mode with a console that takes commands.
+static bool irecovery_client_has_console(irecovery_client_t client) {
+	return irecovery_mode_has_console(client->mode);
+}
+
+// Sends a null-terminated command of length characters to a client that was already checked.
+static irecovery_error_t irecovery_console_send(irecovery_client_t client, const char* command, size_t length, uint8_t b_request) {
+	int ret = irecovery_usb_control_transfer_unchecked(client, 0x40, b_request, 0, 0, (unsigned char*)command, length + 1);
+	if (ret < 0) return ret;
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Checks that the client has a phone with a console. Runs the USB event handler, so batches call it once.
+static irecovery_error_t irecovery_console_check_client(irecovery_client_t client) {
+	if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (!irecovery_client_has_console(client)) {
+		return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Checks a command before it goes to the console, and gives back its length. Empty commands pass, what they mean is up
+// to the caller.
+static irecovery_error_t irecovery_console_check_command(const char* command, size_t* length) {
+	if (!command) return IRECOVERY_E_BAD_PTR;
+
+	*length = strlen(command);
+	if (*length >= 256) return IRECOVERY_E_COMMAND_TOO_LONG;
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3108 */
+static irecovery_error_t irecovery_send_command_raw(irecovery_client_t client, const char* command, uint8_t b_request) {
+	size_t length = 0;
+	irecovery_error_t error = irecovery_console_check_client(client);
+	if (error == IRECOVERY_E_SUCCESS) error = irecovery_console_check_command(command, &length);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	if (length > 0) {
+		return irecovery_console_send(client, command, length, b_request);
+	} else {
+		return IRECOVERY_E_NO_COMMAND;
+	}
+}
+
+/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3123 */
+irecovery_error_t irecovery_send_command_breq(irecovery_client_t client, const char* command, uint8_t b_request) {
+	size_t length = 0;
+	irecovery_error_t error = irecovery_console_check_client(client);
+	if (error == IRECOVERY_E_SUCCESS) error = irecovery_console_check_command(command, &length);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	error = (length > 0) ? irecovery_console_send(client, command, length, b_request) : IRECOVERY_E_NO_COMMAND;
+	if (error != IRECOVERY_E_SUCCESS) {
+		IRECOVERY_LOG_ERROR(client, "Failed to send command %s\n", command);
+	}
+
+	return error;
+}
+
+/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/tools/irecovery.c#L222 */
+static bool irecovery_is_breq_command(const char* cmd) {
+	return (
+		!strcmp(cmd, "go")
+		|| !strcmp(cmd, "bootx")
+		|| !strcmp(cmd, "reboot")
+		|| !strcmp(cmd, "memboot")
+	);
+}
+
+/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3168 */
+irecovery_error_t irecovery_send_command(irecovery_client_t client, const char* command) {
+	// Client eligibility checked by irecovery_send_command_breq()
+	if (!command) return IRECOVERY_E_BAD_PTR;
+
+	return irecovery_send_command_breq(client, command, irecovery_is_breq_command(command));
+}
+
+irecovery_error_t irecovery_send_commands(irecovery_client_t client, const char* const* commands, size_t count, irecovery_error_t* results) {
+	if (!commands) return IRECOVERY_E_BAD_PTR;
+
+	for (size_t i = 0; results && i < count; i++) {
+		results[i] = IRECOVERY_E_NO_COMMAND;
+	}
+
+	// The client once, then every command before sending any, so a bad one doesn't leave the batch half sent
+	irecovery_error_t error = irecovery_console_check_client(client);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t length = 0;
+		irecovery_error_t result = irecovery_console_check_command(commands[i], &length);
+		if (result != IRECOVERY_E_SUCCESS) {
+			if (results) results[i] = result;
+			if (error == IRECOVERY_E_SUCCESS) error = result;
+		}
+	}
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t length = strlen(commands[i]);
+		if (length == 0) {
+			// Nothing to send, which is what the batch asked for
+			if (results) results[i] = IRECOVERY_E_SUCCESS;
+			continue;
+		}
+
+		error = irecovery_console_send(client, commands[i], length, irecovery_is_breq_command(commands[i]));
+		if (results) results[i] = error;
+		if (error != IRECOVERY_E_SUCCESS) {
+			IRECOVERY_LOG_ERROR(client, "Failed to send command %s\n", commands[i]);
+			return error;
+		}
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+#ifndef IRECOVERY_NO_RECOVERY
+// Hands the line collected so far to the IRECOVERY_CONSOLE_LINE subscribers, without the '\r' of a "\r\n" ending.
+static void irecovery_console_publish_line(struct irecovery_console_read* read) {
+	size_t length = read->line_length;
+	if (length > 0 && read->line[length - 1] == '\r') length--;
+	read->line[length] = '\0';
+	read->line_length = 0;
+
+	irecovery_event_t event = {
+		.size     = length,
+		.data     = read->line,
+		.progress = 0.0,
+		.type     = IRECOVERY_CONSOLE_LINE,
+		.error    = IRECOVERY_E_SUCCESS,
+		.mode     = read->client->mode,
+		.ecid     = read->client->device_info.ecid
+	};
+	irecovery_event_publish(read->client, &event);
+}
+
+// Adds what a console read brought in to the ring buffer, and splits it into lines if anyone listens for them.
+static void irecovery_console_append(struct irecovery_console_read* read, const unsigned char* data, size_t length) {
+	irecovery_client_t client = read->client;
+	bool lines = irecovery_event_is_wanted(client, IRECOVERY_CONSOLE_LINE, true);
+
+	// A line callback can stop the console
+	for (size_t i = 0; i < length && read->client; i++) {
+		char c = (char)data[i];
+		if (c == '\0') continue; // iBoot pads its output with NULs
+
+		if (client->console_ring_used < client->console_ring_size) {
+			size_t tail = client->console_ring_head + client->console_ring_used;
+			if (tail >= client->console_ring_size) tail -= client->console_ring_size;
+			client->console_ring[tail] = c;
+			client->console_ring_used++;
+		} else if (client->console_ring) {
+			client->stats.console_dropped++;
+		}
+
+		if (!lines) continue;
+		if (c == '\n') {
+			irecovery_console_publish_line(read);
+		} else {
+			read->line[read->line_length++] = c;
+			if (read->line_length == IRECOVERY_CONSOLE_LINE_SIZE - 1) irecovery_console_publish_line(read);
+		}
+	}
+}
+
+static usb_error_t irecovery_console_read_complete(usb_endpoint_t endpoint, usb_transfer_status_t status, size_t transferred, usb_transfer_data_t* data) {
+	struct irecovery_console_read* read = (struct irecovery_console_read*)data;
+
+	if (read->client && status == USB_TRANSFER_COMPLETED) irecovery_console_append(read, read->data, transferred);
+
+	irecovery_client_t client = read->client;
+	if (client && (status != USB_TRANSFER_COMPLETED ||
+	    usb_ScheduleTransfer(endpoint, read->data, IRECOVERY_CONSOLE_READ_SIZE, irecovery_console_read_complete, read) != USB_SUCCESS)) {
+		IRECOVERY_LOG_WARN(client, "Console read failed, the console was stopped.\n");
+		client->console_read = NULL;
+		client = NULL;
+	}
+	if (!client) {
+		// Landed while stopped, so the next start queues a read of its own
+		if (read->parked_by) read->parked_by->console_parked = NULL;
+		free(read);
+	}
+
+	return USB_SUCCESS;
+}
+
+irecovery_error_t irecovery_console_start(irecovery_client_t client, char* buffer, size_t size) {
+	if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (buffer && size == 0) {
+		return IRECOVERY_E_DST_BUF_SIZE_ZERO;
+	} else if (!irecovery_client_has_console(client)) {
+		return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+	} else if (client->console_read) {
+		return IRECOVERY_E_CLIENT_ALREADY_ACTIVE;
+	}
+
+	client->console_ring      = buffer;
+	client->console_ring_size = buffer ? size : 0;
+	client->console_ring_head = 0;
+	client->console_ring_used = 0;
+
+	// A read that's still in flight from before irecovery_console_stop() is taken back, a second one would queue behind it
+	struct irecovery_console_read* read = client->console_parked;
+	if (read) {
+		client->console_parked = NULL;
+		read->parked_by   = NULL;
+		read->client      = client;
+		read->line_length = 0;
+		client->console_read = read;
+		return IRECOVERY_E_SUCCESS;
+	}
+
+	// Past recovery mode 2 the console is on alternate setting 1 of interface 1, like libirecovery switches to. usbdrvce sets it,
+	// so endpoint 0x81 is that setting's and not the one usb_SetConfiguration() left behind
+	if (client->mode > IRECOVERY_K_RECOVERY_MODE_2) {
+		irecovery_error_t error = irecovery_usb_set_interface(client, 1, 1);
+		if (error != IRECOVERY_E_SUCCESS) return error;
+	}
+
+	usb_endpoint_t endpoint = usb_GetDeviceEndpoint(client->handle, 0x81);
+	if (!endpoint) return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+
+	read = (struct irecovery_console_read*)malloc(sizeof(struct irecovery_console_read));
+	if (!read) return IRECOVERY_E_NO_MEMORY;
+	read->client      = client;
+	read->parked_by   = NULL;
+	read->line_length = 0;
+
+	if (usb_ScheduleTransfer(endpoint, read->data, IRECOVERY_CONSOLE_READ_SIZE, irecovery_console_read_complete, read) != USB_SUCCESS) {
+		free(read);
+		return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+	}
+	client->console_read = read;
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Stops delivering the console read in flight, but keeps it for irecovery_console_start() until it lands.
+// Another read can't be queued behind it on the same endpoint.
+static void irecovery_console_park(irecovery_client_t client) {
+    struct irecovery_console_read* read = client->console_read;
+    irecovery_console_detach(client);
+    if (!read) return;
+
+    read->parked_by = client;
+    client->console_parked = read;
+}
+
+irecovery_error_t irecovery_console_stop(irecovery_client_t client) {
+	if (!client) return IRECOVERY_E_BAD_PTR;
+
+	irecovery_console_park(client);
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_console_read(irecovery_client_t client, char* data, size_t size, size_t* length) {
+	if (length) *length = 0;
+	if (!client || !data || !length) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (size == 0) {
+		return IRECOVERY_E_DST_BUF_SIZE_ZERO;
+	}
+
+	// Let reads that already landed in
+	if (client->console_read) usb_HandleEvents();
+
+	size_t count = (client->console_ring_used < size) ? client->console_ring_used : size;
+	if (count == 0) return IRECOVERY_E_SUCCESS;
+
+	// At most two pieces, the ring may wrap around
+	size_t first = client->console_ring_size - client->console_ring_head;
+	if (first > count) first = count;
+	memcpy(data, client->console_ring + client->console_ring_head, first);
+	memcpy(data + first, client->console_ring, count - first);
+
+	client->console_ring_head += count;
+	if (client->console_ring_head >= client->console_ring_size) client->console_ring_head -= client->console_ring_size;
+	client->console_ring_used -= count;
+
+	*length = count;
+	return IRECOVERY_E_SUCCESS;
+}
+#endif
+
+static const unsigned char irecovery_dfu_xbuf[12] = {0xff, 0xff, 0xff, 0xff, 0xac, 0x05, 0x00, 0x01, 0x55, 0x46, 0x44, 0x10};
+
+static irecovery_error_t irecovery_upload_packet_buffer(irecovery_client_t client, struct irecovery_upload_slot* slot) {
+	if (!slot->packet) {
+		slot->packet = (unsigned char*)irecovery_scratch_alloc(client, client->upload.packet_size);
+		if (!slot->packet) return IRECOVERY_E_NO_MEMORY;
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Points data at `size` bytes of the image starting at `offset`, either in place or in the slot's packet buffer.
+static irecovery_error_t irecovery_upload_fetch(irecovery_client_t client, struct irecovery_upload_slot* slot, size_t offset, size_t size, unsigned char** data) {
+	const struct irecovery_source* source = &client->upload.source;
+
+	if (source->map) {
+		*data = (unsigned char*)source->map(source->user_data, offset, size);
+		if (*data) return IRECOVERY_E_SUCCESS;
+	}
+
+	irecovery_error_t error = irecovery_upload_packet_buffer(client, slot);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	if (source->read(source->user_data, offset, slot->packet, size) != (int)size) return IRECOVERY_E_USB_UPLOAD_FAILED;
+
+	*data = slot->packet;
+	return IRECOVERY_E_SUCCESS;
+}
+
+static usb_error_t irecovery_upload_transfer_complete(usb_endpoint_t endpoint, usb_transfer_status_t status, size_t transferred, usb_transfer_data_t* data) {
+	(void)endpoint;
+	struct irecovery_upload_slot* slot = (struct irecovery_upload_slot*)data;
+
+	slot->transfer_status = status;
+	slot->transferred     = transferred;
+	slot->pending         = false;
+
+	clock_t elapsed = clock() - slot->started;
+	if (slot->bulk) {
+		slot->stats->bulk_ticks += elapsed;
+	} else {
+		slot->stats->control_ticks += elapsed;
+	}
+	if (status != USB_TRANSFER_COMPLETED) slot->stats->failed_transfers++;
+
+	return USB_SUCCESS;
+}
+
+static irecovery_error_t irecovery_upload_schedule_control(irecovery_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, unsigned char* data, uint16_t w_length) {
+	struct irecovery_upload* upload = &client->upload;
+
+	upload->setup.bmRequestType = bm_request_type;
+	upload->setup.bRequest      = b_request;
+	upload->setup.wValue        = w_value;
+	upload->setup.wIndex        = 0;
+	upload->setup.wLength       = w_length;
+
+	struct irecovery_upload_slot* slot = IRECOVERY_UPLOAD_SLOT(upload, upload->index);
+	slot->pending     = true;
+	slot->transferred = 0;
+	slot->stats       = &client->stats;
+	slot->started     = clock();
+	slot->bulk        = false;
+	if (usb_ScheduleControlTransfer(usb_GetDeviceEndpoint(client->handle, 0), &upload->setup, data, irecovery_upload_transfer_complete, slot) != USB_SUCCESS) {
+		slot->pending = false;
+		return IRECOVERY_E_USB_UPLOAD_FAILED;
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+static irecovery_error_t irecovery_upload_schedule_bulk(irecovery_client_t client, struct irecovery_upload_slot* slot, unsigned char* data, size_t length) {
+	slot->pending     = true;
+	slot->transferred = 0;
+	slot->stats       = &client->stats;
+	slot->started     = clock();
+	slot->bulk        = true;
+	if (usb_ScheduleTransfer(usb_GetDeviceEndpoint(client->handle, 0x04), data, length, irecovery_upload_transfer_complete, slot) != USB_SUCCESS) {
+		slot->pending = false;
+		return IRECOVERY_E_USB_UPLOAD_FAILED;
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+static irecovery_error_t irecovery_upload_schedule_status(irecovery_client_t client, irecovery_upload_state_t state) {
+	client->upload.state = state;
+	client->stats.status_polls++;
+	memset(client->upload.reply, 0, sizeof(client->upload.reply));
+	return irecovery_upload_schedule_control(client, 0xA1, 3, 0, client->upload.reply, 6);
+}
+
+static void irecovery_upload_hash(irecovery_client_t client, const unsigned char* data, size_t size) {
+#ifndef IRECOVERY_NO_CRC32
+	clock_t started = clock();
+	client->upload.h1 = irecovery_crc32_update(client->upload.h1, data, size);
+	client->stats.crc_ticks += clock() - started;
+#else
+	// Only trusted uploads get this far, and they never hash
+	(void)client; (void)data; (void)size;
+#endif
+}
+
+/* https://github.com/libimobiledevice/libirecovery/blob/638056a593b3254d05f2960fab836bace10ff105/src/libirecovery.c#L3206 */
+// Appends the DFU trailer to the last `size` bytes of the image and sends them as one packet.
+static irecovery_error_t irecovery_upload_send_trailer(irecovery_client_t client, unsigned char* data, size_t size) {
+	struct irecovery_upload* upload = &client->upload;
+	struct irecovery_upload_slot* slot = IRECOVERY_UPLOAD_SLOT(upload, upload->index);
+
+	// The trailer goes right behind the last bytes of the image, in the packet buffer
+	irecovery_error_t error = irecovery_upload_packet_buffer(client, slot);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+	unsigned char* newbuf = slot->packet;
+	if (size > 0 && data != newbuf) memcpy(newbuf, data, size);
+
+	if (upload->trusted) {
+		memcpy(newbuf+size, client->manifest.trailer, 16);
+	} else {
+		irecovery_upload_hash(client, irecovery_dfu_xbuf, sizeof(irecovery_dfu_xbuf));
+		memcpy(newbuf+size, irecovery_dfu_xbuf, 12);
+		newbuf[size+12] = upload->h1 & 0xFF;
+		newbuf[size+13] = (upload->h1 >> 8) & 0xFF;
+		newbuf[size+14] = (upload->h1 >> 16) & 0xFF;
+		newbuf[size+15] = (upload->h1 >> 24) & 0xFF;
+	}
+
+	slot->data    = newbuf;
+	slot->size    = size + 16;
+	upload->state = IRECOVERY_UPLOAD_STATE_PACKET;
+	return irecovery_upload_schedule_control(client, 0x21, 1, upload->index, newbuf, slot->size);
+}
+
+// Reads the packet after the one that was just queued, so it's ready as soon as the device takes that one.
+// Only one packet is in flight at a time without pipelining, which is when this helps. When the client's arena has no room
+// for a spare buffer it's skipped, rather than costing a heap allocation per upload.
+static void irecovery_upload_prefetch(irecovery_client_t client) {
+	struct irecovery_upload* upload = &client->upload;
+	int i = upload->queued;
+	if (!upload->source.prefetch || upload->depth > 1 || i >= upload->packets) return;
+
+	if (!upload->prefetch) {
+		upload->prefetch = (unsigned char*)irecovery_scratch_alloc_spare(client, upload->packet_size);
+		if (!upload->prefetch) return;
+	}
+
+	size_t size = (i + 1) < upload->packets ? upload->packet_size : upload->last;
+	// A read that falls short is tried again, and reported, when the packet is sent
+	upload->prefetched = (upload->source.read(upload->source.user_data, i * upload->packet_size, upload->prefetch, size) == (int)size);
+}
+
+/* https://github.com/libimobiledevice/libirecovery/blob/638056a593b3254d05f2960fab836bace10ff105/src/libirecovery.c#L3206 */
+// Hands the next packet that isn't queued yet to usbdrvce.
+static irecovery_error_t irecovery_upload_send_packet(irecovery_client_t client) {
+	struct irecovery_upload* upload = &client->upload;
+	int i = upload->queued;
+	struct irecovery_upload_slot* slot = IRECOVERY_UPLOAD_SLOT(upload, i);
+	size_t size = (i + 1) < upload->packets ? upload->packet_size : upload->last;
+
+	unsigned char* data = NULL;
+	irecovery_error_t error = IRECOVERY_E_SUCCESS;
+	if (upload->prefetched) {
+		// The packet before this one is done with its buffer, so the two trade places
+		unsigned char* packet = slot->packet;
+		slot->packet       = upload->prefetch;
+		upload->prefetch   = packet;
+		upload->prefetched = false;
+		data = slot->packet;
+	} else {
+		error = irecovery_upload_fetch(client, slot, i * upload->packet_size, size, &data);
+		if (error != IRECOVERY_E_SUCCESS) return error;
+	}
+
+	slot->data = data;
+	slot->size = size;
+	upload->queued++;
+
+	// Use bulk transfer for recovery mode and control transfer for DFU and WTF mode
+	if (IRECOVERY_UPLOAD_IS_RECOVERY(upload)) {
+		upload->state = (upload->depth > 1) ? IRECOVERY_UPLOAD_STATE_PIPELINE : IRECOVERY_UPLOAD_STATE_PACKET;
+		error = irecovery_upload_schedule_bulk(client, slot, data, size);
+		if (error == IRECOVERY_E_SUCCESS) irecovery_upload_prefetch(client);
+		return error;
+	}
+
+	upload->retry = 0;
+	upload->state = IRECOVERY_UPLOAD_STATE_PACKET;
+
+	if (i + 1 == upload->packets) {
+		if (!upload->trusted) irecovery_upload_hash(client, data, size);
+		if (size + 16 > upload->packet_size) {
+			// The trailer goes in a packet of its own once this one is out
+			upload->state = IRECOVERY_UPLOAD_STATE_TRAILER;
+		} else {
+			return irecovery_upload_send_trailer(client, data, size);
+		}
+		return irecovery_upload_schedule_control(client, 0x21, 1, i, data, size);
+	}
+
+	// The packet stays untouched until it completes, so hash it while usbdrvce is sending it
+	error = irecovery_upload_schedule_control(client, 0x21, 1, i, data, size);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+	if (!upload->trusted) irecovery_upload_hash(client, data, size);
+	irecovery_upload_prefetch(client);
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Queues packets until every slot is busy or the whole image is queued.
+// Without pipelining there's one slot, so this sends exactly one packet.
+static irecovery_error_t irecovery_upload_fill(irecovery_client_t client) {
+	struct irecovery_upload* upload = &client->upload;
+
+	while (upload->queued < upload->packets && upload->queued - upload->index < upload->depth) {
+		irecovery_error_t error = irecovery_upload_send_packet(client);
+		if (error != IRECOVERY_E_SUCCESS) return error;
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+static bool irecovery_upload_idle(const struct irecovery_upload* upload) {
+	for (uint8_t i = 0; i < upload->depth; i++) {
+		if (upload->slots[i].pending) return false;
+	}
+
+	return true;
+}
+
+static irecovery_error_t irecovery_upload_report_progress(irecovery_client_t client, size_t size) {
+	struct irecovery_upload* upload = &client->upload;
+	(void)size; // Only the trace log uses it
+
+	if (irecovery_event_is_wanted(client, IRECOVERY_PROGRESS, true)) {
+		irecovery_event_t event = {
+			.size     = upload->count,
+			.data     = (char*)"Uploading",
+			.progress = 0.0,
+			.type     = IRECOVERY_PROGRESS,
+			.permille = irecovery_permille(upload->count, upload->length)
+		};
+		// Soft-float on the calculator, so only when someone reads it
+		if (irecovery_event_is_wanted(client, IRECOVERY_PROGRESS, false)) event.progress = ((double)upload->count / (double)upload->length) * 100.0;
+		clock_t started = clock();
+		int cancel = irecovery_event_publish(client, &event);
+		client->stats.callback_ticks += clock() - started;
+		if (cancel != 0) return IRECOVERY_E_UPLOAD_CANCELLED;
+	} else {
+		IRECOVERY_LOG_TRACE(client, "Sent %zu bytes - %zu of %zu\n", size, upload->count, upload->length);
+	}
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Whether or not the failed packet can be sent again on its own: none of it reached the device, and neither did any of the
+// packets queued behind it.
+static bool irecovery_upload_can_resend(const struct irecovery_upload* upload) {
+	for (int i = upload->index; i < upload->queued; i++) {
+		if (IRECOVERY_UPLOAD_SLOT(upload, i)->transferred != 0) return false;
+	}
+
+	return true;
+}
+
+// Called when a packet or its status poll failed. With IRECOVERY_SEND_OPT_RETRY and retries left, waits out the backoff in
+// IRECOVERY_UPLOAD_STATE_RETRY and returns IRECOVERY_E_SUCCESS, otherwise returns error.
+static irecovery_error_t irecovery_upload_retry(irecovery_client_t client, irecovery_error_t error) {
+	struct irecovery_upload* upload = &client->upload;
+	if (!(upload->options & IRECOVERY_SEND_OPT_RETRY) || upload->attempts >= IRECOVERY_UPLOAD_RETRIES) return error;
+
+	uint32_t delay = (uint32_t)IRECOVERY_UPLOAD_RETRY_DELAY << upload->attempts++;
+	IRECOVERY_LOG_WARN(client, "Packet %d failed (%s), retrying in %" PRIu32 " ms\n", upload->index, irecovery_strerror(error), delay);
+	client->stats.upload_retries++;
+	upload->wait_started = clock();
+	upload->wait         = irecovery_ms_to_clock(delay);
+	upload->state        = IRECOVERY_UPLOAD_STATE_RETRY;
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Starts the upload over from the first packet. The source and the packet buffers are kept.
+static irecovery_error_t irecovery_upload_restart(irecovery_client_t client) {
+	struct irecovery_upload* upload = &client->upload;
+
+	upload->index      = 0;
+	upload->queued     = 0;
+	upload->count      = 0;
+	upload->retry      = 0;
+	upload->prefetched = false;
+	upload->h1         = irecovery_crc32_init();
+	if (IRECOVERY_UPLOAD_IS_RECOVERY(upload)) {
+		upload->state = IRECOVERY_UPLOAD_STATE_INITIATE;
+		return irecovery_upload_schedule_control(client, 0x41, 0, 0, NULL, 0);
+	}
+
+	// Back to dfuIDLE, CLRSTATUS is only allowed in dfuERROR, so the status picks the request
+	return irecovery_upload_schedule_status(client, IRECOVERY_UPLOAD_STATE_RESTART);
+}
+
+// Schedules whatever closes the upload once every packet is in, if anything does. An empty image goes straight here.
+static irecovery_error_t irecovery_upload_finish(irecovery_client_t client) {
+	struct irecovery_upload* upload = &client->upload;
+	struct irecovery_upload_slot* slot = IRECOVERY_UPLOAD_SLOT(upload, upload->index);
+
+	if (IRECOVERY_UPLOAD_IS_RECOVERY(upload)) {
+		if (upload->length % 512 != 0) {
+			upload->state = IRECOVERY_UPLOAD_STATE_DONE;
+			return IRECOVERY_E_SUCCESS;
+		}
+
+		// send a ZLP
+		upload->state = IRECOVERY_UPLOAD_STATE_ZLP;
+		return irecovery_upload_schedule_bulk(client, slot, slot->data, 0);
+	}
+
+	if (!(upload->options & IRECOVERY_SEND_OPT_DFU_NOTIFY_FINISH)) {
+		upload->state = IRECOVERY_UPLOAD_STATE_DONE;
+		return IRECOVERY_E_SUCCESS;
+	}
+
+	upload->state = IRECOVERY_UPLOAD_STATE_FINISH;
+	return irecovery_upload_schedule_control(client, 0x21, 1, upload->packets, NULL, 0);
+}
+
+// Moves on to the next packet, or to whatever closes the upload after the last one.
+static irecovery_error_t irecovery_upload_next_packet(irecovery_client_t client) {
+	struct irecovery_upload* upload = &client->upload;
+	struct irecovery_upload_slot* slot = IRECOVERY_UPLOAD_SLOT(upload, upload->index);
+
+	upload->count += slot->size;
+	client->stats.bytes_sent += slot->size;
+	client->stats.packets_sent++;
+	irecovery_error_t error = irecovery_upload_report_progress(client, slot->size);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	if (++upload->index < upload->packets) return irecovery_upload_fill(client);
+
+	return irecovery_upload_finish(client);
+}
+
+// Schedules the DFU request b_request, CLRSTATUS or ABORT, and fails the upload with error once it's sent.
+static irecovery_error_t irecovery_upload_close(irecovery_client_t client, uint8_t b_request, irecovery_error_t error) {
+	client->upload.result = error;
+	client->upload.state  = IRECOVERY_UPLOAD_STATE_CLOSE;
+	if (irecovery_upload_schedule_control(client, 0x21, b_request, 0, NULL, 0) != IRECOVERY_E_SUCCESS) return error;
+
+	return IRECOVERY_E_UPLOAD_IN_PROGRESS;
+}
+
+// Handles the transfer that just completed and schedules the next one.
+// Returns IRECOVERY_E_UPLOAD_IN_PROGRESS while there's more to do.
+static irecovery_error_t irecovery_upload_advance(irecovery_client_t client) {
+	struct irecovery_upload* upload = &client->upload;
+	irecovery_error_t error = IRECOVERY_E_SUCCESS;
+
+	if (upload->state == IRECOVERY_UPLOAD_STATE_CLOSE) {
+		// The upload failed already, whether or not the device took the request
+		return upload->result;
+	} else if (upload->cancelled) {
+		if (!IRECOVERY_UPLOAD_IS_RECOVERY(upload) && irecovery_client_check(client, false)) {
+			// Bring the device back to dfuIDLE
+			return irecovery_upload_close(client, 6, IRECOVERY_E_UPLOAD_CANCELLED);
+		}
+		return IRECOVERY_E_UPLOAD_CANCELLED;
+	} else if (!irecovery_client_check(client, false)) {
+		return IRECOVERY_E_NO_DEVICE;
+	}
+
+	struct irecovery_upload_slot* slot = IRECOVERY_UPLOAD_SLOT(upload, upload->index);
+	bool completed = (slot->transfer_status == USB_TRANSFER_COMPLETED);
+
+	switch (upload->state) {
+		case IRECOVERY_UPLOAD_STATE_INITIATE: {
+			if (!completed) return IRECOVERY_E_USB_UPLOAD_FAILED;
+			if (!IRECOVERY_UPLOAD_IS_RECOVERY(upload)) {
+				if (slot->transferred != 1) return IRECOVERY_E_USB_UPLOAD_FAILED;
+				switch (upload->reply[0]) {
+					case 2:
+						// DFU IDLE
+						break;
+					case 10:
+						IRECOVERY_LOG_WARN(client, "DFU ERROR, issuing CLRSTATUS\n");
+						return irecovery_upload_close(client, 4, IRECOVERY_E_USB_UPLOAD_FAILED);
+					default:
+						IRECOVERY_LOG_WARN(client, "Unexpected state %d, issuing ABORT\n", upload->reply[0]);
+						return irecovery_upload_close(client, 6, IRECOVERY_E_USB_UPLOAD_FAILED);
+				}
+			}
+			// With nothing to send, no packet would ever move the upload on
+			error = (upload->packets > 0) ? irecovery_upload_fill(client) : irecovery_upload_finish(client);
+			break;
+		}
+
+#ifndef IRECOVERY_NO_DFU
+		case IRECOVERY_UPLOAD_STATE_TRAILER: {
+			if (!completed || slot->transferred != slot->size) {
+				error = irecovery_upload_retry(client, IRECOVERY_E_USB_UPLOAD_FAILED);
+				break;
+			}
+			upload->count += slot->size;
+			client->stats.bytes_sent += slot->size;
+			client->stats.packets_sent++;
+			error = irecovery_upload_send_trailer(client, NULL, 0);
+			break;
+		}
+#endif
+
+		case IRECOVERY_UPLOAD_STATE_PIPELINE:
+		case IRECOVERY_UPLOAD_STATE_PACKET: {
+			if (!completed || slot->transferred != slot->size) {
+				error = irecovery_upload_retry(client, IRECOVERY_E_USB_UPLOAD_FAILED);
+				break;
+			}
+			if (IRECOVERY_UPLOAD_IS_RECOVERY(upload)) {
+				error = irecovery_upload_next_packet(client);
+			} else {
+				error = irecovery_upload_schedule_status(client, IRECOVERY_UPLOAD_STATE_STATUS);
+			}
+			break;
+		}
+
+#ifndef IRECOVERY_NO_DFU
+		case IRECOVERY_UPLOAD_STATE_STATUS: {
+			bool valid = completed && slot->transferred == 6;
+			// Only the first poll after a packet is allowed to fail outright
+			if (!valid && upload->retry == 0) {
+				error = irecovery_upload_retry(client, IRECOVERY_E_INVALID_USB_STATUS);
+				break;
+			}
+
+			struct irecovery_dfu_status status = { 0 };
+			if (valid) irecovery_parse_dfu_status(upload->reply, &status);
+
+			if (valid && status.b_state == 5) {
+				// dfuDNLOAD-IDLE
+				error = irecovery_upload_next_packet(client);
+				break;
+			} else if (valid && status.b_state == 10) {
+				// dfuERROR, waiting won't help
+				IRECOVERY_LOG_ERROR(client, "DFU ERROR (bStatus %" PRIu8 ") after block %d\n", status.b_status, upload->index);
+				error = irecovery_upload_retry(client, IRECOVERY_E_USB_UPLOAD_FAILED);
+				break;
+			}
+
+			clock_t now = clock();
+			client->stats.status_retries++;
+			if (upload->retry++ == 0) {
+				upload->busy_started = now;
+			} else if (now - upload->busy_started >= irecovery_ms_to_clock(IRECOVERY_DFU_STATUS_TIMEOUT)) {
+				return IRECOVERY_E_USB_UPLOAD_FAILED;
+			}
+
+			// Poll again exactly when the device said it would be ready
+			upload->wait_started = now;
+			upload->wait         = irecovery_ms_to_clock(status.bw_poll_timeout);
+			upload->after        = IRECOVERY_UPLOAD_STATE_STATUS;
+			upload->state        = IRECOVERY_UPLOAD_STATE_STATUS_DELAY;
 			break;
+		}
+
+		case IRECOVERY_UPLOAD_STATE_STATUS_DELAY: {
+			if (clock() - upload->wait_started < upload->wait) break;
+			error = irecovery_upload_schedule_status(client, upload->after);
+			break;
+		}
+#endif
+
+		case IRECOVERY_UPLOAD_STATE_RETRY: {
+			// Pipelined packets behind the failed one have to land first
+			if (clock() - upload->wait_started < upload->wait || !irecovery_upload_idle(upload)) break;
+			if (IRECOVERY_UPLOAD_IS_RECOVERY(upload) && irecovery_upload_can_resend(upload)) {
+				upload->queued     = upload->index;
+				upload->prefetched = false;
+				error = irecovery_upload_fill(client);
+			} else {
+				// DFU blocks are numbered from the start of the image, and bytes the device took can't be taken back
+				error = irecovery_upload_restart(client);
+			}
+			break;
+		}
+
+#ifndef IRECOVERY_NO_DFU
+		case IRECOVERY_UPLOAD_STATE_RESTART: {
+			// Without a status the device gets an ABORT, whatever it's doing
+			struct irecovery_dfu_status status = { 0 };
+			if (completed && slot->transferred == 6) irecovery_parse_dfu_status(upload->reply, &status);
+			bool dfu_error = (status.b_state == 10);
+			upload->state = IRECOVERY_UPLOAD_STATE_RESTART_CLEAR;
+			error = irecovery_upload_schedule_control(client, 0x21, dfu_error ? 4 : 6, 0, NULL, 0);
+			break;
+		}
+
+		case IRECOVERY_UPLOAD_STATE_RESTART_CLEAR: {
+			// Whether or not it went through, GETSTATE tells if the device is in dfuIDLE
+			upload->state = IRECOVERY_UPLOAD_STATE_INITIATE;
+			error = irecovery_upload_schedule_control(client, 0xA1, 5, 0, upload->reply, 1);
+			break;
+		}
+#endif
+
+#ifndef IRECOVERY_NO_RECOVERY
+		case IRECOVERY_UPLOAD_STATE_ZLP:
+			return IRECOVERY_E_SUCCESS;
+#endif
+
+#ifndef IRECOVERY_NO_DFU
+		case IRECOVERY_UPLOAD_STATE_FINISH: {
+			upload->retry = 0;
+			error = irecovery_upload_schedule_status(client, IRECOVERY_UPLOAD_STATE_FINISH_STATUS);
+			break;
+		}
+
+		case IRECOVERY_UPLOAD_STATE_FINISH_STATUS: {
+			if (!completed || slot->transferred != 6) return IRECOVERY_E_INVALID_USB_STATUS;
+			if (++upload->retry < 2) {
+				struct irecovery_dfu_status status;
+				irecovery_parse_dfu_status(upload->reply, &status);
+				upload->wait_started = clock();
+				upload->wait         = irecovery_ms_to_clock(status.bw_poll_timeout);
+				upload->after        = IRECOVERY_UPLOAD_STATE_FINISH_STATUS;
+				upload->state        = IRECOVERY_UPLOAD_STATE_STATUS_DELAY;
+			} else if ((upload->options & IRECOVERY_SEND_OPT_DFU_FORCE_ZLP)) {
+				// we send a pseudo ZLP here just in case
+				upload->state = IRECOVERY_UPLOAD_STATE_FINISH_ZLP;
+				error = irecovery_upload_schedule_control(client, 0x21, 0, 0, NULL, 0);
+			} else {
+				usb_ResetDevice(client->handle);
+				return IRECOVERY_E_SUCCESS;
+			}
+			break;
+		}
+
+		case IRECOVERY_UPLOAD_STATE_FINISH_ZLP: {
+			usb_ResetDevice(client->handle);
+			return IRECOVERY_E_SUCCESS;
+		}
+#endif
+
+		default:
+			return IRECOVERY_E_NO_UPLOAD;
+	}
+
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	return (upload->state == IRECOVERY_UPLOAD_STATE_DONE) ? IRECOVERY_E_SUCCESS : IRECOVERY_E_UPLOAD_IN_PROGRESS;
+}
+
+// Releases everything the upload holds and reports how it went.
+// Lets go of a source that never made it into an upload, or that an upload is done with.
+static void irecovery_source_release(irecovery_client_t client, const struct irecovery_source* source) {
+	irecovery_scratch_free(client, source->primed);
+	if (source->release) source->release(client, source->user_data);
+}
+
+static void irecovery_upload_end(irecovery_client_t client, irecovery_error_t error) {
+	struct irecovery_upload* upload = &client->upload;
+
+	irecovery_scratch_free(client, upload->prefetch);
+	for (uint8_t i = IRECOVERY_PIPELINE_DEPTH; i-- > 0;) {
+		irecovery_scratch_free(client, upload->slots[i].packet);
+	}
+	irecovery_source_release(client, &upload->source);
+
+	size_t count  = upload->count;
+	size_t length = upload->length;
+
+	// Only the packets counted so far may have reached the device, or IRECOVERY_SEND_OPT_RESUME would send some of them twice
+	client->checkpoint_ecid = 0;
+	if (error != IRECOVERY_E_SUCCESS && IRECOVERY_UPLOAD_IS_RECOVERY(upload) && count > 0 && count < length && irecovery_upload_can_resend(upload)) {
+		client->checkpoint_ecid   = client->last_ecid;
+		client->checkpoint_length = length;
+		client->checkpoint_offset = count;
+	}
+	memset(upload, 0, sizeof(struct irecovery_upload));
+
+	// Everything logged while packets were in flight goes out now
+	client->log_deferred = false;
+	irecovery_log_flush(client);
+
+	irecovery_event_t event = {
+		.size     = count,
+		.data     = irecovery_strerror(error),
+		.progress = length ? ((double)count / (double)length) * 100.0 : 100.0,
+		.type     = IRECOVERY_UPLOAD_FINISHED,
+		.error    = error,
+		.permille = irecovery_permille(count, length)
+	};
+	irecovery_event_publish(client, &event);
+}
+
+// Largest DNLOAD block the device takes. The trailer has to fit in a block of its own, and blocks are capped like in recovery mode.
+// The trailer's packet buffer is a whole block, so blocks above 0x800 bytes need an arena bigger than IRECOVERY_SCRATCH_SIZE.
+static size_t irecovery_dfu_packet_size(irecovery_client_t client) {
+	size_t size = client->dfu_functional.w_transfer_size;
+	if (size < 16) return 0x800;
+	if (size > 0x8000) return 0x8000;
+	return size;
+}
+
+static size_t irecovery_upload_packet_size(irecovery_client_t client) {
+	bool recovery_mode = (client->mode != IRECOVERY_K_DFU_MODE && client->mode != IRECOVERY_K_WTF_MODE);
+	return recovery_mode ? 0x8000 : irecovery_dfu_packet_size(client);
+}
+
+static irecovery_error_t irecovery_upload_begin(irecovery_client_t client, const struct irecovery_source* source, size_t length, unsigned int options) {
+	struct irecovery_upload* upload = &client->upload;
+	if (upload->state != IRECOVERY_UPLOAD_STATE_IDLE) {
+		irecovery_source_release(client, source);
+		return IRECOVERY_E_UPLOAD_IN_PROGRESS;
+	}
+
+	bool recovery_mode = (client->mode != IRECOVERY_K_DFU_MODE && client->mode != IRECOVERY_K_WTF_MODE);
+#if defined(IRECOVERY_NO_DFU) || defined(IRECOVERY_NO_RECOVERY)
+	if (recovery_mode != IRECOVERY_UPLOAD_IS_RECOVERY(upload)) {
+		IRECOVERY_LOG_ERROR(client, "This build can't upload in %s mode.\n", irecovery_mode_to_str(client->mode));
+		irecovery_source_release(client, source);
+		return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+	}
+#endif
+
+	bool trusted = !recovery_mode && (options & IRECOVERY_SEND_OPT_DFU_MANIFEST);
+	if (trusted && (!client->has_manifest || client->manifest.length != length)) {
+		IRECOVERY_LOG_ERROR(client, "Manifest doesn't describe this %zu byte image.\n", length);
+		irecovery_source_release(client, source);
+		return IRECOVERY_E_BAD_MANIFEST;
+	}
+#ifdef IRECOVERY_NO_CRC32
+	// Without the CRC the DFU trailer has to come from a manifest
+	if (!recovery_mode && !trusted) {
+		IRECOVERY_LOG_ERROR(client, "Built without CRC32, DFU uploads need IRECOVERY_SEND_OPT_DFU_MANIFEST.\n");
+		irecovery_source_release(client, source);
+		return IRECOVERY_E_BAD_MANIFEST;
+	}
+#endif
+
+	bool resume = recovery_mode && (options & IRECOVERY_SEND_OPT_RESUME) && client->checkpoint_ecid != 0 &&
+	              client->checkpoint_ecid == client->last_ecid && client->checkpoint_length == length;
+
+	memset(upload, 0, sizeof(struct irecovery_upload));
+	for (size_t i = 0; i < IRECOVERY_EVENT_SUBSCRIBERS; i++) {
+		client->subscribers[i].delivered = false;
+	}
+	upload->source        = *source;
+	upload->length        = length;
+	upload->options       = options;
+	upload->recovery_mode = recovery_mode;
+	upload->trusted       = trusted;
+	upload->packet_size   = irecovery_upload_packet_size(client);
+	upload->h1            = irecovery_crc32_init();
+	upload->depth         = 1;
+	client->log_deferred  = (client->log_ring != NULL);
+
+	upload->last    = length % upload->packet_size;
+	upload->packets = length / upload->packet_size;
+	if (upload->last != 0) {
+		upload->packets++;
+	} else {
+		upload->last = upload->packet_size;
+	}
+
+	// Bulk transfers can be queued back to back on endpoint 0x04, DFU needs every block acknowledged first
+	if (IRECOVERY_UPLOAD_IS_RECOVERY(upload) && (options & IRECOVERY_SEND_OPT_RECOVERY_PIPELINE) && upload->packets > 1) {
+		upload->depth = IRECOVERY_PIPELINE_DEPTH;
+	}
+
+	// A first packet read ahead of time is as good as a prefetched one
+	if (source->primed) {
+		size_t first = (upload->packets > 1) ? upload->packet_size : upload->last;
+		if (!resume && upload->depth == 1 && source->prefetch && source->primed_size == first) {
+			upload->prefetch   = source->primed;
+			upload->prefetched = true;
+		} else {
+			irecovery_scratch_free(client, source->primed);
+		}
+		upload->source.primed = NULL;
+	}
+
+	// initiate transfer
+	irecovery_error_t error;
+	upload->state = IRECOVERY_UPLOAD_STATE_INITIATE;
+	if (resume) {
+		// Initiating again would throw away what the device already has
+		IRECOVERY_LOG_INFO(client, "Resuming at byte %zu of %zu.\n", client->checkpoint_offset, length);
+		upload->index  = client->checkpoint_offset / upload->packet_size;
+		upload->queued = upload->index;
+		upload->count  = client->checkpoint_offset;
+		error = irecovery_upload_fill(client);
+	} else if (IRECOVERY_UPLOAD_IS_RECOVERY(upload)) {
+		error = irecovery_upload_schedule_control(client, 0x41, 0, 0, NULL, 0);
+	} else {
+		error = irecovery_upload_schedule_control(client, 0xA1, 5, 0, upload->reply, 1);
+	}
+
+	if (error != IRECOVERY_E_SUCCESS) irecovery_upload_end(client, error);
+
+	return error;
+}
+
+irecovery_error_t irecovery_send_step(irecovery_client_t client) {
+	if (!client) return IRECOVERY_E_BAD_PTR;
+
+	struct irecovery_upload* upload = &client->upload;
+	if (upload->state == IRECOVERY_UPLOAD_STATE_IDLE) return IRECOVERY_E_NO_UPLOAD;
+
+	usb_HandleEvents();
+
+	// A transfer that's in flight when the device goes away is never coming back
+	bool usable = irecovery_client_check(client, false);
+	if (usable) {
+		if (upload->state == IRECOVERY_UPLOAD_STATE_DRAIN) {
+			if (!irecovery_upload_idle(upload)) return IRECOVERY_E_UPLOAD_IN_PROGRESS;
+		} else if (IRECOVERY_UPLOAD_SLOT(upload, upload->index)->pending) {
+			return IRECOVERY_E_UPLOAD_IN_PROGRESS;
+		}
+	}
+
+	irecovery_error_t error = (upload->state == IRECOVERY_UPLOAD_STATE_DRAIN) ? upload->result : irecovery_upload_advance(client);
+	if (error == IRECOVERY_E_UPLOAD_IN_PROGRESS) return error;
+
+	// Queued packets still point into the upload, let them land before it goes away
+	if (usable && !irecovery_upload_idle(upload)) {
+		upload->result = error;
+		upload->state  = IRECOVERY_UPLOAD_STATE_DRAIN;
+		return IRECOVERY_E_UPLOAD_IN_PROGRESS;
+	}
+
+	irecovery_upload_end(client, error);
+	return error;
+}
+
+irecovery_error_t irecovery_get_upload_checkpoint(irecovery_client_t client, size_t* offset, size_t* length) {
+	if (!client || !offset || !length) return IRECOVERY_E_BAD_PTR;
+	if (client->checkpoint_ecid == 0) return IRECOVERY_E_NO_UPLOAD;
+
+	*offset = client->checkpoint_offset;
+	*length = client->checkpoint_length;
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_send_cancel(irecovery_client_t client) {
+	if (!client) return IRECOVERY_E_BAD_PTR;
+	if (client->upload.state == IRECOVERY_UPLOAD_STATE_IDLE) return IRECOVERY_E_NO_UPLOAD;
+
+	// The upload ends on the next irecovery_send_step(), once nothing is in flight
+	client->upload.cancelled = true;
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+// Runs the upload in progress to completion.
+static irecovery_error_t irecovery_send_wait(irecovery_client_t client) {
+	irecovery_error_t error;
+
+	while ((error = irecovery_send_step(client)) == IRECOVERY_E_UPLOAD_IN_PROGRESS) {
+		if (!irecovery_upload_idle(&client->upload)) usb_WaitForEvents();
+	}
+
+	return error;
+}
+
+static const unsigned char* irecovery_buffer_source_map(void* user_data, size_t offset, size_t length) {
+	(void)length;
+	return (const unsigned char*)user_data + offset;
+}
+
+static int irecovery_buffer_source_read(void* user_data, size_t offset, unsigned char* dst, size_t length) {
+	memcpy(dst, (const unsigned char*)user_data + offset, length);
+	return length;
+}
+
+irecovery_error_t irecovery_send_buffer_begin(irecovery_client_t client, unsigned char* buffer, size_t length, unsigned int options) {
+	if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (!buffer) {
+		return IRECOVERY_E_BAD_PTR;
+	}
+
+	struct irecovery_source source = {
+		.read      = irecovery_buffer_source_read,
+		.map       = irecovery_buffer_source_map,
+		.release   = NULL,
+		.user_data = buffer
+	};
+
+	return irecovery_upload_begin(client, &source, length, options);
+}
+
+irecovery_error_t irecovery_send_buffer(irecovery_client_t client, unsigned char* buffer, size_t length, unsigned int options) {
+	irecovery_error_t error = irecovery_send_buffer_begin(client, buffer, length, options);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	return irecovery_send_wait(client);
+}
+
+irecovery_error_t irecovery_send_stream_begin(irecovery_client_t client, irecovery_stream_read_cb_t read_cb, void* user_data, size_t length, unsigned int options) {
+	if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (!read_cb) {
+		return IRECOVERY_E_BAD_PTR;
+	}
+
+	struct irecovery_source source = {
+		.read      = read_cb,
+		.map       = NULL,
+		.release   = NULL,
+		.user_data = user_data
+	};
+
+	return irecovery_upload_begin(client, &source, length, options);
+}
+
+irecovery_error_t irecovery_send_stream(irecovery_client_t client, irecovery_stream_read_cb_t read_cb, void* user_data, size_t length, unsigned int options) {
+	irecovery_error_t error = irecovery_send_stream_begin(client, read_cb, user_data, length, options);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	return irecovery_send_wait(client);
+}
+
+// One AppVar's data, as laid out in flash (or RAM if it isn't archived).
+struct irecovery_appvar_segment {
+	const unsigned char* data;
+	size_t size;
+	size_t offset; // Offset of this segment within the whole image
+};
+
+struct irecovery_appvar_source {
+	uint8_t count;
+	uint8_t cursor; // Segment the last request started in, uploads are sequential
+	struct irecovery_appvar_segment segments[];
+};
+
+static struct irecovery_appvar_segment* irecovery_appvar_source_seek(struct irecovery_appvar_source* appvars, size_t offset) {
+	if (appvars->segments[appvars->cursor].offset > offset) appvars->cursor = 0;
+
+	while (appvars->cursor + 1 < appvars->count && appvars->segments[appvars->cursor].offset + appvars->segments[appvars->cursor].size <= offset) {
+		appvars->cursor++;
+	}
+
+	return &appvars->segments[appvars->cursor];
+}
+
+static const unsigned char* irecovery_appvar_source_map(void* user_data, size_t offset, size_t length) {
+	struct irecovery_appvar_segment* segment = irecovery_appvar_source_seek((struct irecovery_appvar_source*)user_data, offset);
+
+	// Packets that straddle two AppVars have to be stitched together by irecovery_appvar_source_read()
+	if (offset + length > segment->offset + segment->size) return NULL;
+
+	return segment->data + (offset - segment->offset);
+}
+
+static int irecovery_appvar_source_read(void* user_data, size_t offset, unsigned char* dst, size_t length) {
+	struct irecovery_appvar_source* appvars = (struct irecovery_appvar_source*)user_data;
+	size_t copied = 0;
+
+	while (copied < length) {
+		struct irecovery_appvar_segment* segment = irecovery_appvar_source_seek(appvars, offset + copied);
+		size_t segment_offset = offset + copied - segment->offset;
+		if (segment_offset >= segment->size) break;
+
+		size_t chunk = segment->size - segment_offset;
+		if (chunk > length - copied) chunk = length - copied;
+
+		memcpy(dst + copied, segment->data + segment_offset, chunk);
+		copied += chunk;
+	}
+
+	return copied;
+}
+
+static void irecovery_appvar_source_release(irecovery_client_t client, void* user_data) {
+	irecovery_scratch_free(client, user_data);
+}
+
+// Resolves the AppVars into a source for irecovery_upload_begin(). Doesn't need the device.
+static irecovery_error_t irecovery_appvar_source_open(irecovery_client_t client, const char* const* names, uint8_t count, struct irecovery_source* source, size_t* length) {
+	size_t appvars_size = sizeof(struct irecovery_appvar_source) + count * sizeof(struct irecovery_appvar_segment);
+	struct irecovery_appvar_source* appvars = (struct irecovery_appvar_source*)irecovery_scratch_alloc(client, appvars_size);
+	if (!appvars) return IRECOVERY_E_NO_MEMORY;
+	memset(appvars, 0, appvars_size);
+	appvars->count = count;
+
+	// Resolve every AppVar to its data pointer up front. The pointers stay valid as long as the VAT doesn't change,
+	// which nothing does during an upload, so the handles can be closed right away.
+	*length = 0;
+	for (uint8_t i = 0; i < count; i++) {
+		uint8_t handle = names[i] ? ti_Open(names[i], "r") : 0;
+		if (!handle) {
+			irecovery_scratch_free(client, appvars);
+			IRECOVERY_LOG_ERROR(client, "Couldn't open AppVar %s.\n", names[i] ? names[i] : "(null)");
+			return IRECOVERY_E_APPVAR_NOT_FOUND;
+		}
+
+		appvars->segments[i].data   = (const unsigned char*)ti_GetDataPtr(handle);
+		appvars->segments[i].size   = ti_GetSize(handle);
+		appvars->segments[i].offset = *length;
+		*length += appvars->segments[i].size;
+		ti_Close(handle);
+	}
+
+	struct irecovery_source appvar_source = {
+		.read      = irecovery_appvar_source_read,
+		.map       = irecovery_appvar_source_map,
+		.release   = irecovery_appvar_source_release,
+		.user_data = appvars
+	};
+	*source = appvar_source;
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_send_appvars_begin(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options) {
+	if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (!names || count == 0) {
+		return IRECOVERY_E_BAD_PTR;
+	}
+
+	struct irecovery_source source;
+	size_t length;
+	irecovery_error_t error = irecovery_appvar_source_open(client, names, count, &source, &length);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	return irecovery_upload_begin(client, &source, length, options);
+}
+
+irecovery_error_t irecovery_send_appvars(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options) {
+	irecovery_error_t error = irecovery_send_appvars_begin(client, names, count, options);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	return irecovery_send_wait(client);
+}
+
+static uint32_t irecovery_read_le32(const unsigned char* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md */
+// Decodes one LZ4 block into dst, which has room for dst_size bytes. Matches only reach back into the same block.
+// Returns the number of bytes decoded, 0 if the block is malformed or doesn't fit.
+static size_t irecovery_lz4_decode(const unsigned char* src, size_t src_size, unsigned char* dst, size_t dst_size) {
+	const unsigned char* ip = src;
+	const unsigned char* iend = src + src_size;
+	unsigned char* op = dst;
+	unsigned char* oend = dst + dst_size;
+
+	while (ip < iend) {
+		unsigned char token = *ip++;
+
+		size_t literals = token >> 4;
+		if (literals == 15) {
+			unsigned char byte;
+			do {
+				if (ip >= iend) return 0;
+				byte = *ip++;
+				literals += byte;
+			} while (byte == 255);
+		}
+		if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) return 0;
+		memcpy(op, ip, literals);
+		ip += literals;
+		op += literals;
+
+		// The last sequence is literals only
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return 0;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - dst)) return 0;
+
+		size_t match = token & 15;
+		if (match == 15) {
+			unsigned char byte;
+			do {
+				if (ip >= iend) return 0;
+				byte = *ip++;
+				match += byte;
+			} while (byte == 255);
+		}
+		match += 4;
+		if (match > (size_t)(oend - op)) return 0;
+
+		// Byte by byte, matches can overlap what they produce
+		const unsigned char* from = op - offset;
+		while (match--) *op++ = *from++;
+	}
+
+	return op - dst;
+}
+
+// Image compressed by tools/mkcompressed.py, resolved to its AppVars' data.
+// Blocks are decoded straight into the packet buffer, except when a packet doesn't start and end on block boundaries.
+struct irecovery_compressed_source {
+	size_t length;                // Decompressed image length
+	size_t block_size;            // Decompressed size of every block but the last
+	unsigned char* staging;       // One decoded block, only allocated when packets and blocks don't line up
+	size_t staged;                // Index of the block in staging plus one, 0 if there's none
+	size_t block;                 // Index of the block at the cursor
+	uint8_t segment;              // Cursor: AppVar and offset of that block's header
+	size_t position;
+	uint8_t count;
+	struct irecovery_appvar_segment segments[];
+};
 
-		default:
-			return IRECOVERY_E_UNKNOWN_EVENT_TYPE;
+// Moves the cursor to the given block. Offsets only go backwards when an upload starts over.
+static bool irecovery_compressed_source_seek(struct irecovery_compressed_source* compressed, size_t block) {
+	if (block < compressed->block) {
+		compressed->block    = 0;
+		compressed->segment  = 0;
+		compressed->position = IRECOVERY_COMPRESSED_HEADER_SIZE;
 	}
 
-	return IRECOVERY_E_SUCCESS;
-}
+	while (compressed->block < block) {
+		const struct irecovery_appvar_segment* segment = &compressed->segments[compressed->segment];
+		if (compressed->position == segment->size) {
+			// Blocks never straddle two AppVars
+			if (++compressed->segment == compressed->count) return false;
+			compressed->position = 0;
+			continue;
+		}
+		if (segment->size - compressed->position < 2) return false;
 
-/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3108 */
-static irecovery_error_t irecovery_send_command_raw(irecovery_client_t client, const char* command, uint8_t b_request) {
-	if (!irecovery_client_is_usable(client, true)) {
-		return IRECOVERY_E_NO_DEVICE;
-	} else if (!command) {
-		return IRECOVERY_E_BAD_PTR;
-	} else if (client->mode != IRECOVERY_K_RECOVERY_MODE_1 && client->mode != IRECOVERY_K_RECOVERY_MODE_2 && client->mode != IRECOVERY_K_RECOVERY_MODE_3 && client->mode != IRECOVERY_K_RECOVERY_MODE_4) {
-		return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+		size_t size = segment->data[compressed->position] | (segment->data[compressed->position + 1] << 8);
+		if (size == 0) size = compressed->block_size; // Stored as is. Only the last block is shorter, and it's never skipped
+		if (segment->size - compressed->position - 2 < size) return false;
+		compressed->position += 2 + size;
+		compressed->block++;
 	}
-	
-	size_t length = strlen(command);
-	if (length >= 256) return IRECOVERY_E_COMMAND_TOO_LONG;
 
-	if (length > 0) {
-		int ret = irecovery_usb_control_transfer(client, 0x40, b_request, 0, 0, (unsigned char*)command, length + 1);
-		if (ret < 0) return ret;
+	return true;
+}
+
+// Decodes the block at the cursor into dst, which has room for the whole block, and moves the cursor past it.
+static size_t irecovery_compressed_source_decode(struct irecovery_compressed_source* compressed, unsigned char* dst) {
+	size_t expected = compressed->length - compressed->block * compressed->block_size;
+	if (expected > compressed->block_size) expected = compressed->block_size;
+
+	const struct irecovery_appvar_segment* segment = &compressed->segments[compressed->segment];
+	if (compressed->position == segment->size && compressed->segment + 1 < compressed->count) {
+		segment = &compressed->segments[++compressed->segment];
+		compressed->position = 0;
+	}
+	if (segment->size - compressed->position < 2) return 0;
+
+	const unsigned char* header = segment->data + compressed->position;
+	size_t size = header[0] | (header[1] << 8);
+	size_t decoded;
+	if (size == 0) {
+		// Stored as is
+		size    = expected;
+		decoded = (segment->size - compressed->position - 2 >= size) ? size : 0;
+		if (decoded) memcpy(dst, header + 2, size);
 	} else {
-		return IRECOVERY_E_NO_COMMAND;
+		decoded = (segment->size - compressed->position - 2 >= size) ? irecovery_lz4_decode(header + 2, size, dst, expected) : 0;
+	}
+	if (decoded != expected) return 0;
+
+	compressed->position += 2 + size;
+	compressed->block++;
+	return decoded;
+}
+
+static int irecovery_compressed_source_read(void* user_data, size_t offset, unsigned char* dst, size_t length) {
+	struct irecovery_compressed_source* compressed = (struct irecovery_compressed_source*)user_data;
+	size_t copied = 0;
+
+	while (copied < length) {
+		size_t block = (offset + copied) / compressed->block_size;
+		size_t block_offset = (offset + copied) % compressed->block_size;
+		size_t block_length = compressed->length - block * compressed->block_size;
+		if (block_length > compressed->block_size) block_length = compressed->block_size;
+		size_t chunk = block_length - block_offset;
+		if (chunk > length - copied) chunk = length - copied;
+
+		if (block_offset == 0 && chunk == block_length) {
+			// The whole block lands in the packet
+			if (!irecovery_compressed_source_seek(compressed, block) || irecovery_compressed_source_decode(compressed, dst + copied) == 0) break;
+		} else {
+			if (!compressed->staging) break;
+			if (compressed->staged != block + 1) {
+				compressed->staged = 0;
+				if (!irecovery_compressed_source_seek(compressed, block) || irecovery_compressed_source_decode(compressed, compressed->staging) == 0) break;
+				compressed->staged = block + 1;
+			}
+			memcpy(dst + copied, compressed->staging + block_offset, chunk);
+		}
+		copied += chunk;
+	}
+
+	return copied;
+}
+
+static void irecovery_compressed_source_release(irecovery_client_t client, void* user_data) {
+	struct irecovery_compressed_source* compressed = (struct irecovery_compressed_source*)user_data;
+
+	// Staging can come from the heap when the arena is full, so it's freed on its own
+	irecovery_scratch_free(client, compressed->staging);
+	irecovery_scratch_free(client, compressed);
+}
+
+// Checks the compressed image's header and makes a source for irecovery_upload_begin() out of it, for packets of packet_size.
+// Doesn't need the device.
+static irecovery_error_t irecovery_compressed_source_open(irecovery_client_t client, const char* const* names, uint8_t count, size_t packet_size,
+                                                          struct irecovery_source* source, size_t* length) {
+	size_t compressed_size = sizeof(struct irecovery_compressed_source) + count * sizeof(struct irecovery_appvar_segment);
+	struct irecovery_compressed_source* compressed = (struct irecovery_compressed_source*)irecovery_scratch_alloc(client, compressed_size);
+	if (!compressed) return IRECOVERY_E_NO_MEMORY;
+	memset(compressed, 0, compressed_size);
+	compressed->count    = count;
+	compressed->position = IRECOVERY_COMPRESSED_HEADER_SIZE;
+
+	// Same as irecovery_send_appvars_begin(), the data pointers outlive the handles
+	for (uint8_t i = 0; i < count; i++) {
+		uint8_t handle = names[i] ? ti_Open(names[i], "r") : 0;
+		if (!handle) {
+			irecovery_scratch_free(client, compressed);
+			IRECOVERY_LOG_ERROR(client, "Couldn't open AppVar %s.\n", names[i] ? names[i] : "(null)");
+			return IRECOVERY_E_APPVAR_NOT_FOUND;
+		}
+
+		compressed->segments[i].data = (const unsigned char*)ti_GetDataPtr(handle);
+		compressed->segments[i].size = ti_GetSize(handle);
+		ti_Close(handle);
 	}
 
+	const unsigned char* header = compressed->segments[0].data;
+	if (compressed->segments[0].size < IRECOVERY_COMPRESSED_HEADER_SIZE || memcmp(header, "IRLZ", 4) != 0 || header[4] != IRECOVERY_COMPRESSED_VERSION) {
+		irecovery_scratch_free(client, compressed);
+		return IRECOVERY_E_BAD_IMAGE;
+	}
+	compressed->block_size = header[6] | (header[7] << 8);
+	compressed->length     = irecovery_read_le32(header + 8);
+	if (compressed->block_size == 0 || compressed->block_size > 0x8000) {
+		irecovery_scratch_free(client, compressed);
+		return IRECOVERY_E_BAD_IMAGE;
+	}
+
+	// Packets that don't line up with blocks go through one decoded block in RAM
+	if (packet_size % compressed->block_size != 0) {
+		compressed->staging = (unsigned char*)irecovery_scratch_alloc(client, compressed->block_size);
+		if (!compressed->staging) {
+			irecovery_scratch_free(client, compressed);
+			return IRECOVERY_E_NO_MEMORY;
+		}
+	}
+
+	struct irecovery_source compressed_source = {
+		.read      = irecovery_compressed_source_read,
+		.map       = NULL,
+		.release   = irecovery_compressed_source_release,
+		.user_data = compressed,
+		.prefetch  = true
+	};
+	*source = compressed_source;
+	*length = compressed->length;
 	return IRECOVERY_E_SUCCESS;
 }
 
-/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3123 */
-irecovery_error_t irecovery_send_command_breq(irecovery_client_t client, const char* command, uint8_t b_request) {
-	if (!irecovery_client_is_usable(client, true)) {
+irecovery_error_t irecovery_send_compressed_appvars_begin(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options) {
+	if (!irecovery_client_check(client, true)) {
 		return IRECOVERY_E_NO_DEVICE;
-	} else if (!command) {
+	} else if (!names || count == 0) {
 		return IRECOVERY_E_BAD_PTR;
-	} else if (client->mode != IRECOVERY_K_RECOVERY_MODE_1 && client->mode != IRECOVERY_K_RECOVERY_MODE_2 && client->mode != IRECOVERY_K_RECOVERY_MODE_3 && client->mode != IRECOVERY_K_RECOVERY_MODE_4) {
-		return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
 	}
 
-	size_t length = strlen(command);
-	if (length >= 256) return IRECOVERY_E_COMMAND_TOO_LONG;
-
-	irecovery_error_t error = irecovery_send_command_raw(client, command, b_request);
-	if (error != IRECOVERY_E_SUCCESS) {
-		irecovery_log(client, "Failed to send command %s\n", command);
-	}
+	struct irecovery_source source;
+	size_t length;
+	irecovery_error_t error = irecovery_compressed_source_open(client, names, count, irecovery_upload_packet_size(client), &source, &length);
+	if (error != IRECOVERY_E_SUCCESS) return error;
 
-	return error;
+	return irecovery_upload_begin(client, &source, length, options);
 }
 
-/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/tools/irecovery.c#L222 */
-static bool irecovery_is_breq_command(const char* cmd) {
-	return (
-		!strcmp(cmd, "go")
-		|| !strcmp(cmd, "bootx")
-		|| !strcmp(cmd, "reboot")
-		|| !strcmp(cmd, "memboot")
-	);
+irecovery_error_t irecovery_send_compressed_appvars(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options) {
+	irecovery_error_t error = irecovery_send_compressed_appvars_begin(client, names, count, options);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	return irecovery_send_wait(client);
 }
 
-/* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3168 */
-irecovery_error_t irecovery_send_command(irecovery_client_t client, const char* command) {
-	// Client eligibility checked by irecovery_send_command_breq()
-	if (!command) return IRECOVERY_E_BAD_PTR;
+// Whether or not uploads in that mode go out in recovery mode packets.
+static bool irecovery_mode_is_recovery(unsigned int mode) {
+	return mode != IRECOVERY_K_DFU_MODE && mode != IRECOVERY_K_WTF_MODE;
+}
 
-	return irecovery_send_command_breq(client, command, irecovery_is_breq_command(command));
+// Makes a source out of the stage's image, for packets of packet_size.
+static irecovery_error_t irecovery_boot_stage_open(irecovery_client_t client, const struct irecovery_boot_stage* stage, size_t packet_size,
+                                                   struct irecovery_source* source, size_t* length) {
+	switch (stage->image) {
+		case IRECOVERY_BOOT_IMAGE_BUFFER: {
+			struct irecovery_source buffer_source = {
+				.read      = irecovery_buffer_source_read,
+				.map       = irecovery_buffer_source_map,
+				.release   = NULL,
+				.user_data = stage->buffer
+			};
+			*source = buffer_source;
+			*length = stage->length;
+			return IRECOVERY_E_SUCCESS;
+		}
+		case IRECOVERY_BOOT_IMAGE_STREAM: {
+			struct irecovery_source stream_source = {
+				.read      = stage->read_cb,
+				.map       = NULL,
+				.release   = NULL,
+				.user_data = stage->user_data
+			};
+			*source = stream_source;
+			*length = stage->length;
+			return IRECOVERY_E_SUCCESS;
+		}
+		case IRECOVERY_BOOT_IMAGE_APPVARS:
+			return irecovery_appvar_source_open(client, stage->names, stage->count, source, length);
+		case IRECOVERY_BOOT_IMAGE_COMPRESSED_APPVARS:
+			return irecovery_compressed_source_open(client, stage->names, stage->count, packet_size, source, length);
+		default:
+			return IRECOVERY_E_BAD_PTR;
+	}
 }
 
-/* https://github.com/libimobiledevice/libirecovery/blob/638056a593b3254d05f2960fab836bace10ff105/src/libirecovery.c#L3206 */
-irecovery_error_t irecovery_send_buffer(irecovery_client_t client, unsigned char* buffer, size_t length, unsigned int options) {
-	if (!irecovery_client_is_usable(client, true)) {
-        return IRECOVERY_E_NO_DEVICE;
-    } else if (!buffer) {
-        return IRECOVERY_E_BAD_PTR;
-    }
+static bool irecovery_boot_stage_is_valid(const struct irecovery_boot_stage* stage) {
+	switch (stage->image) {
+		case IRECOVERY_BOOT_IMAGE_NONE:
+			break;
+		case IRECOVERY_BOOT_IMAGE_BUFFER:
+			if (!stage->buffer) return false;
+			break;
+		case IRECOVERY_BOOT_IMAGE_STREAM:
+			if (!stage->read_cb) return false;
+			break;
+		case IRECOVERY_BOOT_IMAGE_APPVARS:
+		case IRECOVERY_BOOT_IMAGE_COMPRESSED_APPVARS:
+			if (!stage->names || stage->count == 0) return false;
+			break;
+		default:
+			return false;
+	}
 
-	irecovery_error_t error = IRECOVERY_E_SUCCESS;
-	bool recovery_mode = (client->mode != IRECOVERY_K_DFU_MODE && client->mode != IRECOVERY_K_WTF_MODE);
+	return stage->command_count == 0 || stage->commands;
+}
 
-	uint32_t h1 = 0xFFFFFFFF;
-	unsigned char dfu_xbuf[12] = {0xff, 0xff, 0xff, 0xff, 0xac, 0x05, 0x00, 0x01, 0x55, 0x46, 0x44, 0x10};
-	int dfu_crc = 1;
-	size_t packet_size = recovery_mode ? 0x8000 : 0x800;
-	int last = length % packet_size;
-	int packets = length / packet_size;
-	
-	if (last != 0) {
-		packets++;
-	} else {
-		last = packet_size;
+// Gets the stage after the current one ready while the phone re-enumerates into `mode`. Only AppVars have anything to
+// open, and only recovery mode packets have a size that's known before the phone is back.
+static irecovery_error_t irecovery_boot_prepare(irecovery_client_t client, unsigned int mode) {
+	struct irecovery_boot* boot = &client->boot;
+	const struct irecovery_boot_stage* stage = &boot->stages[boot->index + 1];
+	if ((stage->image != IRECOVERY_BOOT_IMAGE_APPVARS && stage->image != IRECOVERY_BOOT_IMAGE_COMPRESSED_APPVARS) || !irecovery_mode_is_recovery(mode)) {
+		return IRECOVERY_E_SUCCESS;
 	}
 
-	// initiate transfer
-	if (recovery_mode) {
-		error = irecovery_usb_control_transfer(client, 0x41, 0, 0, 0, NULL, 0);
-	} else {
-		uint8_t state = 0;
-		if (irecovery_usb_control_transfer(client, 0xa1, 5, 0, 0, (unsigned char*)&state, 1) == 1) {
-			error = IRECOVERY_E_SUCCESS;
+	irecovery_error_t error = irecovery_boot_stage_open(client, stage, 0x8000, &boot->next, &boot->next_length);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+	boot->prepared = true;
+
+	// Decompress the first packet now rather than once the phone is waiting for it. Pipelined uploads don't prefetch.
+	struct irecovery_source* next = &boot->next;
+	if (next->prefetch && !(stage->options & IRECOVERY_SEND_OPT_RECOVERY_PIPELINE) && boot->next_length > 0) {
+		size_t size = (boot->next_length < 0x8000) ? boot->next_length : 0x8000;
+		next->primed = (unsigned char*)irecovery_scratch_alloc(client, size);
+		if (next->primed && next->read(next->user_data, 0, next->primed, size) == (int)size) {
+			next->primed_size = size;
 		} else {
-			return IRECOVERY_E_USB_UPLOAD_FAILED;
-		}
-		switch (state) {
-			case 2:
-				// DFU IDLE
-				break;
-			case 10:
-				irecovery_log(client, "DFU ERROR, issuing CLRSTATUS\n");
-				irecovery_usb_control_transfer(client, 0x21, 4, 0, 0, NULL, 0);
-				error = IRECOVERY_E_USB_UPLOAD_FAILED;
-				break;
-			default:
-				irecovery_log(client, "Unexpected state %d, issuing ABORT\n", state);
-				irecovery_usb_control_transfer(client, 0x21, 6, 0, 0, NULL, 0);
-				error = IRECOVERY_E_USB_UPLOAD_FAILED;
-				break;
+			// It's read again once the upload asks for it
+			irecovery_scratch_free(client, next->primed);
+			next->primed = NULL;
 		}
 	}
 
+	return IRECOVERY_E_SUCCESS;
+}
+
+static irecovery_error_t irecovery_boot_finish_stage(irecovery_client_t client);
+
+// Starts the current stage on the phone that's connected now.
+static irecovery_error_t irecovery_boot_start_stage(irecovery_client_t client) {
+	struct irecovery_boot* boot = &client->boot;
+	const struct irecovery_boot_stage* stage = &boot->stages[boot->index];
+	IRECOVERY_LOG_INFO(client, "Boot stage %zu of %zu in %s mode.\n", boot->index + 1, boot->count, irecovery_mode_to_str(client->mode));
+
+	if (stage->image == IRECOVERY_BOOT_IMAGE_NONE) return irecovery_boot_finish_stage(client);
+
+	irecovery_error_t error = IRECOVERY_E_SUCCESS;
+	if (!boot->prepared) {
+		error = irecovery_boot_stage_open(client, stage, irecovery_upload_packet_size(client), &boot->next, &boot->next_length);
+		if (error != IRECOVERY_E_SUCCESS) return error;
+	}
+	boot->prepared = false;
+
+	// The upload owns the source from here on, it releases it when it fails
+	error = irecovery_upload_begin(client, &boot->next, boot->next_length, stage->options);
 	if (error != IRECOVERY_E_SUCCESS) return error;
 
-	size_t count = 0;
-	unsigned int status = 0;
-	size_t bytes = 0;
-	for (int i = 0; i < packets; i++) {
-		size_t size = (i + 1) < packets ? packet_size : last;
+	boot->state = IRECOVERY_BOOT_STATE_UPLOAD;
+	return IRECOVERY_E_BOOT_IN_PROGRESS;
+}
 
-		// Use bulk transfer for recovery mode and control transfer for DFU and WTF mode
-		if (recovery_mode) {
-			error = irecovery_usb_bulk_transfer(client, 0x04, &buffer[i * packet_size], size, &bytes);
-		} else {
-			if (dfu_crc) {
-				size_t j;
-				for (j = 0; j < size; j++) {
-					crc32_step(h1, buffer[i*packet_size + j]);
-				}
-			}
-			if (dfu_crc && i+1 == packets) {
-				int j;
-				if (size+16 > packet_size) {
-					bytes = irecovery_usb_control_transfer(client, 0x21, 1, i, 0, &buffer[i * packet_size], size);
-					if (bytes != size) return IRECOVERY_E_USB_UPLOAD_FAILED;
-					count += size;
-					size = 0;
-				}
-				for (j = 0; j < 2; j++) {
-					crc32_step(h1, dfu_xbuf[j*6 + 0]);
-					crc32_step(h1, dfu_xbuf[j*6 + 1]);
-					crc32_step(h1, dfu_xbuf[j*6 + 2]);
-					crc32_step(h1, dfu_xbuf[j*6 + 3]);
-					crc32_step(h1, dfu_xbuf[j*6 + 4]);
-					crc32_step(h1, dfu_xbuf[j*6 + 5]);
-				}
+// Sends the current stage's commands once its image is up, then moves on to the next stage or waits for the phone.
+static irecovery_error_t irecovery_boot_finish_stage(irecovery_client_t client) {
+	struct irecovery_boot* boot = &client->boot;
+	const struct irecovery_boot_stage* stage = &boot->stages[boot->index];
 
-				char* newbuf = (char*)malloc(size + 16);
-				if (!newbuf) return IRECOVERY_E_NO_MEMORY;
-				if (size > 0) memcpy(newbuf, &buffer[i * packet_size], size);
-				memcpy(newbuf+size, dfu_xbuf, 12);
-				newbuf[size+12] = h1 & 0xFF;
-				newbuf[size+13] = (h1 >> 8) & 0xFF;
-				newbuf[size+14] = (h1 >> 16) & 0xFF;
-				newbuf[size+15] = (h1 >> 24) & 0xFF;
-				size += 16;
-				bytes = irecovery_usb_control_transfer(client, 0x21, 1, i, 0, (unsigned char*)newbuf, size);
-				free(newbuf);
-			} else {
-				bytes = irecovery_usb_control_transfer(client, 0x21, 1, i, 0, &buffer[i * packet_size], size);
-			}
-		}
+	if (stage->command_count > 0) {
+		irecovery_error_t error = irecovery_send_commands(client, stage->commands, stage->command_count, NULL);
+		if (error != IRECOVERY_E_SUCCESS) return error;
+	}
 
-		if (bytes != size) return IRECOVERY_E_USB_UPLOAD_FAILED;
+	if (stage->next_mode == 0) {
+		if (++boot->index == boot->count) return IRECOVERY_E_SUCCESS;
+		return irecovery_boot_start_stage(client);
+	}
 
-		if (!recovery_mode) error = irecovery_get_status(client, &status);
+	irecovery_error_t error = irecovery_reconnect_begin(client);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+	boot->state   = IRECOVERY_BOOT_STATE_RECONNECT;
+	boot->started = clock();
 
+	if (boot->index + 1 < boot->count) {
+		error = irecovery_boot_prepare(client, stage->next_mode);
 		if (error != IRECOVERY_E_SUCCESS) return error;
+	}
 
-		if (!recovery_mode && status != 5) {
-			int retry = 0;
+	return IRECOVERY_E_BOOT_IN_PROGRESS;
+}
 
-			while (retry++ < 20) {
-				irecovery_get_status(client, &status);
-				if (status == 5) break;
-				sleep(1);
-			}
+static void irecovery_boot_end(irecovery_client_t client) {
+	struct irecovery_boot* boot = &client->boot;
 
-			if (status != 5) return IRECOVERY_E_USB_UPLOAD_FAILED;
-		}
+	if (boot->state == IRECOVERY_BOOT_STATE_RECONNECT) irecovery_reconnect_end(client);
+	if (boot->prepared) irecovery_source_release(client, &boot->next);
+	// An upload that's still running is left to finish on its own, irecovery_send_step() ends it
+	boot->prepared = false;
+	boot->state    = IRECOVERY_BOOT_STATE_IDLE;
+}
 
-		count += size;
-		if (client->progress_callback) {
-			irecovery_event_t event = {
-				.size     = count,
-				.data     = (char*)"Uploading",
-				.progress = ((double)count / (double)length) * 100.0,
-				.type     = IRECOVERY_PROGRESS
-			};
-			client->progress_callback(client, &event);
-		} else {
-			irecovery_log(client, "Sent %d bytes - %lu of %zu\n", bytes, count, length);
-		}
+irecovery_error_t irecovery_boot_begin(irecovery_client_t client, const struct irecovery_boot_stage* stages, size_t count, uint32_t timeout_ms) {
+	if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (!stages || count == 0) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (client->boot.state != IRECOVERY_BOOT_STATE_IDLE) {
+		return IRECOVERY_E_BOOT_IN_PROGRESS;
+	} else if (client->upload.state != IRECOVERY_UPLOAD_STATE_IDLE) {
+		return IRECOVERY_E_UPLOAD_IN_PROGRESS;
 	}
 
-	if (recovery_mode && length % 512 == 0) {
-		// send a ZLP
-		bytes = 0;
-		irecovery_usb_bulk_transfer(client, 0x04, buffer, 0, &bytes);
+	// Check every stage before starting, so a bad one doesn't leave the phone half booted. A stage's commands need a console
+	// in the mode it runs in, the one the stages before it leave the phone in.
+	unsigned int mode = client->mode;
+	for (size_t i = 0; i < count; i++) {
+		if (!irecovery_boot_stage_is_valid(&stages[i])) return IRECOVERY_E_BAD_PTR;
+		if (stages[i].command_count > 0 && !irecovery_mode_has_console(mode)) return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+		if (stages[i].next_mode) mode = stages[i].next_mode;
 	}
 
-	if ((options & IRECOVERY_SEND_OPT_DFU_NOTIFY_FINISH) && !recovery_mode) {
-		irecovery_usb_control_transfer(client, 0x21, 1, packets, 0, (unsigned char*)buffer, 0);
+	struct irecovery_boot* boot = &client->boot;
+	memset(boot, 0, sizeof(struct irecovery_boot));
+	boot->stages  = stages;
+	boot->count   = count;
+	boot->timeout = irecovery_ms_to_clock(timeout_ms);
+
+	irecovery_error_t error = irecovery_boot_start_stage(client);
+	if (error != IRECOVERY_E_BOOT_IN_PROGRESS) irecovery_boot_end(client);
+
+	return error;
+}
 
-		for (int i = 0; i < 2; i++) {
-			error = irecovery_get_status(client, &status);
-			if (error != IRECOVERY_E_SUCCESS) return error;
+irecovery_error_t irecovery_boot_step(irecovery_client_t client) {
+	if (!client) return IRECOVERY_E_BAD_PTR;
+
+	struct irecovery_boot* boot = &client->boot;
+	irecovery_error_t error = IRECOVERY_E_BOOT_IN_PROGRESS;
+	if (boot->state == IRECOVERY_BOOT_STATE_UPLOAD) {
+		error = irecovery_send_step(client);
+		if (error == IRECOVERY_E_UPLOAD_IN_PROGRESS) return IRECOVERY_E_BOOT_IN_PROGRESS;
+		if (error == IRECOVERY_E_SUCCESS) error = irecovery_boot_finish_stage(client);
+	} else if (boot->state == IRECOVERY_BOOT_STATE_RECONNECT) {
+		error = irecovery_reconnect_poll(client);
+		if (error == IRECOVERY_E_SUCCESS) {
+			const struct irecovery_boot_stage* stage = &boot->stages[boot->index];
+			irecovery_reconnect_end(client);
+			boot->state = IRECOVERY_BOOT_STATE_IDLE;
+
+			if (client->mode != stage->next_mode) {
+				IRECOVERY_LOG_ERROR(client, "Expected the device back in %s mode, it's in %s mode.\n", irecovery_mode_to_str(stage->next_mode), irecovery_mode_to_str(client->mode));
+				error = IRECOVERY_E_UNEXPECTED_MODE;
+			} else if (++boot->index < boot->count) {
+				error = irecovery_boot_start_stage(client);
+			}
+		} else if (clock() - boot->started < boot->timeout) {
+			return IRECOVERY_E_BOOT_IN_PROGRESS;
 		}
+	} else {
+		return IRECOVERY_E_NO_BOOT;
+	}
+
+	if (error != IRECOVERY_E_BOOT_IN_PROGRESS) irecovery_boot_end(client);
+	return error;
+}
 
-		if ((options & IRECOVERY_SEND_OPT_DFU_FORCE_ZLP)) {
-			// we send a pseudo ZLP here just in case
-			irecovery_usb_control_transfer(client, 0x21, 0, 0, 0, NULL, 0);
+// Sleeps while the phone re-enumerates, until something happens on the bus or the stage runs out of time.
+static void irecovery_boot_sleep(irecovery_client_t client) {
+	const struct irecovery_boot* boot = &client->boot;
+
+	if (boot->timeout != IRECOVERY_CLOCK_MAX) {
+		clock_t elapsed = clock() - boot->started;
+		if (elapsed >= boot->timeout) return;
+
+		// Without a timer nothing might wake it up in time
+		uint32_t remaining = (uint32_t)((uint64_t)(boot->timeout - elapsed) * 1000 / CLOCKS_PER_SEC);
+		if (!irecovery_wait_timer_arm(client, remaining)) return;
+	}
+
+	usb_WaitForEvents();
+}
+
+irecovery_error_t irecovery_boot(irecovery_client_t client, const struct irecovery_boot_stage* stages, size_t count, uint32_t timeout_ms, size_t* stage) {
+	irecovery_error_t error = irecovery_boot_begin(client, stages, count, timeout_ms);
+
+	while (error == IRECOVERY_E_BOOT_IN_PROGRESS) {
+		// Sleep while packets are in flight or the phone re-enumerates
+		if (client->boot.state == IRECOVERY_BOOT_STATE_UPLOAD && !irecovery_upload_idle(&client->upload)) {
+			usb_WaitForEvents();
+		} else if (client->boot.state == IRECOVERY_BOOT_STATE_RECONNECT) {
+			irecovery_boot_sleep(client);
 		}
+		error = irecovery_boot_step(client);
+	}
+	if (client) irecovery_wait_timer_stop(client);
+
+	if (stage) *stage = client ? client->boot.index : 0;
+	return error;
+}
+
+irecovery_error_t irecovery_get_boot_stage(irecovery_client_t client, size_t* stage) {
+	if (!client || !stage) return IRECOVERY_E_BAD_PTR;
+	if (!client->boot.stages) return IRECOVERY_E_NO_BOOT;
+
+	*stage = client->boot.index;
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_manifest_parse(const unsigned char* data, size_t length, struct irecovery_manifest* manifest) {
+	if (!data || !manifest) return IRECOVERY_E_BAD_PTR;
+	if (length < IRECOVERY_MANIFEST_SIZE || memcmp(data, "IRMF", 4) != 0 || data[4] != IRECOVERY_MANIFEST_VERSION) return IRECOVERY_E_BAD_MANIFEST;
+
+	struct irecovery_manifest parsed;
+	parsed.length  = irecovery_read_le32(data + 5);
+	parsed.packets = (uint16_t)(data[9] | (data[10] << 8));
+	parsed.crc     = irecovery_read_le32(data + 11);
+	memcpy(parsed.trailer, data + 15, 16);
+
+	// The trailer has to be the DFU suffix carrying the running CRC, and the packet count has to add up
+	if (memcmp(parsed.trailer, irecovery_dfu_xbuf, 12) != 0 || irecovery_read_le32(parsed.trailer + 12) != ~parsed.crc) return IRECOVERY_E_BAD_MANIFEST;
+	if (parsed.packets != (parsed.length + 0x7FF) / 0x800) return IRECOVERY_E_BAD_MANIFEST;
+
+	*manifest = parsed;
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_manifest_load(const char* name, struct irecovery_manifest* manifest) {
+	if (!name || !manifest) return IRECOVERY_E_BAD_PTR;
+
+	uint8_t handle = ti_Open(name, "r");
+	if (!handle) return IRECOVERY_E_APPVAR_NOT_FOUND;
+
+	irecovery_error_t error = irecovery_manifest_parse((const unsigned char*)ti_GetDataPtr(handle), ti_GetSize(handle), manifest);
+	ti_Close(handle);
+	return error;
+}
 
-		usb_ResetDevice(client->handle);
+irecovery_error_t irecovery_set_manifest(irecovery_client_t client, const struct irecovery_manifest* manifest) {
+	if (!client) return IRECOVERY_E_BAD_PTR;
+
+	if (manifest) {
+		client->manifest = *manifest;
+		client->has_manifest = true;
+	} else {
+		memset(&client->manifest, 0, sizeof(struct irecovery_manifest));
+		client->has_manifest = false;
 	}
-	
+
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_get_stats(irecovery_client_t client, struct irecovery_stats* stats) {
+	if (!client || !stats) return IRECOVERY_E_BAD_PTR;
+
+	*stats = client->stats;
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_reset_stats(irecovery_client_t client) {
+	if (!client) return IRECOVERY_E_BAD_PTR;
+
+	memset(&client->stats, 0, sizeof(struct irecovery_stats));
 	return IRECOVERY_E_SUCCESS;
 }
 
@@ -1413,29 +4641,59 @@ irecovery_error_t irecovery_saveenv(irecovery_client_t client) {
 	return irecovery_send_command_raw(client, "saveenv", 0);
 }
 
+// Joins parts into command, truncated like snprintf(command, size - 1, ...) was. Without it, builds with logging compiled
+// out don't need printf at all.
+static void irecovery_format_command(char* command, size_t size, const char* const* parts, size_t count) {
+	size_t length = 0;
+	for (size_t i = 0; i < count; i++) {
+		for (const char* p = parts[i]; *p && length + 2 < size; p++) {
+			command[length++] = *p;
+		}
+	}
+	command[length] = '\0';
+}
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3535 */
 irecovery_error_t irecovery_getenv(irecovery_client_t client, const char* variable, char** value) {
-	// Client checked by irecovery_send_command_raw().
 	if (!variable || !value || *value) return IRECOVERY_E_BAD_PTR;
 
-	char command[256];
-	memset(command, 0, sizeof(command));
-	snprintf(command, sizeof(command)-1, "getenv %s", variable);
-	irecovery_error_t error = irecovery_send_command_raw(client, command, 0);
-	if (error != IRECOVERY_E_SUCCESS) return error;
-
 	size_t response_size = 256;
 	char* response = (char*)calloc(1, response_size);
 	if (!response) return IRECOVERY_E_NO_MEMORY;
 
-	int ret = irecovery_usb_control_transfer(client, 0xC0, 0, 0, 0, (unsigned char*)response, response_size-1);
-	if (ret < 0) {
+	irecovery_error_t error = irecovery_getenv_into(client, variable, response, response_size, NULL);
+	if (error != IRECOVERY_E_SUCCESS) {
 		free(response);
-		return ret;
-	} else {
-		*value = response;
+		return error;
+	}
+
+	*value = response;
+	return IRECOVERY_E_SUCCESS;
+}
+
+irecovery_error_t irecovery_getenv_into(irecovery_client_t client, const char* variable, char* value, size_t size, size_t* length) {
+	// Client checked by irecovery_send_command_raw().
+	if (length) *length = 0;
+	if (!variable || !value) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (size == 0) {
+		return IRECOVERY_E_DST_BUF_SIZE_ZERO;
 	}
+	value[0] = '\0';
+
+	char command[256];
+	memset(command, 0, sizeof(command));
+	irecovery_format_command(command, sizeof(command), (const char*[]){ "getenv ", variable }, 2);
+	irecovery_error_t error = irecovery_send_command_raw(client, command, 0);
+	if (error != IRECOVERY_E_SUCCESS) return error;
+
+	// libirecovery never asks for more than 255 bytes
+	size_t response_size = (size - 1 > 255) ? 255 : size - 1;
+	int ret = (response_size > 0) ? irecovery_usb_control_transfer(client, 0xC0, 0, 0, 0, (unsigned char*)value, response_size) : 0;
+	if (ret < 0) return ret;
+	value[ret] = '\0';
 
+	if (length) *length = strlen(value);
 	return IRECOVERY_E_SUCCESS;
 }
 
@@ -1446,7 +4704,7 @@ irecovery_error_t irecovery_setenv(irecovery_client_t client, const char* variab
 
 	char command[256];
 	memset(command, 0, sizeof(command));
-	snprintf(command, sizeof(command)-1, "setenv %s %s", variable, value);
+	irecovery_format_command(command, sizeof(command), (const char*[]){ "setenv ", variable, " ", value }, 4);
 	return irecovery_send_command_raw(client, command, 0);
 }
 
@@ -1457,7 +4715,7 @@ irecovery_error_t irecovery_setenv_np(irecovery_client_t client, const char* var
 
 	char command[256];
 	memset(command, 0, sizeof(command));
-	snprintf(command, sizeof(command)-1, "setenvnp %s %s", variable, value);
+	irecovery_format_command(command, sizeof(command), (const char*[]){ "setenvnp ", variable, " ", value }, 4);
 	return irecovery_send_command_raw(client, command, 0);
 }
 
@@ -1467,9 +4725,91 @@ irecovery_error_t irecovery_reboot(irecovery_client_t client) {
 	return irecovery_send_command_raw(client, "reboot", 0);
 }
 
+// Finds the line starting at p, without its line ending. Returns where the next line starts.
+static const char* irecovery_script_line(const char* p, const char* end, size_t* length) {
+	const char* eol = memchr(p, '\n', end - p);
+	if (!eol) eol = end;
+
+	*length = eol - p;
+	if (*length > 0 && p[*length - 1] == '\r') (*length)--;
+	return (eol < end) ? eol + 1 : end;
+}
+
+irecovery_error_t irecovery_run_script(irecovery_client_t client, const char* name, size_t* line) {
+	if (line) *line = 0;
+	if (!irecovery_client_check(client, true)) {
+		return IRECOVERY_E_NO_DEVICE;
+	} else if (!name) {
+		return IRECOVERY_E_BAD_PTR;
+	} else if (!irecovery_client_has_console(client)) {
+		return IRECOVERY_E_SERVICE_NOT_AVAILABLE;
+	}
+
+	uint8_t handle = ti_Open(name, "r");
+	if (!handle) return IRECOVERY_E_APPVAR_NOT_FOUND;
+
+	const char* script = (const char*)ti_GetDataPtr(handle);
+	const char* end = script + ti_GetSize(handle);
+	const char* nul = memchr(script, '\0', end - script);
+	if (nul) end = nul;
+
+	// Check every line before sending any, so a bad one doesn't leave the script half run
+	irecovery_error_t error = IRECOVERY_E_SUCCESS;
+	size_t number = 0;
+	for (const char* p = script; p < end;) {
+		size_t length;
+		p = irecovery_script_line(p, end, &length);
+		number++;
+		if (length >= 256) {
+			if (line) *line = number;
+			error = IRECOVERY_E_COMMAND_TOO_LONG;
+			break;
+		}
+	}
+
+	char* command = (error == IRECOVERY_E_SUCCESS) ? (char*)irecovery_scratch_alloc(client, 256) : NULL;
+	if (error == IRECOVERY_E_SUCCESS && !command) error = IRECOVERY_E_NO_MEMORY;
+
+	// Environment changes are saved before the device boots away, or once the script ends
+	bool unsaved = false;
+	number = 0;
+	for (const char* p = script; error == IRECOVERY_E_SUCCESS && p < end;) {
+		const char* start = p;
+		size_t length;
+		p = irecovery_script_line(p, end, &length);
+		number++;
+		if (length == 0 || start[0] == '#') continue;
+
+		memcpy(command, start, length);
+		command[length] = '\0';
+
+		uint8_t b_request = irecovery_is_breq_command(command);
+		if (b_request && unsaved) {
+			error = irecovery_console_send(client, "saveenv", 7, 0);
+			unsaved = false;
+		}
+		if (error == IRECOVERY_E_SUCCESS) error = irecovery_console_send(client, command, length, b_request);
+
+		if (error != IRECOVERY_E_SUCCESS) {
+			IRECOVERY_LOG_ERROR(client, "Failed to send command %s (line %zu)\n", command, number);
+			if (line) *line = number;
+		} else if (!strcmp(command, "saveenv")) {
+			unsaved = false;
+		} else if (!strncmp(command, "setenv", 6)) {
+			unsaved = true;
+		}
+	}
+	if (error == IRECOVERY_E_SUCCESS && unsaved) error = irecovery_console_send(client, "saveenv", 7, 0);
+
+	irecovery_scratch_free(client, command);
+	ti_Close(handle);
+
+	return error;
+}
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3577 */
 irecovery_error_t irecovery_getret(irecovery_client_t client, unsigned int* value) {
-	if (!irecovery_client_is_usable(client, true)) {
+	if (!irecovery_client_check(client, true)) {
 		return IRECOVERY_E_NO_DEVICE;
 	} else if (!value) {
 		return IRECOVERY_E_BAD_PTR;
@@ -1477,31 +4817,67 @@ irecovery_error_t irecovery_getret(irecovery_client_t client, unsigned int* valu
 
 	*value = 0;
 
-	size_t response_size = 256;
-	char* response = (char*)calloc(1, response_size);
-	if (!response) return IRECOVERY_E_NO_MEMORY;
-
-	int ret = irecovery_usb_control_transfer(client, 0xC0, 0, 0, 0, (unsigned char*)response, response_size-1);
-	if (ret < 0) {
-		free(response);
-		return ret;
-	} else {
-		*value = (unsigned int)*response;
-		free(response);
-	}
+	// Only the first byte of the reply is the return value, so that's all that's asked for
+	unsigned char response = 0;
+	int ret = irecovery_usb_control_transfer_unchecked(client, 0xC0, 0, 0, 0, &response, 1);
+	if (ret < 0) return ret;
+	*value = response;
 
 	return IRECOVERY_E_SUCCESS;
 }
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3616 */
 const struct irecovery_device_info* irecovery_get_device_info(irecovery_client_t client) {
-    if (!irecovery_client_is_usable(client, true)) return NULL;
+    if (!irecovery_client_check(client, true)) return NULL;
 
     return &client->device_info;
 }
 
+#ifndef IRECOVERY_NO_DEVICE_TABLE
+static int irecovery_devices_compare_product_type(const struct irecovery_device* key, const struct irecovery_device* device) {
+    return strcmp(key->product_type, device->product_type);
+}
+
+static int irecovery_devices_compare_hardware_model(const struct irecovery_device* key, const struct irecovery_device* device) {
+    return strcmp(key->hardware_model, device->hardware_model);
+}
+
+static int irecovery_devices_compare_chip_board(const struct irecovery_device* key, const struct irecovery_device* device) {
+    if (key->chip_id != device->chip_id) return (key->chip_id < device->chip_id) ? -1 : 1;
+    if (key->board_id != device->board_id) return (key->board_id < device->board_id) ? -1 : 1;
+    return 0;
+}
+
+// Binary searches one of the generated indexes for the first device matching key, like the linear scans used to.
+static irecovery_device_t irecovery_devices_search(const uint16_t* index, const struct irecovery_device* key, int (*compare)(const struct irecovery_device*, const struct irecovery_device*)) {
+    size_t low = 0;
+    size_t high = irecovery_device_count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (compare(key, &irecovery_devices[index[mid]]) > 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low < irecovery_device_count && compare(key, &irecovery_devices[index[low]]) == 0) return &irecovery_devices[index[low]];
+    return NULL;
+}
+
+void irecovery_devices_free(void) {
+#ifdef IRECOVERY_DEVICE_DB
+    // The indexes point into the AppVar, the next lookup loads them again
+    free(irecovery_devices);
+    irecovery_devices      = NULL;
+    irecovery_device_count = 0;
+#endif
+}
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3943 */
 irecovery_device_t irecovery_devices_get_all(void) {
+    if (!irecovery_devices_load()) return NULL;
     return irecovery_devices;
 }
 
@@ -1510,18 +4886,15 @@ irecovery_error_t irecovery_devices_get_device_by_client(irecovery_client_t clie
     if (!client || !device) return IRECOVERY_E_BAD_PTR;
 
     *device = NULL;
+    if (!irecovery_devices_load()) return IRECOVERY_E_APPVAR_NOT_FOUND;
 
-    unsigned int cpid_match = client->device_info.cpid;
-    unsigned int bdid_match = client->device_info.bdid;
-    
-    for (int i = 0; irecovery_devices[i].hardware_model != NULL; i++) {
-        if (irecovery_devices[i].chip_id == cpid_match && irecovery_devices[i].board_id == bdid_match) {
-            *device = &irecovery_devices[i];
-            return IRECOVERY_E_SUCCESS;
-        }
-    }
+    struct irecovery_device key = {
+        .chip_id  = client->device_info.cpid,
+        .board_id = client->device_info.bdid
+    };
 
-    return IRECOVERY_E_NO_DEVICE;
+    *device = irecovery_devices_search(irecovery_devices_by_chip_board, &key, irecovery_devices_compare_chip_board);
+    return *device ? IRECOVERY_E_SUCCESS : IRECOVERY_E_NO_DEVICE;
 }
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L3982 */
@@ -1529,15 +4902,12 @@ irecovery_error_t irecovery_devices_get_device_by_product_type(const char* produ
     if (!product_type || !device) return IRECOVERY_E_BAD_PTR;
 
     *device = NULL;
+    if (!irecovery_devices_load()) return IRECOVERY_E_APPVAR_NOT_FOUND;
 
-    for (int i = 0; irecovery_devices[i].product_type != NULL; i++) {
-        if (!strcmp(product_type, irecovery_devices[i].product_type)) {
-            *device = &irecovery_devices[i];
-            return IRECOVERY_E_SUCCESS;
-        }
-    }
+    struct irecovery_device key = { .product_type = product_type };
 
-    return IRECOVERY_E_NO_DEVICE;
+    *device = irecovery_devices_search(irecovery_devices_by_product_type, &key, irecovery_devices_compare_product_type);
+    return *device ? IRECOVERY_E_SUCCESS : IRECOVERY_E_NO_DEVICE;
 }
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/src/libirecovery.c#L4001 */
@@ -1545,13 +4915,11 @@ irecovery_error_t irecovery_devices_get_device_by_hardware_model(const char* har
     if (!hardware_model || !device) return IRECOVERY_E_BAD_PTR;
 
     *device = NULL;
+    if (!irecovery_devices_load()) return IRECOVERY_E_APPVAR_NOT_FOUND;
 
-    for (int i = 0; irecovery_devices[i].hardware_model != NULL; i++) {
-        if (!strcmp(hardware_model, irecovery_devices[i].hardware_model)) {
-            *device = &irecovery_devices[i];
-            return IRECOVERY_E_SUCCESS;
-        }
-    }
+    struct irecovery_device key = { .hardware_model = hardware_model };
 
-    return IRECOVERY_E_NO_DEVICE;
-}
\ No newline at end of file
+    *device = irecovery_devices_search(irecovery_devices_by_hardware_model, &key, irecovery_devices_compare_hardware_model);
+    return *device ? IRECOVERY_E_SUCCESS : IRECOVERY_E_NO_DEVICE;
+}
+#endif
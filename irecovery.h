@@ -45,9 +45,39 @@ typedef enum {
     IRECOVERY_E_NO_COMMAND              = -15,
     IRECOVERY_E_SERVICE_NOT_AVAILABLE   = -16,
     IRECOVERY_E_USB_RESET_FAILED        = -17,
-    IRECOVERY_E_UNKNOWN_EVENT_TYPE      = -18
+    IRECOVERY_E_UNKNOWN_EVENT_TYPE      = -18,
+    IRECOVERY_E_APPVAR_NOT_FOUND        = -19,
+    IRECOVERY_E_UPLOAD_IN_PROGRESS      = -20,
+    IRECOVERY_E_UPLOAD_CANCELLED        = -21,
+    IRECOVERY_E_NO_UPLOAD               = -22,
+    IRECOVERY_E_BAD_MANIFEST            = -23,
+    IRECOVERY_E_BAD_DEVICE_CACHE        = -24,
+    IRECOVERY_E_TIMEOUT                 = -25,
+    IRECOVERY_E_NO_SESSION              = -26,
+    IRECOVERY_E_BAD_IMAGE               = -27,
+    IRECOVERY_E_BOOT_IN_PROGRESS        = -28,
+    IRECOVERY_E_NO_BOOT                 = -29,
+    IRECOVERY_E_UNEXPECTED_MODE         = -30
 } irecovery_error_t;
 
+// Transfer statistics. Times are cumulative, in clock() ticks (see CLOCKS_PER_SEC).
+struct irecovery_stats {
+	uint32_t bytes_sent;        // Image bytes the device acknowledged, DFU suffix included.
+	uint32_t packets_sent;      // Image packets the device acknowledged.
+	uint32_t status_polls;      // DFU GETSTATUS requests.
+	uint32_t status_retries;    // GETSTATUS replies that weren't dfuDNLOAD-IDLE and had to be polled again.
+	uint32_t failed_transfers;  // Transfers usbdrvce didn't complete.
+	uint32_t upload_retries;    // Packets IRECOVERY_SEND_OPT_RETRY sent again, or DFU uploads it started over.
+	uint32_t reconnects;        // Devices finalized after the first one.
+	uint32_t cache_hits;        // Connections configured from the device cache.
+	uint32_t control_ticks;     // Time spent in control transfers.
+	uint32_t bulk_ticks;        // Time spent in bulk transfers.
+	uint32_t crc_ticks;         // Time spent computing the DFU CRC.
+	uint32_t callback_ticks;    // Time spent in progress callbacks.
+	uint32_t finalize_ticks;    // Time spent finalizing connections in irecovery_poll_for_device().
+	uint32_t console_dropped;   // Console output lost to a full irecovery_console_start() buffer.
+};
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L40 */
 enum irecovery_mode {
 	IRECOVERY_K_RECOVERY_MODE_1   = 0x1280,
@@ -64,9 +94,58 @@ enum {
 	IRECOVERY_SEND_OPT_NONE              = 0,
 	IRECOVERY_SEND_OPT_DFU_NOTIFY_FINISH = (1 << 0),
 	IRECOVERY_SEND_OPT_DFU_FORCE_ZLP     = (1 << 1),
-	IRECOVERY_SEND_OPT_DFU_SMALL_PKT     = (1 << 2)
+	IRECOVERY_SEND_OPT_DFU_SMALL_PKT     = (1 << 2),
+	IRECOVERY_SEND_OPT_RECOVERY_PIPELINE = (1 << 3), // Keep IRECOVERY_PIPELINE_DEPTH (default 2) bulk transfers queued in recovery mode.
+	                                                 // Sources that can't be mapped in place need one 0x8000 byte buffer per queued transfer.
+	IRECOVERY_SEND_OPT_DFU_MANIFEST      = (1 << 4), // Skip hashing the image and send the trailer from irecovery_set_manifest() instead.
+	IRECOVERY_SEND_OPT_RETRY             = (1 << 5), // Retry failed packets up to IRECOVERY_UPLOAD_RETRIES (default 4) times per upload, with a doubling
+	                                                 // backoff from IRECOVERY_UPLOAD_RETRY_DELAY (default 25) ms. DFU uploads start over from block 0.
+	IRECOVERY_SEND_OPT_RESUME            = (1 << 6)  // In recovery mode, pick up at the checkpoint the last failed upload of this image to this phone left,
+	                                                 // see irecovery_get_upload_checkpoint(). Starts from the beginning without one.
+};
+
+// Options for how irecovery_poll_for_device() sets up a new connection, see irecovery_set_finalize_options().
+enum {
+	IRECOVERY_FINALIZE_OPT_NONE        = 0,
+	IRECOVERY_FINALIZE_OPT_SKIP_NONCES = (1 << 0)  // Don't read string descriptor 1, ap_nonce and sep_nonce stay NULL.
 };
 
+/*
+ * What finalization keeps about one phone in one mode, so it can skip downloading its configuration descriptor after a
+ * reconnect. Keyed by ECID and product ID, see irecovery_set_device_cache().
+ */
+#define IRECOVERY_DEVICE_CACHE_CONFIG_SIZE 64 // Configuration descriptors larger than this are fetched every time.
+
+struct irecovery_device_cache_entry {
+	uint64_t ecid;                  // ECID of the phone, 0 if the entry is unused.
+	uint16_t pid;                   // idProduct the phone had, each mode gets its own entry.
+	uint8_t configuration_length;   // Length of configuration, 0 if it wasn't kept.
+	unsigned char configuration[IRECOVERY_DEVICE_CACHE_CONFIG_SIZE]; // Configuration descriptor 1 and everything after it.
+};
+
+/*
+ * Upload manifest, generated on the host by tools/mkmanifest.py and stored in its own AppVar.
+ * Layout, little endian: "IRMF", version (1 byte), length (4), packets (2), crc (4), trailer (16).
+ */
+#define IRECOVERY_MANIFEST_VERSION 1
+#define IRECOVERY_MANIFEST_SIZE    31
+
+struct irecovery_manifest {
+	uint32_t length;            // Image length in bytes.
+	uint16_t packets;           // Number of 0x800 byte DFU packets. Only checked against length, the CRC doesn't depend on the packet size.
+	uint32_t crc;               // Final CRC32 of the image followed by the first 12 bytes of the DFU suffix.
+	unsigned char trailer[16];  // DFU suffix appended to the last packet.
+};
+
+/*
+ * Compressed image, generated on the host by tools/mkcompressed.py and split over one or more AppVars.
+ * Layout, little endian: "IRLZ", version (1 byte), reserved (1), block size (2), image length (4), then for each block its
+ * compressed size (2, 0 if it's stored as is) and the LZ4 block. Every block but the last decompresses to the block size,
+ * and no block straddles two AppVars.
+ */
+#define IRECOVERY_COMPRESSED_VERSION     1
+#define IRECOVERY_COMPRESSED_HEADER_SIZE 12
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L83 */
 struct irecovery_device {
     const char* product_type;
@@ -98,42 +177,224 @@ struct irecovery_device_info {
     uint16_t pid;
 };
 
+/* https://www.usb.org/sites/default/files/DFU_1.1.pdf section 6.1.2 */
+struct irecovery_dfu_status {
+    uint8_t b_status;         // Result of the last request, 0 is OK.
+    uint32_t bw_poll_timeout; // Minimum time in milliseconds to wait before the next GETSTATUS.
+    uint8_t b_state;          // State the device will be in after this response. 5 is dfuDNLOAD-IDLE, 10 is dfuERROR.
+    uint8_t i_string;         // Index of a string descriptor describing the status.
+};
+
+/* https://www.usb.org/sites/default/files/DFU_1.1.pdf section 4.1.3 */
+struct irecovery_dfu_functional_descriptor {
+    uint8_t bm_attributes;     // Bit 0 bitCanDnload, bit 1 bitCanUpload, bit 2 bitManifestationTolerant, bit 3 bitWillDetach.
+    uint16_t w_detach_timeout; // Time in milliseconds the device waits for a USB reset after DFU_DETACH.
+    uint16_t w_transfer_size;  // Largest number of bytes the device accepts per DNLOAD.
+    uint16_t bcd_dfu_version;  // DFU version the device implements, 0x0110 for 1.1. 0 if the descriptor predates DFU 1.1.
+};
+
 typedef enum {
     IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ALL,                             // Allow a new connection to discard an ongoing connection.
                                                                            // Know that if a new connection fails, the previous connection won't be available.
     IRECOVERY_CLIENT_DEVICE_POLICY_ACCEPT_ONLY_WHEN_NO_CURRENT_CONNECTION, // Allow a new connection only if there's no current connection.
-    IRECOVERY_CLIENT_DEVICE_POLICY_ONE_CONNECTION_LIMIT                    // Ignore new connections after the initial one.
+    IRECOVERY_CLIENT_DEVICE_POLICY_ONE_CONNECTION_LIMIT                    // Ignore new connections after the initial one is finalized.
+                                                                           // irecovery_await_reconnect() still takes the same phone back.
 } irecovery_connection_policy_t;
 
 typedef void (*irecovery_log_cb_t)(const char c);
+typedef void (*irecovery_log_sink_cb_t)(const char* data, size_t length);
+
+// Scratch arena size that lets logging, descriptor reads and DFU uploads in 0x800 byte blocks run without touching the heap.
+// DFU blocks are w_transfer_size bytes, up to 0x8000, so a device with bigger blocks needs the difference on top.
+// Compressed uploads only decompress the next packet ahead when a second packet buffer fits, see irecovery_send_compressed_appvars().
+#define IRECOVERY_SCRATCH_SIZE (0x800 + 0x400)
 
 typedef struct irecovery_client* irecovery_client_t;
 
+// Owns the USB backend for several clients, one phone each. See irecovery_context_new().
+typedef struct irecovery_context* irecovery_context_t;
+
+#ifndef IRECOVERY_CONTEXT_MAX_CLIENTS
+#define IRECOVERY_CONTEXT_MAX_CLIENTS 4
+#endif
+
+// Subscriptions a client holds, over all event types.
+#ifndef IRECOVERY_EVENT_SUBSCRIBERS
+#define IRECOVERY_EVENT_SUBSCRIBERS 8
+#endif
+
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L67 */
+// Device events carry the phone's mode in irecovery_event_t.mode (and its name in .data) and its ECID in .ecid, once it's known.
 typedef enum {
-    IRECOVERY_PROGRESS = 1
+    IRECOVERY_EVENT_ANY           = 0, // Only for irecovery_wait_for_event(), any of the events below.
+    IRECOVERY_PROGRESS            = 1,
+    IRECOVERY_UPLOAD_FINISHED     = 2, // An upload ended, successfully or not. See irecovery_event_t.error.
+    IRECOVERY_DEVICE_ATTACHED     = 3, // A supported phone was enabled and the client took it. It isn't finalized yet.
+    IRECOVERY_DEVICE_FINALIZED    = 4, // The client's phone was finalized. If that failed, see irecovery_event_t.error.
+    IRECOVERY_ECID_REJECTED       = 5, // The client's phone didn't have the ECID the client is restricted to. In a context, only
+                                       // once no other client took the phone.
+    IRECOVERY_DEVICE_DISCONNECTED = 6, // The client's phone went away.
+    IRECOVERY_ROLE_LOST           = 7, // The calculator stopped being the USB host, the client's phone (if any) is gone.
+    IRECOVERY_MODE_CHANGED        = 8, // The last finalized phone was finalized again in another mode, right after IRECOVERY_DEVICE_FINALIZED.
+    IRECOVERY_CONSOLE_LINE        = 9  // The console started with irecovery_console_start() printed a line. It's in .data (null-terminated,
+                                       // without its line ending) and .size, until the next console read lands.
 } irecovery_event_type;
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L76 */
 typedef struct {
     size_t size;
     const char* data;
-    double progress;
+    double progress;         // Percentage. Only computed for IRECOVERY_PROGRESS when a subscriber from irecovery_event_subscribe() gets it.
     irecovery_event_type type;
+    irecovery_error_t error; // Result of the operation, for IRECOVERY_UPLOAD_FINISHED and IRECOVERY_DEVICE_FINALIZED.
+    unsigned int mode;       // Mode of the phone, for device events.
+    uint64_t ecid;           // ECID of the phone, for device events. 0 before the phone is finalized.
+    uint16_t permille;       // Progress in tenths of a percent (0 to 1000), for IRECOVERY_PROGRESS and IRECOVERY_UPLOAD_FINISHED.
 } irecovery_event_t;
 
 /* https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L163C1-L165C95 */
 // If your callback function returns something other than 0, the associated irecovery API function will exit early.
+// Only IRECOVERY_PROGRESS callbacks can end an upload that way, the return value of the others is ignored.
 typedef int(*irecovery_event_cb_t)(irecovery_client_t client, const irecovery_event_t* event);
 
+// Bytes of console output each background read asks the device for, one full speed bulk packet by default.
+#ifndef IRECOVERY_CONSOLE_READ_SIZE
+#define IRECOVERY_CONSOLE_READ_SIZE 64
+#endif
+
+// Longest IRECOVERY_CONSOLE_LINE event. Longer lines are split.
+#ifndef IRECOVERY_CONSOLE_LINE_SIZE
+#define IRECOVERY_CONSOLE_LINE_SIZE 128
+#endif
+
+// Timeout that never runs out, for irecovery_wait_for_event(), irecovery_await_reconnect() and irecovery_boot_begin().
+#define IRECOVERY_WAIT_FOREVER UINT32_MAX
+
+// Copy length bytes of the image starting at offset into dst and return the number of bytes copied.
+// Returning anything other than length aborts the upload. Offsets are requested in increasing order, except that
+// IRECOVERY_SEND_OPT_RETRY can start the upload over from offset 0.
+typedef int (*irecovery_stream_read_cb_t)(void* user_data, size_t offset, unsigned char* dst, size_t length);
+
+// Where the image of a boot stage comes from.
+typedef enum {
+    IRECOVERY_BOOT_IMAGE_NONE = 0,          // No image, the stage only sends commands.
+    IRECOVERY_BOOT_IMAGE_BUFFER,            // buffer and length, like irecovery_send_buffer().
+    IRECOVERY_BOOT_IMAGE_STREAM,            // read_cb, user_data and length, like irecovery_send_stream().
+    IRECOVERY_BOOT_IMAGE_APPVARS,           // names and count, like irecovery_send_appvars().
+    IRECOVERY_BOOT_IMAGE_COMPRESSED_APPVARS // names and count, like irecovery_send_compressed_appvars().
+} irecovery_boot_image_t;
+
+/*
+ * One stage of a boot chain for irecovery_boot_begin(): its image is uploaded, then its commands are sent, then the phone
+ * is waited for if the stage makes it re-enumerate. A typical chain is iBSS in DFU mode, next_mode IRECOVERY_K_RECOVERY_MODE_2,
+ * then iBEC with the "go" command, then the commands for the booted iBEC.
+ */
+struct irecovery_boot_stage {
+    irecovery_boot_image_t image;
+    unsigned char* buffer;
+    irecovery_stream_read_cb_t read_cb;
+    void* user_data;
+    size_t length;
+    const char* const* names;
+    uint8_t count;
+    unsigned int options;                   // IRECOVERY_SEND_OPT_* flags for the upload.
+    const char* const* commands;            // Commands sent after the image, like irecovery_send_commands(). Can be NULL.
+    size_t command_count;
+    unsigned int next_mode;                 // Mode the phone comes back in after the stage, 0 if it doesn't re-enumerate.
+};
+
+/*
+ * Build switches that leave whole parts of the library out. The program is copied into RAM when it starts, so whatever's
+ * left out loads faster and leaves more heap for images.
+ *   IRECOVERY_NO_DFU           No DFU and WTF mode uploads, they fail with IRECOVERY_E_SERVICE_NOT_AVAILABLE.
+ *   IRECOVERY_NO_RECOVERY      No recovery mode uploads (they fail the same way) and no irecovery_console_*().
+ *                              Commands are still sent. Can't be combined with IRECOVERY_NO_DFU.
+ *   IRECOVERY_NO_CRC32         No CRC32 table and no irecovery_crc32_update(). DFU uploads need IRECOVERY_SEND_OPT_DFU_MANIFEST,
+ *                              or fail with IRECOVERY_E_BAD_MANIFEST.
+ *   IRECOVERY_NO_DEVICE_TABLE  No device table and no irecovery_devices_*(), neither built in nor from IRECOVERY_DEVICE_DB.
+ *   IRECOVERY_LOG_LEVEL        IRECOVERY_LOG_LEVEL_NONE compiles out every message and irecovery_log() itself, and with it printf.
+ */
+
+/* Log levels, from least to most verbose */
+#define IRECOVERY_LOG_LEVEL_NONE  0
+#define IRECOVERY_LOG_LEVEL_ERROR 1
+#define IRECOVERY_LOG_LEVEL_WARN  2
+#define IRECOVERY_LOG_LEVEL_INFO  3
+#define IRECOVERY_LOG_LEVEL_TRACE 4
+
+// Messages above this level are compiled out, format strings and arguments included. Define it at build time to override.
+#ifndef IRECOVERY_LOG_LEVEL
+#define IRECOVERY_LOG_LEVEL IRECOVERY_LOG_LEVEL_TRACE
+#endif
+
+#if IRECOVERY_LOG_LEVEL >= IRECOVERY_LOG_LEVEL_ERROR
+#define IRECOVERY_LOG_ERROR(client, ...) irecovery_log(client, __VA_ARGS__)
+#else
+#define IRECOVERY_LOG_ERROR(client, ...) ((void)(client))
+#endif
+
+#if IRECOVERY_LOG_LEVEL >= IRECOVERY_LOG_LEVEL_WARN
+#define IRECOVERY_LOG_WARN(client, ...) irecovery_log(client, __VA_ARGS__)
+#else
+#define IRECOVERY_LOG_WARN(client, ...) ((void)(client))
+#endif
+
+#if IRECOVERY_LOG_LEVEL >= IRECOVERY_LOG_LEVEL_INFO
+#define IRECOVERY_LOG_INFO(client, ...) irecovery_log(client, __VA_ARGS__)
+#else
+#define IRECOVERY_LOG_INFO(client, ...) ((void)(client))
+#endif
+
+#if IRECOVERY_LOG_LEVEL >= IRECOVERY_LOG_LEVEL_TRACE
+#define IRECOVERY_LOG_TRACE(client, ...) irecovery_log(client, __VA_ARGS__)
+#else
+#define IRECOVERY_LOG_TRACE(client, ...) ((void)(client))
+#endif
+
 /**
  * @brief Logs a message to the screen.
  * @param client The client to reference the log function pointer from.
  * @param fmt The null-terminated string you want to print with formatting supported.
- * @note If you didn't pass a log function pointer into irecovery_client_new(), this function does nothing.
+ * @note If you didn't pass a log function pointer into irecovery_client_new(), this function does nothing. Neither does it
+ *       when built with IRECOVERY_LOG_LEVEL_NONE.
  */
 void irecovery_log(irecovery_client_t client, const char* fmt, ...);
 
+/**
+ * @brief Sets a logger that receives whole messages instead of one character at a time.
+ * @param[in] client The client to set the logger on.
+ * @param[in] sink Function pointer to a function like void write(const char* data, size_t length). NULL goes back to the
+ *                 logger passed to irecovery_client_new(). Data isn't null-terminated.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_set_log_sink(irecovery_client_t client, irecovery_log_sink_cb_t sink);
+
+/**
+ * @brief Gives the client a ring buffer to hold log output in while an upload is running, or while no logger is set.
+ * @param[in] client The client to set the buffer on.
+ * @param[in] buffer The ring buffer. It must outlive the client, or be unset first. NULL stops buffering.
+ * @param[in] size Size of buffer. Once it's full, the oldest output is dropped.
+ * @return An irecovery_error_t error code.
+ * @note Buffered output is flushed when an upload finishes, and by irecovery_log_flush().
+ */
+irecovery_error_t irecovery_set_log_buffer(irecovery_client_t client, char* buffer, size_t size);
+
+/**
+ * @brief Hands everything in the log ring buffer to the logger.
+ * @param[in] client The client to flush.
+ * @return An irecovery_error_t error code.
+ * @note Without a logger, the output stays buffered.
+ */
+irecovery_error_t irecovery_log_flush(irecovery_client_t client);
+
+/**
+ * @brief Appends everything in the log ring buffer to an AppVar, creating it if needed.
+ * @param[in] client The client to flush.
+ * @param[in] name The name of the AppVar.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_log_flush_to_appvar(irecovery_client_t client, const char* name);
+
 /**
  * @brief Returns a human-readable version of the supplied error code.
  * @param[in] error The error code.
@@ -155,6 +416,70 @@ const char* irecovery_strerror(irecovery_error_t error);
  */
 irecovery_error_t irecovery_client_new(irecovery_connection_policy_t connection_policy, uint64_t ecid, irecovery_log_cb_t logger, irecovery_client_t* client);
 
+/**
+ * @brief Allocates a new client with a scratch arena and initializes the USB backend.
+ * @param[in] connection_policy The connection policy to use. See irecovery_connection_policy_t.
+ * @param[in] ecid ECID restrictions (in decimal) for this client. Set to 0 for no restrictions.
+ * @param[in] logger Function pointer to a function like void putc(const char c) used to log events regarding this client.
+ *                   Leave NULL to disable logging.
+ * @param[in] scratch Buffer the client uses for logging, descriptors and upload packets instead of the heap.
+ *                    Leave NULL to have the client allocate scratch_size bytes once. It must outlive the client.
+ * @param[in] scratch_size Size of the arena. IRECOVERY_SCRATCH_SIZE covers everything but recovery mode uploads
+ *                         from sources that can't be mapped in place, which need 0x8000 more bytes per queued transfer, and
+ *                         DFU uploads in blocks bigger than 0x800 bytes, which need w_transfer_size - 0x800 more bytes.
+ *                         Compressed uploads keep their source in the arena too, and skip decompressing ahead unless one
+ *                         more packet buffer fits.
+ * @param[out] client Pointer where to store the new client.
+ * @return An irecovery_error_t error code.
+ * @note Anything that doesn't fit in the arena falls back to the heap. See irecovery_client_new().
+ */
+irecovery_error_t irecovery_client_new_with_scratch(irecovery_connection_policy_t connection_policy, uint64_t ecid, irecovery_log_cb_t logger, void* scratch, size_t scratch_size, irecovery_client_t* client);
+
+/**
+ * @brief Allocates a context and initializes the USB backend for it, so several phones can be served at once, e.g. through a hub.
+ * @param[out] context Pointer where to store the new context.
+ * @return An irecovery_error_t error code.
+ * @note Like irecovery_client_new(), this invalidates clients made without the context.
+ */
+irecovery_error_t irecovery_context_new(irecovery_context_t* context);
+
+/**
+ * @brief Frees a context, any clients still in it and deinitializes the USB backend.
+ * @param[in] context Pointer to the context to free. This will be set to NULL.
+ * @note Free the context's clients first if you hold on to them, the ones freed here aren't reset to NULL for you.
+ */
+void irecovery_context_free(irecovery_context_t* context);
+
+/**
+ * @brief Allocates a new client that gets its phones from a context.
+ * @param[in] context The context to add the client to. It holds up to IRECOVERY_CONTEXT_MAX_CLIENTS clients.
+ * @param[in] ecid ECID restrictions for this client. Set to 0 to take any phone no other client is restricted to.
+ * @param[in] logger Function pointer to a function like void putc(const char c). Leave NULL to disable logging.
+ * @param[in] scratch See irecovery_client_new_with_scratch().
+ * @param[in] scratch_size See irecovery_client_new_with_scratch(). 0 for no arena.
+ * @param[out] client Pointer where to store the new client.
+ * @return An irecovery_error_t error code. IRECOVERY_E_NO_MEMORY if the context is full.
+ * @note A client in a context only takes a phone while it doesn't have one, there's no connection policy.
+ */
+irecovery_error_t irecovery_context_client_new(irecovery_context_t context, uint64_t ecid, irecovery_log_cb_t logger, void* scratch, size_t scratch_size, irecovery_client_t* client);
+
+/**
+ * @brief Handles USB events, hands new phones to the context's clients and finalizes them.
+ * @param[in] context The context to poll.
+ * @return An irecovery_error_t error code.
+ * @note A phone goes to its ECID's client, or else to a free client without a restriction. irecovery_poll_for_device() on a client
+ *       in a context polls the whole context.
+ */
+irecovery_error_t irecovery_context_poll(irecovery_context_t context);
+
+/**
+ * @brief Runs one round of every upload in progress in the context, so a DFU status delay on one phone doesn't hold up the others.
+ * @param[in] context The context to step.
+ * @return IRECOVERY_E_UPLOAD_IN_PROGRESS while an upload is running, IRECOVERY_E_SUCCESS once none are.
+ * @note Start the uploads with irecovery_send_*_begin(). Each result is reported through the client's IRECOVERY_UPLOAD_FINISHED event.
+ */
+irecovery_error_t irecovery_context_send_step(irecovery_context_t context);
+
 /**
  * @brief Determines if the given client is able to be communicated with.
  * @param[in] client The client to poll.
@@ -164,6 +489,25 @@ irecovery_error_t irecovery_client_new(irecovery_connection_policy_t connection_
  */
 bool irecovery_client_is_usable(irecovery_client_t client, bool run_event_handler);
 
+/**
+ * @brief Starts a session, checking once that the client is usable so the calls inside it only have to see that the connection is
+ *        still the same one.
+ * @param[in] client The client to start a session on.
+ * @return An irecovery_error_t error code. IRECOVERY_E_NO_DEVICE if the client isn't usable, or if the connection changed since the
+ *         enclosing session began.
+ * @note Sessions nest. Until the outermost one ends, a disconnect or a role change makes every call on the client fail with
+ *       IRECOVERY_E_NO_DEVICE, even once a phone is connected again, so don't hold one across irecovery_await_reconnect().
+ */
+irecovery_error_t irecovery_session_begin(irecovery_client_t client);
+
+/**
+ * @brief Ends the session started by the matching irecovery_session_begin().
+ * @param[in] client The client to end the session on.
+ * @return IRECOVERY_E_SUCCESS if the connection lasted the whole session, IRECOVERY_E_NO_DEVICE if it didn't,
+ *         IRECOVERY_E_NO_SESSION if no session was started, or another irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_session_end(irecovery_client_t client);
+
 /**
  * @brief Removes all device connection attributes from the provided client.
  * @param[in] client The client to clear.
@@ -198,10 +542,57 @@ int irecovery_usb_bulk_transfer(irecovery_client_t client, unsigned char endpoin
  * @brief Polls for devices in a single run per call.
  * @param[in] client The client to work with.
  * @return IRECOVERY_E_SUCCESS when a device is connected, IRECOVERY_E_NO_DEVICE when there's no device, or another irecovery_error_t error code.
- * @note Call this in a loop with some condition to exit. e.g. while the user isn't pressing a key.
+ * @note Call this in a loop with some condition to exit. e.g. while the user isn't pressing a key. To wait for a phone without
+ *       spinning, see irecovery_wait_for_event().
  */
 irecovery_error_t irecovery_poll_for_device(irecovery_client_t client);
 
+/**
+ * @brief Sets the options used when finalizing new connections.
+ * @param[in] client The client to set the options on.
+ * @param[in] options IRECOVERY_FINALIZE_OPT_* flags.
+ * @return An irecovery_error_t error code.
+ * @note Only affects connections finalized afterwards.
+ */
+irecovery_error_t irecovery_set_finalize_options(irecovery_client_t client, unsigned int options);
+
+/**
+ * @brief Gives the client a cache of configuration descriptors, filled in by every connection it finalizes.
+ * @param[in] client The client to set the cache on.
+ * @param[in] entries The cache. It must outlive the client, or be unset first. NULL stops caching.
+ *                    Zero it before first use, or fill it with irecovery_device_cache_load().
+ * @param[in] count Number of entries. Once they're all used, the oldest is replaced.
+ * @return An irecovery_error_t error code.
+ * @note A hit, on the ECID the phone reports and its product ID, only skips downloading the configuration descriptor.
+ *       The serial string is still read and parsed on every connection, it's the only way to know the phone's ECID,
+ *       and the nonces are still read.
+ */
+irecovery_error_t irecovery_set_device_cache(irecovery_client_t client, struct irecovery_device_cache_entry* entries, size_t count);
+
+/**
+ * @brief Forgets every entry in the client's device cache.
+ * @param[in] client The client to clear the cache of.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_device_cache_clear(irecovery_client_t client);
+
+/**
+ * @brief Writes the used entries of the client's device cache to an AppVar, replacing it.
+ * @param[in] client The client to save the cache of.
+ * @param[in] name The name of the AppVar.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_device_cache_save(irecovery_client_t client, const char* name);
+
+/**
+ * @brief Fills the client's device cache from an AppVar written by irecovery_device_cache_save().
+ * @param[in] client The client to load the cache of. It must have a cache set.
+ * @param[in] name The name of the AppVar.
+ * @return An irecovery_error_t error code. IRECOVERY_E_BAD_DEVICE_CACHE if the AppVar is malformed.
+ * @note Entries that don't fit in the cache are ignored. AppVars in an older layout fail with IRECOVERY_E_BAD_DEVICE_CACHE.
+ */
+irecovery_error_t irecovery_device_cache_load(irecovery_client_t client, const char* name);
+
 /**
  * @brief Resets the USB device.
  * @param[in] client The client to reset.
@@ -214,6 +605,8 @@ irecovery_error_t irecovery_reset(irecovery_client_t client);
  * @brief Frees an irecovery client.
  * @param[in] client Pointer to your client.
  * @note Your client at the dst of the provided pointer will be set to NULL for you.
+ * @note A context client waits for the transfers its upload still has queued. If they haven't landed after
+ *       IRECOVERY_FREE_DRAIN_TIMEOUT milliseconds (2000 by default), the device is reset to drop them.
  * @attention You must call this at least once before the program ends if you've called irecovery_client_new()
  *            so the USB backend deinit can be taken care of.
  */
@@ -235,6 +628,36 @@ irecovery_error_t irecovery_reset_counters(irecovery_client_t client);
  */
 irecovery_error_t irecovery_finish_transfer(irecovery_client_t client);
 
+/**
+ * @brief Waits for the last finalized phone to come back after a reset, and finalizes it as soon as it's enabled.
+ * @param[in] client The client to wait with.
+ * @param[in] timeout_ms How long to wait for, in milliseconds. IRECOVERY_WAIT_FOREVER to wait as long as it takes.
+ * @param[out] ready_ms Time it took for the phone to be usable, in milliseconds. Can be NULL.
+ * @return IRECOVERY_E_SUCCESS once the phone is finalized, IRECOVERY_E_TIMEOUT if it didn't come back, or another irecovery_error_t error code.
+ * @note Use after irecovery_finish_transfer(), irecovery_reset() or IRECOVERY_SEND_OPT_DFU_NOTIFY_FINISH. The connection policy
+ *       doesn't apply while waiting and phones with another ECID are ignored. With an ECID restriction, that ECID is waited for.
+ */
+irecovery_error_t irecovery_await_reconnect(irecovery_client_t client, uint32_t timeout_ms, uint32_t* ready_ms);
+
+/**
+ * @brief Sends a DFU_GETSTATUS request to the device.
+ * @param[in] client The client to send the request to.
+ * @param[out] status The full status reply. It's zeroed if this function fails.
+ * @return An irecovery_error_t error code.
+ * @note Wait at least status->bw_poll_timeout milliseconds before polling again.
+ */
+irecovery_error_t irecovery_get_status(irecovery_client_t client, struct irecovery_dfu_status* status);
+
+/**
+ * @brief Gets the DFU functional descriptor read from the device's configuration during finalization.
+ * @param[in] client The client to query.
+ * @param[out] descriptor Pointer to save the descriptor to.
+ * @return An irecovery_error_t error code. IRECOVERY_E_DESCRIPTOR_FETCH_FAILED if the configuration doesn't have one.
+ * @note Uploads in DFU mode are split into w_transfer_size byte blocks, capped at 0x8000, or 0x800 byte blocks without a
+ *       descriptor. A block buffer bigger than 0x800 bytes doesn't fit in an IRECOVERY_SCRATCH_SIZE arena.
+ */
+irecovery_error_t irecovery_get_dfu_functional_descriptor(irecovery_client_t client, struct irecovery_dfu_functional_descriptor* descriptor);
+
 /**
  * @brief Retrieves the given client's mode.
  * @param[in] client The client to query.
@@ -256,19 +679,56 @@ const char* irecovery_mode_to_str(int mode);
  * @param[in] client The client to subscribe with.
  * @param[in] type The type of event to subscribe to.
  * @param[in] callback Callback function to run when this event occurs.
- * @return An irecovery_error_t error code.
+ * @return An irecovery_error_t error code. IRECOVERY_E_NO_MEMORY if the client already has IRECOVERY_EVENT_SUBSCRIBERS subscriptions.
+ * @note A type can have several callbacks. Subscribing the same callback twice does nothing.
+ *       Subscriptions survive disconnects, so subscribe before there's a phone to hear about it.
  * @see https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L164
  */
 irecovery_error_t irecovery_event_subscribe(irecovery_client_t client, irecovery_event_type type, irecovery_event_cb_t callback);
 
 /**
- * @brief Unsubscribes from an event type.
+ * @brief Subscribes to IRECOVERY_PROGRESS, but only hears about it once progress moved by a step or some time went by.
+ * @param[in] client The client to subscribe with.
+ * @param[in] callback Callback function to run when progress is made.
+ * @param[in] step_permille Progress between two calls, in tenths of a percent. 0 to not wait for progress.
+ * @param[in] interval_ms Time between two calls, in milliseconds. 0 to not wait for time.
+ * @return An irecovery_error_t error code. IRECOVERY_E_NO_MEMORY if the client already has IRECOVERY_EVENT_SUBSCRIBERS subscriptions.
+ * @note Whichever of the two comes first triggers a call. The first packet of every upload and the last always get one.
+ *       Read irecovery_event_t.permille, irecovery_event_t.progress isn't computed for this callback. It can still end the
+ *       upload early, and irecovery_event_unsubscribe_callback() unsubscribes it.
+ */
+irecovery_error_t irecovery_event_subscribe_progress(irecovery_client_t client, irecovery_event_cb_t callback, uint16_t step_permille, uint32_t interval_ms);
+
+/**
+ * @brief Unsubscribes every callback from an event type.
  * @param[in] client The client to unsubscribe with.
  * @param[in] type The type of event to unsubscribe from.
  * @return An irecovery_error_t error code.
  */
 irecovery_error_t irecovery_event_unsubscribe(irecovery_client_t client, irecovery_event_type type);
 
+/**
+ * @brief Unsubscribes one callback from an event type.
+ * @param[in] client The client to unsubscribe with.
+ * @param[in] type The type of event to unsubscribe from.
+ * @param[in] callback The callback irecovery_event_subscribe() was given.
+ * @return An irecovery_error_t error code. IRECOVERY_E_BAD_PTR if the callback isn't subscribed to that type.
+ */
+irecovery_error_t irecovery_event_unsubscribe_callback(irecovery_client_t client, irecovery_event_type type, irecovery_event_cb_t callback);
+
+/**
+ * @brief Sleeps until the client gets an event, instead of spinning on irecovery_poll_for_device().
+ * @param[in] client The client to wait with.
+ * @param[in] type The type of event to wait for, or IRECOVERY_EVENT_ANY.
+ * @param[in] timeout_ms How long to wait for, in milliseconds. IRECOVERY_WAIT_FOREVER to wait as long as it takes.
+ * @param[out] event The event that came. Can be NULL.
+ * @return IRECOVERY_E_SUCCESS once the event came, IRECOVERY_E_TIMEOUT if it didn't, or another irecovery_error_t error code.
+ * @note Blocks in usb_WaitForEvents(), with a usbdrvce timer to wake it up for the timeout. New phones are finalized like
+ *       irecovery_poll_for_device() would, and an upload started with irecovery_send_*_begin() keeps going. Subscribers still
+ *       run for every event.
+ */
+irecovery_error_t irecovery_wait_for_event(irecovery_client_t client, irecovery_event_type type, uint32_t timeout_ms, irecovery_event_t* event);
+
 /**
  * @brief Sends a command to a supported device.
  * @param[in] client The client to send the command to.
@@ -290,6 +750,55 @@ irecovery_error_t irecovery_send_command(irecovery_client_t client, const char*
  */
 irecovery_error_t irecovery_send_command_breq(irecovery_client_t client, const char* command, uint8_t b_request);
 
+/**
+ * @brief Sends several commands to a supported device back to back.
+ * @param[in] client The client to send the commands to.
+ * @param[in] commands The null-terminated command strings. Empty ones are skipped and count as sent.
+ * @param[in] count Number of commands.
+ * @param[out] results Where to store the result of each command, can be NULL. Commands that weren't sent get IRECOVERY_E_NO_COMMAND.
+ * @return IRECOVERY_E_SUCCESS if every command was sent, otherwise the first error.
+ * @note The client and every command are checked once, before anything is sent. Sending stops at the first command that fails.
+ *       b_request is set automatically depending on the command, like irecovery_send_command().
+ */
+irecovery_error_t irecovery_send_commands(irecovery_client_t client, const char* const* commands, size_t count, irecovery_error_t* results);
+
+#ifndef IRECOVERY_NO_RECOVERY
+/**
+ * @brief Starts reading the iBoot console in the background, into a ring buffer the caller owns.
+ * @param[in] client The client to read the console of.
+ * @param[in] buffer The ring buffer. It must stay valid until the client is freed or gets another one. Can be NULL to only get
+ *                   IRECOVERY_CONSOLE_LINE events. Output left over from an earlier start is dropped.
+ * @param[in] size Size of buffer. Once it's full, new output is dropped and counted in irecovery_stats.console_dropped.
+ * @return An irecovery_error_t error code. IRECOVERY_E_SERVICE_NOT_AVAILABLE if the device isn't in recovery mode,
+ *         IRECOVERY_E_CLIENT_ALREADY_ACTIVE if the console is already running.
+ * @note Reads are queued on the bulk IN endpoint and land whenever usbdrvce handles events, so output keeps coming in while
+ *       commands are sent and uploads run. Subscribe to IRECOVERY_CONSOLE_LINE to get it a line at a time; those callbacks
+ *       run inside usb_HandleEvents(), so they shouldn't send commands or start uploads themselves.
+ *       The console stops when the phone goes away, start it again once it's back.
+ */
+irecovery_error_t irecovery_console_start(irecovery_client_t client, char* buffer, size_t size);
+
+/**
+ * @brief Stops reading the console. What's in the ring buffer can still be read.
+ * @param[in] client The client to stop the console of.
+ * @return An irecovery_error_t error code.
+ * @note Doesn't wait for the read in flight. Output it brings in while stopped is dropped, and an irecovery_console_start()
+ *       before it lands takes it back instead of queuing another read.
+ */
+irecovery_error_t irecovery_console_stop(irecovery_client_t client);
+
+/**
+ * @brief Takes console output out of the ring buffer, without waiting for more.
+ * @param[in] client The client to read the console of.
+ * @param[out] data Where to copy the output to. It isn't null-terminated.
+ * @param[in] size Size of data.
+ * @param[out] length Number of bytes copied, 0 if there's nothing to read.
+ * @return An irecovery_error_t error code.
+ * @note While the console is running, it handles USB events once first so reads that already landed are in.
+ */
+irecovery_error_t irecovery_console_read(irecovery_client_t client, char* data, size_t size, size_t* length);
+#endif
+
 /**
  * @brief Sends a buffer to the currently connected device (if any).
  * @param[in] client The client to send the buffer to.
@@ -301,6 +810,207 @@ irecovery_error_t irecovery_send_command_breq(irecovery_client_t client, const c
  */
 irecovery_error_t irecovery_send_buffer(irecovery_client_t client, unsigned char* buffer, size_t length, unsigned int options);
 
+/**
+ * @brief Sends an image to the currently connected device (if any), pulling it from a read callback one packet at a time.
+ * @param[in] client The client to send the image to.
+ * @param[in] read_cb Callback that copies the requested part of the image into the packet buffer.
+ * @param[in] user_data Pointer passed as-is to read_cb.
+ * @param[in] length Total length of the image.
+ * @param[in] options IRECOVERY_SEND_XXX options.
+ * @return An irecovery_error_t error code.
+ * @note Only one packet (0x8000 bytes in recovery mode, 0x800 bytes in DFU mode) is held in RAM at a time.
+ */
+irecovery_error_t irecovery_send_stream(irecovery_client_t client, irecovery_stream_read_cb_t read_cb, void* user_data, size_t length, unsigned int options);
+
+/**
+ * @brief Sends an image stored in one or more AppVars to the currently connected device (if any).
+ * @param[in] client The client to send the image to.
+ * @param[in] names The AppVar names, in the order their contents make up the image.
+ * @param[in] count Number of AppVar names.
+ * @param[in] options IRECOVERY_SEND_XXX options.
+ * @return An irecovery_error_t error code.
+ * @note Packets are transferred straight from the AppVar data (archived or not). Only packets that straddle two AppVars,
+ *       and the final DFU packet, are copied into RAM.
+ */
+irecovery_error_t irecovery_send_appvars(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options);
+
+/**
+ * @brief Sends an image compressed by tools/mkcompressed.py to the currently connected device (if any).
+ * @param[in] client The client to send the image to.
+ * @param[in] names The AppVar names tools/mkcompressed.py wrote, in order.
+ * @param[in] count Number of AppVar names.
+ * @param[in] options IRECOVERY_SEND_XXX options.
+ * @return An irecovery_error_t error code. IRECOVERY_E_BAD_IMAGE if the first AppVar doesn't start with a valid header.
+ * @note Blocks are decompressed straight into the packet buffer, and the DFU CRC covers the decompressed bytes. Without
+ *       IRECOVERY_SEND_OPT_RECOVERY_PIPELINE, the next packet is decompressed into a second packet buffer while the current one
+ *       is sent. A client with a scratch arena only does this when the buffer fits, in DFU mode with 0x800 byte blocks that's
+ *       an arena of about IRECOVERY_SCRATCH_SIZE + 0x800 bytes. Otherwise packets are decompressed when they're sent. When the packet size isn't a multiple of the
+ *       block size, one decompressed block is also kept in RAM.
+ */
+irecovery_error_t irecovery_send_compressed_appvars(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options);
+
+/**
+ * @brief Starts sending a buffer to the currently connected device (if any) without blocking.
+ * @param[in] client The client to send the buffer to.
+ * @param[in] buffer The buffer to send. It must stay valid until the upload ends.
+ * @param[in] length Length of the buffer.
+ * @param[in] options IRECOVERY_SEND_XXX options.
+ * @return An irecovery_error_t error code.
+ * @note Call irecovery_send_step() from your main loop until it stops returning IRECOVERY_E_UPLOAD_IN_PROGRESS.
+ *       Only one upload per client can be in progress at a time.
+ */
+irecovery_error_t irecovery_send_buffer_begin(irecovery_client_t client, unsigned char* buffer, size_t length, unsigned int options);
+
+/**
+ * @brief Starts sending an image pulled from a read callback without blocking. See irecovery_send_stream().
+ * @param[in] client The client to send the image to.
+ * @param[in] read_cb Callback that copies the requested part of the image into the packet buffer.
+ * @param[in] user_data Pointer passed as-is to read_cb. It must stay valid until the upload ends.
+ * @param[in] length Total length of the image.
+ * @param[in] options IRECOVERY_SEND_XXX options.
+ * @return An irecovery_error_t error code.
+ * @note Call irecovery_send_step() from your main loop until it stops returning IRECOVERY_E_UPLOAD_IN_PROGRESS.
+ */
+irecovery_error_t irecovery_send_stream_begin(irecovery_client_t client, irecovery_stream_read_cb_t read_cb, void* user_data, size_t length, unsigned int options);
+
+/**
+ * @brief Starts sending an image stored in one or more AppVars without blocking. See irecovery_send_appvars().
+ * @param[in] client The client to send the image to.
+ * @param[in] names The AppVar names, in the order their contents make up the image.
+ * @param[in] count Number of AppVar names.
+ * @param[in] options IRECOVERY_SEND_XXX options.
+ * @return An irecovery_error_t error code.
+ * @note Call irecovery_send_step() from your main loop until it stops returning IRECOVERY_E_UPLOAD_IN_PROGRESS.
+ */
+irecovery_error_t irecovery_send_appvars_begin(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options);
+
+/**
+ * @brief Starts sending a compressed image without blocking. See irecovery_send_compressed_appvars().
+ * @param[in] client The client to send the image to.
+ * @param[in] names The AppVar names tools/mkcompressed.py wrote, in order.
+ * @param[in] count Number of AppVar names.
+ * @param[in] options IRECOVERY_SEND_XXX options.
+ * @return An irecovery_error_t error code.
+ * @note Call irecovery_send_step() from your main loop until it stops returning IRECOVERY_E_UPLOAD_IN_PROGRESS.
+ */
+irecovery_error_t irecovery_send_compressed_appvars_begin(irecovery_client_t client, const char* const* names, uint8_t count, unsigned int options);
+
+/**
+ * @brief Advances the upload in progress without blocking.
+ * @param[in] client The client with the upload in progress.
+ * @return IRECOVERY_E_UPLOAD_IN_PROGRESS while the upload is running, otherwise the result of the upload.
+ * @note The result is also reported through the IRECOVERY_UPLOAD_FINISHED event.
+ */
+irecovery_error_t irecovery_send_step(irecovery_client_t client);
+
+/**
+ * @brief Cancels the upload in progress.
+ * @param[in] client The client with the upload in progress.
+ * @return An irecovery_error_t error code.
+ * @note The upload ends with IRECOVERY_E_UPLOAD_CANCELLED on the next irecovery_send_step() that has nothing in flight. In DFU
+ *       mode, that's once the ABORT that puts the device back in dfuIDLE is sent.
+ */
+irecovery_error_t irecovery_send_cancel(irecovery_client_t client);
+
+/**
+ * @brief Gets how far the last failed recovery mode upload got, where IRECOVERY_SEND_OPT_RESUME picks up.
+ * @param[in] client The client the upload ran on.
+ * @param[out] offset Bytes the device accepted, a whole number of packets.
+ * @param[out] length Length of the image.
+ * @return An irecovery_error_t error code. IRECOVERY_E_NO_UPLOAD if there's no checkpoint.
+ * @note The checkpoint survives disconnects, so an upload can be resumed after irecovery_reset() and irecovery_await_reconnect()
+ *       as long as the phone kept what it received. A pipelined upload that failed with bytes of a later packet already sent,
+ *       or any DFU upload, leaves no checkpoint.
+ */
+irecovery_error_t irecovery_get_upload_checkpoint(irecovery_client_t client, size_t* offset, size_t* length);
+
+/**
+ * @brief Starts running a boot chain, one stage after the other.
+ * @param[in] client The client to boot the phone of. It needs a phone, in the first stage's mode.
+ * @param[in] stages The stages, in order. They're not copied and must stay valid until the boot ends.
+ * @param[in] count Number of stages.
+ * @param[in] timeout_ms How long to wait for the phone after each stage that makes it re-enumerate, in milliseconds.
+ *                       IRECOVERY_WAIT_FOREVER to wait as long as it takes.
+ * @return IRECOVERY_E_BOOT_IN_PROGRESS if the boot started, otherwise an irecovery_error_t error code.
+ *         IRECOVERY_E_SERVICE_NOT_AVAILABLE if a stage has commands for a mode without a console, like DFU mode.
+ * @note Call irecovery_boot_step() from your main loop until it stops returning IRECOVERY_E_BOOT_IN_PROGRESS.
+ *       Every stage is checked before anything is sent. While the phone re-enumerates, the next stage's AppVars are opened and, for a compressed image going to recovery mode,
+ *       its first packet is decompressed, so its upload starts as soon as the phone is back. Phones with another ECID are
+ *       ignored, like irecovery_await_reconnect() does.
+ */
+irecovery_error_t irecovery_boot_begin(irecovery_client_t client, const struct irecovery_boot_stage* stages, size_t count, uint32_t timeout_ms);
+
+/**
+ * @brief Moves the boot chain along without blocking.
+ * @param[in] client The client running the boot chain.
+ * @return IRECOVERY_E_BOOT_IN_PROGRESS while it's running, IRECOVERY_E_SUCCESS once every stage is done, otherwise the
+ *         error it stopped on. IRECOVERY_E_UNEXPECTED_MODE if the phone came back in another mode than next_mode,
+ *         IRECOVERY_E_TIMEOUT if it didn't come back in time.
+ */
+irecovery_error_t irecovery_boot_step(irecovery_client_t client);
+
+/**
+ * @brief Runs a boot chain to the end, see irecovery_boot_begin().
+ * @param[in] client The client to boot the phone of.
+ * @param[in] stages The stages, in order.
+ * @param[in] count Number of stages.
+ * @param[in] timeout_ms How long to wait for the phone after each stage that makes it re-enumerate, in milliseconds.
+ *                       IRECOVERY_WAIT_FOREVER to wait as long as it takes.
+ * @param[out] stage Index of the stage the boot ended in, count if every stage is done. Can be NULL.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_boot(irecovery_client_t client, const struct irecovery_boot_stage* stages, size_t count, uint32_t timeout_ms, size_t* stage);
+
+/**
+ * @brief Gets the stage the boot chain is in, or the one the last boot chain ended in.
+ * @param[in] client The client running the boot chain.
+ * @param[out] stage Index of the stage, count if every stage of the last boot chain is done.
+ * @return An irecovery_error_t error code. IRECOVERY_E_NO_BOOT if the client never ran one.
+ */
+irecovery_error_t irecovery_get_boot_stage(irecovery_client_t client, size_t* stage);
+
+/**
+ * @brief Parses an upload manifest.
+ * @param[in] data The raw manifest, IRECOVERY_MANIFEST_SIZE bytes.
+ * @param[in] length The size of data.
+ * @param[out] manifest Where to store the parsed manifest.
+ * @return An irecovery_error_t error code. IRECOVERY_E_BAD_MANIFEST if it isn't consistent.
+ */
+irecovery_error_t irecovery_manifest_parse(const unsigned char* data, size_t length, struct irecovery_manifest* manifest);
+
+/**
+ * @brief Parses an upload manifest stored in an AppVar.
+ * @param[in] name The name of the AppVar.
+ * @param[out] manifest Where to store the parsed manifest.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_manifest_load(const char* name, struct irecovery_manifest* manifest);
+
+/**
+ * @brief Sets the manifest uploads with IRECOVERY_SEND_OPT_DFU_MANIFEST will trust.
+ * @param[in] client The client to set the manifest on.
+ * @param[in] manifest The manifest, copied into the client. NULL clears it.
+ * @return An irecovery_error_t error code.
+ * @note The image isn't checked against the manifest beyond its length. A stale manifest makes the device reject the image.
+ */
+irecovery_error_t irecovery_set_manifest(irecovery_client_t client, const struct irecovery_manifest* manifest);
+
+/**
+ * @brief Gets the client's transfer statistics.
+ * @param[in] client The client to get the statistics of.
+ * @param[out] stats Where to store a copy of the statistics.
+ * @return An irecovery_error_t error code.
+ * @note Transfers pipelined with IRECOVERY_SEND_OPT_RECOVERY_PIPELINE overlap, so bulk_ticks can exceed the wall time.
+ */
+irecovery_error_t irecovery_get_stats(irecovery_client_t client, struct irecovery_stats* stats);
+
+/**
+ * @brief Zeroes the client's transfer statistics, e.g. between stages of a boot chain.
+ * @param[in] client The client to reset the statistics of.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_reset_stats(irecovery_client_t client);
+
 /**
  * @brief Tells the device console to save all environment variables.
  * @param[in] client The client to send the request to.
@@ -319,6 +1029,17 @@ irecovery_error_t irecovery_saveenv(irecovery_client_t client);
  */
 irecovery_error_t irecovery_getenv(irecovery_client_t client, const char* variable, char** value);
 
+/**
+ * @brief Gets an environment variable's value from the device into a buffer the caller provides, without allocating.
+ * @param[in] client The client to send the request to.
+ * @param[in] variable The name of the environment variable to query.
+ * @param[out] value Buffer to save the NUL-terminated value to.
+ * @param[in] size Size of value, in bytes. At most 255 bytes of the value are read, like irecovery_getenv().
+ * @param[out] length Length of the value, not counting the NUL. Can be NULL.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_getenv_into(irecovery_client_t client, const char* variable, char* value, size_t size, size_t* length);
+
 /**
  * @brief Sets an environment variable's value on the device.
  * @param[in] client The client to send the request to.
@@ -348,6 +1069,18 @@ irecovery_error_t irecovery_setenv_np(irecovery_client_t client, const char* var
  */
 irecovery_error_t irecovery_reboot(irecovery_client_t client);
 
+/**
+ * @brief Runs the commands in an AppVar, one per line, on the device's console.
+ * @param[in] client The client to send the commands to.
+ * @param[in] name The name of the AppVar.
+ * @param[out] line Where to store the line number of the command that failed, or 0. Can be NULL.
+ * @return An irecovery_error_t error code.
+ * @note Empty lines and lines starting with # are skipped. Lines are checked before anything is sent.
+ * @note If the script changes the environment with setenv or setenvnp, saveenv is sent before go, bootx, reboot or memboot,
+ *       and at the end, unless the script already saved it.
+ */
+irecovery_error_t irecovery_run_script(irecovery_client_t client, const char* name, size_t* line);
+
 /**
  * @brief Requests the on-device's return value.
  * @param[in] client The client to send the request to.
@@ -365,13 +1098,36 @@ irecovery_error_t irecovery_getret(irecovery_client_t client, unsigned int* valu
  */
 const struct irecovery_device_info* irecovery_get_device_info(irecovery_client_t client);
 
+/**
+ * @brief Reads a string descriptor from the device as ASCII into a buffer the caller provides, without allocating.
+ * @param[in] client The client to send the request to.
+ * @param[in] desc_index Index of the string descriptor, e.g. the device descriptor's iSerialNumber.
+ * @param[out] buffer Buffer to save the NUL-terminated string to. Characters above 0x7F become '?'.
+ * @param[in] size Size of buffer, in bytes. The UTF-16 descriptor is read into buffer and converted in place, so a string of
+ *                 n characters needs 2 + 2n bytes. Buffers under 4 bytes fit size - 1 characters, like irecovery_getenv_into().
+ * @param[out] length Length of the string, not counting the NUL. Can be NULL.
+ * @return An irecovery_error_t error code.
+ */
+irecovery_error_t irecovery_get_string_descriptor_ascii_into(irecovery_client_t client, uint8_t desc_index, unsigned char* buffer, size_t size, size_t* length);
+
+#ifndef IRECOVERY_NO_DEVICE_TABLE
 /**
  * @brief Gets a list of all Apple devices.
  * @return Pointer to an array of struct irecovery_device. Can be iterated over until struct members are NULL or -1.
+ *         NULL if the library was built with IRECOVERY_DEVICE_DB and the database AppVar is missing or malformed.
  * @see https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L187
+ * @note With IRECOVERY_DEVICE_DB, the device lookups return IRECOVERY_E_APPVAR_NOT_FOUND in that case. The table is built
+ *       on the heap by the first call that needs it, one struct irecovery_device per device, and kept until irecovery_devices_free().
  */
 irecovery_device_t irecovery_devices_get_all(void);
 
+/**
+ * @brief Frees the device table built from the IRECOVERY_DEVICE_DB AppVar, so its heap can go to something else.
+ * @note Every irecovery_device_t handed out before is invalid afterwards. The next lookup builds the table again.
+ *       Does nothing with the built-in table.
+ */
+void irecovery_devices_free(void);
+
 /**
  * @brief Gets the device description for the given client.
  * @param[in] client The client to query.
@@ -398,5 +1154,34 @@ irecovery_error_t irecovery_devices_get_device_by_product_type(const char* produ
  * @see https://github.com/libimobiledevice/libirecovery/blob/3fa36c5a7a745fd334bed8a3d5e432c626677910/include/libirecovery.h#L190
  */
 irecovery_error_t irecovery_devices_get_device_by_hardware_model(const char* hardware_model, irecovery_device_t* device);
+#endif
+
+/**
+ * @brief Returns the starting value of a CRC32 computation.
+ * @return The initial CRC32 register.
+ */
+uint32_t irecovery_crc32_init(void);
+
+#ifndef IRECOVERY_NO_CRC32
+/**
+ * @brief Feeds `length` bytes into a running CRC32 (IEEE 802.3, reflected).
+ * @param[in] crc The running CRC32, from irecovery_crc32_init() or a previous call.
+ * @param[in] data The bytes to hash.
+ * @param[in] length The number of bytes to hash.
+ * @return The updated CRC32 register.
+ * @note Define IRECOVERY_CRC32_NIBBLE_TABLE to use a 64 byte table instead of the 1 KB one, at about half the speed.
+ *       Define IRECOVERY_CRC32_EZ80 and add irecovery_crc32.asm to the program for the assembly kernel. It builds its table
+ *       in 2 KB of RAM on the first call instead of carrying it in the program. Only for the CE toolchain.
+ */
+uint32_t irecovery_crc32_update(uint32_t crc, const void* data, size_t length);
+#endif
+
+/**
+ * @brief Finishes a CRC32 computation.
+ * @param[in] crc The running CRC32.
+ * @return The final CRC32.
+ * @note The DFU trailer carries the running register, not the finished value.
+ */
+uint32_t irecovery_crc32_final(uint32_t crc);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,104 @@
+; irecovery_crc32.asm
+; eZ80 kernel behind irecovery_crc32_update() in builds with IRECOVERY_CRC32_EZ80. Put it in src/ next to irecovery.c.
+;
+; The table is split into four byte planes, one per byte of a crc32_lookup_t1 entry, built by irecovery.c on a 1 KB boundary.
+; An entry is then read with the index in L and the plane in H, one inc h apart, and the CRC stays in 8-bit registers:
+;     c0' = c1 ^ plane0[i], c1' = c2 ^ plane1[i], c2' = c3 ^ plane2[i], c3' = plane3[i], with i = c0 ^ byte
+; B counts bytes for djnz, so c3 and the number of 256 byte blocks live in memory. Interrupts and IY are left alone.
+
+	assume	adl=1
+
+	section	.text
+
+	public	_irecovery_crc32_update_ez80
+
+; uint32_t irecovery_crc32_update_ez80(uint32_t crc, const void* data, size_t length, const unsigned char* planes)
+_irecovery_crc32_update_ez80:
+	push	ix
+	ld	ix, 0
+	add	ix, sp
+	; ix+6: crc bits 0-23, ix+9: crc bits 24-31, ix+12: data, ix+15: length, ix+18: planes
+
+	ld	hl, (ix+15)
+	ld	bc, 0
+	or	a, a
+	sbc	hl, bc
+	jr	z, .unchanged
+
+	; The first block is length & 0xFF bytes (256 if that's 0), every other one 256
+	ld	b, l
+	dec	hl
+	ld	(crc32_blocks), hl
+	ld	hl, (crc32_blocks+1)	; (length - 1) >> 8, crc32_blocks+3 is always 0
+	inc	hl
+	ld	(crc32_blocks), hl
+
+	ld	a, (ix+9)
+	ld	(crc32_c3), a
+	ld	c, (ix+8)		; c2
+	ld	de, (ix+6)		; d = c1, e = c0
+	ld	hl, (ix+18)		; h = plane 0
+	ld	ix, (ix+12)
+
+.byte:
+	ld	a, (ix+0)
+	inc	ix
+	xor	a, e
+	ld	l, a
+	ld	a, (hl)
+	xor	a, d
+	ld	e, a
+	inc	h
+	ld	a, (hl)
+	xor	a, c
+	ld	d, a
+	inc	h
+	ld	a, (crc32_c3)
+	xor	a, (hl)
+	ld	c, a
+	inc	h
+	ld	a, (hl)
+	ld	(crc32_c3), a
+	dec	h
+	dec	h
+	dec	h
+	djnz	.byte
+
+	; B is 0 again, so the next block is 256 bytes
+	push	hl
+	ld	hl, (crc32_blocks)
+	dec	hl
+	ld	(crc32_blocks), hl
+	ld	a, (crc32_blocks+2)
+	or	a, h
+	or	a, l
+	pop	hl
+	jr	nz, .byte
+
+	; Returned in E:UHL
+	ld	a, e
+	ld	(crc32_result), a
+	ld	a, d
+	ld	(crc32_result+1), a
+	ld	a, c
+	ld	(crc32_result+2), a
+	ld	hl, (crc32_result)
+	ld	a, (crc32_c3)
+	ld	e, a
+	pop	ix
+	ret
+
+.unchanged:
+	ld	hl, (ix+6)
+	ld	e, (ix+9)
+	pop	ix
+	ret
+
+	section	.data
+
+crc32_c3:
+	db	0
+crc32_blocks:
+	db	0, 0, 0, 0
+crc32_result:
+	db	0, 0, 0
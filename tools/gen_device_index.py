@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Regenerates the sorted device table indexes in irecovery.c.
+
+Run it after editing irecovery_devices[]:
+
+    tools/gen_device_index.py irecovery.c
+
+Each index lists positions in irecovery_devices[] sorted by one key, ties
+broken by position, so a binary search finds the same entry the old linear
+scan did.
+"""
+
+import re
+import sys
+
+BEGIN = "/* BEGIN GENERATED DEVICE INDEX - tools/gen_device_index.py */"
+END = "/* END GENERATED DEVICE INDEX */"
+
+ENTRY = re.compile(r'^\s*\{\s*"([^"]*)",\s*"([^"]*)",\s*(0x[0-9A-Fa-f]+|\d+),\s*(0x[0-9A-Fa-f]+|\d+),\s*"([^"]*)"\s*\},')
+
+
+def c_array(name, values):
+    lines = []
+    for i in range(0, len(values), 12):
+        lines.append("\t" + ", ".join("%3d" % v for v in values[i:i + 12]) + ",")
+    return "static const uint16_t %s[] = {\n%s\n};\n" % (name, "\n".join(lines).rstrip(","))
+
+
+def parse_devices(source):
+    """Returns (product_type, hardware_model, board_id, chip_id, display_name) for each irecovery_devices[] entry."""
+    table = source[source.index("irecovery_devices[] = {"):]
+    table = table[:table.index("\n};")]
+
+    devices = []
+    for line in table.splitlines():
+        match = ENTRY.match(line)
+        if match:
+            product_type, hardware_model, board_id, chip_id, display_name = match.groups()
+            devices.append((product_type, hardware_model, int(board_id, 0), int(chip_id, 0), display_name))
+    return devices
+
+
+def sorted_indexes(devices):
+    """Returns the product type, hardware model and (chip ID, board ID) indexes."""
+    positions = range(len(devices))
+    return (sorted(positions, key=lambda i: (devices[i][0].encode(), i)),
+            sorted(positions, key=lambda i: (devices[i][1].encode(), i)),
+            sorted(positions, key=lambda i: (devices[i][3], devices[i][2], i)))
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+
+    path = sys.argv[1]
+    with open(path) as f:
+        source = f.read()
+
+    devices = parse_devices(source)
+    by_product_type, by_hardware_model, by_chip_board = sorted_indexes(devices)
+
+    block = "\n".join([
+        BEGIN,
+        "#define IRECOVERY_DEVICE_COUNT %d" % len(devices),
+        "",
+        c_array("irecovery_devices_by_product_type", by_product_type),
+        c_array("irecovery_devices_by_hardware_model", by_hardware_model),
+        c_array("irecovery_devices_by_chip_board", by_chip_board),
+        END,
+    ])
+
+    start = source.index(BEGIN)
+    end = source.index(END) + len(END)
+    with open(path, "w") as f:
+        f.write(source[:start] + block + source[end:])
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+"""Compresses an image for irecovery_send_compressed_appvars().
+
+    mkcompressed.py iBSS.img4 -n IBSSZ         # writes IBSSZ.8xv, or IBSSZ1.8xv, IBSSZ2.8xv... if it needs several
+    mkcompressed.py iBSS.img4 --raw iBSS.lz    # writes the bare stream
+    mkcompressed.py iBSS.img4 -n IBSSZ -b 0x1000
+
+Layout, little endian:
+    "IRLZ", version (1 byte), reserved (1), block size (2), image length (4)
+    blocks: compressed size (2, 0 if the block is stored as is), LZ4 block
+
+Each block is compressed on its own, so the calculator can decompress it
+straight into a packet buffer. Keep the block size a divisor of the packet
+size (0x8000 in recovery mode, the DFU transfer size in DFU mode, usually
+0x800) or the calculator has to keep a decompressed block in RAM. No block
+straddles two AppVars.
+"""
+
+import argparse
+import struct
+import sys
+
+from mkmanifest import build_appvar
+
+COMPRESSED_VERSION = 1
+APPVAR_MAX_DATA = 0xFFE0
+
+MIN_MATCH = 4
+LAST_LITERALS = 5   # An LZ4 block ends with at least this many literals
+MATCH_LIMIT = 12    # and its last match starts at least this far from the end
+MAX_OFFSET = 0xFFFF
+
+
+def lz4_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def lz4_sequence(out, literals, offset=0, match=0):
+    token_literals = min(len(literals), 15)
+    token_match = min(match - MIN_MATCH, 15) if match else 0
+    out.append((token_literals << 4) | token_match)
+    if token_literals == 15:
+        lz4_length(out, len(literals) - 15)
+    out += literals
+    if match:
+        out += struct.pack("<H", offset)
+        if token_match == 15:
+            lz4_length(out, match - MIN_MATCH - 15)
+
+
+def lz4_compress_block(data):
+    """Greedy LZ4 block compression, no dictionary."""
+    out = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+    limit = len(data) - MATCH_LIMIT
+
+    while i < limit:
+        key = data[i:i + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = i
+        if candidate is None or i - candidate > MAX_OFFSET:
+            i += 1
+            continue
+
+        match = MIN_MATCH
+        end = len(data) - LAST_LITERALS
+        while i + match < end and data[candidate + match] == data[i + match]:
+            match += 1
+
+        lz4_sequence(out, data[anchor:i], i - candidate, match)
+        for j in range(i + 1, min(i + match, limit)):
+            table[data[j:j + MIN_MATCH]] = j
+        i += match
+        anchor = i
+
+    lz4_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def build_blocks(image, block_size):
+    blocks = []
+    for offset in range(0, len(image), block_size):
+        block = image[offset:offset + block_size]
+        compressed = lz4_compress_block(block)
+        if len(compressed) < len(block):
+            blocks.append(struct.pack("<H", len(compressed)) + compressed)
+        else:
+            blocks.append(struct.pack("<H", 0) + block)
+    return blocks
+
+
+def build_header(image, block_size):
+    return b"IRLZ" + struct.pack("<BBHI", COMPRESSED_VERSION, 0, block_size, len(image))
+
+
+def split_appvars(header, blocks):
+    """Packs the header and the blocks into AppVar sized pieces without splitting a block."""
+    pieces = [bytearray(header)]
+    for block in blocks:
+        if len(block) > APPVAR_MAX_DATA:
+            raise ValueError("block doesn't fit in an AppVar")
+        if len(pieces[-1]) + len(block) > APPVAR_MAX_DATA:
+            pieces.append(bytearray())
+        pieces[-1] += block
+    return [bytes(piece) for piece in pieces]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="image that will be uploaded")
+    parser.add_argument("-n", "--name", help="AppVar name, written to NAME.8xv (at most 7 characters if it takes several)")
+    parser.add_argument("-b", "--block-size", type=lambda x: int(x, 0), default=0x800, help="decompressed block size (default 0x800)")
+    parser.add_argument("--raw", metavar="FILE", help="write the bare stream to FILE instead")
+    parser.add_argument("--ram", action="store_true", help="don't mark the AppVars as archived")
+    args = parser.parse_args()
+
+    if not args.name and not args.raw:
+        parser.error("one of --name or --raw is required")
+    if not 1 <= args.block_size <= 0x8000:
+        parser.error("the block size has to be between 1 and 0x8000")
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+
+    header = build_header(image, args.block_size)
+    blocks = build_blocks(image, args.block_size)
+
+    if args.raw:
+        with open(args.raw, "wb") as f:
+            f.write(header + b"".join(blocks))
+        return 0
+
+    pieces = split_appvars(header, blocks)
+    names = [args.name] if len(pieces) == 1 else ["%s%d" % (args.name, i + 1) for i in range(len(pieces))]
+    for name, piece in zip(names, pieces):
+        with open(name + ".8xv", "wb") as f:
+            f.write(build_appvar(name, piece, not args.ram))
+
+    compressed = sum(len(piece) for piece in pieces)
+    print("%d -> %d bytes in %s" % (len(image), compressed, ", ".join(names)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
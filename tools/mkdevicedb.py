@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Packs irecovery_devices[] into an AppVar for builds with IRECOVERY_DEVICE_DB.
+
+    tools/mkdevicedb.py irecovery.c              # writes IRECDEV.8xv
+    tools/mkdevicedb.py irecovery.c -n MYDEVS    # for -DIRECOVERY_DEVICE_DB_NAME=\\"MYDEVS\\"
+
+Layout, little endian:
+    "IRDB", version (1 byte), reserved (1), count (2)
+    product type index, hardware model index, (chip ID, board ID) index (count * 2 bytes each)
+    records: board ID (2), chip ID (2), product type, hardware model, display name (string pool offsets, 2 each)
+    string pool: NUL-terminated strings
+"""
+
+import argparse
+import struct
+import sys
+
+from gen_device_index import parse_devices, sorted_indexes
+from mkmanifest import build_appvar
+
+DB_VERSION = 1
+
+
+def build_db(devices):
+    pool = bytearray()
+    offsets = {}
+
+    def intern(string):
+        if string not in offsets:
+            offsets[string] = len(pool)
+            pool.extend(string.encode("ascii") + b"\0")
+        return offsets[string]
+
+    records = bytearray()
+    for product_type, hardware_model, board_id, chip_id, display_name in devices:
+        records += struct.pack("<HHHHH", board_id, chip_id, intern(product_type), intern(hardware_model), intern(display_name))
+
+    if len(pool) > 0xFFFF:
+        raise ValueError("string pool is too large")
+
+    db = bytearray(b"IRDB" + struct.pack("<BBH", DB_VERSION, 0, len(devices)))
+    for index in sorted_indexes(devices):
+        db += struct.pack("<%dH" % len(index), *index)
+    return bytes(db + records + pool)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("source", help="irecovery.c")
+    parser.add_argument("-n", "--name", default="IRECDEV", help="AppVar name, written to NAME.8xv")
+    parser.add_argument("--raw", metavar="FILE", help="write the bare database to FILE instead")
+    args = parser.parse_args()
+
+    with open(args.source) as f:
+        db = build_db(parse_devices(f.read()))
+
+    if args.raw:
+        with open(args.raw, "wb") as f:
+            f.write(db)
+    else:
+        with open(args.name + ".8xv", "wb") as f:
+            f.write(build_appvar(args.name, db))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
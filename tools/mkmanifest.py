@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+"""Builds a tirecovery upload manifest for an image.
+
+The manifest lets irecovery_send_*() with IRECOVERY_SEND_OPT_DFU_MANIFEST skip
+hashing the image on the calculator. See struct irecovery_manifest.
+
+    mkmanifest.py iBSS.img4 -n IBSSMF          # writes IBSSMF.8xv
+    mkmanifest.py iBSS.img4 --raw iBSS.mf      # writes the bare 31 bytes
+"""
+
+import argparse
+import struct
+import sys
+import zlib
+
+MANIFEST_VERSION = 1
+DFU_PACKET_SIZE = 0x800
+DFU_XBUF = bytes([0xff, 0xff, 0xff, 0xff, 0xac, 0x05, 0x00, 0x01, 0x55, 0x46, 0x44, 0x10])
+
+APPVAR_TYPE = 0x15
+
+
+def build_manifest(image):
+    # zlib.crc32 is the finished value, the DFU suffix carries the running register (its complement)
+    crc = zlib.crc32(DFU_XBUF, zlib.crc32(image)) & 0xFFFFFFFF
+    trailer = DFU_XBUF + struct.pack("<I", crc ^ 0xFFFFFFFF)
+    packets = (len(image) + DFU_PACKET_SIZE - 1) // DFU_PACKET_SIZE
+    if packets > 0xFFFF:
+        raise ValueError("image is too large for a manifest")
+    return b"IRMF" + struct.pack("<BIHI", MANIFEST_VERSION, len(image), packets, crc) + trailer
+
+
+def build_appvar(name, data, archived=True):
+    name_bytes = name.encode("ascii")
+    if not 1 <= len(name_bytes) <= 8:
+        raise ValueError("AppVar names are 1 to 8 characters")
+
+    body = struct.pack("<H", len(data)) + data
+    entry = struct.pack("<HHB", 13, len(body), APPVAR_TYPE)
+    entry += name_bytes.ljust(8, b"\0")
+    entry += struct.pack("<BBH", 0, 0x80 if archived else 0, len(body))
+    entry += body
+
+    comment = b"tirecovery upload manifest".ljust(42, b"\0")
+    header = b"**TI83F*\x1a\x0a\x00" + comment + struct.pack("<H", len(entry))
+    return header + entry + struct.pack("<H", sum(entry) & 0xFFFF)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="image that will be uploaded")
+    parser.add_argument("-n", "--name", help="AppVar name, written to NAME.8xv")
+    parser.add_argument("--raw", metavar="FILE", help="write the bare manifest to FILE instead")
+    parser.add_argument("--ram", action="store_true", help="don't mark the AppVar as archived")
+    args = parser.parse_args()
+
+    if not args.name and not args.raw:
+        parser.error("one of --name or --raw is required")
+
+    with open(args.image, "rb") as f:
+        manifest = build_manifest(f.read())
+
+    if args.raw:
+        with open(args.raw, "wb") as f:
+            f.write(manifest)
+    else:
+        with open(args.name + ".8xv", "wb") as f:
+            f.write(build_appvar(args.name, manifest, not args.ram))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())